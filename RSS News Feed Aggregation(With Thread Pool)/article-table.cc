@@ -0,0 +1,28 @@
+/**
+ * File: article-table.cc
+ * ----------------------
+ * Presents the implementation of the ArticleTable class.
+ */
+
+#include "article-table.h"
+#include <functional>
+using namespace std;
+
+ArticleTable::ArticleTable(size_t numShards) :
+  numShards(numShards == 0 ? 1 : numShards), shards(new Shard[this->numShards]) {}
+
+size_t ArticleTable::shardFor(const string& server) const {
+  return hash<string>()(server) % numShards;
+}
+
+LatencyHistogram ArticleTable::lockWaitTimes() const {
+  LatencyHistogram waits;
+  for (size_t i = 0; i < numShards; i++) waits.merge(shards[i].lock.waitTimes());
+  return waits;
+}
+
+LatencyHistogram ArticleTable::lockHoldTimes() const {
+  LatencyHistogram holds;
+  for (size_t i = 0; i < numShards; i++) holds.merge(shards[i].lock.holdTimes());
+  return holds;
+}
@@ -0,0 +1,97 @@
+/**
+ * File: article-table.h
+ * ---------------------
+ * Defines ArticleTable, where the aggregator collects each server's
+ * articles by title while they download, so that articles with the same
+ * server and title can be merged before they're indexed.
+ *
+ * The servers are hashed over a fixed number of shards, each with its own
+ * lock and its own unordered tables, so two article tasks only contend
+ * when their servers land in the same shard.  Every shard's lock is a
+ * MeasuredMutex, and lockWaitTimes and lockHoldTimes report on all of
+ * them together (so constructing a table with a single shard measures
+ * what one global lock would cost).
+ */
+
+#pragma once
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "article.h"
+#include "latency-histogram.h"
+#include "measured-mutex.h"
+
+class ArticleTable {
+ public:
+/**
+ * One entry per server and title.  downloaded says whether any article
+ * under them has been merged in yet (if not, article and tokens are
+ * meaningless), and numPending counts articles that have been announced
+ * but not yet merged or given up on, for clients that need to know when
+ * an entry is final.
+ */
+  struct Entry {
+    Article article;
+    std::vector<std::string> tokens;
+    bool downloaded = false;
+    size_t numPending = 0;
+  };
+
+  typedef std::unordered_map<std::string, Entry> TitleTable;
+
+  static const size_t kDefaultNumShards = 16;
+
+  ArticleTable(size_t numShards = kDefaultNumShards);
+
+/**
+ * Calls f with the specified server's title table, holding the lock of
+ * that server's shard (and no other) throughout.  The table is created
+ * on demand, and dropped again if f leaves it empty.
+ */
+  template <typename F>
+  void withServer(const std::string& server, F f) {
+    Shard& shard = shards[shardFor(server)];
+    std::lock_guard<MeasuredMutex> lg(shard.lock);
+    auto found = shard.servers.find(server);
+    if (found == shard.servers.end()) found = shard.servers.emplace(server, TitleTable()).first;
+    f(found->second);
+    if (found->second.empty()) shard.servers.erase(found);
+  }
+
+/**
+ * Calls f(server, titles) for every server in the table, one shard at a
+ * time, holding that shard's lock.  Servers f leaves empty are dropped.
+ */
+  template <typename F>
+  void forEachServer(F f) {
+    for (size_t i = 0; i < numShards; i++) {
+      std::lock_guard<MeasuredMutex> lg(shards[i].lock);
+      for (auto serverIt = shards[i].servers.begin(); serverIt != shards[i].servers.end();) {
+        f(serverIt->first, serverIt->second);
+        if (serverIt->second.empty()) serverIt = shards[i].servers.erase(serverIt);
+        else ++serverIt;
+      }
+    }
+  }
+
+  size_t getNumShards() const { return numShards; }
+  LatencyHistogram lockWaitTimes() const;
+  LatencyHistogram lockHoldTimes() const;
+
+ private:
+  struct Shard {
+    MeasuredMutex lock;
+    std::unordered_map<std::string, TitleTable> servers;
+  };
+
+  size_t numShards;
+  std::unique_ptr<Shard[]> shards;
+
+  size_t shardFor(const std::string& server) const;
+
+  ArticleTable(const ArticleTable& original) = delete;
+  ArticleTable& operator=(const ArticleTable& rhs) = delete;
+};
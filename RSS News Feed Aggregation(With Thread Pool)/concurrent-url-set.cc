@@ -0,0 +1,160 @@
+/**
+ * File: concurrent-url-set.cc
+ * ---------------------------
+ * Presents the implementation of the ConcurrentURLSet class.
+ */
+
+#include "concurrent-url-set.h"
+#include <functional>
+#include <cstring>
+#include <new>
+using namespace std;
+
+static const size_t kInitialBuckets = 16;
+static const uint64_t kHighBit = (uint64_t) 1 << 63;
+
+static uint64_t reverseBits(uint64_t bits) {
+  bits = ((bits >> 1) & 0x5555555555555555ULL) | ((bits & 0x5555555555555555ULL) << 1);
+  bits = ((bits >> 2) & 0x3333333333333333ULL) | ((bits & 0x3333333333333333ULL) << 2);
+  bits = ((bits >> 4) & 0x0F0F0F0F0F0F0F0FULL) | ((bits & 0x0F0F0F0F0F0F0F0FULL) << 4);
+  return __builtin_bswap64(bits);
+}
+
+/**
+ * A URL's key sets the hash's high bit before reversing it, so it's always
+ * odd and sorts after its bucket's sentinel, whose key is the reversed
+ * bucket number (and so always even).
+ */
+static uint64_t urlKey(uint64_t hash) { return reverseBits(hash | kHighBit); }
+static uint64_t sentinelKey(size_t bucket) { return reverseBits(bucket); }
+
+ConcurrentURLSet::Node *ConcurrentURLSet::Node::create(uint64_t key, const string& url) {
+  Node *node = new (::operator new(sizeof(Node) + url.size())) Node;
+  node->key = key;
+  node->next.store(nullptr, memory_order_relaxed);
+  node->length = url.size();
+  memcpy(reinterpret_cast<char *>(node + 1), url.data(), url.size());
+  return node;
+}
+
+void ConcurrentURLSet::Node::destroy(Node *node) {
+  if (node == nullptr) return;
+  node->~Node();
+  ::operator delete(node);
+}
+
+bool ConcurrentURLSet::Node::holds(const string& url) const {
+  return length == url.size() && memcmp(this->url(), url.data(), length) == 0;
+}
+
+ConcurrentURLSet::ConcurrentURLSet() : numBuckets(kInitialBuckets), numURLs(0) {
+  for (size_t s = 0; s <= kMaxBucketBits; s++) segments[s].store(nullptr, memory_order_relaxed);
+  bucketSlot(0).store(Node::create(sentinelKey(0), ""), memory_order_release);
+}
+
+ConcurrentURLSet::~ConcurrentURLSet() {
+  Node *node = bucketSlot(0).load(memory_order_relaxed);
+  while (node != nullptr) {
+    Node *next = node->next.load(memory_order_relaxed);
+    Node::destroy(node);
+    node = next;
+  }
+  for (size_t s = 0; s <= kMaxBucketBits; s++) delete[] segments[s].load(memory_order_relaxed);
+}
+
+bool ConcurrentURLSet::insert(const string& url) {
+  uint64_t hash = std::hash<string>()(url);
+  size_t bucket = hash & (numBuckets.load(memory_order_acquire) - 1);
+  bool inserted;
+  insertAfter(bucketSentinel(bucket), urlKey(hash), url, inserted);
+  if (!inserted) return false;
+
+  size_t count = numURLs.fetch_add(1, memory_order_relaxed) + 1;
+  size_t buckets = numBuckets.load(memory_order_relaxed);
+  if (count > buckets * kMaxLoadFactor && buckets < ((size_t) 1 << kMaxBucketBits)) {
+    numBuckets.compare_exchange_strong(buckets, buckets * 2, memory_order_release, memory_order_relaxed);
+  }
+  return true;
+}
+
+size_t ConcurrentURLSet::memoryBytes() const {
+  size_t bytes = 0;
+  for (Node *node = segments[0].load(memory_order_acquire)[0].load(memory_order_acquire); node != nullptr;
+       node = node->next.load(memory_order_acquire)) {
+    bytes += sizeof(Node) + node->length;
+  }
+  for (size_t s = 0; s <= kMaxBucketBits; s++) {
+    if (segments[s].load(memory_order_acquire) != nullptr) {
+      bytes += (s == 0 ? 1 : (size_t) 1 << (s - 1)) * sizeof(atomic<Node *>);
+    }
+  }
+  return bytes;
+}
+
+atomic<ConcurrentURLSet::Node *>& ConcurrentURLSet::bucketSlot(size_t bucket) {
+  size_t segment = bucket == 0 ? 0 : 64 - __builtin_clzll(bucket);
+  size_t first = segment == 0 ? 0 : (size_t) 1 << (segment - 1);
+  atomic<Node *> *buckets = segments[segment].load(memory_order_acquire);
+  if (buckets == nullptr) {
+    size_t size = segment == 0 ? 1 : first;
+    atomic<Node *> *allocated = new atomic<Node *>[size];
+    for (size_t i = 0; i < size; i++) allocated[i].store(nullptr, memory_order_relaxed);
+    if (segments[segment].compare_exchange_strong(buckets, allocated, memory_order_acq_rel)) {
+      buckets = allocated;
+    } else {
+      delete[] allocated; // someone else got there first, and buckets now holds theirs
+    }
+  }
+  return buckets[bucket - first];
+}
+
+/**
+ * Returns the bucket's sentinel, first splicing it into the list (after its
+ * parent bucket's sentinel, which is initialized the same way if need be)
+ * if this is the first time the bucket has been used.  Racing threads may
+ * both try, but insertAfter lets only one sentinel in, and both come back
+ * with that one.
+ */
+ConcurrentURLSet::Node *ConcurrentURLSet::bucketSentinel(size_t bucket) {
+  atomic<Node *>& slot = bucketSlot(bucket);
+  Node *sentinel = slot.load(memory_order_acquire);
+  if (sentinel != nullptr) return sentinel;
+  size_t parent = bucket & ~((size_t) 1 << (63 - __builtin_clzll(bucket)));
+  bool inserted;
+  sentinel = insertAfter(bucketSentinel(parent), sentinelKey(bucket), "", inserted);
+  slot.store(sentinel, memory_order_release);
+  return sentinel;
+}
+
+/**
+ * Finds the node with the specified key and URL at or after start, or
+ * splices a new one in where it belongs if there isn't one, and returns
+ * it.  inserted says which happened.  The list is sorted by key, and
+ * nothing is ever removed from it, so a failed compare-and-swap only ever
+ * means that something new was spliced in right after prev, and the
+ * search can carry on from prev.
+ */
+ConcurrentURLSet::Node *ConcurrentURLSet::insertAfter(Node *start, uint64_t key, const string& url, bool& inserted) {
+  Node *node = nullptr;
+  Node *prev = start;
+  while (true) {
+    Node *curr = prev->next.load(memory_order_acquire);
+    while (curr != nullptr && curr->key < key) {
+      prev = curr;
+      curr = curr->next.load(memory_order_acquire);
+    }
+    for (Node *same = curr; same != nullptr && same->key == key; same = same->next.load(memory_order_acquire)) {
+      if (same->holds(url)) {
+        Node::destroy(node);
+        inserted = false;
+        return same;
+      }
+    }
+    if (node == nullptr) node = Node::create(key, url);
+    node->next.store(curr, memory_order_relaxed);
+    if (prev->next.compare_exchange_strong(curr, node, memory_order_release, memory_order_relaxed)) {
+      inserted = true;
+      return node;
+    }
+  }
+}
@@ -0,0 +1,78 @@
+/**
+ * File: concurrent-url-set.h
+ * --------------------------
+ * Defines ConcurrentURLSet, the set of URLs the aggregator has already
+ * claimed, which every feed and article task checks and updates with a
+ * single insert call.  insert never takes a lock: it's a split-ordered
+ * list (Shalev and Shavit's lock-free extensible hash table), which keeps
+ * every URL in one linked list sorted by the bit-reversal of its hash, so
+ * that each bucket is just a shortcut into the middle of the list and
+ * doubling the number of buckets never moves anything.
+ *
+ * Each node holds the URL's 64-bit hash and its own copy of the URL's
+ * characters, stored right after the node in the same allocation, so
+ * walking a bucket compares hashes and only looks at the characters when
+ * two hashes match.  URLs are never removed; nodes are freed when the set
+ * is.
+ */
+
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+class ConcurrentURLSet {
+ public:
+  ConcurrentURLSet();
+  ~ConcurrentURLSet();
+
+/**
+ * Adds the URL to the set, returning true if it wasn't already there and
+ * false if it was.  When several threads insert the same URL at once,
+ * exactly one of them gets true.
+ */
+  bool insert(const std::string& url);
+
+/**
+ * Returns the number of URLs in the set.
+ */
+  size_t size() const { return numURLs.load(std::memory_order_relaxed); }
+
+/**
+ * Returns roughly how many bytes the set is using for its nodes (URL
+ * characters included) and buckets.  It walks the whole list, so it's for
+ * statistics and benchmarks, not for every insert.
+ */
+  size_t memoryBytes() const;
+
+ private:
+  struct Node {
+    uint64_t key;           // the bit-reversed hash, odd for URLs and even for bucket sentinels
+    std::atomic<Node *> next;
+    size_t length;          // of the URL, whose characters follow the node (0 for sentinels)
+
+    const char *url() const { return reinterpret_cast<const char *>(this + 1); }
+    bool holds(const std::string& url) const;
+    static Node *create(uint64_t key, const std::string& url);
+    static void destroy(Node *node);
+  };
+
+/**
+ * Buckets live in segments allocated on demand: segment 0 holds bucket 0,
+ * and segment s > 0 holds buckets 2^(s-1) through 2^s - 1.
+ */
+  static const size_t kMaxBucketBits = 32;
+  static const size_t kMaxLoadFactor = 1;
+
+  std::atomic<std::atomic<Node *> *> segments[kMaxBucketBits + 1];
+  std::atomic<size_t> numBuckets;
+  std::atomic<size_t> numURLs;
+
+  std::atomic<Node *>& bucketSlot(size_t bucket);
+  Node *bucketSentinel(size_t bucket);
+  Node *insertAfter(Node *start, uint64_t key, const std::string& url, bool& inserted);
+
+  ConcurrentURLSet(const ConcurrentURLSet& original) = delete;
+  ConcurrentURLSet& operator=(const ConcurrentURLSet& rhs) = delete;
+};
@@ -0,0 +1,180 @@
+/**
+ * File: cpu-topology.cc
+ * ---------------------
+ * Presents the implementation of CPUTopology and the placement helpers.
+ */
+
+#include "cpu-topology.h"
+#include <algorithm>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <new>
+#include <dirent.h>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+#ifdef HAVE_LIBNUMA
+#include <numa.h>
+#endif
+using namespace std;
+
+#ifdef HAVE_LIBNUMA
+static bool numaUsable() {
+  static const bool usable = numa_available() >= 0;
+  return usable;
+}
+#endif
+
+/**
+ * Returns the CPUs this process may run on, in increasing order.
+ */
+static vector<int> allowedCPUs() {
+  vector<int> cpus;
+#ifdef __linux__
+  cpu_set_t mask;
+  if (sched_getaffinity(0, sizeof(mask), &mask) == 0) {
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET(cpu, &mask)) cpus.push_back(cpu);
+    }
+  }
+#endif
+  if (cpus.empty()) {
+    for (int cpu = 0; cpu < (int) max(thread::hardware_concurrency(), 1u); cpu++) cpus.push_back(cpu);
+  }
+  return cpus;
+}
+
+/**
+ * Parses a kernel cpulist such as "0-3,8-11" into the CPUs it names.
+ */
+static vector<int> parseCPUList(const string& list) {
+  vector<int> cpus;
+  istringstream ranges(list);
+  string range;
+  while (getline(ranges, range, ',')) {
+    if (range.empty() || range == "\n") continue;
+    size_t dash = range.find('-');
+    int first = atoi(range.c_str());
+    int last = dash == string::npos ? first : atoi(range.c_str() + dash + 1);
+    for (int cpu = first; cpu <= last; cpu++) cpus.push_back(cpu);
+  }
+  return cpus;
+}
+
+/**
+ * Returns the kernel's CPU list for every node, indexed by kernel node
+ * number (nodes that don't exist come back empty).
+ */
+static vector<vector<int>> kernelNodeCPUs() {
+  vector<vector<int>> nodeCPUs;
+#ifdef HAVE_LIBNUMA
+  if (numaUsable()) {
+    struct bitmask *mask = numa_allocate_cpumask();
+    for (int node = 0; node <= numa_max_node(); node++) {
+      nodeCPUs.push_back(vector<int>());
+      if (numa_node_to_cpus(node, mask) != 0) continue;
+      for (unsigned int cpu = 0; cpu < mask->size; cpu++) {
+        if (numa_bitmask_isbitset(mask, cpu)) nodeCPUs.back().push_back(cpu);
+      }
+    }
+    numa_free_cpumask(mask);
+    return nodeCPUs;
+  }
+#endif
+  static const string kNodeDirectory = "/sys/devices/system/node";
+  DIR *dir = opendir(kNodeDirectory.c_str());
+  if (dir == NULL) return nodeCPUs;
+  while (struct dirent *entry = readdir(dir)) {
+    if (strncmp(entry->d_name, "node", 4) != 0 || entry->d_name[4] < '0' || entry->d_name[4] > '9') continue;
+    size_t node = atoi(entry->d_name + 4);
+    ifstream cpulist(kNodeDirectory + "/" + entry->d_name + "/cpulist");
+    string list;
+    getline(cpulist, list);
+    if (nodeCPUs.size() <= node) nodeCPUs.resize(node + 1);
+    nodeCPUs[node] = parseCPUList(list);
+  }
+  closedir(dir);
+  return nodeCPUs;
+}
+
+const CPUTopology& CPUTopology::detect() {
+  static CPUTopology *topology = nullptr;
+  static once_flag detected;
+  call_once(detected, [] {
+    topology = new CPUTopology;
+    vector<int> allowed = allowedCPUs();
+    vector<bool> isAllowed(allowed.back() + 1, false);
+    for (int cpu : allowed) isAllowed[cpu] = true;
+    vector<bool> placed(isAllowed.size(), false);
+
+    vector<vector<int>> nodeCPUs = kernelNodeCPUs();
+    for (size_t node = 0; node < nodeCPUs.size(); node++) {
+      vector<int> usable;
+      for (int cpu : nodeCPUs[node]) {
+        if (cpu < (int) isAllowed.size() && isAllowed[cpu] && !placed[cpu]) {
+          usable.push_back(cpu);
+          placed[cpu] = true;
+        }
+      }
+      if (usable.empty()) continue;
+      topology->nodes.push_back(usable);
+      topology->kernelNodes.push_back(node);
+    }
+
+    vector<int> unplaced; // CPUs the node listing didn't mention, or all of them if there was none
+    for (int cpu : allowed) {
+      if (!placed[cpu]) unplaced.push_back(cpu);
+    }
+    if (!unplaced.empty()) {
+      if (topology->nodes.empty()) {
+        topology->nodes.push_back(unplaced);
+        topology->kernelNodes.push_back(0);
+      } else {
+        topology->nodes[0].insert(topology->nodes[0].end(), unplaced.begin(), unplaced.end());
+      }
+    }
+  });
+  return *topology;
+}
+
+bool pinThisThread(const vector<int>& cpus) {
+#ifdef __linux__
+  cpu_set_t mask;
+  CPU_ZERO(&mask);
+  for (int cpu : cpus) CPU_SET(cpu, &mask);
+  return pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask) == 0;
+#else
+  return false;
+#endif
+}
+
+/**
+ * libnuma hands out whole pages, so it's only worth going through when a
+ * node has actually been asked for.
+ */
+void *allocateOnNode(size_t size, int node) {
+#ifdef HAVE_LIBNUMA
+  if (node >= 0 && numaUsable()) {
+    void *memory = numa_alloc_onnode(size, node);
+    if (memory == NULL) throw bad_alloc();
+    return memory;
+  }
+#endif
+  return ::operator new(size);
+}
+
+void freeOnNode(void *memory, size_t size, int node) {
+#ifdef HAVE_LIBNUMA
+  if (node >= 0 && numaUsable()) {
+    numa_free(memory, size);
+    return;
+  }
+#endif
+  ::operator delete(memory);
+}
@@ -0,0 +1,64 @@
+/**
+ * File: cpu-topology.h
+ * --------------------
+ * Defines CPUTopology, which describes which CPUs this process may run on
+ * and how they're grouped into NUMA nodes, along with the handful of
+ * helpers the ThreadPool needs to place workers (and their memory) on
+ * particular CPUs or nodes.
+ *
+ * The topology comes from libnuma when the build defines HAVE_LIBNUMA,
+ * otherwise from /sys/devices/system/node, and failing that it's a single
+ * node holding every CPU the process is allowed to use.  Pinning is only
+ * supported on Linux; elsewhere pinThisThread quietly does nothing.
+ */
+
+#pragma once
+#include <cstddef>
+#include <vector>
+
+class CPUTopology {
+ public:
+
+/**
+ * Discovers the topology of the machine we're running on.  Only CPUs in
+ * the process's affinity mask are included, and nodes left with no usable
+ * CPUs are dropped.
+ */
+  static const CPUTopology& detect();
+
+/**
+ * Returns the number of NUMA nodes with usable CPUs.
+ */
+  size_t numNodes() const { return nodes.size(); }
+
+/**
+ * Returns the usable CPUs on the specified node (indexed 0 through
+ * numNodes() - 1, which needn't match the kernel's node numbering).
+ */
+  const std::vector<int>& cpusOn(size_t node) const { return nodes[node]; }
+
+/**
+ * Returns the kernel's number for the specified node, as libnuma expects.
+ */
+  int kernelNode(size_t node) const { return kernelNodes[node]; }
+
+ private:
+  CPUTopology() {}
+  std::vector<std::vector<int>> nodes;
+  std::vector<int> kernelNodes;
+};
+
+/**
+ * Restricts the calling thread to the supplied CPUs.  Returns false if
+ * the request failed or pinning isn't supported here.
+ */
+bool pinThisThread(const std::vector<int>& cpus);
+
+/**
+ * Allocates memory on the specified kernel NUMA node (or with plain
+ * operator new, if node is negative or libnuma isn't available), and
+ * frees memory allocated that way.  size and node must be the same for
+ * both calls.
+ */
+void *allocateOnNode(size_t size, int node);
+void freeOnNode(void *memory, size_t size, int node);
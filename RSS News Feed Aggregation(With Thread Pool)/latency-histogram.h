@@ -0,0 +1,134 @@
+/**
+ * File: latency-histogram.h
+ * -------------------------
+ * Defines LatencyHistogram and ConcurrentLatencyHistogram, which count
+ * durations (in nanoseconds) in log-linear buckets, in the style of
+ * HdrHistogram: every power of two is split into kSubBuckets equal
+ * buckets, so any recorded value can be recovered to within about 6%
+ * no matter how large it is, with a fixed, small number of buckets.
+ *
+ * ConcurrentLatencyHistogram is what gets recorded into, by one thread
+ * at a time, while any number of other threads take snapshots of it;
+ * LatencyHistogram is the plain snapshot it hands back, which can be
+ * merged with others and asked for percentiles.
+ */
+
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace latency {
+static const size_t kSubBucketBits = 4;
+static const size_t kSubBuckets = 1 << kSubBucketBits;
+static const size_t kMaxExponent = 47;  // values from 2^48 ns (about three days) up share the last bucket
+static const size_t kNumBuckets = (kMaxExponent - kSubBucketBits + 2) * kSubBuckets;
+
+inline size_t bucketFor(uint64_t nanos) {
+  if (nanos < kSubBuckets) return nanos;
+  size_t exponent = 63 - __builtin_clzll(nanos);
+  if (exponent > kMaxExponent) return kNumBuckets - 1;
+  size_t subBucket = (nanos >> (exponent - kSubBucketBits)) & (kSubBuckets - 1);
+  return (exponent - kSubBucketBits + 1) * kSubBuckets + subBucket;
+}
+
+/**
+ * Returns the largest value that lands in the specified bucket.
+ */
+inline uint64_t highestValueIn(size_t bucket) {
+  if (bucket < kSubBuckets) return bucket;
+  size_t exponent = bucket / kSubBuckets + kSubBucketBits - 1;
+  uint64_t lowest = (uint64_t) (kSubBuckets + bucket % kSubBuckets) << (exponent - kSubBucketBits);
+  return lowest + ((uint64_t) 1 << (exponent - kSubBucketBits)) - 1;
+}
+}
+
+class LatencyHistogram {
+ public:
+  LatencyHistogram() : counts(latency::kNumBuckets, 0), total(0), sum(0), maximum(0) {}
+
+  void record(uint64_t nanos, uint64_t weight = 1) {
+    counts[latency::bucketFor(nanos)] += weight;
+    total += weight;
+    sum += nanos * weight;
+    if (nanos > maximum) maximum = nanos;
+  }
+
+  void merge(const LatencyHistogram& other) {
+    for (size_t bucket = 0; bucket < counts.size(); bucket++) counts[bucket] += other.counts[bucket];
+    total += other.total;
+    sum += other.sum;
+    if (other.maximum > maximum) maximum = other.maximum;
+  }
+
+  uint64_t count() const { return total; }
+  uint64_t max() const { return maximum; }
+  double mean() const { return total == 0 ? 0 : double(sum) / total; }
+
+/**
+ * Returns the smallest bucket bound below which at least the specified
+ * fraction (between 0 and 1) of the recorded values fall, or 0 if nothing
+ * has been recorded.
+ */
+  uint64_t percentile(double fraction) const {
+    if (total == 0) return 0;
+    uint64_t rank = (uint64_t) (fraction * total);
+    if (rank == 0) rank = 1;
+    uint64_t seen = 0;
+    for (size_t bucket = 0; bucket < counts.size(); bucket++) {
+      seen += counts[bucket];
+      if (seen >= rank) return bucket == counts.size() - 1 ? maximum : latency::highestValueIn(bucket);
+    }
+    return maximum;
+  }
+
+ private:
+  std::vector<uint64_t> counts;
+  uint64_t total;
+  uint64_t sum;
+  uint64_t maximum;
+
+  friend class ConcurrentLatencyHistogram;
+};
+
+class ConcurrentLatencyHistogram {
+ public:
+  ConcurrentLatencyHistogram() : sum(0), maximum(0) {
+    for (std::atomic<uint64_t>& count : counts) count.store(0, std::memory_order_relaxed);
+  }
+
+/**
+ * Records a value as if it had been seen weight times (so that a caller
+ * timing only every Nth event can still produce a histogram of all of
+ * them).  Since there's only ever one writer, every update is a relaxed
+ * load and store rather than a read-modify-write, which keeps recording
+ * down to a few plain instructions; a snapshot taken mid-record may be
+ * off by that one value, which is fine for statistics.
+ */
+  void record(uint64_t nanos, uint64_t weight = 1) {
+    std::atomic<uint64_t>& count = counts[latency::bucketFor(nanos)];
+    count.store(count.load(std::memory_order_relaxed) + weight, std::memory_order_relaxed);
+    sum.store(sum.load(std::memory_order_relaxed) + nanos * weight, std::memory_order_relaxed);
+    if (nanos > maximum.load(std::memory_order_relaxed)) maximum.store(nanos, std::memory_order_relaxed);
+  }
+
+  LatencyHistogram snapshot() const {
+    LatencyHistogram histogram;
+    for (size_t bucket = 0; bucket < latency::kNumBuckets; bucket++) {
+      histogram.counts[bucket] = counts[bucket].load(std::memory_order_relaxed);
+      histogram.total += histogram.counts[bucket];
+    }
+    histogram.sum = sum.load(std::memory_order_relaxed);
+    histogram.maximum = maximum.load(std::memory_order_relaxed);
+    return histogram;
+  }
+
+ private:
+  std::atomic<uint64_t> counts[latency::kNumBuckets];
+  std::atomic<uint64_t> sum;
+  std::atomic<uint64_t> maximum;
+
+  ConcurrentLatencyHistogram(const ConcurrentLatencyHistogram& original) = delete;
+  ConcurrentLatencyHistogram& operator=(const ConcurrentLatencyHistogram& rhs) = delete;
+};
@@ -16,7 +16,7 @@ using namespace std;
 static const int kIncorrectUsage = 1;
 void NewsAggregatorLog::printUsage(const string& message, const string& executable) {
   cerr << "Error: " << message << endl;
-  cerr << "Usage: ./" << executable << " [--verbose] [--quiet] [--conserve-threads] [--url <feed-file>]" << endl;
+  cerr << "Usage: ./" << executable << " [--verbose] [--quiet] [--conserve-threads] [--stats] [--incremental] [--url-filter] [--url-filter-budget <MB>] [--url <feed-file>]" << endl;
   exit(kIncorrectUsage);
 }
 
@@ -0,0 +1,107 @@
+/**
+ * File: mpmc-queue.h
+ * ------------------
+ * Defines a bounded, lock-free, multi-producer/multi-consumer FIFO queue
+ * (Dmitry Vyukov's array-based design).  Every slot carries a sequence
+ * number; producers and consumers claim positions with a single
+ * compare-and-swap on their respective cursors and then use the slot's
+ * sequence number to hand the element across without any locks.
+ *
+ * The queue never blocks: enqueue reports failure when the queue is full
+ * and dequeue reports failure when it's empty, leaving it to the client
+ * to decide what to do instead.
+ */
+
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+template <typename T>
+class MPMCQueue {
+ public:
+
+/**
+ * Constructs an empty queue able to hold at least the requested number of
+ * elements (the capacity is rounded up to a power of two).
+ */
+  MPMCQueue(size_t requestedCapacity) : capacity(roundUp(requestedCapacity)),
+    buffer(new Cell[capacity]), mask(capacity - 1), enqueuePos(0), dequeuePos(0) {
+    for (size_t i = 0; i < capacity; i++) buffer[i].sequence.store(i, std::memory_order_relaxed);
+  }
+
+/**
+ * Moves value into the queue and returns true, or returns false (leaving
+ * value untouched) if the queue is full.
+ */
+  bool enqueue(T& value) {
+    Cell *cell;
+    size_t pos = enqueuePos.load(std::memory_order_relaxed);
+    while (true) {
+      cell = &buffer[pos & mask];
+      size_t seq = cell->sequence.load(std::memory_order_acquire);
+      intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+      if (diff == 0) {
+        if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+      } else if (diff < 0) {
+        return false; // slot still holds an element from the previous lap
+      } else {
+        pos = enqueuePos.load(std::memory_order_relaxed);
+      }
+    }
+    cell->data = std::move(value);
+    cell->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+/**
+ * Moves the oldest element into value and returns true, or returns false
+ * if the queue is empty.
+ */
+  bool dequeue(T& value) {
+    Cell *cell;
+    size_t pos = dequeuePos.load(std::memory_order_relaxed);
+    while (true) {
+      cell = &buffer[pos & mask];
+      size_t seq = cell->sequence.load(std::memory_order_acquire);
+      intptr_t diff = (intptr_t) seq - (intptr_t) (pos + 1);
+      if (diff == 0) {
+        if (dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+      } else if (diff < 0) {
+        return false; // nothing published in this slot yet
+      } else {
+        pos = dequeuePos.load(std::memory_order_relaxed);
+      }
+    }
+    value = std::move(cell->data);
+    cell->data = T();
+    cell->sequence.store(pos + mask + 1, std::memory_order_release);
+    return true;
+  }
+
+ private:
+  struct Cell {
+    std::atomic<size_t> sequence;
+    T data;
+  };
+
+  static const size_t kCacheLineSize = 64;
+  static size_t roundUp(size_t n) {
+    size_t capacity = 2;
+    while (capacity < n) capacity <<= 1;
+    return capacity;
+  }
+
+  const size_t capacity;
+  std::unique_ptr<Cell[]> buffer;
+  const size_t mask;
+  char producerPad[kCacheLineSize];  // keeps the two cursors on separate cache lines
+  std::atomic<size_t> enqueuePos;
+  char consumerPad[kCacheLineSize];
+  std::atomic<size_t> dequeuePos;
+
+  MPMCQueue(const MPMCQueue& original) = delete;
+  MPMCQueue& operator=(const MPMCQueue& rhs) = delete;
+};
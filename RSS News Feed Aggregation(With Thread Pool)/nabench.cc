@@ -0,0 +1,260 @@
+/**
+ * File: nabench.cc
+ * ----------------
+ * Benchmarks the data structures the NewsAggregator shares between its
+ * article tasks, away from the network.  Available benchmarks:
+ *
+ *   --article-table [N]  has N threads (24 by default, about what the
+ *                        aggregator's pool runs with while downloads are
+ *                        outstanding) merge articles into an ArticleTable
+ *                        with a single shard, which behaves like the old
+ *                        global ArticleMapLock, and then into one with the
+ *                        default number of shards, reporting merges per
+ *                        second and how long the shard locks were waited
+ *                        on and held.
+ *   --url-set [N]        has N threads (32 by default) claim 1M URLs, each of
+ *                        which is offered twice by different threads, first
+ *                        in an unordered_set behind one mutex (the old
+ *                        urlSet and urlSetLock) and then in a
+ *                        ConcurrentURLSet, reporting claims per second and
+ *                        checking that every URL was claimed exactly once.
+ *   --url-filter         inserts 100K, 500K, 1M and 2M distinct URLs into a
+ *                        ConcurrentURLSet and an unbounded URLFilter and
+ *                        compares their memory use, measuring the filter's
+ *                        false-positive rate on as many URLs again that
+ *                        were never inserted.  It then inserts the same
+ *                        URLs into a filter with a 1MB budget, counting
+ *                        how many were wrongly skipped as already seen
+ *                        against how many the filter expected to skip.
+ *
+ * With no arguments, every benchmark runs.
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <iterator>
+#include <string>
+#include <random>
+#include <atomic>
+#include <mutex>
+#include <unordered_set>
+
+#include "article-table.h"
+#include "concurrent-url-set.h"
+#include "url-filter.h"
+#include "latency-histogram.h"
+using namespace std;
+
+static const size_t kDefaultNumWorkers = 24;
+static const size_t kDefaultNumClaimers = 32;
+static const size_t kNumURLs = 1000000;
+static const size_t kFilterBudgetBytes = 1 << 20;
+static const size_t kMergesPerWorker = 20000;
+static const size_t kNumServers = 64;
+static const size_t kNumTitlesPerServer = 32;
+static const size_t kNumTokensPerArticle = 100;
+static const size_t kVocabularySize = 400;
+
+struct SimulatedArticle {
+  string server;
+  Article article;
+  vector<string> tokens;
+};
+
+static vector<SimulatedArticle> makeArticles(size_t numArticles, unsigned int seed) {
+  mt19937 random(seed);
+  vector<SimulatedArticle> articles(numArticles);
+  for (size_t i = 0; i < numArticles; i++) {
+    size_t server = random() % kNumServers;
+    size_t title = random() % kNumTitlesPerServer;
+    articles[i].server = "www.server-" + to_string(server) + ".com";
+    articles[i].article.url = "http://" + articles[i].server + "/" + to_string(seed) + "/" + to_string(i);
+    articles[i].article.title = "title " + to_string(title);
+    for (size_t j = 0; j < kNumTokensPerArticle; j++) {
+      articles[i].tokens.push_back("token" + to_string(random() % kVocabularySize));
+    }
+    sort(articles[i].tokens.begin(), articles[i].tokens.end());
+  }
+  return articles;
+}
+
+/**
+ * The same merge NewsAggregator::mergeArticle performs.
+ */
+static void merge(ArticleTable::Entry& entry, const Article& article, const vector<string>& tokens) {
+  if (entry.downloaded) {
+    vector<string> newTokens;
+    set_intersection(entry.tokens.cbegin(), entry.tokens.cend(),
+                     tokens.cbegin(), tokens.cend(), back_inserter(newTokens));
+    entry.article = min(entry.article, article);
+    entry.tokens = move(newTokens);
+  } else {
+    entry.article = article;
+    entry.tokens = tokens;
+    entry.downloaded = true;
+  }
+}
+
+static void printMicros(const string& label, const LatencyHistogram& histogram) {
+  static const double kNanosPerMicro = 1e3;
+  cout << "    " << left << setw(12) << label << right << fixed << setprecision(2)
+       << "mean " << setw(9) << histogram.mean() / kNanosPerMicro << "us"
+       << "   p99 " << setw(9) << histogram.percentile(0.99) / kNanosPerMicro << "us"
+       << "   max " << setw(10) << histogram.max() / kNanosPerMicro << "us" << endl;
+}
+
+static void articleTableBenchmark(size_t numWorkers) {
+  cout << "ArticleTable: " << numWorkers << " workers, " << kMergesPerWorker << " merges each, "
+       << kNumServers << " servers" << endl;
+  vector<vector<SimulatedArticle>> articles;
+  for (size_t worker = 0; worker < numWorkers; worker++) {
+    articles.push_back(makeArticles(kMergesPerWorker, worker + 1));
+  }
+  for (size_t numShards : {(size_t) 1, ArticleTable::kDefaultNumShards}) {
+    ArticleTable table(numShards);
+    vector<thread> workers;
+    auto start = chrono::steady_clock::now();
+    for (size_t worker = 0; worker < numWorkers; worker++) {
+      workers.push_back(thread([&table, &articles, worker] {
+        for (const SimulatedArticle& simulated : articles[worker]) {
+          table.withServer(simulated.server, [&simulated](ArticleTable::TitleTable& titles) {
+            merge(titles[simulated.article.title], simulated.article, simulated.tokens);
+          });
+        }
+      }));
+    }
+    for (thread& t : workers) t.join();
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cout << "  " << setw(2) << numShards << (numShards == 1 ? " shard:  " : " shards: ") << fixed
+         << setprecision(0) << numWorkers * kMergesPerWorker / seconds << " merges/sec" << endl;
+    printMicros("lock wait", table.lockWaitTimes());
+    printMicros("lock hold", table.lockHoldTimes());
+  }
+}
+
+/**
+ * Runs numClaimers threads, each offering every URL in its own slice and
+ * then every URL in the next thread's slice to claim, and returns how
+ * many claims per second that came to.  Exits if any URL was claimed
+ * other than exactly once.
+ */
+template <typename Claim>
+static double timeClaims(const vector<string>& urls, size_t numClaimers, Claim claim) {
+  vector<atomic<int>> claims(urls.size());
+  for (atomic<int>& count : claims) count.store(0);
+  size_t sliceSize = (urls.size() + numClaimers - 1) / numClaimers;
+  vector<thread> claimers;
+  auto start = chrono::steady_clock::now();
+  for (size_t claimer = 0; claimer < numClaimers; claimer++) {
+    claimers.push_back(thread([&, claimer] {
+      for (size_t slice : {claimer, (claimer + 1) % numClaimers}) {
+        for (size_t i = slice * sliceSize; i < min(urls.size(), (slice + 1) * sliceSize); i++) {
+          if (claim(urls[i])) claims[i]++;
+        }
+      }
+    }));
+  }
+  for (thread& t : claimers) t.join();
+  double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  for (size_t i = 0; i < urls.size(); i++) {
+    if (claims[i] != 1) {
+      cout << "URL " << urls[i] << " was claimed " << claims[i] << " times!" << endl;
+      exit(1);
+    }
+  }
+  return 2 * urls.size() / seconds;
+}
+
+static vector<string> makeURLs(size_t numURLs, unsigned int seed) {
+  mt19937 random(seed);
+  vector<string> urls;
+  for (size_t i = 0; i < numURLs; i++) {
+    urls.push_back("http://www.server-" + to_string(random() % kNumServers) + ".com/2017/06/" +
+                   to_string(random()) + "/article-" + to_string(seed) + "-" + to_string(i) + ".html");
+  }
+  return urls;
+}
+
+static void urlSetBenchmark(size_t numClaimers) {
+  cout << "URL set: " << numClaimers << " threads, " << kNumURLs << " URLs, each offered twice" << endl;
+  vector<string> urls = makeURLs(kNumURLs, 1);
+
+  mutex urlSetLock;
+  unordered_set<string> urlSet;
+  double locked = timeClaims(urls, numClaimers, [&](const string& url) {
+    lock_guard<mutex> lg(urlSetLock);
+    if (urlSet.count(url)) return false;
+    urlSet.insert(url);
+    return true;
+  });
+  cout << "  unordered_set + mutex: " << fixed << setprecision(0) << setw(10) << locked << " claims/sec" << endl;
+
+  ConcurrentURLSet concurrentSet;
+  double lockFree = timeClaims(urls, numClaimers, [&](const string& url) {
+    return concurrentSet.insert(url);
+  });
+  cout << "  ConcurrentURLSet:      " << setw(10) << lockFree << " claims/sec" << endl;
+}
+
+static void urlFilterBenchmark() {
+  cout << "URL filter (" << URLFilter::kDefaultFalsePositiveRate * 100 << "% false positives, "
+       << kFilterBudgetBytes / 1024 << "KB when bounded):" << endl;
+  cout << setw(10) << "URLs" << setw(12) << "set KB" << setw(12) << "filter KB" << setw(14) << "measured fp"
+       << setw(18) << "bounded skipped" << setw(12) << "expected" << endl;
+  for (size_t numURLs : {100000, 500000, 1000000, 2000000}) {
+    vector<string> urls = makeURLs(numURLs, 2);
+    size_t setBytes;
+    {
+      ConcurrentURLSet urlSet;
+      for (const string& url : urls) urlSet.insert(url);
+      setBytes = urlSet.memoryBytes();
+    }
+
+    URLFilter filter;
+    for (const string& url : urls) filter.insert(url);
+    size_t numFalsePositives = 0;
+    for (const string& url : makeURLs(numURLs, 3)) {
+      if (filter.mightContain(url)) numFalsePositives++;
+    }
+
+    URLFilter bounded(URLFilter::kDefaultInitialCapacity, URLFilter::kDefaultFalsePositiveRate, kFilterBudgetBytes);
+    size_t numSkipped = 0;
+    for (const string& url : urls) {
+      if (!bounded.insert(url)) numSkipped++;
+    }
+
+    cout << setw(10) << numURLs << setw(12) << setBytes / 1024 << setw(12) << filter.memoryBytes() / 1024
+         << setw(13) << fixed << setprecision(4) << 100.0 * numFalsePositives / numURLs << "%"
+         << setw(18) << numSkipped << setw(12) << setprecision(0) << bounded.expectedFalsePositives() << endl;
+  }
+}
+
+int main(int argc, char *argv[]) {
+  size_t numWorkers = kDefaultNumWorkers;
+  if (argc == 1) {
+    articleTableBenchmark(numWorkers);
+    urlSetBenchmark(kDefaultNumClaimers);
+    urlFilterBenchmark();
+    return 0;
+  }
+
+  if (strcmp(argv[1], "--article-table") == 0) {
+    if (argc > 2) numWorkers = max<size_t>(strtoul(argv[2], NULL, 10), 1);
+    articleTableBenchmark(numWorkers);
+  } else if (strcmp(argv[1], "--url-set") == 0) {
+    size_t numClaimers = kDefaultNumClaimers;
+    if (argc > 2) numClaimers = max<size_t>(strtoul(argv[2], NULL, 10), 1);
+    urlSetBenchmark(numClaimers);
+  } else if (strcmp(argv[1], "--url-filter") == 0) {
+    urlFilterBenchmark();
+  } else {
+    cout << "Oops... we don't recognize the flag \"" << argv[1] << "\"." << endl;
+  }
+  return 0;
+}
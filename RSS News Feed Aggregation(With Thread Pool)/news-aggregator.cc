@@ -22,6 +22,10 @@
 #include <unordered_map>
 #include <unordered_set>
 #include <utility> 
+#include <functional>
+#include <future>
+#include <memory>
+#include <chrono>
 
 #include "rss-feed.h"
 #include "rss-feed-list.h"
@@ -47,13 +51,21 @@ NewsAggregator *NewsAggregator::createNewsAggregator(int argc, char *argv[]) {
 	{"verbose", no_argument, NULL, 'v'},
 	{"quiet", no_argument, NULL, 'q'},
 	{"url", required_argument, NULL, 'u'},
+	{"stats", no_argument, NULL, 's'},
+	{"incremental", no_argument, NULL, 'i'},
+	{"url-filter", no_argument, NULL, 'f'},
+	{"url-filter-budget", required_argument, NULL, 'b'},
 	{NULL, 0, NULL, 0},
     };
 
     string rssFeedListURI = kDefaultRSSFeedListURL;
     bool verbose = false;
+    bool showStats = false;
+    bool incremental = false;
+    bool urlFilter = false;
+    size_t urlFilterBudgetMB = 0;
     while (true) {
-	int ch = getopt_long(argc, argv, "vqu:", options, NULL);
+	int ch = getopt_long(argc, argv, "vqsifb:u:", options, NULL);
 	if (ch == -1) break;
 	switch (ch) {
 	    case 'v':
@@ -65,6 +77,20 @@ NewsAggregator *NewsAggregator::createNewsAggregator(int argc, char *argv[]) {
 	    case 'u':
 		rssFeedListURI = optarg;
 		break;
+	    case 's':
+		showStats = true;
+		break;
+	    case 'i':
+		incremental = true;
+		break;
+	    case 'f':
+		urlFilter = true;
+		break;
+	    case 'b':
+		urlFilter = true;
+		urlFilterBudgetMB = strtoul(optarg, NULL, 10);
+		if (urlFilterBudgetMB == 0) NewsAggregatorLog::printUsage("The URL filter budget must be a positive number of megabytes.", argv[0]);
+		break;
 	    default:
 		NewsAggregatorLog::printUsage("Unrecognized flag.", argv[0]);
 	}
@@ -72,7 +98,7 @@ NewsAggregator *NewsAggregator::createNewsAggregator(int argc, char *argv[]) {
 
     argc -= optind;
     if (argc > 0) NewsAggregatorLog::printUsage("Too many arguments.", argv[0]);
-    return new NewsAggregator(rssFeedListURI, verbose);
+    return new NewsAggregator(rssFeedListURI, verbose, showStats, incremental, urlFilter, urlFilterBudgetMB);
 }
 
 /**
@@ -90,6 +116,71 @@ void NewsAggregator::buildIndex() {
     processAllFeeds();
     xmlCatalogCleanup();
     xmlCleanupParser();
+    if (showStats) printPoolStats();
+}
+
+static void printLatencies(const string& label, const LatencyHistogram& histogram) {
+    static const double kNanosPerMilli = 1e6;
+    cout << "  " << left << setw(14) << label << right << fixed << setprecision(3)
+	 << setw(8) << histogram.count()
+	 << setw(12) << histogram.mean() / kNanosPerMilli
+	 << setw(12) << histogram.percentile(0.5) / kNanosPerMilli
+	 << setw(12) << histogram.percentile(0.99) / kNanosPerMilli
+	 << setw(12) << histogram.max() / kNanosPerMilli << endl;
+}
+
+/**
+ * Method: printPoolStats
+ * ----------------------
+ * Dumps a snapshot of the pool's statistics: latencies are printed in
+ * milliseconds as count/mean/p50/p99/max, and busy is the fraction of
+ * each worker's lifetime it spent doing anything other than sleeping.
+ */
+static const char *kLaneNames[] = {"feeds", "articles", "index"};
+void NewsAggregator::printPoolStats() const {
+    ThreadPool::Stats stats = pool.stats();
+    cout << "Thread pool: " << stats.numThreads << " live workers, " << setprecision(1) << fixed
+	 << stats.busyFraction * 100 << "% busy, at most " << stats.outstandingHighWater
+	 << " thunks outstanding at once." << endl;
+    cout << "  " << left << setw(14) << "(ms)" << right << setw(8) << "count" << setw(12) << "mean"
+	 << setw(12) << "p50" << setw(12) << "p99" << setw(12) << "max" << endl;
+    printLatencies("queue latency", stats.queueLatency);
+    printLatencies("run time", stats.runTime);
+    for (size_t lane = 0; lane < stats.lanes.size(); lane++) {
+	const ThreadPool::LaneStats& laneStats = stats.lanes[lane];
+	cout << "Lane " << kLaneNames[lane] << " (weight " << laneStats.weight << "): "
+	     << laneStats.numDispatched << " dispatched, deepest " << laneStats.depthHighWater
+	     << ", mean wait " << setprecision(3) << laneStats.meanWaitMillis << "ms, max wait "
+	     << laneStats.maxWaitMillis << "ms." << endl;
+    }
+    for (size_t workerID = 0; workerID < stats.workers.size(); workerID++) {
+	const ThreadPool::WorkerStats& worker = stats.workers[workerID];
+	if (worker.numRun == 0) continue;
+	cout << "Worker " << workerID << (worker.live ? "" : " (retired)") << ": " << worker.numRun
+	     << " run, " << setprecision(1) << worker.busyFraction * 100 << "% busy, deepest deque "
+	     << worker.dequeHighWater << "." << endl;
+    }
+    if (stats.helpers.numRun > 0) {
+	cout << "Helpers: " << stats.helpers.numRun << " run." << endl;
+    }
+    cout << "Article table (" << articleTable.getNumShards() << " shards) locks:" << endl;
+    printLatencies("lock wait", articleTable.lockWaitTimes());
+    printLatencies("lock hold", articleTable.lockHoldTimes());
+    if (urlFilter == nullptr || !urlFilterOnly) {
+	cout << "URL set: " << urlSet.size() << " URLs in " << urlSet.memoryBytes() / 1024 << "KB, "
+	     << numURLsSkipped << " duplicates skipped." << endl;
+    }
+    if (urlFilter != nullptr) {
+	cout << "URL filter: " << urlFilter->size() << " URLs in " << urlFilter->memoryBytes() / 1024 << "KB ("
+	     << urlFilter->getNumStages() << " stages), estimated false-positive rate " << setprecision(4)
+	     << urlFilter->falsePositiveRate() * 100 << "%." << endl;
+	if (urlFilterOnly) {
+	    cout << "  " << numURLsSkipped << " URLs skipped as already seen, about " << setprecision(1)
+		 << urlFilter->expectedFalsePositives() << " of them false positives." << endl;
+	} else {
+	    cout << "  " << numFilterFalsePositives << " false positives caught by the URL set." << endl;
+	}
+    }
 }
 
 /**
@@ -144,9 +235,47 @@ void NewsAggregator::queryIndex() const {
  * initialize any additional fields you add to the private section
  * of the class definition.
  */
-NewsAggregator::NewsAggregator(const string& rssFeedListURI, bool verbose): 
-    log(verbose), rssFeedListURI(rssFeedListURI), built(false),
-    feedPool(kNumMaxFeed), articlePool(kNumMaxArticle) {}
+NewsAggregator::NewsAggregator(const string& rssFeedListURI, bool verbose, bool showStats, bool incremental,
+			       bool urlFilter, size_t urlFilterBudgetMB):
+    urlFilter(urlFilter ? new URLFilter(URLFilter::kDefaultInitialCapacity, URLFilter::kDefaultFalsePositiveRate,
+					 urlFilterBudgetMB * kBytesPerMB) : nullptr),
+    urlFilterOnly(urlFilterBudgetMB > 0), numURLsSkipped(0), numFilterFalsePositives(0),
+    log(verbose), rssFeedListURI(rssFeedListURI), built(false), showStats(showStats),
+    incremental(incremental),
+    pool(ThreadPool::Elasticity{kNumMinThreads, kNumMaxThreads, chrono::milliseconds(kSpawnDelayMillis),
+			      chrono::milliseconds(kIdleTimeoutMillis)},
+	 {kFeedLaneWeight, kArticleLaneWeight, kIndexLaneWeight}),
+    numFeedsUnparsed(0) {}
+
+/**
+ * Private Method: claimURL
+ * ------------------------
+ * Claims a feed or article URL for the calling task, returning false if
+ * some other task claimed it first.  With a URL filter in front of urlSet,
+ * every URL still goes through urlSet.insert, which has to walk its bucket
+ * either way (and two tasks can both miss in the filter for the same URL),
+ * so the filter saves no work here; it only gets its false positives
+ * counted exactly.  With the filter alone, a URL it thinks it has seen is
+ * skipped, and false positives can only be estimated.
+ */
+bool NewsAggregator::claimURL(const string& url) {
+    if (urlFilter == nullptr) return urlSet.insert(url);
+    bool claimed;
+    if (urlFilterOnly) {
+	claimed = urlFilter->insert(url);
+    } else if (!urlFilter->mightContain(url)) {
+	urlFilter->insert(url);
+	claimed = urlSet.insert(url);
+    } else {
+	claimed = urlSet.insert(url);
+	if (claimed) {
+	    urlFilter->insert(url);
+	    numFilterFalsePositives++;
+	}
+    }
+    if (!claimed) numURLsSkipped++;
+    return claimed;
+}
 
 /**
  * Private Method: processAllFeeds
@@ -161,78 +290,177 @@ NewsAggregator::NewsAggregator(const string& rssFeedListURI, bool verbose):
  */
 
 
+/**
+ * Private Method: downloadArticleTokens
+ * -------------------------------------
+ * Claims the article's URL, downloads and tokenizes the document, and hands
+ * back its sorted tokens.  Returns nullptr if the URL has already been claimed
+ * or the download fails, so there's nothing to merge.
+ */
+unique_ptr<vector<string>> NewsAggregator::downloadArticleTokens(const Article& article) {
+	if (!claimURL(article.url)) return nullptr;
+	HTMLDocument htmlDocument(article.url);
+	try{
+		BlockingRegion downloading;
+		htmlDocument.parse();
+	} catch(const HTMLDocumentException& hde) {
+		return nullptr;
+	}
+	const auto& const_tokens = htmlDocument.getTokens();
+	unique_ptr<vector<string>> tokens(new vector<string>(const_tokens.begin(), const_tokens.end()));
+	sort(tokens->begin(), tokens->end());
+	return tokens;
+}
+
+/**
+ * Private Method: downloadArticle
+ * -------------------------------
+ * Runs on the article lane: downloads the article and merges its tokens
+ * into its server's articleTable entry, holding only that server's shard
+ * lock while it does.  When indexing incrementally, it also settles the
+ * article, and indexes the entry if that made it final.
+ */
+void NewsAggregator::downloadArticle(const Article& article) {
+	unique_ptr<vector<string>> tokens = downloadArticleTokens(article);
+	if (tokens == nullptr && !incremental) return;
+	ArticleList finalArticles;
+	articleTable.withServer(getURLServer(article.url), [&](ArticleTable::TitleTable& titles) {
+		auto entry = titles.emplace(article.title, ArticleTable::Entry()).first;
+		if (tokens != nullptr) mergeArticle(entry->second, article, *tokens);
+		if (incremental && --entry->second.numPending == 0 && numFeedsUnparsed == 0) {
+			takeArticle(titles, entry, finalArticles);
+		}
+	});
+	indexArticles(move(finalArticles));
+}
+
+/**
+ * Private Method: mergeArticle
+ * ----------------------------
+ * Folds an article's tokens into its entry, intersecting them with those of
+ * any article already recorded under the same server and title.  The caller
+ * must hold the entry's shard lock.
+ */
+void NewsAggregator::mergeArticle(ArticleTable::Entry& entry, const Article& article, vector<string>& tokens) {
+	if (entry.downloaded) {
+		vector<string> newTokens;
+		set_intersection(entry.tokens.cbegin(), entry.tokens.cend(),
+					tokens.cbegin(), tokens.cend(), back_inserter(newTokens));
+		entry.article = min(entry.article, article);
+		entry.tokens = move(newTokens);
+	} else {
+		entry.article = article;
+		entry.tokens = move(tokens);
+		entry.downloaded = true;
+	}
+}
+
+/**
+ * Private Method: articleThreads
+ * ------------------------------
+ * Downloads all of a feed's articles in parallel on the article lane, each
+ * article task merging its own tokens into articleTable.
+ */
 void NewsAggregator::articleThreads(std::vector<Article> articles){
-	//std::mutex articleMapLock;
-	for(auto iter = articles.begin(); iter != articles.end(); iter++) {
-		articlePool.schedule([this, iter]{
-        	Article article = *iter;
-			urlSetLock.lock();
-            if(urlSet.count(article.url)) {
-           		urlSetLock.unlock();
-                return;
-            } else {
-            	urlSet.insert(article.url);
-                urlSetLock.unlock();
-            }
-			server Server = getURLServer(article.url);
-			HTMLDocument htmlDocument(article.url);
-			try{
-                htmlDocument.parse();
-            } catch(const HTMLDocumentException& hde) {
-                return;
-            }
-			const auto& const_tokens = htmlDocument.getTokens();
-            vector<std::string> tokens(const_tokens.begin(), const_tokens.end());
-            sort(tokens.begin(), tokens.end());
-            //assert(is_sorted(tokens.cbegin(), tokens.cend()));
-            Article newArticle;
-			const auto& serverIt = ArticleMap.find(Server);
-            if(serverIt != ArticleMap.end() &&
-            serverIt->second.find(article.title) != serverIt->second.end()) {
-				vector<string> newTokens;
-                Article old = ArticleMap[Server][article.title].first;
-                vector<string> oldTokens = ArticleMap[Server][article.title].second;
-                sort(oldTokens.begin(), oldTokens.end());
-                set_intersection(oldTokens.cbegin(), oldTokens.cend(),
-                                        tokens.cbegin(), tokens.cend(), back_inserter(newTokens));
-
-                newArticle = min(old,article);
-                ArticleMap[Server][article.title] = make_pair(newArticle, newTokens);
-                ArticleMapLock.unlock();
-	    }else {
-                ArticleMap[Server][article.title] = make_pair(article, tokens);
-                ArticleMapLock.unlock();	
-		//cout << article.title << endl;
-            }
-		
-        });
-    }
-    articlePool.wait();
+	// waits on this feed's articles only, so feeds never wait on one another
+	TaskGroup feedArticles(pool, kArticleLane);
+	vector<UniqueFunction> thunks;
+	for (const Article& article : articles) {
+		thunks.push_back([this, article] { downloadArticle(article); });
+	}
+	feedArticles.scheduleBulk(thunks.begin(), thunks.end());
+	feedArticles.wait();
+}
+
+/**
+ * Private Method: expectArticles
+ * ------------------------------
+ * Counts a freshly parsed feed's articles as pending under their server and
+ * title, so that none of those entries is indexed before they've all been
+ * merged.  Only used when indexing incrementally.
+ */
+void NewsAggregator::expectArticles(const vector<Article>& articles) {
+	for (const Article& article : articles) {
+		articleTable.withServer(getURLServer(article.url), [&](ArticleTable::TitleTable& titles) {
+			titles[article.title].numPending++;
+		});
+	}
+}
+
+/**
+ * Private Method: takeArticle
+ * ---------------------------
+ * Moves a final entry (if any article under its server and title was
+ * downloaded at all) into finalArticles, and drops it from its table.
+ * Returns the entry after it.  The caller must hold the entry's shard lock.
+ */
+ArticleTable::TitleTable::iterator NewsAggregator::takeArticle(ArticleTable::TitleTable& titles,
+							       ArticleTable::TitleTable::iterator entry,
+							       ArticleList& finalArticles) {
+	if (entry->second.downloaded) {
+		finalArticles.push_back(make_pair(move(entry->second.article), move(entry->second.tokens)));
+	}
+	return titles.erase(entry);
+}
+
+/**
+ * Private Method: feedParsed
+ * --------------------------
+ * Notes that one more feed has been parsed (or skipped, or has failed).
+ * Once that's all of them, every entry with nothing left pending is final,
+ * so they all go to the index.  Only used when indexing incrementally.
+ */
+void NewsAggregator::feedParsed() {
+	if (--numFeedsUnparsed > 0) return;
+	ArticleList finalArticles;
+	articleTable.forEachServer([&](const server& Server, ArticleTable::TitleTable& titles) {
+		for (auto entry = titles.begin(); entry != titles.end();) {
+			if (entry->second.numPending == 0) entry = takeArticle(titles, entry, finalArticles);
+			else ++entry;
+		}
+	});
+	indexArticles(move(finalArticles));
+}
+
+/**
+ * Private Method: indexArticles
+ * -----------------------------
+ * Adds final articles to the index on the index lane.  RSSIndex::add is
+ * safe to call from several threads at once, so no lock is needed.
+ */
+void NewsAggregator::indexArticles(ArticleList finalArticles) {
+	if (finalArticles.empty()) return;
+	pool.schedule(kIndexLane, [this, finalArticles = move(finalArticles)] {
+		for (const pair<Article, vector<string>>& article : finalArticles) {
+			index.add(article.first, article.second);
+		}
+	});
 }
 
 
 
 void NewsAggregator::feedThread(const pair<string, string>& feed) {
 
-    urlSetLock.lock();
     std::string xmlUrl = feed.first;
     std::string xmlTitle = feed.second;
-    if(urlSet.count(xmlUrl)) {
-        urlSetLock.unlock();
+    if (!claimURL(xmlUrl)) {
+        if (incremental) feedParsed();
         return;
     }
-    else {
-        urlSet.insert(xmlUrl);
-        urlSetLock.unlock();
-    }
     RSSFeed rssFeed(xmlUrl);
     try{
+        BlockingRegion downloading;
         rssFeed.parse();
     } catch(const RSSFeedException& exception) {
         log.noteSingleFeedDownloadFailure(xmlUrl);
+        if (incremental) feedParsed();
         return;
     }
     const auto& articles = rssFeed.getArticles(); 
+    if (incremental) {
+        expectArticles(articles);
+        feedParsed();
+    }
     articleThreads(articles);
 }
 
@@ -250,19 +478,20 @@ void NewsAggregator::processAllFeeds() {
     }
     const auto& feeds = rssFeedList.getFeeds();
     //* Usage: const auto& feeds = list.getFeeds();
+    numFeedsUnparsed = feeds.size();
     for (const pair<string, string>& feed : feeds) {
-	feedPool.schedule([this,feed] {
+	pool.schedule(kFeedLane, [this,feed] {
 		feedThread(feed);
 	});
     }
-    feedPool.wait();
-    for(auto serverIt = ArticleMap.begin(); serverIt != ArticleMap.end(); serverIt++) {
-	for (auto articleIt = serverIt->second.cbegin(); articleIt != serverIt->second.cend(); articleIt++) {
-	    indexSetLock.lock();
-	    index.add(articleIt->second.first, articleIt->second.second);
-	    indexSetLock.unlock();
-	}
-    }
+    pool.wait();
+    // when indexing incrementally, every entry has been indexed already and articleTable is empty
+    articleTable.forEachServer([this](const server& Server, ArticleTable::TitleTable& titles) {
+	ArticleList articles;
+	for (auto entry = titles.begin(); entry != titles.end();) entry = takeArticle(titles, entry, articles);
+	indexArticles(move(articles));
+    });
+    pool.wait();
 
 
 
@@ -2,8 +2,11 @@
  * File: news-aggregator.h
  * -----------------------
  * Defines the NewsAggregator class.  As opposed to your Assignment 5
- * version, this one relies on the services of two ThreadPools to
- * limit and *recycle* a small number of threads.
+ * version, this one relies on the services of a ThreadPool to
+ * limit and *recycle* a small number of threads.  Feeds, articles and
+ * index merges share the pool's threads through three weighted lanes,
+ * so whichever stage has work can use every thread, and the pool
+ * itself grows and shrinks with the number of blocked downloads.
  */
 
 #pragma once
@@ -11,12 +14,18 @@
 #include "log.h"
 #include "rss-index.h"
 #include "thread-pool.h"
+#include "article-table.h"
+#include "concurrent-url-set.h"
+#include "url-filter.h"
 #include <unordered_set>
 #include <unordered_map>
 #include "semaphore.h"
 #include <iostream>
 #include <mutex>
+#include <atomic>
 #include <utility> 
+#include <memory>
+#include <vector>
 using namespace std;
 class NewsAggregator {
   
@@ -62,27 +71,80 @@ class NewsAggregator {
   typedef std::string server;
   typedef std::string title;
  
-  
-  std::mutex serverLock;
-  std::mutex ArticleMapLock;
-  std::mutex urlSetLock;
-  std::mutex indexSetLock;
-  
-  static const unsigned int kNumMaxFeed = 3;
-  static const unsigned int kNumMaxArticle = 20;
+/**
+ * Pool sizing.  Feed and article tasks spend most of their time blocked
+ * on the network (and say so with a BlockingRegion), so the pool grows
+ * past the number of cores while downloads are outstanding and shrinks
+ * back once they're done.
+ */
+  static const size_t kNumMinThreads = 4;
+  static const size_t kNumMaxThreads = 64;
+  static const unsigned int kSpawnDelayMillis = 50;
+  static const unsigned int kIdleTimeoutMillis = 2000;
 
+/**
+ * Pool lanes, in priority order: feed discovery, then article downloads,
+ * then index merges.  The weights are how often each lane is served
+ * relative to the others while they all have work queued.
+ */
+  static const size_t kFeedLane = 0;
+  static const size_t kArticleLane = 1;
+  static const size_t kIndexLane = 2;
+  static const size_t kFeedLaneWeight = 4;
+  static const size_t kArticleLaneWeight = 2;
+  static const size_t kIndexLaneWeight = 1;
 
-  std::unordered_set<std::string> urlSet;
+
+/**
+ * Every feed and article URL claimed so far.  Claiming one is a single
+ * lock-free insert, so feed and article tasks never queue on each other
+ * to check for duplicates.
+ */
+  ConcurrentURLSet urlSet;
+
+/**
+ * Optional URL filter (aggregate --url-filter or --url-filter-budget).
+ * With --url-filter, a URLFilter sits in front of urlSet and counts its
+ * own false positives, without sparing urlSet any lookups.  With --url-filter-budget, the filter replaces
+ * urlSet altogether and never grows past the budget, at the price of
+ * sometimes skipping a URL it has never seen.
+ */
+  static const size_t kBytesPerMB = 1 << 20;
+  std::unique_ptr<URLFilter> urlFilter;
+  bool urlFilterOnly;
+  std::atomic<size_t> numURLsSkipped;
+  std::atomic<size_t> numFilterFalsePositives;
 
  
   NewsAggregatorLog log;
   std::string rssFeedListURI;
   RSSIndex index;
   bool built;
+  bool showStats;
+  bool incremental;
    
-  ThreadPool feedPool;
-  ThreadPool articlePool;
-  std::map<std::string, std::map<std::string, std::pair<Article, std::vector<std::string>>>> ArticleMap;
+  ThreadPool pool;
+
+/**
+ * Articles are merged into articleTable by the article tasks themselves,
+ * each locking only its own server's shard.
+ */
+  ArticleTable articleTable;
+
+/**
+ * Incremental indexing (aggregate --incremental).  An articleTable entry
+ * is final once every feed has been parsed (so no new article can join
+ * it) and every article announced under its server and title has been
+ * merged or has failed, which is what the entry's numPending counts.
+ * Final entries are moved out of articleTable and added to the index on
+ * the index lane while other articles are still downloading.
+ *
+ * numFeedsUnparsed is only ever checked with the entry's shard locked,
+ * and feedParsed sweeps every shard after it drops to zero, so an entry
+ * that settles just as the last feed is parsed is indexed by one of the
+ * two, never by neither.
+ */
+  std::atomic<size_t> numFeedsUnparsed;
   
  
 /**
@@ -91,17 +153,48 @@ class NewsAggregator {
  * Private constructor used exclusively by the createNewsAggregator function
  * (and no one else) to construct a NewsAggregator around the supplied URI.
  */
-  NewsAggregator(const std::string& rssFeedListURI, bool verbose);
+  NewsAggregator(const std::string& rssFeedListURI, bool verbose, bool showStats, bool incremental,
+                 bool urlFilter, size_t urlFilterBudgetMB);
+
+/**
+ * Method: printPoolStats
+ * ----------------------
+ * Prints the pool's statistics (queue latency, run time, utilization and
+ * queue depths), how long articleTable's locks were waited on and held,
+ * and how URL deduplication went, once the index has been built, for
+ * aggregate --stats.
+ */
+  void printPoolStats() const;
 
 /**
  * Method: processAllFeeds
  * -----------------------
  * Downloads all of the feeds and news articles to build the index.
- * You need to implement this function using two ThreadPools instead
+ * You need to implement this function using a ThreadPool instead
  * of an unbounded number of threads.
  */
 
 
+  std::unique_ptr<std::vector<std::string>> downloadArticleTokens(const Article& article);
+
+  typedef std::vector<std::pair<Article, std::vector<std::string>>> ArticleList;
+
+  bool claimURL(const std::string& url);
+
+  void downloadArticle(const Article& article);
+
+  void mergeArticle(ArticleTable::Entry& entry, const Article& article, std::vector<std::string>& tokens);
+
+  void expectArticles(const std::vector<Article>& articles);
+
+  ArticleTable::TitleTable::iterator takeArticle(ArticleTable::TitleTable& titles,
+                                                 ArticleTable::TitleTable::iterator entry,
+                                                 ArticleList& finalArticles);
+
+  void feedParsed();
+
+  void indexArticles(ArticleList finalArticles);
+
   void articleThreads(std::vector<Article> articles);
 
   void feedThread(const pair<string, string>& it);
@@ -8,19 +8,36 @@
 #include "rss-index.h"
 
 #include <algorithm>
+#include <functional>
 
 using namespace std;
 
+size_t RSSIndex::shardFor(const string& word) {
+  return hash<string>()(word) % kNumShards;
+}
+
+/**
+ * Sorts the words out by shard first, so that each shard's lock is taken
+ * once per article rather than once per word.
+ */
 void RSSIndex::add(const Article& article, const vector<string>& words) {
+  vector<const string *> byShard[kNumShards];
   for (const string& word : words) { // iteration via for keyword, yay C++11
-    index[word][article]++;
+    byShard[shardFor(word)].push_back(&word);
+  }
+  for (size_t i = 0; i < kNumShards; i++) {
+    if (byShard[i].empty()) continue;
+    lock_guard<mutex> lg(shards[i].lock);
+    for (const string *word : byShard[i]) shards[i].index[*word][article]++;
   }
 }
 
 static const vector<pair<Article, int> > emptyResult;
 vector<pair<Article, int> > RSSIndex::getMatchingArticles(const string& word) const {
-  auto indexFound = index.find(word);
-  if (indexFound == index.end()) return emptyResult;
+  const Shard& shard = shards[shardFor(word)];
+  lock_guard<mutex> lg(shard.lock);
+  auto indexFound = shard.index.find(word);
+  if (indexFound == shard.index.end()) return emptyResult;
   const map<Article, int>& matches = indexFound->second;
   vector<pair<Article, int> > v;
   for (const pair<Article, int>& match: matches) v.push_back(match);
@@ -4,10 +4,17 @@
  * Exports an RSSIndex type, which is a data structure that maps
  * words to vectors of document/frequency pairs (where the document frequency 
  * pairs are represented as pair<Article, int>s).
+ *
+ * The words are spread over kNumShards independently locked maps, so
+ * threads adding different articles at the same time mostly lock
+ * different shards instead of queueing on one lock for the whole index.
  */
 
 #pragma once
+#include <cstddef>
 #include <map>
+#include <mutex>
+#include <string>
 #include <vector>
 #include "article.h"
 
@@ -20,9 +27,8 @@ class RSSIndex {
 
 /**
  * Notes that each of the words in the supplied vector appears within the
- * specified article.  The add operation is not thread-safe, so care must be taken
- * to externally lock the RSSIndex down if two racing threads might try to
- * add to the RSSIndex at the same time.
+ * specified article.  Any number of threads may add to the RSSIndex at the
+ * same time; each add locks every shard it touches once.
  */
   void add(const Article& article, const std::vector<std::string>& words);
 
@@ -34,7 +40,16 @@ class RSSIndex {
   std::vector<std::pair<Article, int> > getMatchingArticles(const std::string& word) const;
   
  private:
-  std::map<std::string, std::map<Article, int> > index;
+  static const size_t kNumShards = 16;
+
+  struct Shard {
+    mutable std::mutex lock;
+    std::map<std::string, std::map<Article, int> > index;
+  };
+
+  Shard shards[kNumShards];
+
+  static size_t shardFor(const std::string& word);
 
 /**
  * RSSIndex instances can theoretically store a huge amount of data, so we
@@ -5,93 +5,588 @@
  */
 
 #include "thread-pool.h"
-#include <thread> 
+#include <thread>
 #include <mutex>
-#include <queue>
-#include "semaphore.h"
+#include <deque>
 #include <condition_variable>
+#include <cstdint>
+#include <chrono>
+#include <algorithm>
+#include <new>
 
 
 using namespace std;
 
+/**
+ * Every worker thread records which pool it belongs to and its index
+ * within that pool, so that schedule can tell whether it's being called
+ * from inside one of its own thunks (in which case the new thunk goes on
+ * the caller's own deque).
+ */
+static thread_local ThreadPool *currentPool = nullptr;
+static thread_local size_t currentWorkerID = 0;
+
+static const size_t kSubmissionQueueCapacity = 4096;
+static const size_t kWakeAll = SIZE_MAX;
+static const uint64_t kStrideScale = 1 << 20;
+static const int64_t kStarvationNanos = 100 * 1000 * 1000; // a lane left waiting this long jumps the queue
+
+static int64_t nanosSinceEpoch(chrono::steady_clock::time_point when) {
+	return chrono::duration_cast<chrono::nanoseconds>(when.time_since_epoch()).count();
+}
+
+/**
+ * Raises a high-water mark to value.  This is a plain load and store rather
+ * than a compare-and-swap loop, since a queue that's growing would otherwise
+ * pay for a read-modify-write on every push; two racing producers can leave
+ * the mark a little short of the true peak, which is fine for statistics.
+ */
+static void raiseTo(atomic<size_t>& highWater, size_t value) {
+	if (value > highWater.load(memory_order_relaxed)) highWater.store(value, memory_order_relaxed);
+}
 
+ThreadPool::Lane::Lane(size_t weight, size_t capacity) : weight(weight),
+	stride(kStrideScale / weight), ring(capacity), overflowSize(0), depth(0),
+	depthHighWater(0), lastServed(0), numDispatched(0), totalWaitNanos(0), maxWaitNanos(0) {}
+
+ThreadPool::Counters::Counters() : numRun(0), liveSince(0), liveNanos(0), idleNanos(0),
+	dequeHighWater(0) {}
+
+/**
+ * Records one finished thunk.  ran is only meaningful for every
+ * kRunTimeSampling'th thunk, which is the only time it's recorded.
+ */
+void ThreadPool::Counters::record(uint64_t waited, uint64_t ran) {
+	size_t run = numRun.load(memory_order_relaxed);
+	numRun.store(run + 1, memory_order_relaxed);
+	queueLatency.record(waited);
+	if (run % kRunTimeSampling == 0) runTime.record(ran, kRunTimeSampling);
+}
+
+ThreadPool::ThreadPool(size_t numThreads) : ThreadPool(numThreads, vector<size_t>(1, 1)) {}
+
+/**
+ * A fixed-size pool is just an elastic one whose bounds coincide: it
+ * spawns a worker whenever work arrives with no idle worker to take it,
+ * until all numThreads are running, and never retires any of them.
+ */
+ThreadPool::ThreadPool(size_t numThreads, const vector<size_t>& laneWeights, Placement placement) :
+	ThreadPool(Elasticity{numThreads, numThreads, chrono::milliseconds(0),
+		chrono::milliseconds::max()}, laneWeights, placement) {}
 
-ThreadPool::ThreadPool(size_t numThreads) : wts(numThreads),thunkQueue(numThreads),exit(false) {
-	dt = thread([this](){dispatcher();});
-	totalNumThreads = numThreads;
-	for (size_t workerID = 0; workerID < numThreads; workerID++) {
-		unique_ptr<semaphore>& semaph = thunkQueue[workerID].first;
-		if (semaph == nullptr){
-		    semaph.reset(new semaphore(0));
+/**
+ * Worker slot i is dealt to node i % numNodes (and, for Placement::Cores,
+ * to the (i / numNodes)'th core on that node), which spreads any number of
+ * workers evenly across the nodes.
+ */
+ThreadPool::ThreadPool(const Elasticity& elasticity, const vector<size_t>& laneWeights,
+	Placement placement) : elasticity(elasticity), wts(elasticity.maxThreads), live(elasticity.maxThreads, false),
+	numLive(0), numRunning(0), numBlocked(0), lastStarted(0), nextQueue(0), epoch(0),
+	numSleeping(0), exit(false), numOutstanding(0), outstandingHighWater(0) {
+	for (size_t weight : laneWeights) {
+		lanes.push_back(unique_ptr<Lane>(new Lane(max<size_t>(weight, 1), kSubmissionQueueCapacity)));
+	}
+	if (lanes.empty()) lanes.push_back(unique_ptr<Lane>(new Lane(1, kSubmissionQueueCapacity)));
+	const CPUTopology& topology = CPUTopology::detect();
+	numNodes = placement == Placement::Anywhere ? 1 : topology.numNodes();
+	for (size_t workerID = 0; workerID < elasticity.maxThreads; workerID++) {
+		size_t node = workerID % numNodes;
+		int kernelNode = placement == Placement::Anywhere ? -1 : topology.kernelNode(node);
+		void *memory = allocateOnNode(sizeof(WorkerQueue), kernelNode);
+		WorkerQueue *queue;
+		try {
+			queue = new (memory) WorkerQueue();
+		} catch (...) {
+			freeOnNode(memory, sizeof(WorkerQueue), kernelNode);
+			throw;
 		}
-		wts[workerID] = thread([this](size_t workerID) {worker(workerID);
-				}, workerID);
-		threadQueue.push(workerID);
+		queue->kernelNode = kernelNode;
+		queues.push_back(unique_ptr<WorkerQueue, WorkerQueueDeleter>(queue));
+		queues.back()->node = node;
+		if (placement == Placement::Nodes) {
+			queues.back()->cpus = topology.cpusOn(node);
+		} else if (placement == Placement::Cores) {
+			const vector<int>& cpus = topology.cpusOn(node);
+			queues.back()->cpus.push_back(cpus[(workerID / numNodes) % cpus.size()]);
+		}
+		queues.back()->lanePass.assign(lanes.size(), 0);
+		queues.back()->virtualTime = 0;
+	}
+	if (elasticity.minThreads < elasticity.maxThreads) {
+		monitor = thread([this] {monitorStalls();});
 	}
 }
 
+void ThreadPool::WorkerQueueDeleter::operator()(WorkerQueue *queue) const {
+	int kernelNode = queue->kernelNode;
+	queue->~WorkerQueue();
+	freeOnNode(queue, sizeof(WorkerQueue), kernelNode);
+}
 
-void ThreadPool::dispatcher(){
-	while (true) {
-		jobLock.lock();
-		jobCV.wait(jobLock,[this] {return !jobQueue.empty() || exit;});
-		if (exit) // threadpool done
-		{
-			jobLock.unlock();
+/**
+ * Spawns workers for up to numQueued newly queued thunks that no parked
+ * worker is around to take.  A worker is spawned straight away only while
+ * the pool is below its minimum, when it has no spawn delay (as with
+ * fixed-size pools), or when every live worker has declared itself
+ * blocked; otherwise stalled work is left to monitorStalls.
+ */
+void ThreadPool::spawnIfNeeded(size_t numQueued) {
+	if (numLive >= elasticity.maxThreads) return;
+	size_t sleeping = numSleeping;
+	if (numQueued <= sleeping) return;
+	for (size_t i = 0; i < numQueued - sleeping; i++) {
+		size_t numAlive = numLive;
+		if (numAlive >= elasticity.minThreads && elasticity.spawnDelay.count() != 0 &&
+			numBlocked < numAlive) return;
+		if (!spawnWorker()) return;
+	}
+}
+
+/**
+ * Starts a worker in the first free slot, first joining the thread of the
+ * worker that last retired from it.
+ */
+bool ThreadPool::spawnWorker() {
+	lock_guard<mutex> lg(spawnLock);
+	if (exit || numLive >= elasticity.maxThreads) return false;
+	size_t workerID = 0;
+	while (live[workerID]) workerID++;
+	if (wts[workerID].joinable()) wts[workerID].join();
+	live[workerID] = true;
+	numLive++;
+	queues[workerID]->counters.liveSince = nanosSinceEpoch(chrono::steady_clock::now());
+	wts[workerID] = thread([this](size_t workerID) {worker(workerID);
+			}, workerID);
+	return true;
+}
+
+/**
+ * Decides whether an idle worker may retire: the pool must be above its
+ * minimum and the worker's own deque empty (no one else pushes onto it,
+ * so it stays empty).  The epoch is rechecked after numLive drops, which
+ * pairs with enqueue advancing the epoch before spawnIfNeeded reads
+ * numLive: either this worker sees the new work and stays, or the
+ * scheduler sees one fewer worker and spawns a replacement.
+ */
+bool ThreadPool::retire(size_t workerID, size_t seen) {
+	lock_guard<mutex> lg(spawnLock);
+	if (exit || numLive <= elasticity.minThreads) return false;
+	WorkerQueue& queue = *queues[workerID];
+	queue.lock.lock();
+	bool empty = queue.tasks.empty();
+	queue.lock.unlock();
+	if (!empty) return false;
+	numLive--;
+	if (epoch != seen) {
+		numLive++;
+		return false;
+	}
+	live[workerID] = false;
+	Counters& counters = queue.counters;
+	counters.liveNanos += nanosSinceEpoch(chrono::steady_clock::now()) - counters.liveSince;
+	return true;
+}
+
+/**
+ * Runs on its own thread in elastic pools.  Every half spawn delay it
+ * checks whether work is queued, no worker is idle, and no thunk has
+ * started for a full spawn delay, and if so spawns another worker.
+ */
+void ThreadPool::monitorStalls() {
+	chrono::milliseconds period = max(elasticity.spawnDelay / 2, chrono::milliseconds(1));
+	int64_t spawnDelayNanos = chrono::duration_cast<chrono::nanoseconds>(elasticity.spawnDelay).count();
+	monitorLock.lock();
+	while (!monitorCV.wait_for(monitorLock, period, [this]{return exit.load();})) {
+		size_t outstanding = numOutstanding, running = numRunning;
+		int64_t now = nanosSinceEpoch(chrono::steady_clock::now());
+		if (outstanding > running && numSleeping == 0 && now - lastStarted > spawnDelayNanos) {
+			spawnWorker();
+		}
+	}
+	monitorLock.unlock();
+}
+
+void ThreadPool::enterBlockingRegion() {
+	numBlocked++;
+	if (numOutstanding > numRunning) spawnIfNeeded(1);
+}
+
+void ThreadPool::exitBlockingRegion() {
+	numBlocked--;
+}
+
+/**
+ * Advances the epoch and wakes up to numToWake parked threads.  The epoch
+ * is bumped before numSleeping is read, and a parking worker bumps
+ * numSleeping before it rereads the epoch, so at least one side always
+ * sees the other and no wakeup is lost.
+ */
+void ThreadPool::advanceEpoch(size_t numToWake) {
+	epoch++;
+	if (numSleeping == 0 || numToWake == 0) return;
+	lock_guard<mutex> lg(idleLock);
+	if (numToWake >= numSleeping) {
+		idleCV.notify_all();
+	} else {
+		for (size_t i = 0; i < numToWake; i++) idleCV.notify_one();
+	}
+}
+
+/**
+ * Queues a thunk without waking anyone; callers follow up with advanceEpoch.
+ * Untagged nested thunks stay on the scheduling worker's deque, and other
+ * untagged thunks go to lane 0.  A lane's lock-free queue spills into the
+ * lane's overflow deque in the rare case that it's full.
+ */
+void ThreadPool::enqueue(UniqueFunction thunk, TaskGroup *group, size_t lane) {
+	raiseTo(outstandingHighWater, ++numOutstanding);
+	if (group != nullptr) group->numOutstanding++;
+	chrono::steady_clock::time_point now = chrono::steady_clock::now();
+	Task task = {move(thunk), group, now};
+	if (lane == kUntagged) {
+		if (currentPool == this) {
+			push(currentWorkerID, move(task));
 			return;
 		}
-		const function<void(void)> thunk = jobQueue.front();
-		jobQueue.pop();
-		jobCV.notify_all();
-		jobLock.unlock();
+		lane = 0;
+	}
+
+	Lane& target = *lanes[lane];
+	size_t depth = target.depth++;
+	if (depth == 0) target.lastServed = nanosSinceEpoch(now); // starvation clock starts now
+	raiseTo(target.depthHighWater, depth + 1);
+	if (!target.ring.enqueue(task)) {
+		lock_guard<mutex> lg(target.overflowLock);
+		target.overflow.push_back(move(task));
+		target.overflowSize++;
+	}
+}
+
+/**
+ * Takes the oldest task from the specified lane, if it has one, and
+ * records how long it waited there.
+ */
+bool ThreadPool::popLane(size_t lane, Task& task) {
+	Lane& source = *lanes[lane];
+	bool found = source.ring.dequeue(task);
+	if (!found && source.overflowSize > 0) {
+		lock_guard<mutex> lg(source.overflowLock);
+		if (!source.overflow.empty()) {
+			task = move(source.overflow.front());
+			source.overflow.pop_front();
+			source.overflowSize--;
+			found = true;
+		}
+	}
+	if (!found) return false;
+
+	chrono::steady_clock::time_point now = chrono::steady_clock::now();
+	uint64_t waited = chrono::duration_cast<chrono::nanoseconds>(now - task.enqueued).count();
+	source.depth--;
+	source.lastServed = nanosSinceEpoch(now);
+	source.numDispatched++;
+	source.totalWaitNanos += waited;
+	uint64_t longest = source.maxWaitNanos;
+	while (waited > longest && !source.maxWaitNanos.compare_exchange_weak(longest, waited));
+	return true;
+}
+
+/**
+ * Picks a lane to serve and takes a task from it.  Any lane that has had
+ * work queued without being served for kStarvationNanos goes first.
+ * Otherwise a worker serves the non-empty lane with the smallest pass,
+ * then advances that lane's pass by its stride; a lane that sat idle has
+ * its pass pulled up to the worker's virtual time so it can't bank credit
+ * while empty and then monopolize the worker.  Threads outside the pool
+ * (worker == nullptr) have no stride state and simply scan in lane order.
+ */
+bool ThreadPool::popLanes(WorkerQueue *worker, Task& task) {
+	if (lanes.size() == 1) return popLane(0, task);
+	int64_t now = nanosSinceEpoch(chrono::steady_clock::now());
+	for (size_t lane = 0; lane < lanes.size(); lane++) {
+		if (lanes[lane]->depth > 0 && now - lanes[lane]->lastServed > kStarvationNanos &&
+			popLane(lane, task)) return true;
+	}
+
+	if (worker == nullptr) {
+		for (size_t lane = 0; lane < lanes.size(); lane++) {
+			if (popLane(lane, task)) return true;
+		}
+		return false;
+	}
+
+	vector<bool> tried(lanes.size(), false);
+	while (true) {
+		size_t best = lanes.size();
+		for (size_t lane = 0; lane < lanes.size(); lane++) {
+			if (tried[lane] || lanes[lane]->depth == 0) continue;
+			if (worker->lanePass[lane] < worker->virtualTime) worker->lanePass[lane] = worker->virtualTime;
+			if (best == lanes.size() || worker->lanePass[lane] < worker->lanePass[best]) best = lane;
+		}
+		if (best == lanes.size()) return false;
+		tried[best] = true;
+		if (popLane(best, task)) {
+			worker->virtualTime = worker->lanePass[best];
+			worker->lanePass[best] += lanes[best]->stride;
+			return true;
+		}
+	}
+}
 
-		threadLock.lock();
-		threadCV.wait(threadLock, [this]{return !threadQueue.empty();});
-		size_t availableWorkerID = threadQueue.front();
-		threadQueue.pop();
-		threadLock.unlock();
-		thunkQueue[availableWorkerID].second = thunk;
-		thunkQueue[availableWorkerID].first->signal();
+void ThreadPool::push(size_t workerID, Task task) {
+	WorkerQueue& queue = *queues[workerID];
+	queue.lock.lock();
+	queue.tasks.push_back(move(task));
+	raiseTo(queue.counters.dequeHighWater, queue.tasks.size());
+	queue.lock.unlock();
+}
+
+bool ThreadPool::popLocal(size_t workerID, Task& task) {
+	WorkerQueue& queue = *queues[workerID];
+	lock_guard<mutex> lg(queue.lock);
+	if (queue.tasks.empty()) return false;
+	task = move(queue.tasks.back()); // owner takes the newest
+	queue.tasks.pop_back();
+	return true;
+}
+
+/**
+ * Steals the oldest task from some other worker's deque.  When workers are
+ * spread across several nodes, the thief tries every worker on its own
+ * node before it tries any on another, so work (and the data it touches)
+ * tends to stay on the node where it was scheduled.
+ */
+bool ThreadPool::steal(size_t thiefID, Task& task) {
+	size_t home = queues[thiefID]->node;
+	for (size_t pass = 0; pass < (numNodes > 1 ? 2 : 1); pass++) {
+		for (size_t offset = 1; offset <= queues.size(); offset++) {
+			WorkerQueue& victim = *queues[(thiefID + offset) % queues.size()];
+			if (numNodes > 1 && (victim.node == home) != (pass == 0)) continue;
+			lock_guard<mutex> lg(victim.lock);
+			if (victim.tasks.empty()) continue;
+			task = move(victim.tasks.front()); // thieves take the oldest
+			victim.tasks.pop_front();
+			return true;
+		}
 	}
+	return false;
+}
+
+/**
+ * Runs the task's thunk and then retires it, first from its group (whose
+ * waiter may destroy the group the moment its count reaches zero, so the
+ * group isn't touched again) and then from the pool as a whole.  The two
+ * clock readings here, together with the one taken when the task was
+ * scheduled, are all the timing the statistics need.
+ */
+void ThreadPool::run(Task& task) {
+	bool helping = currentPool != this;
+	Counters& counters = helping ? helperCounters : queues[currentWorkerID]->counters;
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	numRunning++;
+	lastStarted = nanosSinceEpoch(start);
+	task.thunk();
+	task.thunk = UniqueFunction(); // release captured state before anyone is told we're done
+	numRunning--;
+
+	if (helping) helperLock.lock();
+	uint64_t waited = chrono::duration_cast<chrono::nanoseconds>(start - task.enqueued).count();
+	uint64_t ran = 0;
+	if (counters.numRun % kRunTimeSampling == 0) {
+		ran = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+	}
+	counters.record(waited, ran);
+	if (helping) helperLock.unlock();
+	if (task.group != nullptr && --task.group->numOutstanding == 0) advanceEpoch(kWakeAll);
+	if (--numOutstanding == 0) {
+		lock_guard<mutex> lg(doneLock);
+		doneCV.notify_all();
+	}
+}
+
+/**
+ * Runs one pending thunk on the calling thread, if there is one to be had.
+ * Given a lane, only that lane is looked at.  Otherwise pool workers look
+ * at their own deque first, then the lanes, and only then steal.  Any
+ * other thread (a TaskGroup waiter lending a hand) skips the first step
+ * and starts stealing from a rotating victim so helpers don't all pile
+ * onto the same deque.
+ */
+bool ThreadPool::runPendingThunk(size_t lane) {
+	Task task;
+	bool found = lane != kUntagged ? popLane(lane, task) :
+		currentPool == this ?
+		popLocal(currentWorkerID, task) || popLanes(queues[currentWorkerID].get(), task) ||
+		steal(currentWorkerID, task) :
+		popLanes(nullptr, task) || steal(nextQueue++ % queues.size(), task);
+	if (found) run(task);
+	return found;
+}
+
+/**
+ * Parks the calling thread alongside the idle workers until the epoch
+ * moves past seen, or done() returns true, or the timeout expires.
+ * Returns false if and only if it gave up because of the timeout.
+ */
+bool ThreadPool::park(size_t seen, const function<bool(void)>& done, chrono::milliseconds timeout) {
+	unique_lock<mutex> ul(idleLock);
+	numSleeping++;
+	auto ready = [this, seen, &done]{return epoch != seen || done();};
+	bool woken = true;
+	if (timeout == chrono::milliseconds::max()) {
+		idleCV.wait(ul, ready);
+	} else {
+		woken = idleCV.wait_for(ul, timeout, ready);
+	}
+	numSleeping--;
+	return woken;
 }
 
 void ThreadPool::worker(size_t workerID){
+	currentPool = this;
+	currentWorkerID = workerID;
+	if (!queues[workerID]->cpus.empty()) pinThisThread(queues[workerID]->cpus);
 	while (true) {
-		thunkQueue[workerID].first->wait();
-		lock_guard<mutex> lg(sLock);
-		if (exit) return;
-		thunkQueue[workerID].second();
-		threadQueue.push(workerID);
-		threadCV.notify_all();
+		size_t seen = epoch;
+		if (runPendingThunk()) continue;
+		if (exit) return; // the destructor only sets exit once everything has drained
+		chrono::steady_clock::time_point parked = chrono::steady_clock::now();
+		bool woken = park(seen, []{return false;}, elasticity.idleTimeout);
+		Counters& counters = queues[workerID]->counters;
+		counters.idleNanos.store(counters.idleNanos.load(memory_order_relaxed) +
+			chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - parked).count(),
+			memory_order_relaxed);
+		if (!woken && retire(workerID, seen)) return;
 	}
 }
 
-void ThreadPool::schedule(const function<void(void)>& thunk) {
-	jobLock.lock();
-	jobQueue.push(thunk);
-	jobLock.unlock();
-	jobCV.notify_all();	
+void ThreadPool::schedule(UniqueFunction thunk) {
+	schedule(move(thunk), nullptr, kUntagged);
+}
 
+void ThreadPool::schedule(size_t lane, UniqueFunction thunk) {
+	schedule(move(thunk), nullptr, lane);
 }
+
+void ThreadPool::schedule(UniqueFunction thunk, TaskGroup *group, size_t lane) {
+	enqueue(move(thunk), group, lane);
+	advanceEpoch(1);
+	spawnIfNeeded(1);
+}
+
+size_t ThreadPool::numThreads() const {
+	return numLive;
+}
+
+ThreadPool::WorkerStats ThreadPool::snapshot(const Counters& counters, bool live, int64_t now) const {
+	WorkerStats stats;
+	stats.live = live;
+	stats.numRun = counters.numRun;
+	uint64_t lifetime = counters.liveNanos + (live ? now - counters.liveSince : 0);
+	stats.busyFraction = lifetime == 0 ? 0 : max(0.0, 1 - double(counters.idleNanos) / lifetime);
+	stats.dequeHighWater = counters.dequeHighWater;
+	stats.queueLatency = counters.queueLatency.snapshot();
+	stats.runTime = counters.runTime.snapshot();
+	return stats;
+}
+
+/**
+ * Takes spawnLock only to read which slots are live; the counters themselves
+ * are read while workers keep recording into them.
+ */
+ThreadPool::Stats ThreadPool::stats() const {
+	Stats stats;
+	stats.numThreads = numLive;
+	stats.numOutstanding = numOutstanding;
+	stats.outstandingHighWater = outstandingHighWater;
+	stats.lanes = laneStats();
+	int64_t now = nanosSinceEpoch(chrono::steady_clock::now());
+	spawnLock.lock();
+	vector<bool> liveNow = live;
+	spawnLock.unlock();
+
+	double idle = 0, lifetime = 0;
+	for (size_t workerID = 0; workerID < queues.size(); workerID++) {
+		const Counters& counters = queues[workerID]->counters;
+		stats.workers.push_back(snapshot(counters, liveNow[workerID], now));
+		stats.queueLatency.merge(stats.workers.back().queueLatency);
+		stats.runTime.merge(stats.workers.back().runTime);
+		idle += counters.idleNanos;
+		lifetime += counters.liveNanos + (liveNow[workerID] ? now - counters.liveSince : 0);
+	}
+	stats.busyFraction = lifetime == 0 ? 0 : max(0.0, 1 - idle / lifetime);
+	stats.helpers = snapshot(helperCounters, false, now);
+	stats.queueLatency.merge(stats.helpers.queueLatency);
+	stats.runTime.merge(stats.helpers.runTime);
+	return stats;
+}
+
+vector<ThreadPool::LaneStats> ThreadPool::laneStats() const {
+	vector<LaneStats> stats;
+	for (const unique_ptr<Lane>& lane : lanes) {
+		size_t numDispatched = lane->numDispatched;
+		double totalWaitMillis = lane->totalWaitNanos / 1e6;
+		LaneStats laneStats = {lane->weight, lane->depth, lane->depthHighWater, numDispatched,
+			numDispatched == 0 ? 0 : totalWaitMillis / numDispatched, lane->maxWaitNanos / 1e6};
+		stats.push_back(laneStats);
+	}
+	return stats;
+}
+
 void ThreadPool::wait() {
-	jobLock.lock();
-	jobCV.wait(jobLock, [this]{return jobQueue.empty();});
-	jobLock.unlock();	
-	threadLock.lock();
-	threadCV.wait(threadLock, [this]{return totalNumThreads == threadQueue.size();});
-	threadLock.unlock();
+	doneLock.lock();
+	doneCV.wait(doneLock, [this]{return numOutstanding == 0;});
+	doneLock.unlock();
 }
+
+/**
+ * Shutdown happens in three steps: drain (wait until every thunk, including
+ * ones scheduled by running thunks, has finished), announce (raise the exit
+ * flag, which also stops any further spawning, and advance the epoch so
+ * parked workers wake up and see it), and reap (join the monitor and every
+ * worker thread, including ones left behind by retired workers).
+ */
 ThreadPool::~ThreadPool() {
-	sLock.lock();
 	wait();
+	spawnLock.lock();
 	exit = true;
-	jobCV.notify_all();
-	sLock.unlock();
-	threadCV.notify_all();
-	dt.join();
-	for (std::pair<std::unique_ptr<semaphore>, std::function<void(void)>> &thunk : thunkQueue){
-		thunk.first->signal();
-		thunk.first.release();
-	}
-	for (thread &t : wts) t.join();
+	spawnLock.unlock();
+	monitorLock.lock();
+	monitorCV.notify_all();
+	monitorLock.unlock();
+	if (monitor.joinable()) monitor.join();
+	advanceEpoch(kWakeAll);
+	for (thread &t : wts) {
+		if (t.joinable()) t.join();
+	}
+}
+
+TaskGroup::TaskGroup(ThreadPool& pool) : pool(pool), lane(ThreadPool::kUntagged),
+	numOutstanding(0) {}
+
+TaskGroup::TaskGroup(ThreadPool& pool, size_t lane) : pool(pool), lane(lane),
+	numOutstanding(0) {}
+
+void TaskGroup::schedule(UniqueFunction thunk) {
+	pool.schedule(move(thunk), this, lane);
+}
+
+BlockingRegion::BlockingRegion() : pool(currentPool) {
+	if (pool != nullptr) pool->enterBlockingRegion();
+}
+
+BlockingRegion::~BlockingRegion() {
+	if (pool != nullptr) pool->exitBlockingRegion();
+}
+
+void TaskGroup::wait() {
+	while (numOutstanding > 0) {
+		size_t seen = pool.epoch;
+		if (pool.runPendingThunk(lane)) continue;
+		pool.park(seen, [this]{return numOutstanding == 0;});
+	}
+}
+
+TaskGroup::~TaskGroup() {
+	wait();
 }
@@ -3,73 +3,445 @@
  * -------------------
  * This class defines the ThreadPool class, which accepts a collection
  * of thunks (which are zero-argument functions that don't return a value)
- * and schedules them in a FIFO manner to be executed by a constant number
- * of child threads that exist solely to invoke previously scheduled thunks.
+ * and schedules them to be executed by a bounded number of child threads
+ * that exist solely to invoke previously scheduled thunks.  Functions that
+ * do return a value can be handed to submit, which hands back a future.
+ *
+ * Thunks are stored as UniqueFunctions (see unique-function.h), so they
+ * may capture move-only state and are moved, never copied, on their way
+ * from schedule to the worker that runs them.
+ *
+ * Each worker owns a deque of pending thunks.  A worker pops its own
+ * deque from the back (LIFO, so freshly scheduled nested work runs while
+ * it's still cache-hot), and when its deque runs dry it steals from the
+ * front of some other worker's deque (FIFO, so thieves take the oldest,
+ * typically largest, pieces of work).  There is no central dispatcher
+ * thread.  Thunks scheduled from outside the pool go into a shared,
+ * lock-free submission queue (see mpmc-queue.h) that every worker drains
+ * in FIFO order whenever its own deque is empty; thunks scheduled from
+ * inside the pool go straight onto the scheduling worker's deque.
+ *
+ * A pool may be configured with several weighted lanes, each with its own
+ * submission queue, so that a single pool can serve several stages of a
+ * computation at once.  When a worker turns to the submission queues it
+ * picks a lane by stride scheduling (a lane with twice the weight of
+ * another is served twice as often while both have work), and any lane
+ * whose work has sat untouched for too long is served first regardless
+ * of weight, so low-weight lanes can't starve.
+ *
+ * Workers are spawned lazily, the first time there's work and no idle
+ * worker to take it, so constructing a pool is cheap.  An elastic pool
+ * (see Elasticity) goes further: it keeps between minThreads and
+ * maxThreads workers, spawning another whenever queued work has gone
+ * unstarted for too long and retiring workers that sit idle.  A thunk
+ * about to block (on network I/O, say) can declare a BlockingRegion so
+ * the pool spawns a replacement right away instead of waiting it out.
+ *
+ * On machines with several NUMA nodes, a pool can pin its workers to
+ * particular cores or nodes (see Placement).  Each worker's queue slot
+ * (its lock, counters and deque bookkeeping, though not the deque's own
+ * chunks) is then allocated on its own node, and idle workers steal from
+ * workers on their own node before reaching across to another one.
+ *
+ * Every pool keeps running statistics (see stats): how long thunks wait
+ * between being scheduled and starting, how long they run, how busy each
+ * worker is, and how deep its queues have ever been.
  */
 
 #ifndef _thread_pool_
 #define _thread_pool_
 
 #include <cstddef>     // for size_t
-#include <functional>  // for the function template used in the schedule signature
+#include <functional>  // for the function template used by park
+#include <future>      // for future and packaged_task, used by submit
+#include <tuple>       // for tuple, used by submit
+#include <type_traits> // for decay and result_of, used by submit
+#include <utility>     // for index_sequence, used by submit
 #include <thread>      // for thread
 #include <vector>      // for vector
+#include <deque>       // for deque
+#include <memory>      // for unique_ptr
+#include <atomic>      // for atomic
+#include <chrono>      // for steady_clock, used to time lane waits
+#include <cstdint>     // for uint64_t
 #include <condition_variable>
 #include <mutex>
-#include <queue>
-#include "semaphore.h"
-
+#include "mpmc-queue.h"
+#include "unique-function.h"
+#include "latency-histogram.h"
+#include "cpu-topology.h"
 
+class TaskGroup;
 
 class ThreadPool {
  public:
 
+/**
+ * Type: Elasticity
+ * ----------------
+ * Sizing policy for an elastic pool.  The pool never runs more than
+ * maxThreads workers, and never retires workers below minThreads.
+ * Another worker is spawned once queued work has waited spawnDelay
+ * without any thunk starting, and a worker above minThreads retires after
+ * sitting idle for idleTimeout.
+ */
+  struct Elasticity {
+    size_t minThreads;
+    size_t maxThreads;
+    std::chrono::milliseconds spawnDelay;
+    std::chrono::milliseconds idleTimeout;
+  };
+
+/**
+ * Type: Placement
+ * ---------------
+ * Where workers run.  Anywhere leaves it to the operating system.  Cores
+ * pins each worker to a core of its own (workers beyond the number of
+ * cores share), and Nodes pins each worker to the cores of one NUMA node,
+ * leaving the operating system to choose among them.  Either way workers
+ * are dealt out to the nodes in turn, so every node gets its share.
+ */
+  enum class Placement { Anywhere, Cores, Nodes };
+
 /**
  * Constructs a ThreadPool configured to spawn up to the specified
- * number of threads.
+ * number of threads, with a single submission lane.
  */
   ThreadPool(size_t numThreads);
 
+/**
+ * Constructs a ThreadPool configured to spawn up to the specified
+ * number of threads, with one submission lane per entry in laneWeights.
+ * Lane i is served in proportion to laneWeights[i] (each weight must be
+ * at least 1) whenever several lanes have work queued.
+ */
+  ThreadPool(size_t numThreads, const std::vector<size_t>& laneWeights,
+             Placement placement = Placement::Anywhere);
+
+/**
+ * Constructs an elastic ThreadPool sized according to the supplied policy,
+ * with one submission lane per entry in laneWeights.
+ */
+  ThreadPool(const Elasticity& elasticity,
+             const std::vector<size_t>& laneWeights = std::vector<size_t>(1, 1),
+             Placement placement = Placement::Anywhere);
+
 /**
  * Schedules the provided thunk (which is something that can
  * be invoked as a zero-argument function without a return value)
- * to be executed by one of the ThreadPool's threads as soon as
- * all previously scheduled thunks have been handled.
+ * to be executed by one of the ThreadPool's threads.  Thunks scheduled
+ * from outside the pool go through the submission queue; thunks
+ * scheduled by a thunk that's already running inside the pool
+ * land on that same worker's deque.
+ */
+  void schedule(UniqueFunction thunk);
+
+/**
+ * Schedules the provided thunk on the specified lane.  Unlike plain
+ * schedule, the thunk goes through the lane's submission queue even when
+ * scheduled from inside the pool, so that it competes for workers
+ * according to the lane's weight.
+ */
+  void schedule(size_t lane, UniqueFunction thunk);
+
+/**
+ * Schedules every thunk in the range [begin, end) exactly as schedule
+ * would, but wakes at most one parked worker per thunk once the whole
+ * batch is queued, rather than poking the idle workers once per thunk.
+ * The thunks are moved out of the range.
+ */
+  template <typename Iterator>
+  void scheduleBulk(Iterator begin, Iterator end) {
+    scheduleBulk(begin, end, nullptr, kUntagged);
+  }
+
+/**
+ * Schedules f(args...) to run on one of the ThreadPool's threads and
+ * returns a future that will eventually hold whatever it returns (or
+ * whatever it throws).  f and args are moved (or copied, if they're
+ * lvalues) into the pool, and the arguments are moved into f when it's
+ * finally called, so move-only arguments and results are fine.
  */
-  void schedule(const std::function<void(void)>& thunk);
+  template <typename F, typename... Args>
+  std::future<typename std::result_of<typename std::decay<F>::type&(typename std::decay<Args>::type&&...)>::type>
+  submit(F&& f, Args&&... args) {
+    auto task = package(std::forward<F>(f), std::forward<Args>(args)...);
+    auto result = task.get_future();
+    schedule(std::move(task));
+    return result;
+  }
 
 /**
  * Blocks and waits until all previously scheduled thunks
- * have been executed in full.
+ * have been executed in full.  This waits on the entire pool, so it must
+ * not be called from inside one of the pool's own thunks; use a TaskGroup
+ * to wait on just the thunks you scheduled.
  */
   void wait();
 
 /**
- * Waits for all previously scheduled thunks to execute, and then
+ * Type: LaneStats
+ * ---------------
+ * A snapshot of one lane: its weight, how many thunks are queued on it
+ * right now, how many have left it for a worker, and how long those
+ * thunks waited in the lane before a worker picked them up.
+ */
+  struct LaneStats {
+    size_t weight;
+    size_t depth;
+    size_t depthHighWater;
+    size_t numDispatched;
+    double meanWaitMillis;
+    double maxWaitMillis;
+  };
+
+/**
+ * Returns a snapshot of every lane's statistics, indexed by lane.
+ */
+  std::vector<LaneStats> laneStats() const;
+
+/**
+ * Type: WorkerStats
+ * -----------------
+ * A snapshot of one worker slot: how many thunks it has run, the fraction
+ * of its lifetime it spent not parked, the deepest its deque has been,
+ * and histograms (in nanoseconds) of how long its thunks waited between
+ * being scheduled and starting, and how long they then ran.  Only every
+ * kRunTimeSampling'th thunk is timed (timing costs a clock read, which is
+ * as expensive as scheduling an empty thunk), and each one timed stands
+ * for all kRunTimeSampling in the runTime histogram.
+ */
+  struct WorkerStats {
+    bool live;
+    size_t numRun;
+    double busyFraction;
+    size_t dequeHighWater;
+    LatencyHistogram queueLatency;
+    LatencyHistogram runTime;
+  };
+
+/**
+ * Type: Stats
+ * -----------
+ * A snapshot of the whole pool.  The pool-wide histograms and busy
+ * fraction combine every worker, and helpers covers thunks run by threads
+ * outside the pool (TaskGroup waiters lending a hand).
+ */
+  struct Stats {
+    size_t numThreads;
+    size_t numOutstanding;
+    size_t outstandingHighWater;
+    double busyFraction;
+    LatencyHistogram queueLatency;
+    LatencyHistogram runTime;
+    std::vector<LaneStats> lanes;
+    std::vector<WorkerStats> workers;
+    WorkerStats helpers;
+  };
+
+/**
+ * Returns a snapshot of the pool's statistics since it was constructed.
+ */
+  Stats stats() const;
+
+/**
+ * Returns the number of worker threads currently alive.
+ */
+  size_t numThreads() const;
+
+/**
+ * Waits for all previously scheduled thunks to execute (including any
+ * thunks those thunks schedule while the pool drains), and then
  * properly brings down the ThreadPool and any resources tapped
  * over the course of its lifetime.
  */
   ~ThreadPool();
-  
+
  private:
-  std::thread dt;                // dispatcher thread handle
-  std::vector<std::thread> wts;  // worker thread handles
+/**
+ * Type: Task
+ * ----------
+ * A scheduled thunk, along with the TaskGroup it belongs to (or nullptr
+ * if it was scheduled directly on the pool) and when it was scheduled.
+ */
+  struct Task {
+    UniqueFunction thunk;
+    TaskGroup *group;
+    std::chrono::steady_clock::time_point enqueued;
+  };
+
+/**
+ * Type: Counters
+ * --------------
+ * The running statistics behind WorkerStats.  Each worker slot records
+ * into its own, and only its worker ever writes to it, so the hot path
+ * touches only cache lines it owns and needs no read-modify-writes.
+ * liveSince is when the slot's current worker was spawned, liveNanos the
+ * lifetimes of the slot's previous workers, and idleNanos the time its
+ * workers have spent parked, all in nanoseconds.
+ */
+  struct Counters {
+    Counters();
+    void record(uint64_t waited, uint64_t ran);
+    ConcurrentLatencyHistogram queueLatency;
+    ConcurrentLatencyHistogram runTime;
+    std::atomic<size_t> numRun;
+    std::atomic<int64_t> liveSince;
+    std::atomic<uint64_t> liveNanos;
+    std::atomic<uint64_t> idleNanos;
+    std::atomic<size_t> dequeHighWater;
+  };
+
+/**
+ * Type: WorkerQueue
+ * -----------------
+ * A worker's deque of pending tasks along with the lock guarding it.
+ * The owner pushes and pops at the back, thieves pop at the front.
+ * lanePass and virtualTime are the worker's private stride-scheduling
+ * state, touched only by the owner and so left unguarded.  node and cpus
+ * say where the worker runs.  Under a Placement other than Anywhere, each
+ * WorkerQueue is allocated on its worker's kernelNode, so the slot's
+ * counters and deque bookkeeping stay local; WorkerQueueDeleter frees it
+ * from there.
+ */
+  struct WorkerQueue {
+    int kernelNode;         // the node it was allocated on, or -1 for anywhere
+    size_t node;
+    std::vector<int> cpus;
+    std::mutex lock;
+    std::deque<Task> tasks;
+    std::vector<uint64_t> lanePass;
+    uint64_t virtualTime;
+    Counters counters;
+  };
 
-  std::vector<std::pair<std::unique_ptr<semaphore>, std::function<void(void)>>> thunkQueue;  // thunk handles
-  std::mutex sLock;
-  bool exit;
-  size_t totalNumThreads; 
-  std::mutex jobLock;
-  std::condition_variable_any jobCV;
-  std::queue<std::function<void(void)>> jobQueue;          // jobs queue  
+  struct WorkerQueueDeleter {
+    void operator()(WorkerQueue *queue) const;
+  };
 
-  std::mutex threadLock;
-  std::condition_variable_any threadCV;
-  std::queue<std::size_t> threadQueue;    // thread queue
+/**
+ * Type: Lane
+ * ----------
+ * One submission lane: a lock-free queue, a locked overflow deque used
+ * only when that queue is full, and the lane's bookkeeping.  lastServed
+ * is the time (in steady_clock nanoseconds) a worker last took a task
+ * from the lane, or the time the lane last went from empty to non-empty.
+ */
+  struct Lane {
+    Lane(size_t weight, size_t capacity);
+    size_t weight;
+    uint64_t stride;
+    MPMCQueue<Task> ring;
+    std::mutex overflowLock;
+    std::deque<Task> overflow;
+    std::atomic<size_t> overflowSize;
+    std::atomic<size_t> depth;
+    std::atomic<size_t> depthHighWater;
+    std::atomic<int64_t> lastServed;
+    std::atomic<size_t> numDispatched;
+    std::atomic<uint64_t> totalWaitNanos;
+    std::atomic<uint64_t> maxWaitNanos;
+  };
+
+/**
+ * Type: BoundCall
+ * ---------------
+ * The callable submit packages up: a function together with the arguments
+ * it should eventually be called with.
+ */
+  template <typename F, typename... Args>
+  struct BoundCall {
+    typedef typename std::result_of<F&(Args&&...)>::type Result;
+    F f;
+    std::tuple<Args...> args;
+    Result operator()() { return call(std::index_sequence_for<Args...>()); }
+    template <size_t... I>
+    Result call(std::index_sequence<I...>) { return f(std::move(std::get<I>(args))...); }
+  };
+
+  template <typename F, typename... Args>
+  static std::packaged_task<typename BoundCall<typename std::decay<F>::type,
+                                               typename std::decay<Args>::type...>::Result(void)>
+  package(F&& f, Args&&... args) {
+    typedef BoundCall<typename std::decay<F>::type, typename std::decay<Args>::type...> Call;
+    return std::packaged_task<typename Call::Result(void)>(
+      Call{std::forward<F>(f), std::make_tuple(std::forward<Args>(args)...)});
+  }
+
+  template <typename Iterator>
+  void scheduleBulk(Iterator begin, Iterator end, TaskGroup *group, size_t lane) {
+    size_t numScheduled = 0;
+    for (Iterator iter = begin; iter != end; ++iter, numScheduled++) {
+      enqueue(UniqueFunction(std::move(*iter)), group, lane);
+    }
+    advanceEpoch(numScheduled);
+    spawnIfNeeded(numScheduled);
+  }
+
+  const Elasticity elasticity;
+  size_t numNodes;                                    // nodes the workers are spread over
+
+/**
+ * There is one slot per potential worker.  A slot's thread and deque
+ * outlive the worker itself: a retired worker's thread is joined the next
+ * time its slot is reused (or by the destructor), and its deque, which it
+ * only retires with once empty, stays in place for the next occupant.
+ * spawnLock guards live and the thread handles.
+ */
+  std::vector<std::thread> wts;                       // worker thread handles
+  std::vector<std::unique_ptr<WorkerQueue, WorkerQueueDeleter>> queues;   // one deque per worker
+  std::vector<bool> live;                             // which slots have a running worker
+  mutable std::mutex spawnLock;
+  std::atomic<size_t> numLive;
+  std::atomic<size_t> numRunning;                     // workers inside a thunk
+  std::atomic<size_t> numBlocked;                     // workers inside a BlockingRegion
+  std::atomic<int64_t> lastStarted;                   // when any thunk last started, in nanoseconds
+  std::thread monitor;                                // spawns workers for stalled work; elastic pools only
+  std::mutex monitorLock;
+  std::condition_variable_any monitorCV;
+  std::vector<std::unique_ptr<Lane>> lanes;           // submission lanes
+  std::atomic<size_t> nextQueue;                      // rotating steal start for helpers
+
+/**
+ * Idle workers park on idleCV until the epoch moves past the value they
+ * sampled before their last unsuccessful scan for work.  Every push and
+ * the shutdown itself advance the epoch, so a worker can never sleep
+ * through either.  No lock is held while a thunk runs; idleLock only
+ * guards the park/notify handshake.
+ */
+  std::atomic<size_t> epoch;
+  std::atomic<size_t> numSleeping;    // workers parked on idleCV
+  std::mutex idleLock;
+  std::condition_variable_any idleCV;
+  std::atomic<bool> exit;
 
+  std::atomic<size_t> numOutstanding; // thunks scheduled but not yet finished
+  std::atomic<size_t> outstandingHighWater;
+  Counters helperCounters;            // for thunks run by threads outside the pool
+  std::mutex helperLock;              // serializes those threads' updates to helperCounters
+  std::mutex doneLock;
+  std::condition_variable_any doneCV;
 
-  void dispatcher();
   void worker(size_t workerID);
+  void run(Task& task);
+  bool runPendingThunk(size_t lane = kUntagged);
+  bool park(size_t seen, const std::function<bool(void)>& done,
+            std::chrono::milliseconds timeout = std::chrono::milliseconds::max());
+  void advanceEpoch(size_t numToWake);
+  void spawnIfNeeded(size_t numQueued);
+  bool spawnWorker();
+  bool retire(size_t workerID, size_t seen);
+  void monitorStalls();
+  void enterBlockingRegion();
+  void exitBlockingRegion();
+  void schedule(UniqueFunction thunk, TaskGroup *group, size_t lane);
+  void enqueue(UniqueFunction thunk, TaskGroup *group, size_t lane);
+  bool popLane(size_t lane, Task& task);
+  bool popLanes(WorkerQueue *worker, Task& task);
+  bool popLocal(size_t workerID, Task& task);
+  bool steal(size_t thiefID, Task& task);
+  void push(size_t workerID, Task task);
+  WorkerStats snapshot(const Counters& counters, bool live, int64_t now) const;
 
 /**
  * ThreadPools are the type of thing that shouldn't be cloneable, since it's
@@ -82,6 +454,117 @@ class ThreadPool {
  */
   ThreadPool(const ThreadPool& original) = delete;
   ThreadPool& operator=(const ThreadPool& rhs) = delete;
+
+  static const size_t kUntagged = SIZE_MAX;  // lane for thunks scheduled without one
+  static const size_t kRunTimeSampling = 32;
+
+  friend class TaskGroup;
+  friend class BlockingRegion;
+};
+
+/**
+ * Class: BlockingRegion
+ * ---------------------
+ * Declares that the thunk constructing it is about to block for a while
+ * (typically on I/O) and won't need its CPU until the BlockingRegion is
+ * destroyed.  If the pool has work queued and no idle worker, and is
+ * still below its maximum size, it spawns another worker right away
+ * rather than waiting out its spawn delay.  Constructing one anywhere
+ * other than inside a pool thunk does nothing.
+ */
+class BlockingRegion {
+ public:
+  BlockingRegion();
+  ~BlockingRegion();
+
+ private:
+  ThreadPool *pool;
+
+  BlockingRegion(const BlockingRegion& original) = delete;
+  BlockingRegion& operator=(const BlockingRegion& rhs) = delete;
+};
+
+/**
+ * Class: TaskGroup
+ * ----------------
+ * Tracks a subset of the thunks running on a ThreadPool so that a client
+ * can wait for just those thunks rather than for the entire pool.
+ *
+ * A thread blocked in TaskGroup::wait doesn't sit idle: while its group is
+ * unfinished it runs other pending thunks from the same pool.  That means
+ * a pool worker can wait on a group scheduled into its own pool without
+ * deadlocking, and a worker from one pool waiting on a group in another
+ * lends a hand instead of parking.  A group scheduled on a lane only helps
+ * with thunks from that lane, so a thunk waiting on its group can't pick
+ * up an unrelated one from another lane that waits on a group of its own,
+ * and so on, nesting one inside the other; an untagged group helps with
+ * any pending thunk.
+ */
+class TaskGroup {
+ public:
+
+/**
+ * Constructs an empty TaskGroup whose thunks will run on the supplied pool.
+ * The pool must outlive the group.
+ */
+  TaskGroup(ThreadPool& pool);
+
+/**
+ * Constructs an empty TaskGroup whose thunks will all be scheduled on the
+ * specified lane of the supplied pool.
+ */
+  TaskGroup(ThreadPool& pool, size_t lane);
+
+/**
+ * Schedules the provided thunk on the underlying pool as a member of
+ * this group.
+ */
+  void schedule(UniqueFunction thunk);
+
+/**
+ * Schedules every thunk in the range [begin, end) as a member of this
+ * group, using the pool's scheduleBulk.  The thunks are moved out of
+ * the range.
+ */
+  template <typename Iterator>
+  void scheduleBulk(Iterator begin, Iterator end) {
+    pool.scheduleBulk(begin, end, this, lane);
+  }
+
+/**
+ * Submits f(args...) to the underlying pool as a member of this group,
+ * exactly as ThreadPool::submit would.
+ */
+  template <typename F, typename... Args>
+  std::future<typename std::result_of<typename std::decay<F>::type&(typename std::decay<Args>::type&&...)>::type>
+  submit(F&& f, Args&&... args) {
+    auto task = ThreadPool::package(std::forward<F>(f), std::forward<Args>(args)...);
+    auto result = task.get_future();
+    schedule(std::move(task));
+    return result;
+  }
+
+/**
+ * Blocks until every thunk scheduled through this group has executed in
+ * full, running other pending pool thunks (from the group's lane, if it
+ * has one) in the meantime.
+ */
+  void wait();
+
+/**
+ * Waits for the group's outstanding thunks before going away.
+ */
+  ~TaskGroup();
+
+ private:
+  ThreadPool& pool;
+  size_t lane;
+  std::atomic<size_t> numOutstanding;
+
+  TaskGroup(const TaskGroup& original) = delete;
+  TaskGroup& operator=(const TaskGroup& rhs) = delete;
+
+  friend class ThreadPool;
 };
 
 #endif
@@ -0,0 +1,522 @@
+/**
+ * File: tpbench.cc
+ * ----------------
+ * Benchmarks the ThreadPool.  The benchmarks available are:
+ *
+ *   --scaling [N]      measures how many thunks per second the pool can push
+ *                      through as the number of worker threads grows from 1
+ *                      to N (N defaults to the number of hardware threads).
+ *                      Each thunk spins for a small, fixed amount of CPU work
+ *                      so that the numbers reflect scheduling overhead and
+ *                      scaling rather than the cost of the work itself.
+ *   --submit-latency   measures how long a single call to schedule takes when
+ *                      1, 4, 16 and 64 producer threads submit at once.
+ *   --allocations      counts heap allocations per scheduled thunk, comparing
+ *                      the old std::function path (copy the thunk into a
+ *                      std::function, results written to shared state under
+ *                      a lock) against UniqueFunction thunks and submit
+ *                      futures that hand their results back by move.
+ *   --suite [N]        runs each of the suite's workloads (empty thunks,
+ *                      fan-out/fan-in, nested scheduling, mixed CPU/sleep,
+ *                      and wait() latency) on pools of 1, 2, 4, ... up to N
+ *                      threads, reporting ops/sec and p50/p99/p999 latency.
+ *   --json [N]         runs the suite exactly as --suite does, but prints
+ *                      the results as a single JSON document so runs can be
+ *                      compared by script from one release to the next.
+ *   --affinity [N]     runs a CPU-bound tokenize-and-index stage (the shape
+ *                      of the aggregator's work once articles are downloaded)
+ *                      on an N-thread pool under each worker Placement.
+ *
+ * With no arguments, every benchmark runs.
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <new>
+#include <string>
+#include <map>
+#include <sstream>
+
+#include "thread-pool.h"
+#include "latency-histogram.h"
+using namespace std;
+
+static const size_t kNumTasks = 200000;
+static const size_t kSpinIterations = 2000;
+
+static void spin() {
+  volatile size_t sink = 0;
+  for (size_t i = 0; i < kSpinIterations; i++) sink += i;
+}
+
+static double measureTasksPerSecond(size_t numThreads) {
+  ThreadPool pool(numThreads);
+  auto start = chrono::steady_clock::now();
+  for (size_t i = 0; i < kNumTasks; i++) pool.schedule(spin);
+  pool.wait();
+  chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+  return kNumTasks / elapsed.count();
+}
+
+static void scalingBenchmark(size_t maxThreads) {
+  cout << "Throughput scaling (" << kNumTasks << " thunks):" << endl;
+  cout << setw(8) << "threads" << setw(16) << "tasks/sec" << setw(10) << "speedup" << endl;
+  vector<size_t> sweep;
+  for (size_t numThreads = 1; numThreads < maxThreads; numThreads *= 2) sweep.push_back(numThreads);
+  sweep.push_back(maxThreads);
+  double base = 0;
+  for (size_t numThreads : sweep) {
+    double rate = measureTasksPerSecond(numThreads);
+    if (numThreads == 1) base = rate;
+    cout << setw(8) << numThreads << setw(16) << fixed << setprecision(0) << rate
+         << setw(9) << setprecision(2) << rate / base << "x" << endl;
+  }
+}
+
+static const size_t kSubmissionsPerRun = 64000;
+static const size_t kProducerCounts[] = {1, 4, 16, 64};
+static void submitLatencyBenchmark() {
+  size_t numWorkers = max<size_t>(thread::hardware_concurrency(), 1);
+  cout << "Submit latency (" << numWorkers << " workers, " << kSubmissionsPerRun
+       << " empty thunks per run, nanoseconds per schedule call):" << endl;
+  cout << setw(10) << "producers" << setw(10) << "mean" << setw(10) << "p50"
+       << setw(10) << "p99" << setw(10) << "max" << endl;
+  for (size_t numProducers : kProducerCounts) {
+    ThreadPool pool(numWorkers);
+    size_t perProducer = kSubmissionsPerRun / numProducers;
+    vector<vector<long>> samples(numProducers, vector<long>(perProducer));
+    vector<thread> producers;
+    for (size_t p = 0; p < numProducers; p++) {
+      producers.push_back(thread([&pool, &samples, p, perProducer] {
+        for (size_t i = 0; i < perProducer; i++) {
+          auto start = chrono::steady_clock::now();
+          pool.schedule([] {});
+          samples[p][i] = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+        }
+      }));
+    }
+    for (thread& t : producers) t.join();
+    pool.wait();
+
+    vector<long> all;
+    for (const vector<long>& s : samples) all.insert(all.end(), s.begin(), s.end());
+    sort(all.begin(), all.end());
+    long total = 0;
+    for (long sample : all) total += sample;
+    cout << setw(10) << numProducers << setw(10) << total / (long) all.size()
+         << setw(10) << all[all.size() / 2] << setw(10) << all[all.size() * 99 / 100]
+         << setw(10) << all.back() << endl;
+  }
+}
+
+/**
+ * Every allocation made anywhere in this executable goes through these,
+ * so the allocations benchmark can see exactly how many each path costs.
+ * The sized delete forwards to the unsized one, and neither that nor new
+ * is inlined, so the optimizer always sees new paired with delete rather
+ * than one of them with malloc or free.
+ */
+static atomic<size_t> numAllocations(0);
+__attribute__((noinline)) void *operator new(size_t size) {
+  numAllocations++;
+  void *memory = malloc(size == 0 ? 1 : size);
+  if (memory == NULL) throw bad_alloc();
+  return memory;
+}
+
+__attribute__((noinline)) void operator delete(void *memory) noexcept {
+  free(memory);
+}
+
+void operator delete(void *memory, size_t) noexcept {
+  ::operator delete(memory);
+}
+
+static const size_t kAllocationTasks = 100000;
+static const size_t kTokensPerResult = 8;
+static const char *kShortToken = "news";                  // fits in std::string's small buffer
+static const char *kLongToken = "internationalization";  // doesn't, so every copy allocates
+
+/**
+ * Measures the allocations per thunk made while scheduling and running
+ * kAllocationTasks thunks through the supplied routine.
+ */
+static double allocationsPerTask(const function<void(ThreadPool&)>& routine) {
+  ThreadPool pool(max<size_t>(thread::hardware_concurrency(), 1));
+  size_t before = numAllocations;
+  routine(pool);
+  pool.wait();
+  return double(numAllocations - before) / kAllocationTasks;
+}
+
+static void allocationsBenchmark() {
+  // a 40-byte capture: too big for std::function's small buffer, small enough for UniqueFunction's
+  struct Capture { size_t a, b, c, d, e; };
+  Capture capture = {1, 2, 3, 4, 5};
+  mutex resultsLock;
+  vector<vector<string>> shared;
+  shared.reserve(kAllocationTasks);
+  cout << "Allocations per thunk (" << kAllocationTasks << " thunks):" << endl;
+
+  double oldEmpty = allocationsPerTask([&capture](ThreadPool& pool) {
+    for (size_t i = 0; i < kAllocationTasks; i++) {
+      function<void(void)> thunk = [capture] { volatile size_t sink = capture.a; (void) sink; };
+      pool.schedule(thunk);
+    }
+  });
+  double newEmpty = allocationsPerTask([&capture](ThreadPool& pool) {
+    for (size_t i = 0; i < kAllocationTasks; i++) {
+      pool.schedule([capture] { volatile size_t sink = capture.a; (void) sink; });
+    }
+  });
+  cout << "  40-byte capture, std::function:        " << fixed << setprecision(2) << oldEmpty << endl;
+  cout << "  40-byte capture, UniqueFunction:       " << newEmpty << endl;
+
+  for (const char *token : {kShortToken, kLongToken}) {
+    shared.clear();
+    double oldResults = allocationsPerTask([&resultsLock, &shared, token](ThreadPool& pool) {
+      for (size_t i = 0; i < kAllocationTasks; i++) {
+        function<void(void)> thunk = [&resultsLock, &shared, token] {
+          vector<string> tokens(kTokensPerResult, token);
+          lock_guard<mutex> lg(resultsLock);
+          shared.push_back(tokens);
+        };
+        pool.schedule(thunk);
+      }
+    });
+    vector<future<vector<string>>> results;
+    results.reserve(kAllocationTasks);
+    double newResults = allocationsPerTask([&results, token](ThreadPool& pool) {
+      for (size_t i = 0; i < kAllocationTasks; i++) {
+        results.push_back(pool.submit([token] { return vector<string>(kTokensPerResult, token); }));
+      }
+    });
+    cout << "  " << kTokensPerResult << " x \"" << token << "\" tokens, shared map under a lock: " << oldResults << endl;
+    cout << "  " << kTokensPerResult << " x \"" << token << "\" tokens, submit future by move:   " << newResults << endl;
+  }
+}
+
+/**
+ * The suite.  Every workload runs once per pool size in the sweep and
+ * produces a SuiteResult: how many operations it completed per second of
+ * wall time, and a histogram of per-operation latencies (what counts as an
+ * operation, and what its latency is, is spelled out above each workload).
+ */
+struct SuiteResult {
+  string workload;
+  size_t numThreads;
+  double opsPerSecond;
+  LatencyHistogram latencies;
+};
+
+static long nanosSince(chrono::steady_clock::time_point start) {
+  return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+}
+
+/**
+ * empty: kSuiteThunks empty thunks scheduled from outside the pool.  The
+ * latency is from the call to schedule to the thunk starting.
+ */
+static const size_t kSuiteThunks = 100000;
+static SuiteResult emptyThunks(size_t numThreads) {
+  SuiteResult result = {"empty", numThreads, 0, LatencyHistogram()};
+  vector<long> latencies(kSuiteThunks);
+  ThreadPool pool(numThreads);
+  auto start = chrono::steady_clock::now();
+  for (size_t i = 0; i < kSuiteThunks; i++) {
+    auto scheduled = chrono::steady_clock::now();
+    pool.schedule([&latencies, i, scheduled] { latencies[i] = nanosSince(scheduled); });
+  }
+  pool.wait();
+  result.opsPerSecond = kSuiteThunks / (nanosSince(start) / 1e9);
+  for (long latency : latencies) result.latencies.record(latency);
+  return result;
+}
+
+/**
+ * fan-out: kFanOutRounds rounds, each of which fans kFanOutWidth spinning
+ * thunks out through a TaskGroup and waits for all of them.  An operation
+ * is one child thunk; the latency is that of a whole round.
+ */
+static const size_t kFanOutRounds = 500;
+static const size_t kFanOutWidth = 64;
+static SuiteResult fanOutFanIn(size_t numThreads) {
+  SuiteResult result = {"fan-out", numThreads, 0, LatencyHistogram()};
+  ThreadPool pool(numThreads);
+  auto start = chrono::steady_clock::now();
+  for (size_t round = 0; round < kFanOutRounds; round++) {
+    auto roundStart = chrono::steady_clock::now();
+    TaskGroup group(pool);
+    for (size_t i = 0; i < kFanOutWidth; i++) group.schedule(spin);
+    group.wait();
+    result.latencies.record(nanosSince(roundStart));
+  }
+  result.opsPerSecond = kFanOutRounds * kFanOutWidth / (nanosSince(start) / 1e9);
+  return result;
+}
+
+/**
+ * nested: kNestedOuter outer thunks, each of which schedules kNestedInner
+ * spinning thunks into the same pool from inside and waits on them.  An
+ * operation is one inner thunk; the latency is from an outer thunk
+ * starting to all of its inner thunks being done.
+ */
+static const size_t kNestedOuter = 2000;
+static const size_t kNestedInner = 16;
+static SuiteResult nestedScheduling(size_t numThreads) {
+  SuiteResult result = {"nested", numThreads, 0, LatencyHistogram()};
+  vector<long> latencies(kNestedOuter);
+  ThreadPool pool(numThreads);
+  auto start = chrono::steady_clock::now();
+  for (size_t outer = 0; outer < kNestedOuter; outer++) {
+    pool.schedule([&pool, &latencies, outer] {
+      auto outerStart = chrono::steady_clock::now();
+      TaskGroup group(pool);
+      for (size_t inner = 0; inner < kNestedInner; inner++) group.schedule(spin);
+      group.wait();
+      latencies[outer] = nanosSince(outerStart);
+    });
+  }
+  pool.wait();
+  result.opsPerSecond = kNestedOuter * kNestedInner / (nanosSince(start) / 1e9);
+  for (long latency : latencies) result.latencies.record(latency);
+  return result;
+}
+
+/**
+ * mixed: kMixedThunks thunks, one in every kMixedSleepEvery of which sleeps
+ * for kMixedSleepMicros (standing in for a download) while the rest spin.
+ * The latency is from the call to schedule to the thunk finishing.
+ */
+static const size_t kMixedThunks = 20000;
+static const size_t kMixedSleepEvery = 10;
+static const size_t kMixedSleepMicros = 1000;
+static SuiteResult mixedWork(size_t numThreads) {
+  SuiteResult result = {"mixed", numThreads, 0, LatencyHistogram()};
+  vector<long> latencies(kMixedThunks);
+  ThreadPool pool(numThreads);
+  auto start = chrono::steady_clock::now();
+  for (size_t i = 0; i < kMixedThunks; i++) {
+    auto scheduled = chrono::steady_clock::now();
+    pool.schedule([&latencies, i, scheduled] {
+      if (i % kMixedSleepEvery == 0) {
+        this_thread::sleep_for(chrono::microseconds(kMixedSleepMicros));
+      } else {
+        spin();
+      }
+      latencies[i] = nanosSince(scheduled);
+    });
+  }
+  pool.wait();
+  result.opsPerSecond = kMixedThunks / (nanosSince(start) / 1e9);
+  for (long latency : latencies) result.latencies.record(latency);
+  return result;
+}
+
+/**
+ * wait: kWaitRounds rounds of scheduling a single empty thunk and calling
+ * wait.  The latency is from the thunk finishing to wait returning, which
+ * is how long the pool takes to notice it has drained and say so.
+ */
+static const size_t kWaitRounds = 5000;
+static SuiteResult waitLatency(size_t numThreads) {
+  SuiteResult result = {"wait", numThreads, 0, LatencyHistogram()};
+  ThreadPool pool(numThreads);
+  auto start = chrono::steady_clock::now();
+  for (size_t round = 0; round < kWaitRounds; round++) {
+    atomic<long> finished(0);
+    pool.schedule([&finished] {
+      finished = chrono::steady_clock::now().time_since_epoch().count();
+    });
+    pool.wait();
+    long returned = chrono::steady_clock::now().time_since_epoch().count();
+    result.latencies.record(chrono::duration_cast<chrono::nanoseconds>(
+      chrono::steady_clock::duration(max(returned - finished, 0L))).count());
+  }
+  result.opsPerSecond = kWaitRounds / (nanosSince(start) / 1e9);
+  return result;
+}
+
+static vector<SuiteResult> runSuite(size_t maxThreads) {
+  static const function<SuiteResult(size_t)> kWorkloads[] = {
+    emptyThunks, fanOutFanIn, nestedScheduling, mixedWork, waitLatency
+  };
+  vector<size_t> sweep;
+  for (size_t numThreads = 1; numThreads < maxThreads; numThreads *= 2) sweep.push_back(numThreads);
+  sweep.push_back(maxThreads);
+  vector<SuiteResult> results;
+  for (const function<SuiteResult(size_t)>& workload : kWorkloads) {
+    for (size_t numThreads : sweep) results.push_back(workload(numThreads));
+  }
+  return results;
+}
+
+static void printSuite(const vector<SuiteResult>& results) {
+  cout << "Suite (latencies in microseconds):" << endl;
+  cout << setw(10) << "workload" << setw(9) << "threads" << setw(14) << "ops/sec"
+       << setw(11) << "p50" << setw(11) << "p99" << setw(11) << "p999" << endl;
+  for (const SuiteResult& result : results) {
+    cout << setw(10) << result.workload << setw(9) << result.numThreads << setw(14) << fixed
+         << setprecision(0) << result.opsPerSecond << setprecision(1)
+         << setw(11) << result.latencies.percentile(0.5) / 1e3
+         << setw(11) << result.latencies.percentile(0.99) / 1e3
+         << setw(11) << result.latencies.percentile(0.999) / 1e3 << endl;
+  }
+}
+
+/**
+ * Prints the results as one JSON object.  Everything that varies from host
+ * to host and that a comparison needs to know about (the hardware thread
+ * count and the sizes of the workloads) is recorded alongside the numbers.
+ */
+static void printSuiteJSON(const vector<SuiteResult>& results) {
+  cout << "{" << endl;
+  cout << "  \"benchmark\": \"tpbench\"," << endl;
+  cout << "  \"hardware_threads\": " << thread::hardware_concurrency() << "," << endl;
+  cout << "  \"workloads\": {\"empty\": " << kSuiteThunks << ", \"fan-out\": [" << kFanOutRounds
+       << ", " << kFanOutWidth << "], \"nested\": [" << kNestedOuter << ", " << kNestedInner
+       << "], \"mixed\": " << kMixedThunks << ", \"wait\": " << kWaitRounds << "}," << endl;
+  cout << "  \"results\": [" << endl;
+  for (size_t i = 0; i < results.size(); i++) {
+    const SuiteResult& result = results[i];
+    cout << "    {\"workload\": \"" << result.workload << "\", \"threads\": " << result.numThreads
+         << ", \"ops_per_sec\": " << fixed << setprecision(1) << result.opsPerSecond
+         << ", \"p50_ns\": " << result.latencies.percentile(0.5)
+         << ", \"p99_ns\": " << result.latencies.percentile(0.99)
+         << ", \"p999_ns\": " << result.latencies.percentile(0.999)
+         << ", \"max_ns\": " << result.latencies.max() << "}"
+         << (i + 1 == results.size() ? "" : ",") << endl;
+  }
+  cout << "  ]" << endl;
+  cout << "}" << endl;
+}
+
+/**
+ * Synthetic documents for the affinity benchmark: kAffinityDocuments
+ * documents of kWordsPerDocument words, drawn (deterministically) from a
+ * vocabulary of kVocabularySize made-up words.
+ */
+static const size_t kAffinityDocuments = 2000;
+static const size_t kWordsPerDocument = 2000;
+static const size_t kVocabularySize = 20000;
+static const size_t kIndexShards = 64;
+static vector<string> makeDocuments() {
+  vector<string> vocabulary;
+  for (size_t i = 0; i < kVocabularySize; i++) vocabulary.push_back("word" + to_string(i * 2654435761u % 1000003));
+  vector<string> documents;
+  uint64_t state = 88172645463325252ull;
+  for (size_t d = 0; d < kAffinityDocuments; d++) {
+    string document;
+    for (size_t w = 0; w < kWordsPerDocument; w++) {
+      state ^= state << 13; state ^= state >> 7; state ^= state << 17;
+      document += vocabulary[state % kVocabularySize];
+      document += ' ';
+    }
+    documents.push_back(document);
+  }
+  return documents;
+}
+
+/**
+ * Tokenizes every document (split, sort, dedupe) on the pool and folds each
+ * document's tokens into a sharded index, one index-merge thunk per shard
+ * per document, as the aggregator does once its downloads are done.
+ * Returns the number of seconds it took.
+ */
+static double tokenizeAndIndex(const vector<string>& documents, size_t numThreads,
+                               ThreadPool::Placement placement) {
+  ThreadPool pool(numThreads, vector<size_t>(1, 1), placement);
+  vector<mutex> shardLocks(kIndexShards);
+  vector<map<string, size_t>> shards(kIndexShards);
+  auto start = chrono::steady_clock::now();
+  for (const string& document : documents) {
+    pool.schedule([&pool, &document, &shardLocks, &shards] {
+      istringstream words(document);
+      vector<string> tokens;
+      string word;
+      while (words >> word) tokens.push_back(word);
+      sort(tokens.begin(), tokens.end());
+      tokens.erase(unique(tokens.begin(), tokens.end()), tokens.end());
+      TaskGroup merges(pool);
+      for (size_t shard = 0; shard < kIndexShards; shard++) {
+        merges.schedule([&tokens, &shardLocks, &shards, shard] {
+          lock_guard<mutex> lg(shardLocks[shard]);
+          for (const string& token : tokens) {
+            if (hash<string>()(token) % kIndexShards == shard) shards[shard][token]++;
+          }
+        });
+      }
+      merges.wait();
+    });
+  }
+  pool.wait();
+  return nanosSince(start) / 1e9;
+}
+
+static void affinityBenchmark(size_t numThreads) {
+  const CPUTopology& topology = CPUTopology::detect();
+  size_t numCPUs = 0;
+  for (size_t node = 0; node < topology.numNodes(); node++) numCPUs += topology.cpusOn(node).size();
+  cout << "Tokenize + index (" << kAffinityDocuments << " documents, " << numThreads << " threads, "
+       << topology.numNodes() << " NUMA node" << (topology.numNodes() == 1 ? "" : "s") << ", "
+       << numCPUs << " CPUs):" << endl;
+  vector<string> documents = makeDocuments();
+  static const pair<const char *, ThreadPool::Placement> kPlacements[] = {
+    {"anywhere", ThreadPool::Placement::Anywhere},
+    {"cores", ThreadPool::Placement::Cores},
+    {"nodes", ThreadPool::Placement::Nodes},
+  };
+  double base = 0;
+  for (const auto& placement : kPlacements) {
+    double seconds = tokenizeAndIndex(documents, numThreads, placement.second);
+    if (base == 0) base = seconds;
+    cout << setw(10) << placement.first << setw(12) << fixed << setprecision(3) << seconds << "s"
+         << setw(14) << setprecision(0) << kAffinityDocuments / seconds << " docs/sec"
+         << setw(9) << setprecision(2) << base / seconds << "x" << endl;
+  }
+}
+
+int main(int argc, char *argv[]) {
+  size_t maxThreads = max<size_t>(thread::hardware_concurrency(), 1);
+  if (argc == 1) {
+    scalingBenchmark(maxThreads);
+    submitLatencyBenchmark();
+    allocationsBenchmark();
+    printSuite(runSuite(maxThreads));
+    affinityBenchmark(maxThreads);
+    return 0;
+  }
+
+  if (strcmp(argv[1], "--scaling") == 0) {
+    if (argc > 2) maxThreads = max<size_t>(strtoul(argv[2], NULL, 10), 1);
+    scalingBenchmark(maxThreads);
+  } else if (strcmp(argv[1], "--submit-latency") == 0) {
+    submitLatencyBenchmark();
+  } else if (strcmp(argv[1], "--allocations") == 0) {
+    allocationsBenchmark();
+  } else if (strcmp(argv[1], "--affinity") == 0) {
+    if (argc > 2) maxThreads = max<size_t>(strtoul(argv[2], NULL, 10), 1);
+    affinityBenchmark(maxThreads);
+  } else if (strcmp(argv[1], "--suite") == 0 || strcmp(argv[1], "--json") == 0) {
+    if (argc > 2) maxThreads = max<size_t>(strtoul(argv[2], NULL, 10), 1);
+    vector<SuiteResult> results = runSuite(maxThreads);
+    if (strcmp(argv[1], "--json") == 0) {
+      printSuiteJSON(results);
+    } else {
+      printSuite(results);
+    }
+  } else {
+    cout << "Oops... we don't recognize the flag \"" << argv[1] << "\"." << endl;
+  }
+  return 0;
+}
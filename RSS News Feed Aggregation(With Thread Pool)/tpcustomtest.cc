@@ -11,6 +11,11 @@
 #include <string>
 #include <functional>
 #include <cstring>
+#include <chrono>
+#include <mutex>
+#include <atomic>
+#include <vector>
+#include <algorithm>
 
 #include <sys/types.h> // used to count the number of threads
 #include <unistd.h>    // used to count the number of threads
@@ -59,6 +64,164 @@ static void reuseThreadPoolTest() {
   pool.wait();
 }
 
+/**
+ * Regression check that workers really do run thunks concurrently: N thunks
+ * that each sleep for kSleeperMillis should finish in roughly kSleeperMillis
+ * on an N-thread pool, not N * kSleeperMillis.  Sleeping (rather than spinning)
+ * keeps the result meaningful even on a machine with fewer than N cores.
+ */
+static const size_t kNumSleepers = 8;
+static const size_t kSleeperMillis = 250;
+static void concurrentSleepersTest() {
+  ThreadPool pool(kNumSleepers);
+  auto start = chrono::steady_clock::now();
+  for (size_t i = 0; i < kNumSleepers; i++) {
+    pool.schedule([] {
+      sleep_for(kSleeperMillis);
+    });
+  }
+  pool.wait();
+  size_t elapsed = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count();
+  size_t serial = kNumSleepers * kSleeperMillis;
+  cout << kNumSleepers << " sleepers took " << elapsed << "ms (serial would be " << serial
+       << "ms, ideal is " << serial / kNumSleepers << "ms)." << endl;
+  cout << (elapsed < 2 * serial / kNumSleepers ? "Concurrent." : "Serialized!") << endl;
+}
+
+/**
+ * Every outer thunk schedules inner thunks into the same pool and waits on
+ * them through a TaskGroup.  With only two workers and four outer thunks,
+ * this deadlocks unless waiting workers help run the pending inner thunks.
+ */
+static void nestedTaskGroupTest() {
+  ThreadPool pool(2);
+  for (size_t outer = 0; outer < 4; outer++) {
+    pool.schedule([&pool, outer] {
+      TaskGroup group(pool);
+      for (size_t inner = 0; inner < 8; inner++) {
+        group.schedule([] {
+          sleep_for(10);
+        });
+      }
+      group.wait();
+      cout << oslock << "Outer thunk " << outer << " saw all of its inner thunks finish." << endl << osunlock;
+    });
+  }
+  pool.wait();
+}
+
+/**
+ * Outer thunks on lane 0 each wait on a group of inner thunks on lane 1.
+ * A waiting thunk should only help with lane 1, so no outer thunk should
+ * ever start on a thread that's still inside another's wait.
+ */
+static thread_local size_t outerDepth = 0;
+static void laneConfinedHelpingTest() {
+  ThreadPool pool(1, {1, 1});
+  atomic<size_t> numNested(0);
+  for (size_t outer = 0; outer < 4; outer++) {
+    pool.schedule(0, [&pool, &numNested] {
+      if (outerDepth > 0) numNested++;
+      outerDepth++;
+      TaskGroup group(pool, 1);
+      for (size_t inner = 0; inner < 4; inner++) {
+        group.schedule([] {
+          sleep_for(5);
+        });
+      }
+      group.wait();
+      outerDepth--;
+    });
+  }
+  pool.wait();
+  cout << numNested << " of 4 outer thunks started inside another's wait." << endl;
+  cout << (numNested == 0 ? "Confined." : "Nested!") << endl;
+}
+
+/**
+ * A single worker is held up by a gate thunk while equal numbers of thunks
+ * pile up on a weight-3 lane and a weight-1 lane.  Once the gate opens,
+ * the worker should serve the two lanes roughly 3:1 for as long as both
+ * have work queued.
+ */
+static const size_t kThunksPerLane = 200;
+static const size_t kSampleSize = 40;
+static void weightedLanesTest() {
+  ThreadPool pool(1, {3, 1});
+  mutex orderLock;
+  vector<size_t> order;
+  pool.schedule(0, [] { sleep_for(50); });
+  for (size_t i = 0; i < kThunksPerLane; i++) {
+    for (size_t lane = 0; lane < 2; lane++) {
+      pool.schedule(lane, [&orderLock, &order, lane] {
+        lock_guard<mutex> lg(orderLock);
+        order.push_back(lane);
+      });
+    }
+  }
+  pool.wait();
+  size_t numHeavy = count(order.begin(), order.begin() + kSampleSize, 0);
+  cout << "Of the first " << kSampleSize << " thunks, " << numHeavy << " came from the weight-3 lane and "
+       << kSampleSize - numHeavy << " from the weight-1 lane." << endl;
+  cout << (numHeavy >= kSampleSize * 2 / 3 && numHeavy <= kSampleSize * 5 / 6 ? "Weighted." : "Unweighted!") << endl;
+  for (const ThreadPool::LaneStats& stats : pool.laneStats()) {
+    cout << "weight " << stats.weight << ": " << stats.numDispatched << " dispatched, "
+         << stats.maxWaitMillis << "ms max wait" << endl;
+  }
+}
+
+/**
+ * An elastic pool starts with no workers.  Eight thunks that declare a
+ * BlockingRegion and sleep should each get a worker of their own almost
+ * at once, and once the pool has been idle for longer than its idle
+ * timeout, it should shrink back down to its minimum.
+ */
+static void elasticGrowthTest() {
+  ThreadPool::Elasticity elasticity = {1, kNumSleepers, chrono::milliseconds(1000), chrono::milliseconds(100)};
+  ThreadPool pool(elasticity);
+  cout << "Workers before any work: " << pool.numThreads() << endl;
+  auto start = chrono::steady_clock::now();
+  for (size_t i = 0; i < kNumSleepers; i++) {
+    pool.schedule([] {
+      BlockingRegion blocking;
+      sleep_for(kSleeperMillis);
+    });
+  }
+  pool.wait();
+  size_t elapsed = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count();
+  cout << "Workers after " << kNumSleepers << " blocking thunks: " << pool.numThreads() << endl;
+  cout << (elapsed < 2 * kSleeperMillis ? "Grew." : "Didn't grow!") << endl;
+  sleep_for(kSleeperMillis * 2);
+  cout << "Workers after idling: " << pool.numThreads() << endl;
+  cout << (pool.numThreads() == elasticity.minThreads ? "Shrank." : "Didn't shrink!") << endl;
+}
+
+/**
+ * Runs a known number of thunks that each sleep for a known amount of time
+ * and checks that the pool's statistics account for every one of them.
+ */
+static const size_t kNumCountedThunks = 64;
+static const size_t kCountedThunkMillis = 5;
+static void poolStatsTest() {
+  ThreadPool pool(4);
+  for (size_t i = 0; i < kNumCountedThunks; i++) {
+    pool.schedule([] {
+      sleep_for(kCountedThunkMillis);
+    });
+  }
+  pool.wait();
+  ThreadPool::Stats stats = pool.stats();
+  size_t numRun = 0;
+  for (const ThreadPool::WorkerStats& worker : stats.workers) numRun += worker.numRun;
+  cout << numRun << " thunks run, " << stats.queueLatency.count() << " queue latencies recorded, "
+       << "outstanding peaked at " << stats.outstandingHighWater << "." << endl;
+  cout << "Median run time: " << stats.runTime.percentile(0.5) / 1000000 << "ms, workers were "
+       << int(stats.busyFraction * 100) << "% busy." << endl;
+  bool counted = numRun == kNumCountedThunks && stats.queueLatency.count() == kNumCountedThunks &&
+    stats.runTime.percentile(0.5) >= kCountedThunkMillis * 1000000;
+  cout << (counted ? "Counted." : "Miscounted!") << endl;
+}
+
 struct testEntry {
   string flag;
   function<void(void)> testfn;
@@ -70,6 +233,12 @@ static void buildMap(map<string, function<void(void)>>& testFunctionMap) {
     {"--single-thread-single-wait", singleThreadSingleWaitTest},
     {"--no-threads-double-wait", noThreadsDoubleWaitTest},
     {"--reuse-thread-pool", reuseThreadPoolTest},
+    {"--concurrent-sleepers", concurrentSleepersTest},
+    {"--nested-task-groups", nestedTaskGroupTest},
+    {"--lane-confined-helping", laneConfinedHelpingTest},
+    {"--weighted-lanes", weightedLanesTest},
+    {"--elastic-growth", elasticGrowthTest},
+    {"--pool-stats", poolStatsTest},
   };
 
   for (const testEntry& entry: entries) {
@@ -0,0 +1,146 @@
+/**
+ * File: unique-function.h
+ * -----------------------
+ * Defines UniqueFunction, a move-only stand-in for std::function<void(void)>.
+ * Unlike std::function, it happily wraps callables that can't be copied
+ * (lambdas that capture a std::packaged_task or a unique_ptr, for instance),
+ * and it stores any callable up to kInlineSize bytes directly inside the
+ * UniqueFunction object instead of on the heap.  Moving a UniqueFunction
+ * moves the wrapped callable; nothing is ever copied.
+ */
+
+#pragma once
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+class UniqueFunction {
+ public:
+
+/**
+ * Constructs an empty UniqueFunction, which must not be invoked.
+ */
+  UniqueFunction() : ops(nullptr) {}
+
+/**
+ * Wraps the supplied callable, moving (or copying, if it's an lvalue)
+ * it into inline storage when it fits and onto the heap when it doesn't.
+ */
+  template <typename F, typename = typename std::enable_if<
+              !std::is_same<typename std::decay<F>::type, UniqueFunction>::value>::type>
+  UniqueFunction(F&& callable) {
+    typedef typename std::decay<F>::type Callable;
+    store(std::forward<F>(callable), std::integral_constant<bool, fitsInline<Callable>()>());
+  }
+
+  UniqueFunction(UniqueFunction&& other) : ops(other.ops) {
+    if (ops != nullptr) ops->move(other.storage, storage);
+    other.ops = nullptr;
+  }
+
+  UniqueFunction& operator=(UniqueFunction&& rhs) {
+    if (this == &rhs) return *this;
+    reset();
+    ops = rhs.ops;
+    if (ops != nullptr) ops->move(rhs.storage, storage);
+    rhs.ops = nullptr;
+    return *this;
+  }
+
+  ~UniqueFunction() { reset(); }
+
+/**
+ * Invokes the wrapped callable.
+ */
+  void operator()() { ops->invoke(storage); }
+
+/**
+ * Returns true if and only if a callable is wrapped.
+ */
+  explicit operator bool() const { return ops != nullptr; }
+
+ private:
+  static const size_t kInlineSize = 48;
+
+/**
+ * Type: Ops
+ * ---------
+ * A hand-rolled vtable: one static instance exists per wrapped callable type
+ * (and per storage strategy), and ops points to the one for the callable
+ * currently held.  move transfers the callable from one buffer into another
+ * (uninitialized) buffer and destroys the source.
+ */
+  struct Ops {
+    void (*invoke)(void *buffer);
+    void (*move)(void *from, void *to);
+    void (*destroy)(void *buffer);
+  };
+
+  template <typename Callable>
+  static constexpr bool fitsInline() {
+    return sizeof(Callable) <= kInlineSize &&
+      alignof(Callable) <= alignof(std::max_align_t) &&
+      std::is_nothrow_move_constructible<Callable>::value;
+  }
+
+  template <typename Callable>
+  struct InlineOps {
+    static Callable *get(void *buffer) { return reinterpret_cast<Callable *>(buffer); }
+    static void invoke(void *buffer) { (*get(buffer))(); }
+    static void move(void *from, void *to) {
+      new (to) Callable(std::move(*get(from)));
+      get(from)->~Callable();
+    }
+    static void destroy(void *buffer) { get(buffer)->~Callable(); }
+    static const Ops table;
+  };
+
+  template <typename Callable>
+  struct HeapOps {
+    static Callable *&get(void *buffer) { return *reinterpret_cast<Callable **>(buffer); }
+    static void invoke(void *buffer) { (*get(buffer))(); }
+    static void move(void *from, void *to) { get(to) = get(from); }
+    static void destroy(void *buffer) { delete get(buffer); }
+    static const Ops table;
+  };
+
+  template <typename F>
+  void store(F&& callable, std::true_type /* fits inline */) {
+    typedef typename std::decay<F>::type Callable;
+    new (storage) Callable(std::forward<F>(callable));
+    ops = &InlineOps<Callable>::table;
+  }
+
+  template <typename F>
+  void store(F&& callable, std::false_type /* fits inline */) {
+    typedef typename std::decay<F>::type Callable;
+    *reinterpret_cast<Callable **>(storage) = new Callable(std::forward<F>(callable));
+    ops = &HeapOps<Callable>::table;
+  }
+
+  void reset() {
+    if (ops != nullptr) ops->destroy(storage);
+    ops = nullptr;
+  }
+
+  const Ops *ops;
+  alignas(std::max_align_t) unsigned char storage[kInlineSize];
+
+  UniqueFunction(const UniqueFunction& original) = delete;
+  UniqueFunction& operator=(const UniqueFunction& rhs) = delete;
+};
+
+template <typename Callable>
+const UniqueFunction::Ops UniqueFunction::InlineOps<Callable>::table = {
+  &UniqueFunction::InlineOps<Callable>::invoke,
+  &UniqueFunction::InlineOps<Callable>::move,
+  &UniqueFunction::InlineOps<Callable>::destroy
+};
+
+template <typename Callable>
+const UniqueFunction::Ops UniqueFunction::HeapOps<Callable>::table = {
+  &UniqueFunction::HeapOps<Callable>::invoke,
+  &UniqueFunction::HeapOps<Callable>::move,
+  &UniqueFunction::HeapOps<Callable>::destroy
+};
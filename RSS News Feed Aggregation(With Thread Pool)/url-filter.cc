@@ -0,0 +1,162 @@
+/**
+ * File: url-filter.cc
+ * -------------------
+ * Presents the implementation of the URLFilter class.
+ */
+
+#include "url-filter.h"
+#include <algorithm>
+#include <cmath>
+#include <functional>
+using namespace std;
+
+static const size_t kBitsPerWord = 64;
+static const double kMicros = 1e6;
+
+/**
+ * The second hash for double hashing (Kirsch and Mitzenmacher): bit i of
+ * a URL is (hash1 + i * hash2) mod numBits.  hash2 is forced odd so it
+ * can't be zero.
+ */
+static uint64_t secondHash(uint64_t hash) {
+  hash ^= hash >> 30;
+  hash *= 0xbf58476d1ce4e5b9ULL;
+  hash ^= hash >> 27;
+  hash *= 0x94d049bb133111ebULL;
+  hash ^= hash >> 31;
+  return hash | 1;
+}
+
+URLFilter::Stage::Stage(size_t capacity, double falsePositiveRate, size_t maxBytes) :
+  capacity(capacity), count(0), numBitsSet(0) {
+  double optimalBits = ceil(capacity * -log(falsePositiveRate) / (log(2) * log(2)));
+  numBits = ((size_t) optimalBits + kBitsPerWord - 1) / kBitsPerWord * kBitsPerWord;
+  if (maxBytes > 0 && numBits / 8 > maxBytes) {
+    numBits = max(kBitsPerWord, maxBytes * 8 / kBitsPerWord * kBitsPerWord);
+  }
+  numHashes = max<size_t>(1, (size_t) round((double) numBits / capacity * log(2)));
+  words.reset(new atomic<uint64_t>[numBits / kBitsPerWord]);
+  for (size_t i = 0; i < numBits / kBitsPerWord; i++) words[i].store(0, memory_order_relaxed);
+}
+
+bool URLFilter::Stage::contains(uint64_t hash1, uint64_t hash2) const {
+  for (size_t i = 0; i < numHashes; i++) {
+    size_t bit = (hash1 + i * hash2) % numBits;
+    if ((words[bit / kBitsPerWord].load(memory_order_relaxed) & ((uint64_t) 1 << (bit % kBitsPerWord))) == 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Sets all of the URL's bits, returning true if any of them weren't set
+ * already.
+ */
+bool URLFilter::Stage::set(uint64_t hash1, uint64_t hash2) {
+  size_t numSet = 0;
+  for (size_t i = 0; i < numHashes; i++) {
+    size_t bit = (hash1 + i * hash2) % numBits;
+    uint64_t mask = (uint64_t) 1 << (bit % kBitsPerWord);
+    atomic<uint64_t>& word = words[bit / kBitsPerWord];
+    if ((word.load(memory_order_relaxed) & mask) != 0) continue;
+    if ((word.fetch_or(mask, memory_order_relaxed) & mask) == 0) numSet++;
+  }
+  if (numSet == 0) return false;
+  numBitsSet.fetch_add(numSet, memory_order_relaxed);
+  return true;
+}
+
+double URLFilter::Stage::falsePositiveRate() const {
+  return pow((double) numBitsSet.load(memory_order_relaxed) / numBits, numHashes);
+}
+
+URLFilter::URLFilter(size_t initialCapacity, double falsePositiveRate, size_t maxBytes) :
+  falsePositiveRate0(falsePositiveRate), maxBytes(maxBytes), numStages(1), numURLs(0),
+  falsePositiveMicros(0), fullStagesMiss(1), saturated(false) {
+  for (size_t i = 0; i < kMaxStages; i++) stages[i].store(nullptr, memory_order_relaxed);
+  stages[0].store(new Stage(max<size_t>(initialCapacity, 1), falsePositiveRate / 2, maxBytes), memory_order_release);
+}
+
+URLFilter::~URLFilter() {
+  for (size_t i = 0; i < kMaxStages; i++) delete stages[i].load(memory_order_relaxed);
+}
+
+bool URLFilter::mightContain(const string& url) const {
+  uint64_t hash1 = hash<string>()(url);
+  uint64_t hash2 = secondHash(hash1);
+  size_t count = numStages.load(memory_order_acquire);
+  for (size_t i = 0; i < count; i++) {
+    if (stages[i].load(memory_order_relaxed)->contains(hash1, hash2)) return true;
+  }
+  return false;
+}
+
+/**
+ * Only the newest stage is ever written to, so the older ones just need
+ * checking first.  Each URL the filter takes adds the chance p that a new
+ * URL would have been turned away at that point to the running total, as
+ * p / (1 - p): the expected number of new URLs turned away for every one
+ * let in.
+ */
+bool URLFilter::insert(const string& url) {
+  uint64_t hash1 = hash<string>()(url);
+  uint64_t hash2 = secondHash(hash1);
+  size_t count = numStages.load(memory_order_acquire);
+  for (size_t i = 0; i + 1 < count; i++) {
+    if (stages[i].load(memory_order_relaxed)->contains(hash1, hash2)) return false;
+  }
+  Stage *newest = stages[count - 1].load(memory_order_relaxed);
+  if (!newest->set(hash1, hash2)) return false;
+
+  double rate = 1 - fullStagesMiss.load(memory_order_relaxed) * (1 - newest->falsePositiveRate());
+  falsePositiveMicros.fetch_add((uint64_t) (rate / (1 - rate) * kMicros), memory_order_relaxed);
+  numURLs.fetch_add(1, memory_order_relaxed);
+  if (newest->count.fetch_add(1, memory_order_relaxed) + 1 >= newest->capacity &&
+      !saturated.load(memory_order_relaxed)) {
+    grow(count);
+  }
+  return true;
+}
+
+/**
+ * Adds a stage after the full one, unless another thread already has, or
+ * the budget won't stretch to it.
+ */
+void URLFilter::grow(size_t full) {
+  lock_guard<mutex> lg(growthLock);
+  if (numStages.load(memory_order_relaxed) != full) return;
+  if (full == kMaxStages) {
+    saturated = true;
+    return;
+  }
+  Stage *last = stages[full - 1].load(memory_order_relaxed);
+  double rate = falsePositiveRate0 / ((size_t) 2 << full);
+  unique_ptr<Stage> next(new Stage(last->capacity * 2, rate, 0));
+  if (maxBytes > 0 && memoryBytes() + next->memoryBytes() > maxBytes) {
+    saturated = true;
+    return;
+  }
+  fullStagesMiss.store(fullStagesMiss.load(memory_order_relaxed) * (1 - last->falsePositiveRate()),
+                       memory_order_relaxed);
+  stages[full].store(next.release(), memory_order_release);
+  numStages.store(full + 1, memory_order_release);
+}
+
+size_t URLFilter::memoryBytes() const {
+  size_t bytes = 0;
+  size_t count = numStages.load(memory_order_acquire);
+  for (size_t i = 0; i < count; i++) bytes += stages[i].load(memory_order_relaxed)->memoryBytes();
+  return bytes;
+}
+
+double URLFilter::falsePositiveRate() const {
+  double allMiss = 1;
+  size_t count = numStages.load(memory_order_acquire);
+  for (size_t i = 0; i < count; i++) allMiss *= 1 - stages[i].load(memory_order_relaxed)->falsePositiveRate();
+  return 1 - allMiss;
+}
+
+double URLFilter::expectedFalsePositives() const {
+  return falsePositiveMicros.load(memory_order_relaxed) / kMicros;
+}
@@ -0,0 +1,104 @@
+/**
+ * File: url-filter.h
+ * ------------------
+ * Defines URLFilter, a scalable Bloom filter (Almeida et al.) over URLs
+ * that any number of threads can insert into and query at once.  It can
+ * say for certain that a URL was never inserted, but only that one
+ * probably was, at a cost of a couple of bytes per URL instead of the
+ * whole string.
+ *
+ * The filter is a series of stages.  Each holds twice as many URLs as the
+ * one before at half the false-positive rate, and a new stage is only
+ * added once the newest one is full, so the overall false-positive rate
+ * stays under the one the filter was built with however many URLs it
+ * ends up holding.  Given a memory budget, the filter stops adding stages
+ * once the next one wouldn't fit, and the newest stage simply keeps
+ * filling up, so the false-positive rate climbs instead of the memory.
+ * expectedFalsePositives tracks how many inserts are likely to have been
+ * wrongly turned away as a result.
+ */
+
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+
+class URLFilter {
+ public:
+  static const size_t kDefaultInitialCapacity = 1 << 16;
+  static constexpr double kDefaultFalsePositiveRate = 0.001;
+
+/**
+ * Constructs an empty filter whose first stage holds initialCapacity URLs,
+ * and whose overall false-positive rate stays under falsePositiveRate for
+ * as long as maxBytes allows (0 meaning no limit).
+ */
+  URLFilter(size_t initialCapacity = kDefaultInitialCapacity,
+            double falsePositiveRate = kDefaultFalsePositiveRate, size_t maxBytes = 0);
+  ~URLFilter();
+
+/**
+ * Returns false if the URL has certainly never been inserted, and true if
+ * it probably has.
+ */
+  bool mightContain(const std::string& url) const;
+
+/**
+ * Inserts the URL, returning true if it certainly wasn't in the filter
+ * before, and false if it probably was.  Two threads inserting the same
+ * URL at the same moment can, rarely, both get true.
+ */
+  bool insert(const std::string& url);
+
+  size_t size() const { return numURLs.load(std::memory_order_relaxed); }
+  size_t getNumStages() const { return numStages.load(std::memory_order_acquire); }
+  size_t memoryBytes() const;
+
+/**
+ * Returns the estimated chance, given how full each stage is, that a URL
+ * that was never inserted is reported as present.
+ */
+  double falsePositiveRate() const;
+
+/**
+ * Returns the expected number of inserts so far that returned false even
+ * though their URL had never been inserted.
+ */
+  double expectedFalsePositives() const;
+
+ private:
+  struct Stage {
+    size_t numBits;
+    size_t numHashes;
+    size_t capacity;
+    std::atomic<size_t> count;
+    std::atomic<size_t> numBitsSet;
+    std::unique_ptr<std::atomic<uint64_t>[]> words;
+
+    Stage(size_t capacity, double falsePositiveRate, size_t maxBytes);
+    bool contains(uint64_t hash1, uint64_t hash2) const;
+    bool set(uint64_t hash1, uint64_t hash2);
+    double falsePositiveRate() const;
+    size_t memoryBytes() const { return numBits / 8; }
+  };
+
+  static const size_t kMaxStages = 32;
+
+  double falsePositiveRate0;
+  size_t maxBytes;
+  std::atomic<Stage *> stages[kMaxStages];
+  std::atomic<size_t> numStages;
+  std::atomic<size_t> numURLs;
+  std::atomic<uint64_t> falsePositiveMicros; // expectedFalsePositives, in millionths
+  std::atomic<double> fullStagesMiss;        // chance a new URL misses every stage but the newest
+  std::atomic<bool> saturated;               // set once the budget rules out another stage
+  std::mutex growthLock;                     // held only while adding a stage
+
+  void grow(size_t full);
+
+  URLFilter(const URLFilter& original) = delete;
+  URLFilter& operator=(const URLFilter& rhs) = delete;
+};
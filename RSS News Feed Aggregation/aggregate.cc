@@ -13,6 +13,10 @@
  * this assignment, the function could very well return a pointer
  * to a subclass instance instead, and that subclass might have 
  * different versions of buildIndex and queryIndex.
+ *
+ * With --daemon, buildIndex leaves a thread behind that keeps
+ * updating the index while it's being searched, which the
+ * aggregator's destructor stops once the user is done.
  */
 
 #include "news-aggregator.h"
@@ -0,0 +1,81 @@
+/**
+ * File: bounded-queue.h
+ * ---------------------
+ * Defines the BoundedQueue class template, a FIFO of at most capacity
+ * items that any number of threads can push onto and pop from.  Pushing
+ * onto a full queue blocks until there's room, which is what lets one
+ * stage of the aggregator's pipeline slow down the stage feeding it
+ * instead of piling up an unbounded amount of work in between.
+ *
+ * Once the producers are done, close() lets the consumers drain what's
+ * left and then see pop() return false, and reopen() readies the queue
+ * for another batch.
+ */
+
+#pragma once
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+template <typename T>
+class BoundedQueue {
+ public:
+  BoundedQueue(size_t capacity) : capacity(capacity), closed(false) {}
+
+/**
+ * Appends the item, first waiting until the queue has fewer than
+ * capacity items in it.
+ */
+  void push(T item) {
+    std::unique_lock<std::mutex> ul(lock);
+    notFull.wait(ul, [this] { return items.size() < capacity; });
+    items.push_back(std::move(item));
+    notEmpty.notify_one();
+  }
+
+/**
+ * Removes the oldest item into item and returns true, first waiting until
+ * there is one.  Returns false, leaving item alone, if the queue is empty
+ * and has been closed.
+ */
+  bool pop(T& item) {
+    std::unique_lock<std::mutex> ul(lock);
+    notEmpty.wait(ul, [this] { return closed || !items.empty(); });
+    if (items.empty()) return false;
+    item = std::move(items.front());
+    items.pop_front();
+    notFull.notify_one();
+    return true;
+  }
+
+/**
+ * Announces that nothing more will be pushed, so that consumers waiting
+ * on an empty queue give up.
+ */
+  void close() {
+    std::lock_guard<std::mutex> lg(lock);
+    closed = true;
+    notEmpty.notify_all();
+  }
+
+/**
+ * Undoes close(), once its consumers are gone, so that the queue can be
+ * used again.
+ */
+  void reopen() {
+    std::lock_guard<std::mutex> lg(lock);
+    closed = false;
+  }
+
+ private:
+  size_t capacity;
+  std::deque<T> items;
+  std::mutex lock;
+  std::condition_variable notFull;
+  std::condition_variable notEmpty;
+  bool closed;
+
+  BoundedQueue(const BoundedQueue& original) = delete;
+  BoundedQueue& operator=(const BoundedQueue& rhs) = delete;
+};
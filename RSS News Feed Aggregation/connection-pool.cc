@@ -0,0 +1,701 @@
+/**
+ * File: connection-pool.cc
+ * ------------------------
+ * Presents the implementation of the ConnectionPool class.
+ */
+
+#include "connection-pool.h"
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <unistd.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+using namespace std;
+
+static const size_t kReadChunkSize = 1 << 14;
+static const size_t kMaxLineLength = 1 << 16;
+static const string kUserAgent = "aggregate/1.0";
+
+static string lowercase(string str) {
+  transform(str.begin(), str.end(), str.begin(), [](unsigned char ch) { return tolower(ch); });
+  return str;
+}
+
+static string trim(const string& str) {
+  size_t start = str.find_first_not_of(" \t");
+  if (start == string::npos) return "";
+  return str.substr(start, str.find_last_not_of(" \t") - start + 1);
+}
+
+static string tlsError() {
+  unsigned long code = ERR_get_error();
+  if (code == 0) return errno != 0 ? strerror(errno) : "connection closed";
+  char message[256];
+  ERR_error_string_n(code, message, sizeof(message));
+  ERR_clear_error();
+  return message;
+}
+
+string HTTPResponse::header(const string& name) const {
+  auto found = headers.find(name);
+  return found == headers.end() ? "" : found->second;
+}
+
+static const chrono::milliseconds kCancelCheckInterval(10);
+
+/**
+ * A nonblocking socket, wrapped in a TLS session for https.  Every read
+ * and write waits (with poll) for the socket to be ready, and throws a
+ * ConnectionException if it's been timeout since the last progress, or
+ * the current request's deadline has passed, or it's been cancelled
+ * (which it checks every kCancelCheckInterval while it waits).
+ */
+class ConnectionPool::Connection {
+ public:
+  chrono::steady_clock::time_point lastUsed;
+
+  Connection(int fd, SSL *ssl, chrono::seconds timeout) :
+    fd(fd), ssl(ssl), timeout(timeout), deadline(chrono::steady_clock::time_point::max()), cancelled(nullptr) {}
+
+/**
+ * OpenSSL takes a TLS connection freed without a shutdown for a broken one
+ * and won't resume its session, so connections that are merely done with
+ * are marked as shut down (without waiting on a close_notify exchange).
+ */
+  ~Connection() {
+    if (ssl != nullptr) {
+      if (SSL_is_init_finished(ssl)) {
+        SSL_set_quiet_shutdown(ssl, 1);
+        SSL_shutdown(ssl);
+      }
+      SSL_free(ssl);
+    }
+    close(fd);
+  }
+
+  void handshake(const string& host) {
+    while (true) {
+      ERR_clear_error();
+      int result = SSL_connect(ssl);
+      if (result == 1) return;
+      if (!retry(SSL_get_error(ssl, result))) {
+        long verified = SSL_get_verify_result(ssl);
+        string reason = verified != X509_V_OK ? X509_verify_cert_error_string(verified) : tlsError();
+        throw ConnectionException("TLS handshake with " + host + " failed: " + reason);
+      }
+    }
+  }
+
+  void write(const string& data) {
+    size_t written = 0;
+    while (written < data.size()) {
+      if (ssl != nullptr) {
+        ERR_clear_error();
+        int result = SSL_write(ssl, data.data() + written, data.size() - written);
+        if (result > 0) written += result;
+        else if (!retry(SSL_get_error(ssl, result))) throw ConnectionException("Write failed: " + tlsError());
+      } else {
+        ssize_t result = send(fd, data.data() + written, data.size() - written, MSG_NOSIGNAL);
+        if (result >= 0) written += result;
+        else if (errno == EAGAIN || errno == EWOULDBLOCK) await(POLLOUT);
+        else if (errno != EINTR) throw ConnectionException(string("Write failed: ") + strerror(errno));
+      }
+    }
+  }
+
+/**
+ * Reads whatever's available (waiting for something if nothing is) into
+ * buffer, returning how many bytes that came to, or 0 once the server has
+ * closed the connection.
+ */
+  size_t read(char *buffer, size_t size) {
+    while (true) {
+      if (ssl != nullptr) {
+        ERR_clear_error();
+        int result = SSL_read(ssl, buffer, size);
+        if (result > 0) return result;
+        int error = SSL_get_error(ssl, result);
+        if (error == SSL_ERROR_ZERO_RETURN) return 0;
+        if (!retry(error)) throw ConnectionException("Read failed: " + tlsError());
+      } else {
+        ssize_t result = recv(fd, buffer, size, 0);
+        if (result >= 0) return result;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) await(POLLIN);
+        else if (errno != EINTR) throw ConnectionException(string("Read failed: ") + strerror(errno));
+      }
+    }
+  }
+
+/**
+ * Sets the deadline and cancellation flag of the request the connection
+ * is carrying (time_point::max() and null for none).
+ */
+  void bound(chrono::steady_clock::time_point deadline, const atomic<bool> *cancelled) {
+    this->deadline = deadline;
+    this->cancelled = cancelled;
+  }
+
+/**
+ * Returns true if the server has closed this (idle) connection, or sent
+ * something on it unasked, either of which rules out reusing it.
+ */
+  bool closedByPeer() const {
+    struct pollfd ready = {fd, POLLIN, 0};
+    return poll(&ready, 1, 0) != 0;
+  }
+
+ private:
+  int fd;
+  SSL *ssl;
+  chrono::seconds timeout;
+  chrono::steady_clock::time_point deadline;
+  const atomic<bool> *cancelled;
+
+  void await(short events) {
+    struct pollfd ready = {fd, events, 0};
+    auto until = min(chrono::steady_clock::now() + timeout, deadline);
+    while (true) {
+      if (cancelled != nullptr && *cancelled) throw ConnectionException("Cancelled");
+      auto now = chrono::steady_clock::now();
+      if (now >= until) throw ConnectionException("Timed out");
+      auto wait = chrono::duration_cast<chrono::milliseconds>(until - now) + chrono::milliseconds(1);
+      if (cancelled != nullptr) wait = min(wait, kCancelCheckInterval);
+      int result = poll(&ready, 1, wait.count());
+      if (result > 0) return;
+      if (result < 0 && errno != EINTR) throw ConnectionException(string("Poll failed: ") + strerror(errno));
+    }
+  }
+
+/**
+ * Waits for the socket if a TLS call says it needs to, returning false if
+ * the call failed for some other reason.
+ */
+  bool retry(int error) {
+    if (error == SSL_ERROR_WANT_READ) await(POLLIN);
+    else if (error == SSL_ERROR_WANT_WRITE) await(POLLOUT);
+    else return false;
+    return true;
+  }
+};
+
+/**
+ * Broken connections should come back as exceptions, not as SIGPIPEs
+ * (which TLS writes can't suppress per call), so the pool ignores SIGPIPE
+ * for the whole process.
+ */
+ConnectionPool::ConnectionPool(size_t maxPerHost, size_t idleSeconds, size_t timeoutSeconds,
+                               TLSSessionCache *sessions, DNSCache *resolver) :
+  maxPerHost(max<size_t>(maxPerHost, 1)), idleTimeout(idleSeconds), timeout(timeoutSeconds),
+  sessions(sessions), resolver(resolver), compression(true), cache(nullptr), numIdle(0), numRequests(0), numConnectionsOpened(0), numReused(0),
+  numStale(0), numEvicted(0), numWaits(0), numCompressed(0), numBytesReceived(0), numBodyBytes(0),
+  transferTime(0), decodeTime(0), lastSweep(chrono::steady_clock::now()) {
+  signal(SIGPIPE, SIG_IGN);
+  SSL_library_init();
+  SSL_load_error_strings();
+  tlsContext = SSL_CTX_new(SSLv23_client_method());
+  if (tlsContext == nullptr) throw runtime_error("Couldn't create TLS context: " + tlsError());
+  long options = SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3;
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+  options |= SSL_OP_IGNORE_UNEXPECTED_EOF;   // plenty of servers just close the socket
+#endif
+  SSL_CTX_set_options(tlsContext, options);
+  SSL_CTX_set_verify(tlsContext, SSL_VERIFY_PEER, NULL);
+  SSL_CTX_set_default_verify_paths(tlsContext);
+  if (sessions != nullptr) sessions->enable(tlsContext);
+}
+
+ConnectionPool::~ConnectionPool() {
+  hosts.clear();
+  SSL_CTX_free(tlsContext);
+}
+
+bool ConnectionPool::trustCertificates(const string& pemFile) {
+  return SSL_CTX_load_verify_locations(tlsContext, pemFile.c_str(), NULL) == 1;
+}
+
+ConnectionPool& ConnectionPool::shared() {
+  static ConnectionPool pool;
+  return pool;
+}
+
+ConnectionPool::Endpoint ConnectionPool::parse(const string& url) {
+  size_t schemeEnd = url.find("://");
+  if (schemeEnd == string::npos) throw runtime_error("Not an absolute URL: " + url);
+  Endpoint endpoint;
+  endpoint.scheme = lowercase(url.substr(0, schemeEnd));
+  if (endpoint.scheme != "http" && endpoint.scheme != "https") throw runtime_error("Unsupported URL: " + url);
+  size_t authorityStart = schemeEnd + 3;
+  size_t authorityEnd = min(url.find_first_of("/?#", authorityStart), url.size());
+  string authority = url.substr(authorityStart, authorityEnd - authorityStart);
+  size_t userEnd = authority.rfind('@');
+  if (userEnd != string::npos) authority = authority.substr(userEnd + 1);
+  size_t colon = authority.rfind(':');
+  if (colon != string::npos && authority.find(']', colon) == string::npos) {
+    endpoint.port = authority.substr(colon + 1);
+    authority = authority.substr(0, colon);
+  }
+  if (authority.size() > 1 && authority.front() == '[' && authority.back() == ']') {
+    authority = authority.substr(1, authority.size() - 2);
+  }
+  if (authority.empty()) throw runtime_error("No host in URL: " + url);
+  endpoint.host = lowercase(authority);
+  if (endpoint.port.empty()) endpoint.port = endpoint.secure() ? "443" : "80";
+  endpoint.target = url.substr(authorityEnd, url.find('#', authorityEnd) - authorityEnd);
+  if (endpoint.target.empty() || endpoint.target[0] != '/') endpoint.target = "/" + endpoint.target;
+  return endpoint;
+}
+
+string ConnectionPool::resolve(const string& base, const string& location) {
+  if (location.find("://") != string::npos) return location;
+  size_t schemeEnd = base.find("://");
+  if (schemeEnd == string::npos) return location;
+  if (location.compare(0, 2, "//") == 0) return base.substr(0, schemeEnd + 1) + location;
+  size_t authorityEnd = min(base.find_first_of("/?#", schemeEnd + 3), base.size());
+  if (!location.empty() && location[0] == '/') return base.substr(0, authorityEnd) + location;
+  size_t pathEnd = min(base.find_first_of("?#", authorityEnd), base.size());
+  size_t directoryEnd = base.rfind('/', pathEnd);
+  if (directoryEnd == string::npos || directoryEnd < authorityEnd) return base.substr(0, authorityEnd) + "/" + location;
+  return base.substr(0, directoryEnd + 1) + location;
+}
+
+string ConnectionPool::origin(const string& url) {
+  return parse(url).key();
+}
+
+/**
+ * Connects to the first of the host's addresses that answers, and for
+ * https, completes a TLS handshake that verifies the server's certificate
+ * against the host name (or address: IP literals are checked against the
+ * certificate's IP addresses, and aren't sent as SNI).
+ */
+unique_ptr<ConnectionPool::Connection> ConnectionPool::connect(const Endpoint& endpoint,
+                                                               chrono::steady_clock::time_point deadline) {
+  vector<DNSCache::Address> addresses = resolver != nullptr ? resolver->resolve(endpoint.host, endpoint.port) :
+                                                              DNSCache::lookup(endpoint.host, endpoint.port);
+  int fd = -1;
+  string error = "no addresses";
+  for (const DNSCache::Address& address : addresses) {
+    fd = socket(address.family, address.socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, address.protocol);
+    if (fd == -1) {
+      error = strerror(errno);
+      continue;
+    }
+    if (::connect(fd, (const struct sockaddr *) &address.address, address.length) == 0) break;
+    if (errno == EINPROGRESS) {
+      struct pollfd ready = {fd, POLLOUT, 0};
+      auto until = min(chrono::steady_clock::now() + timeout, deadline);
+      auto wait = chrono::duration_cast<chrono::milliseconds>(until - chrono::steady_clock::now());
+      int result = poll(&ready, 1, max<long long>(wait.count(), 0));
+      int socketError = 0;
+      socklen_t length = sizeof(socketError);
+      if (result > 0 && getsockopt(fd, SOL_SOCKET, SO_ERROR, &socketError, &length) == 0 && socketError == 0) break;
+      error = result == 0 ? "timed out" : strerror(result > 0 ? socketError : errno);
+    } else {
+      error = strerror(errno);
+    }
+    close(fd);
+    fd = -1;
+  }
+  if (fd == -1) {
+    if (resolver != nullptr) resolver->forget(endpoint.host, endpoint.port);
+    throw ConnectionException("Couldn't connect to " + endpoint.bracketedHost() + ":" + endpoint.port + ": " + error);
+  }
+  int noDelay = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+  if (!endpoint.secure()) return unique_ptr<Connection>(new Connection(fd, nullptr, timeout));
+
+  SSL *ssl = SSL_new(tlsContext);
+  if (ssl == nullptr) {
+    close(fd);
+    throw runtime_error("Couldn't create TLS session: " + tlsError());
+  }
+  unique_ptr<Connection> connection(new Connection(fd, ssl, timeout));
+  connection->bound(deadline, nullptr);
+  SSL_set_fd(ssl, fd);
+  unsigned char address[sizeof(struct in6_addr)];
+  if (inet_pton(AF_INET, endpoint.host.c_str(), address) == 1 || inet_pton(AF_INET6, endpoint.host.c_str(), address) == 1) {
+    X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), endpoint.host.c_str());
+  } else {
+    SSL_set_tlsext_host_name(ssl, endpoint.host.c_str());
+    X509_VERIFY_PARAM_set1_host(SSL_get0_param(ssl), endpoint.host.c_str(), 0);
+    if (sessions != nullptr) sessions->offer(ssl, endpoint.host);
+  }
+  connection->handshake(endpoint.host);
+  if (sessions != nullptr) sessions->noteHandshake(ssl);
+  return connection;
+}
+
+/**
+ * Hands out the key's most recently used idle connection that the server
+ * hasn't closed, or else opens a new one, once the key is under
+ * maxPerHost (or throws, if that's not before the deadline).
+ */
+unique_ptr<ConnectionPool::Connection> ConnectionPool::acquire(const Endpoint& endpoint,
+                                                               chrono::steady_clock::time_point deadline, bool& reused) {
+  lock.lock();
+  evictIdle();
+  Host& host = hosts[endpoint.key()];
+  bool waited = false;
+  while (true) {
+    while (!host.idle.empty()) {
+      unique_ptr<Connection> connection = move(host.idle.back());
+      host.idle.pop_back();
+      numIdle--;
+      if (!connection->closedByPeer()) {
+        numReused++;
+        lock.unlock();
+        reused = true;
+        return connection;
+      }
+      numStale++;
+      host.numOpen--;
+    }
+    if (host.numOpen < maxPerHost) break;
+    if (!waited) numWaits++;
+    waited = true;
+    if (deadline == chrono::steady_clock::time_point::max()) {
+      roomCV.wait(lock);
+    } else if (roomCV.wait_until(lock, deadline) == cv_status::timeout && host.numOpen >= maxPerHost &&
+               host.idle.empty()) {
+      lock.unlock();
+      throw ConnectionException("Timed out waiting for a connection to " + endpoint.host);
+    }
+  }
+  host.numOpen++;
+  numConnectionsOpened++;
+  lock.unlock();
+  reused = false;
+  try {
+    return connect(endpoint, deadline);
+  } catch (...) {
+    release(endpoint, nullptr, false);
+    throw;
+  }
+}
+
+/**
+ * Returns the connection to the pool if it can carry another request, and
+ * closes it (or just gives up its slot, if it's null) otherwise.
+ */
+void ConnectionPool::release(const Endpoint& endpoint, unique_ptr<Connection> connection, bool keepAlive) {
+  lock_guard<mutex> lg(lock);
+  Host& host = hosts[endpoint.key()];
+  if (connection != nullptr && keepAlive && numIdle < kMaxIdleConnections) {
+    connection->lastUsed = chrono::steady_clock::now();
+    connection->bound(chrono::steady_clock::time_point::max(), nullptr);
+    host.idle.push_back(move(connection));
+    numIdle++;
+  } else {
+    host.numOpen--;
+  }
+  roomCV.notify_all();
+}
+
+/**
+ * Closes every connection that's been idle for longer than idleTimeout.
+ * Called with the lock held, it looks at most once a second, since each
+ * key's idle connections are in the order they were last used and
+ * nothing expires much sooner than that anyway.
+ */
+void ConnectionPool::evictIdle() {
+  auto now = chrono::steady_clock::now();
+  if (now - lastSweep < chrono::seconds(1)) return;
+  lastSweep = now;
+  bool evicted = false;
+  for (auto& entry : hosts) {
+    Host& host = entry.second;
+    size_t numExpired = 0;
+    while (numExpired < host.idle.size() && now - host.idle[numExpired]->lastUsed > idleTimeout) numExpired++;
+    if (numExpired == 0) continue;
+    host.idle.erase(host.idle.begin(), host.idle.begin() + numExpired);
+    host.numOpen -= numExpired;
+    numIdle -= numExpired;
+    numEvicted += numExpired;
+    evicted = true;
+  }
+  if (evicted) roomCV.notify_all();
+}
+
+/**
+ * Buffers what's been read from a connection, so that a response can be
+ * consumed a line at a time, and passes body bytes on to out as they
+ * come in rather than collecting them.
+ */
+class ResponseReader {
+ public:
+  ResponseReader(function<size_t(char *, size_t)> read) : read(read), pos(0), numBytesRead(0) {}
+
+  string line() {
+    size_t end;
+    while ((end = buffer.find("\r\n", pos)) == string::npos) {
+      if (buffer.size() - pos > kMaxLineLength) throw runtime_error("Response line too long");
+      if (!fill()) throw ConnectionException("Connection closed partway through the response");
+    }
+    string line = buffer.substr(pos, end - pos);
+    pos = end + 2;
+    return line;
+  }
+
+  void bytes(size_t count, const ContentDecoder::Sink& out) {
+    while (buffer.size() - pos < count) {
+      size_t available = buffer.size() - pos;
+      out(buffer.data() + pos, available);
+      count -= available;
+      buffer.clear();
+      pos = 0;
+      if (!fill()) throw ConnectionException("Connection closed partway through the response");
+    }
+    out(buffer.data() + pos, count);
+    pos += count;
+  }
+
+  void rest(const ContentDecoder::Sink& out) {
+    do {
+      out(buffer.data() + pos, buffer.size() - pos);
+      buffer.clear();
+      pos = 0;
+    } while (fill());
+  }
+
+  bool started() const { return numBytesRead > 0; }
+  size_t getNumBytesRead() const { return numBytesRead; }
+  bool exhausted() const { return pos == buffer.size(); }
+
+ private:
+  function<size_t(char *, size_t)> read;
+  string buffer;
+  size_t pos;
+  size_t numBytesRead;
+
+  bool fill() {
+    if (pos > 0 && pos == buffer.size()) {
+      buffer.clear();
+      pos = 0;
+    }
+    char chunk[kReadChunkSize];
+    size_t count = read(chunk, sizeof(chunk));
+    buffer.append(chunk, count);
+    numBytesRead += count;
+    return count > 0;
+  }
+};
+
+/**
+ * Sends the request and reads the whole response, however its body is
+ * framed: by Content-Length, in chunks, or (for old servers) by closing
+ * the connection.  keepAlive says whether the connection can carry
+ * another request afterwards.
+ *
+ * conditions (extra header lines) go out with the request.  Once the
+ * status line and headers are in, route says where the body should go,
+ * and it gets there through a ContentDecoder.
+ */
+HTTPResponse ConnectionPool::exchange(Connection& connection, const Endpoint& endpoint, const string& conditions,
+                                      const function<BodySink(HTTPResponse& head)>& route, bool& started,
+                                      bool& keepAlive) {
+  string host = endpoint.bracketedHost();
+  if (endpoint.port != (endpoint.secure() ? "443" : "80")) host += ":" + endpoint.port;
+  connection.write("GET " + endpoint.target + " HTTP/1.1\r\n"
+                   "Host: " + host + "\r\n"
+                   "User-Agent: " + kUserAgent + "\r\n"
+                   "Accept: */*\r\n" +
+                   (compression ? "Accept-Encoding: " + ContentDecoder::acceptEncoding() + "\r\n" : "") +
+                   conditions +
+                   "\r\n");
+
+  ResponseReader reader([&connection](char *buffer, size_t size) { return connection.read(buffer, size); });
+  HTTPResponse response;
+  string version;
+  do {
+    string statusLine;
+    try {
+      statusLine = reader.line();
+    } catch (...) {
+      started = reader.started();
+      throw;
+    }
+    started = true;
+    size_t space = statusLine.find(' ');
+    if (statusLine.compare(0, 5, "HTTP/") != 0 || space == string::npos) {
+      throw runtime_error("Malformed status line: " + statusLine);
+    }
+    version = statusLine.substr(5, space - 5);
+    response.status = strtoul(statusLine.c_str() + space + 1, NULL, 10);
+    response.headers.clear();
+    for (string line = reader.line(); !line.empty(); line = reader.line()) {
+      size_t colon = line.find(':');
+      if (colon == string::npos) continue;
+      string name = lowercase(trim(line.substr(0, colon)));
+      string value = trim(line.substr(colon + 1));
+      string& existing = response.headers[name];
+      existing = existing.empty() ? value : existing + ", " + value;
+    }
+  } while (response.status >= 100 && response.status < 200);
+
+  string connectionHeader = lowercase(response.header("connection"));
+  keepAlive = version == "1.0" ? connectionHeader == "keep-alive" : connectionHeader != "close";
+  ContentDecoder decoder(response.header("content-encoding"), route(response));
+  auto decode = [&decoder](const char *data, size_t size) { decoder.write(data, size); };
+  if (response.status == 204 || response.status == 304) {
+    // no body
+  } else if (lowercase(response.header("transfer-encoding")).find("chunked") != string::npos) {
+    while (true) {
+      size_t size = strtoul(reader.line().c_str(), NULL, 16);
+      if (size == 0) break;
+      reader.bytes(size, decode);
+      reader.line();
+    }
+    while (!reader.line().empty()); // trailers
+  } else if (!response.header("content-length").empty()) {
+    reader.bytes(strtoul(response.header("content-length").c_str(), NULL, 10), decode);
+  } else {
+    reader.rest(decode);
+    keepAlive = false;
+  }
+  decoder.finish();
+  if (!reader.exhausted()) keepAlive = false;
+  response.numBytesReceived = reader.getNumBytesRead();
+  response.numBodyBytes = decoder.getNumBytesOut();
+  response.decodeTime = decoder.getDecodeTime();
+  return response;
+}
+
+HTTPResponse ConnectionPool::get(const string& url) {
+  return get(url, BodySink());
+}
+
+HTTPResponse ConnectionPool::get(const string& url, const BodySink& sink) {
+  return get(url, sink, RequestOptions());
+}
+
+/**
+ * The body of a 2xx response goes to the sink, if there is one, and any
+ * other body into the response.  On the way, a 200 that the cache will
+ * take is copied into a Store, which is committed once the whole body is
+ * in.
+ */
+HTTPResponse ConnectionPool::get(const string& url, const BodySink& sink, const RequestOptions& options) {
+  Endpoint endpoint = parse(url);
+  auto start = chrono::steady_clock::now();
+  auto deadline = options.timeout.count() > 0 ? start + options.timeout : chrono::steady_clock::time_point::max();
+  const HTTPValidators& validators = options.validators;
+  unique_ptr<HTTPCache::Hit> hit = cache != nullptr && validators.empty() ? cache->lookup(url) : nullptr;
+  if (hit != nullptr && hit->fresh) {
+    HTTPResponse response;
+    serveCached(*hit, sink, response);
+    account(response, start);
+    return response;
+  }
+  lock.lock();
+  numRequests++;
+  lock.unlock();
+  string conditions = hit != nullptr ? hit->validators.conditions() : validators.conditions();
+  unique_ptr<HTTPCache::Store> store;
+  auto route = [this, &url, &sink, &store](HTTPResponse& head) -> BodySink {
+    BodySink deliver = sink;
+    if (!sink || head.status < 200 || head.status >= 300) {
+      deliver = [&head](const char *data, size_t size) { head.body.append(data, size); };
+    }
+    if (cache != nullptr && head.status == 200) store = cache->store(url, head.headers);
+    if (store == nullptr) return deliver;
+    HTTPCache::Store *copy = store.get();
+    return [copy, deliver](const char *data, size_t size) {
+      copy->write(data, size);
+      deliver(data, size);
+    };
+  };
+  while (true) {
+    bool reused;
+    unique_ptr<Connection> connection = acquire(endpoint, deadline, reused);
+    connection->bound(deadline, options.cancelled);
+    bool started = false;
+    bool keepAlive = false;
+    try {
+      HTTPResponse response = exchange(*connection, endpoint, conditions, route, started, keepAlive);
+      release(endpoint, move(connection), keepAlive);
+      if (store != nullptr) cache->commit(move(store));
+      if (response.status == 304 && hit != nullptr) {
+        cache->refresh(url, response.headers);
+        serveCached(*hit, sink, response);
+      }
+      account(response, start);
+      return response;
+    } catch (const ConnectionException& ce) {
+      release(endpoint, move(connection), false);
+      if (!reused || started) throw;
+      lock_guard<mutex> lg(lock);
+      numStale++;
+    } catch (...) {
+      release(endpoint, move(connection), false);
+      throw;
+    }
+  }
+}
+
+/**
+ * Turns response (a 304, or a blank one for a fresh hit) into the cached
+ * 200, handing its body to the sink if there is one.  The hit's
+ * validators stand in for any the response doesn't carry.
+ */
+void ConnectionPool::serveCached(HTTPCache::Hit& hit, const BodySink& sink, HTTPResponse& response) {
+  response.status = 200;
+  response.fromCache = true;
+  if (response.header("etag").empty() && !hit.validators.etag.empty()) response.headers["etag"] = hit.validators.etag;
+  if (response.header("last-modified").empty() && !hit.validators.lastModified.empty()) {
+    response.headers["last-modified"] = hit.validators.lastModified;
+  }
+  response.body.clear();
+  HTTPCache::read(hit, sink ? sink : [&response](const char *data, size_t size) { response.body.append(data, size); });
+  response.numBodyBytes = hit.size;
+}
+
+void ConnectionPool::account(HTTPResponse& response, chrono::steady_clock::time_point start) {
+  response.elapsed = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start);
+  lock_guard<mutex> lg(lock);
+  string coding = lowercase(response.header("content-encoding"));
+  if (response.numBodyBytes > 0 && !coding.empty() && coding != "identity") numCompressed++;
+  numBytesReceived += response.numBytesReceived;
+  numBodyBytes += response.numBodyBytes;
+  transferTime += response.elapsed;
+  decodeTime += response.decodeTime;
+}
+
+size_t ConnectionPool::getNumRequests() const {
+  lock_guard<mutex> lg(lock);
+  return numRequests;
+}
+
+size_t ConnectionPool::getNumConnectionsOpened() const {
+  lock_guard<mutex> lg(lock);
+  return numConnectionsOpened;
+}
+
+size_t ConnectionPool::getNumBytesReceived() const {
+  lock_guard<mutex> lg(lock);
+  return numBytesReceived;
+}
+
+void ConnectionPool::printStats(ostream& out) const {
+  lock_guard<mutex> lg(lock);
+  out << "Connections: " << numRequests << " requests over " << numConnectionsOpened << " connections ("
+      << numReused << " reuses, " << numStale << " closed by the server while pooled, " << numEvicted
+      << " closed idle, " << numWaits << " waits for a free slot)." << endl;
+  out << "Transfer: " << numBytesReceived << " bytes received for " << numBodyBytes << " bytes of content ("
+      << numCompressed << " responses compressed), " << transferTime.count() / 1000 << "ms in requests, "
+      << decodeTime.count() / 1000 << "ms of that decompressing." << endl;
+  if (sessions != nullptr) sessions->printStats(out);
+  if (resolver != nullptr) resolver->printStats(out);
+  if (cache != nullptr) cache->printStats(out);
+}
@@ -0,0 +1,247 @@
+/**
+ * File: connection-pool.h
+ * -----------------------
+ * Defines the ConnectionPool class, which performs HTTP and HTTPS GETs
+ * over persistent HTTP/1.1 connections, so that downloading many
+ * documents from the same server pays for one TCP connection (and, for
+ * HTTPS, one TLS handshake) instead of one per document.
+ *
+ * Connections are keyed by scheme, host and port.  Once a response has
+ * been read in full, its connection goes back to the pool (unless either
+ * side asked for it to be closed) for the next request to the same key to
+ * pick up.  Idle connections are closed once they've sat unused for the
+ * pool's idle timeout, or if the server closes them first.  No more than
+ * maxPerHost connections to any one key are ever open at once; a request
+ * that would need another waits for one to come free.
+ *
+ * Any number of threads may call get at once.  Each request has a
+ * connection to itself for as long as it runs, and can be given a
+ * deadline of its own, or be called off from another thread (see
+ * RequestOptions).
+ *
+ * New https connections offer the session their TLSSessionCache holds
+ * for the host, so that even a connection the pool couldn't reuse can
+ * usually skip the full handshake.  Host names are resolved through a
+ * DNSCache, so new connections to a host don't each look it up again.
+ *
+ * Requests ask for compressed bodies (see ContentDecoder), which are
+ * decompressed as they arrive, and every response reports how many bytes
+ * it took on the wire and how long it took.
+ *
+ * A pool given an HTTPCache serves what it can from there, and stores
+ * what it can there.
+ */
+
+#pragma once
+#include <cstddef>
+#include <string>
+#include <map>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <ostream>
+#include <stdexcept>
+#include "tls-session-cache.h"
+#include "dns-cache.h"
+#include "content-decoder.h"
+#include "http-cache.h"
+
+struct ssl_ctx_st;
+
+/**
+ * Thrown when a connection can't be made, or breaks or times out partway
+ * through a request: failures that point at the server (or the network
+ * to it) being in trouble, rather than at the request itself.
+ */
+class ConnectionException: public std::runtime_error {
+ public:
+  ConnectionException(const std::string& message) : std::runtime_error(message) {}
+};
+
+struct HTTPResponse {
+  unsigned int status;
+  std::map<std::string, std::string> headers;  // keyed by lowercased name
+  std::string body;                            // decoded; left empty if it went to a BodySink
+  size_t numBytesReceived = 0;                 // off the wire, headers and (still compressed) body
+  size_t numBodyBytes = 0;                     // in the body once decoded
+  std::chrono::microseconds elapsed{0};        // from asking for a connection to the last byte
+  std::chrono::microseconds decodeTime{0};     // of elapsed, how much went into decompressing
+  bool fromCache = false;                      // whether the body came from an HTTPCache
+
+/**
+ * Returns the value of the named header (named in lowercase), or the
+ * empty string if the response doesn't have one.
+ */
+  std::string header(const std::string& name) const;
+};
+
+/**
+ * Per-request settings for ConnectionPool::get.
+ */
+struct RequestOptions {
+  HTTPValidators validators;                     // makes the request conditional (see get)
+  std::chrono::milliseconds timeout{0};          // for the whole request, or 0 for none beyond the pool's
+  const std::atomic<bool> *cancelled = nullptr;  // once true, the request gives up with a ConnectionException
+};
+
+class ConnectionPool {
+ public:
+  static const size_t kDefaultMaxPerHost = 16;
+  static const size_t kDefaultIdleSeconds = 30;
+  static const size_t kDefaultTimeoutSeconds = 20;
+
+  typedef ContentDecoder::Sink BodySink;
+
+/**
+ * Constructs a pool that keeps at most maxPerHost connections open to any
+ * one scheme, host and port, closes connections that have been idle for
+ * idleSeconds, and gives up on a connection that makes no progress for
+ * timeoutSeconds.  TLS sessions are saved to and resumed from sessions,
+ * and host names resolved through resolver, unless they're null.
+ */
+  ConnectionPool(size_t maxPerHost = kDefaultMaxPerHost, size_t idleSeconds = kDefaultIdleSeconds,
+                 size_t timeoutSeconds = kDefaultTimeoutSeconds,
+                 TLSSessionCache *sessions = &TLSSessionCache::shared(),
+                 DNSCache *resolver = &DNSCache::shared());
+  ~ConnectionPool();
+
+/**
+ * Returns the pool shared by every client that isn't handed one of its
+ * own.
+ */
+  static ConnectionPool& shared();
+
+/**
+ * Sends a GET for the specified http or https URL and returns the
+ * response, whatever its status.  Redirects are not followed.  Throws a
+ * ConnectionException if the connection fails, and a runtime_error if the
+ * URL can't be handled or the response can't be understood.
+ *
+ * A request sent on a pooled connection that turns out to have been
+ * closed by the server is quietly resent on a new one.
+ *
+ * With a cache, a fresh cached response is returned without going to the
+ * network at all (and with fromCache set), and a stale one is revalidated
+ * with a conditional request, whose 304 is returned as the cached 200.
+ */
+  HTTPResponse get(const std::string& url);
+
+/**
+ * Like get, except that the (decoded) body of a 2xx response is handed to
+ * sink a piece at a time as it arrives, instead of being collected in the
+ * response.  Other responses' bodies are collected as usual.
+ */
+  HTTPResponse get(const std::string& url, const BodySink& sink);
+
+/**
+ * Like get with a sink, with the specified options.  With validators, the
+ * request is conditional on the response having changed since it carried
+ * them, and a 304 comes back as a 304; the cache isn't consulted (the
+ * caller is its own cache), but a 200 is still stored there.  A request
+ * that runs past its timeout, or is cancelled, throws a
+ * ConnectionException.
+ */
+  HTTPResponse get(const std::string& url, const BodySink& sink, const RequestOptions& options);
+
+/**
+ * Turns asking for compressed bodies on (as it starts out) or off.  Only
+ * meant to be called before the pool is put to use.
+ */
+  void requestCompression(bool enabled) { compression = enabled; }
+
+/**
+ * Has the pool go through the specified cache (or none, if it's null).
+ * Only meant to be called before the pool is put to use.
+ */
+  void useCache(HTTPCache *cache) { this->cache = cache; }
+
+/**
+ * Resolves a Location header against the URL of the response it came
+ * with, so that relative redirects can be followed.
+ */
+  static std::string resolve(const std::string& base, const std::string& location);
+
+/**
+ * Returns the URL's origin, as scheme://host:port (the key its
+ * connections are pooled under), or throws a runtime_error if the URL
+ * can't be handled.
+ */
+  static std::string origin(const std::string& url);
+
+/**
+ * Trusts the certificates in the specified PEM file, on top of the
+ * system's, when verifying servers.  Returns false if the file can't be
+ * loaded.
+ */
+  bool trustCertificates(const std::string& pemFile);
+
+  size_t getNumRequests() const;
+  size_t getNumConnectionsOpened() const;
+  size_t getNumBytesReceived() const;
+  void printStats(std::ostream& out) const;
+
+ private:
+  class Connection;
+  struct Endpoint {
+    std::string scheme;
+    std::string host;
+    std::string port;
+    std::string target;   // the path and query to request
+
+    bool secure() const { return scheme == "https"; }
+    // the host as a URL or Host header writes it, with IPv6 literals in brackets
+    std::string bracketedHost() const { return host.find(':') != std::string::npos ? "[" + host + "]" : host; }
+    std::string key() const { return scheme + "://" + bracketedHost() + ":" + port; }
+  };
+
+  struct Host {
+    std::vector<std::unique_ptr<Connection>> idle;  // least recently used first
+    size_t numOpen = 0;                             // idle or in use
+  };
+
+  static const size_t kMaxIdleConnections = 256;    // across every host
+
+  size_t maxPerHost;
+  std::chrono::seconds idleTimeout;
+  std::chrono::seconds timeout;
+  ssl_ctx_st *tlsContext;
+  TLSSessionCache *sessions;
+  DNSCache *resolver;
+  bool compression;
+  HTTPCache *cache;
+
+  mutable std::mutex lock;                          // guards everything below
+  std::condition_variable_any roomCV;
+  std::map<std::string, Host> hosts;
+  size_t numIdle;
+  size_t numRequests;
+  size_t numConnectionsOpened;
+  size_t numReused;
+  size_t numStale;                                  // pooled connections the server had closed
+  size_t numEvicted;                                // closed for sitting idle too long
+  size_t numWaits;                                  // requests that waited for room under maxPerHost
+  size_t numCompressed;                             // responses that came compressed
+  size_t numBytesReceived;
+  size_t numBodyBytes;
+  std::chrono::microseconds transferTime;           // summed over every request
+  std::chrono::microseconds decodeTime;
+  std::chrono::steady_clock::time_point lastSweep;  // when evictIdle last looked for expired connections
+
+  static Endpoint parse(const std::string& url);
+  std::unique_ptr<Connection> acquire(const Endpoint& endpoint, std::chrono::steady_clock::time_point deadline,
+                                      bool& reused);
+  std::unique_ptr<Connection> connect(const Endpoint& endpoint, std::chrono::steady_clock::time_point deadline);
+  void release(const Endpoint& endpoint, std::unique_ptr<Connection> connection, bool keepAlive);
+  void evictIdle();
+  HTTPResponse exchange(Connection& connection, const Endpoint& endpoint, const std::string& conditions,
+                        const std::function<BodySink(HTTPResponse& head)>& route, bool& started, bool& keepAlive);
+  void serveCached(HTTPCache::Hit& hit, const BodySink& sink, HTTPResponse& response);
+  void account(HTTPResponse& response, std::chrono::steady_clock::time_point start);
+
+  ConnectionPool(const ConnectionPool& original) = delete;
+  ConnectionPool& operator=(const ConnectionPool& rhs) = delete;
+};
@@ -0,0 +1,148 @@
+/**
+ * File: content-decoder.cc
+ * ------------------------
+ * Presents the implementation of the ContentDecoder class.
+ */
+
+#include "content-decoder.h"
+#include <algorithm>
+#include <cctype>
+#include <zlib.h>
+#ifdef HAVE_BROTLI
+#include <brotli/decode.h>
+#endif
+using namespace std;
+
+static const size_t kOutputChunkSize = 1 << 14;
+
+const string& ContentDecoder::acceptEncoding() {
+#ifdef HAVE_BROTLI
+  static const string codings = "gzip, deflate, br";
+#else
+  static const string codings = "gzip, deflate";
+#endif
+  return codings;
+}
+
+ContentDecoder::ContentDecoder(const string& contentEncoding, const Sink& sink) :
+  coding(kIdentity), sink(sink), zlib(nullptr), brotli(nullptr), started(false), ended(false),
+  numBytesIn(0), numBytesOut(0), decodeTime(0) {
+  string name = contentEncoding;
+  transform(name.begin(), name.end(), name.begin(), [](unsigned char ch) { return tolower(ch); });
+  name.erase(0, name.find_first_not_of(" \t"));
+  name.erase(name.find_last_not_of(" \t") + 1);
+  if (name.empty() || name == "identity") return;
+  if (name == "gzip" || name == "x-gzip") coding = kGzip;
+  else if (name == "deflate") coding = kDeflate;
+#ifdef HAVE_BROTLI
+  else if (name == "br") coding = kBrotli;
+#endif
+  else throw runtime_error("Unsupported Content-Encoding: " + contentEncoding);
+
+  if (coding == kBrotli) {
+#ifdef HAVE_BROTLI
+    brotli = BrotliDecoderCreateInstance(NULL, NULL, NULL);
+    if (brotli == nullptr) throw runtime_error("Couldn't create a brotli decoder");
+#endif
+    return;
+  }
+  zlib = new z_stream;
+  zlib->zalloc = Z_NULL;
+  zlib->zfree = Z_NULL;
+  zlib->opaque = Z_NULL;
+  zlib->next_in = Z_NULL;
+  zlib->avail_in = 0;
+  if (inflateInit2(zlib, coding == kGzip ? MAX_WBITS + 16 : MAX_WBITS) != Z_OK) {
+    delete zlib;
+    throw runtime_error("Couldn't create a zlib decoder");
+  }
+}
+
+ContentDecoder::~ContentDecoder() {
+  if (zlib != nullptr) {
+    inflateEnd(zlib);
+    delete zlib;
+  }
+#ifdef HAVE_BROTLI
+  if (brotli != nullptr) BrotliDecoderDestroyInstance(brotli);
+#endif
+}
+
+void ContentDecoder::write(const char *data, size_t size) {
+  if (size == 0) return;
+  numBytesIn += size;
+  if (coding == kIdentity) {
+    numBytesOut += size;
+    sink(data, size);
+  } else if (!ended) {
+    if (coding == kBrotli) decompressBrotli(data, size);
+    else inflate(data, size);
+  }
+  started = true;
+}
+
+/**
+ * Anything after the end of the compressed stream is ignored, as browsers
+ * do.
+ */
+void ContentDecoder::finish() {
+  if (compressed() && started && !ended) throw runtime_error("Compressed body was cut short");
+}
+
+/**
+ * A deflate body whose very first bytes aren't a zlib header is taken for
+ * a raw deflate stream, and decoding starts over as one.
+ */
+void ContentDecoder::inflate(const char *data, size_t size) {
+  zlib->next_in = (Bytef *) data;
+  zlib->avail_in = size;
+  bool retried = false;
+  do {
+    char out[kOutputChunkSize];
+    zlib->next_out = (Bytef *) out;
+    zlib->avail_out = sizeof(out);
+    auto start = chrono::steady_clock::now();
+    int status = ::inflate(zlib, Z_NO_FLUSH);
+    decodeTime += chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start);
+    if (status == Z_DATA_ERROR && coding == kDeflate && !started && !retried && numBytesOut == 0) {
+      inflateReset2(zlib, -MAX_WBITS);
+      zlib->next_in = (Bytef *) data;
+      zlib->avail_in = size;
+      retried = true;
+      continue;
+    }
+    if (status == Z_STREAM_END) ended = true;
+    else if (status != Z_OK && status != Z_BUF_ERROR) {
+      throw runtime_error(string("Malformed compressed body: ") + (zlib->msg != NULL ? zlib->msg : "zlib error"));
+    }
+    size_t produced = sizeof(out) - zlib->avail_out;
+    numBytesOut += produced;
+    if (produced > 0) sink(out, produced);
+  } while (!ended && (zlib->avail_in > 0 || zlib->avail_out == 0));
+}
+
+void ContentDecoder::decompressBrotli(const char *data, size_t size) {
+#ifdef HAVE_BROTLI
+  const uint8_t *nextIn = (const uint8_t *) data;
+  size_t availableIn = size;
+  while (true) {
+    uint8_t out[kOutputChunkSize];
+    uint8_t *nextOut = out;
+    size_t availableOut = sizeof(out);
+    auto start = chrono::steady_clock::now();
+    BrotliDecoderResult result = BrotliDecoderDecompressStream(brotli, &availableIn, &nextIn, &availableOut, &nextOut, NULL);
+    decodeTime += chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start);
+    if (result == BROTLI_DECODER_RESULT_ERROR) {
+      throw runtime_error(string("Malformed compressed body: ") + BrotliDecoderErrorString(BrotliDecoderGetErrorCode(brotli)));
+    }
+    size_t produced = sizeof(out) - availableOut;
+    numBytesOut += produced;
+    if (produced > 0) sink((const char *) out, produced);
+    if (result == BROTLI_DECODER_RESULT_SUCCESS) {
+      ended = true;
+      return;
+    }
+    if (result == BROTLI_DECODER_RESULT_NEEDS_MORE_INPUT) return;
+  }
+#endif
+}
@@ -0,0 +1,83 @@
+/**
+ * File: content-decoder.h
+ * -----------------------
+ * Defines the ContentDecoder class, which undoes an HTTP Content-Encoding
+ * (gzip, deflate, or when built with HAVE_BROTLI, br) as the body
+ * arrives: each piece read off the connection is decompressed on the spot
+ * and handed to a sink, so neither the compressed body nor (if the sink
+ * is a parser) the decompressed one is ever held in full.
+ *
+ * "deflate" is meant to be zlib-wrapped, but plenty of servers send the
+ * raw stream instead, so both are accepted.
+ */
+
+#pragma once
+#include <cstddef>
+#include <string>
+#include <functional>
+#include <chrono>
+#include <stdexcept>
+
+struct z_stream_s;
+struct BrotliDecoderStateStruct;
+
+class ContentDecoder {
+ public:
+  typedef std::function<void(const char *data, size_t size)> Sink;
+
+/**
+ * Returns the codings this build can decode, in the form an
+ * Accept-Encoding header wants.
+ */
+  static const std::string& acceptEncoding();
+
+/**
+ * Constructs a decoder for the specified Content-Encoding header value
+ * (an empty one, or "identity", passes bytes straight through) that
+ * delivers what it decodes to sink.  Throws a runtime_error if the coding
+ * isn't one it knows.
+ */
+  ContentDecoder(const std::string& contentEncoding, const Sink& sink);
+  ~ContentDecoder();
+
+/**
+ * Decodes the next size bytes of the body.  Throws a runtime_error if
+ * they don't decode.
+ */
+  void write(const char *data, size_t size);
+
+/**
+ * Checks that the body ended where its compressed stream did, throwing a
+ * runtime_error if it was cut short.
+ */
+  void finish();
+
+  size_t getNumBytesIn() const { return numBytesIn; }
+  size_t getNumBytesOut() const { return numBytesOut; }
+  bool compressed() const { return coding != kIdentity; }
+
+/**
+ * Returns how long has gone into decompressing, not counting the time the
+ * sink took over what it was handed.
+ */
+  std::chrono::microseconds getDecodeTime() const { return decodeTime; }
+
+ private:
+  enum Coding { kIdentity, kGzip, kDeflate, kBrotli };
+
+  Coding coding;
+  Sink sink;
+  z_stream_s *zlib;
+  BrotliDecoderStateStruct *brotli;
+  bool started;              // whether any input has arrived yet
+  bool ended;                // whether the compressed stream has ended
+  size_t numBytesIn;
+  size_t numBytesOut;
+  std::chrono::microseconds decodeTime;
+
+  void inflate(const char *data, size_t size);
+  void decompressBrotli(const char *data, size_t size);
+
+  ContentDecoder(const ContentDecoder& original) = delete;
+  ContentDecoder& operator=(const ContentDecoder& rhs) = delete;
+};
@@ -0,0 +1,92 @@
+/**
+ * File: cpbench.cc
+ * ----------------
+ * Measures what the ConnectionPool saves by downloading a batch of
+ * documents from a StandInServer, first with the server closing every
+ * connection after one reply (which is what a fresh client per request,
+ * as HTMLDocument and RSSFeed used to create, amounts to), and then with
+ * the server keeping connections alive for the pool to reuse.
+ *
+ * Both runs are repeated with the stand-in waiting kSetupMillis before
+ * serving each new connection, which stands in for the round trips a real
+ * server's TCP and TLS handshakes cost, since over loopback they're close
+ * to free.
+ *
+ * Usage: ./cpbench [<number of downloads>]
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include "connection-pool.h"
+#include "stand-in-server.h"
+using namespace std;
+
+static const size_t kDefaultDownloads = 2000;
+static const size_t kNumThreads = 8;       // downloads in flight at once, as to one server
+static const size_t kDocumentBytes = 24 << 10;
+static const size_t kSetupMillis = 5;
+
+struct Result {
+  double millis;
+  size_t numConnections;
+};
+
+static Result run(size_t numDownloads, bool keepAlive, size_t setupMillis) {
+  string document(kDocumentBytes, 'x');
+  StandInServer::Options options;
+  options.keepAlive = keepAlive;
+  options.acceptDelay = chrono::milliseconds(setupMillis);
+  StandInServer server([&document](const StandInServer::Request& request) {
+    StandInServer::Reply reply;
+    reply.body = document;
+    return reply;
+  }, options);
+
+  ConnectionPool pool;
+  atomic<size_t> next(0);
+  atomic<size_t> numFailed(0);
+  vector<thread> threads;
+  auto start = chrono::steady_clock::now();
+  for (size_t i = 0; i < kNumThreads; i++) {
+    threads.push_back(thread([&] {
+      for (size_t download = next++; download < numDownloads; download = next++) {
+        try {
+          HTTPResponse response = pool.get(server.url("/article-" + to_string(download) + ".html"));
+          if (response.body.size() != kDocumentBytes) numFailed++;
+        } catch (const exception& e) {
+          numFailed++;
+        }
+      }
+    }));
+  }
+  for (thread& t : threads) t.join();
+  double millis = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+  if (numFailed > 0) {
+    cerr << numFailed << " downloads failed!" << endl;
+    exit(1);
+  }
+  return {millis, server.getNumConnections()};
+}
+
+int main(int argc, char *argv[]) {
+  size_t numDownloads = argc > 1 ? strtoul(argv[1], NULL, 10) : kDefaultDownloads;
+  cout << numDownloads << " downloads of " << (kDocumentBytes >> 10) << "KB from one server, "
+       << kNumThreads << " at a time:" << endl;
+  cout << setw(12) << "setup ms" << setw(14) << "connections" << setw(12) << "total ms" << setw(16)
+       << "downloads/sec" << endl;
+  for (size_t setupMillis : {(size_t) 0, kSetupMillis}) {
+    for (bool keepAlive : {false, true}) {
+      Result result = run(numDownloads, keepAlive, setupMillis);
+      cout << setw(12) << setupMillis << setw(14) << result.numConnections << setw(12) << fixed
+           << setprecision(0) << result.millis << setw(16) << numDownloads / result.millis * 1000
+           << (keepAlive ? "   (pooled)" : "   (new connection each)") << endl;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,159 @@
+/**
+ * File: dns-cache.cc
+ * ------------------
+ * Presents the implementation of the DNSCache class.
+ */
+
+#include "dns-cache.h"
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <netdb.h>
+using namespace std;
+
+DNSCache::DNSCache(size_t ttlSeconds, size_t negativeTTLSeconds, size_t maxHosts) :
+  ttl(ttlSeconds), negativeTTL(negativeTTLSeconds), maxHosts(max<size_t>(maxHosts, 1)), numLookups(0),
+  numHits(0), numNegativeHits(0), numCoalesced(0), numForgotten(0), lookupTime(0) {}
+
+DNSCache& DNSCache::shared() {
+  static DNSCache cache;
+  return cache;
+}
+
+int DNSCache::query(const string& host, const string& port, vector<Address>& addresses) {
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  struct addrinfo *results;
+  int status = getaddrinfo(host.c_str(), port.c_str(), &hints, &results);
+  if (status != 0) return status;
+  for (struct addrinfo *result = results; result != NULL; result = result->ai_next) {
+    Address address;
+    address.family = result->ai_family;
+    address.socktype = result->ai_socktype;
+    address.protocol = result->ai_protocol;
+    address.length = min<socklen_t>(result->ai_addrlen, sizeof(address.address));
+    memcpy(&address.address, result->ai_addr, address.length);
+    addresses.push_back(address);
+  }
+  freeaddrinfo(results);
+  return 0;
+}
+
+string DNSCache::describe(const string& host, int status) {
+  return "Couldn't resolve " + host + ": " + gai_strerror(status);
+}
+
+vector<DNSCache::Address> DNSCache::lookup(const string& host, const string& port) {
+  vector<Address> addresses;
+  int status = query(host, port, addresses);
+  if (status != 0) throw runtime_error(describe(host, status));
+  return addresses;
+}
+
+/**
+ * Only answers that the name doesn't exist (or has no addresses) are
+ * remembered as failures; anything else might not happen again.
+ */
+static bool definite(int status) {
+  return status == EAI_NONAME || status == EAI_FAIL
+#ifdef EAI_NODATA
+         || status == EAI_NODATA
+#endif
+         ;
+}
+
+vector<DNSCache::Address> DNSCache::resolve(const string& host, const string& port) {
+  string key = host + ":" + port;
+  unique_lock<mutex> ul(lock);
+  bool waited = false;
+  while (true) {
+    auto found = hosts.find(key);
+    if (found == hosts.end()) break;
+    Entry& entry = found->second;
+    if (entry.pending) {
+      waited = true;
+      resolved.wait(ul);
+      continue;
+    }
+    if (entry.expires <= chrono::steady_clock::now()) {
+      hosts.erase(found);
+      break;
+    }
+    numHits++;
+    if (waited) numCoalesced++;
+    if (entry.addresses.empty()) {
+      numNegativeHits++;
+      throw runtime_error(entry.error);
+    }
+    return entry.addresses;
+  }
+
+  if (hosts.size() >= maxHosts) evictExpired(chrono::steady_clock::now());
+  hosts[key].pending = true;
+  numLookups++;
+  ul.unlock();
+  vector<Address> addresses;
+  auto start = chrono::steady_clock::now();
+  int status = query(host, port, addresses);
+  auto now = chrono::steady_clock::now();
+  ul.lock();
+  lookupTime += chrono::duration_cast<chrono::microseconds>(now - start);
+  Entry& entry = hosts[key];
+  entry.pending = false;
+  if (status == 0) {
+    entry.addresses = addresses;
+    entry.expires = now + ttl;
+  } else if (definite(status) && negativeTTL.count() > 0) {
+    entry.error = describe(host, status);
+    entry.expires = now + negativeTTL;
+  } else {
+    hosts.erase(key);
+  }
+  resolved.notify_all();
+  if (status != 0) throw runtime_error(describe(host, status));
+  return addresses;
+}
+
+void DNSCache::forget(const string& host, const string& port) {
+  lock_guard<mutex> lg(lock);
+  auto found = hosts.find(host + ":" + port);
+  if (found == hosts.end() || found->second.pending) return;
+  hosts.erase(found);
+  numForgotten++;
+}
+
+/**
+ * Drops every expired entry, and if that doesn't make room, whichever
+ * settled entry comes first.
+ */
+void DNSCache::evictExpired(chrono::steady_clock::time_point now) {
+  for (auto entry = hosts.begin(); entry != hosts.end();) {
+    if (!entry->second.pending && entry->second.expires <= now) entry = hosts.erase(entry);
+    else ++entry;
+  }
+  for (auto entry = hosts.begin(); hosts.size() >= maxHosts && entry != hosts.end();) {
+    if (!entry->second.pending) entry = hosts.erase(entry);
+    else ++entry;
+  }
+}
+
+size_t DNSCache::getNumLookups() const {
+  lock_guard<mutex> lg(lock);
+  return numLookups;
+}
+
+size_t DNSCache::getNumHits() const {
+  lock_guard<mutex> lg(lock);
+  return numHits;
+}
+
+void DNSCache::printStats(ostream& out) const {
+  lock_guard<mutex> lg(lock);
+  double average = numLookups > 0 ? lookupTime.count() / 1000.0 / numLookups : 0;
+  out << "DNS: " << numLookups << " lookups taking " << lookupTime.count() / 1000 << "ms, " << numHits
+      << " answered from the cache (" << numNegativeHits << " remembered failures, " << numCoalesced
+      << " shared with a lookup under way), saving about " << (size_t) (average * numHits) << "ms; "
+      << numForgotten << " hosts forgotten after failing to connect." << endl;
+}
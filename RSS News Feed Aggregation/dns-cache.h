@@ -0,0 +1,105 @@
+/**
+ * File: dns-cache.h
+ * -----------------
+ * Defines the DNSCache class, which remembers what each host (and port)
+ * resolved to, so that the connections every download opens don't each
+ * pay for a lookup of their own.  getaddrinfo doesn't report the records'
+ * TTLs, so answers are kept for a fixed ttlSeconds; failures to resolve a
+ * name that doesn't exist are kept too, for negativeTTLSeconds, so that a
+ * feed full of links to a dead domain fails fast instead of asking again
+ * for every one.  Failures that may well be gone the next time (the
+ * resolver being unreachable, say) aren't kept at all.
+ *
+ * Lookups of a host that's already being looked up wait for that lookup's
+ * answer instead of sending the same query again, which matters when a
+ * round's first downloads from a server all start at once.
+ *
+ * A host whose addresses all refuse to connect can be forgotten, so the
+ * next connection looks it up again in case it has moved.
+ */
+
+#pragma once
+#include <cstddef>
+#include <string>
+#include <map>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <ostream>
+#include <sys/socket.h>
+
+class DNSCache {
+ public:
+  static const size_t kDefaultTTLSeconds = 5 * 60;
+  static const size_t kDefaultNegativeTTLSeconds = 30;
+  static const size_t kDefaultMaxHosts = 4096;
+
+  struct Address {
+    int family;
+    int socktype;
+    int protocol;
+    struct sockaddr_storage address;
+    socklen_t length;
+  };
+
+  DNSCache(size_t ttlSeconds = kDefaultTTLSeconds, size_t negativeTTLSeconds = kDefaultNegativeTTLSeconds,
+           size_t maxHosts = kDefaultMaxHosts);
+
+/**
+ * Returns the cache shared by every ConnectionPool that isn't handed one
+ * of its own.
+ */
+  static DNSCache& shared();
+
+/**
+ * Returns the stream-socket addresses of the host at the port, from the
+ * cache if it has them, or else from the system's resolver.  Throws a
+ * runtime_error if the host can't be resolved (or, within its negative
+ * TTL, couldn't be last time).
+ */
+  std::vector<Address> resolve(const std::string& host, const std::string& port);
+
+/**
+ * Looks the host up with the system's resolver, bypassing every cache.
+ * Throws as resolve does.
+ */
+  static std::vector<Address> lookup(const std::string& host, const std::string& port);
+
+/**
+ * Drops what the cache knows of the host at the port, if anything.
+ */
+  void forget(const std::string& host, const std::string& port);
+
+  size_t getNumLookups() const;
+  size_t getNumHits() const;
+  void printStats(std::ostream& out) const;
+
+ private:
+  struct Entry {
+    bool pending;                              // being looked up right now
+    std::vector<Address> addresses;            // empty if the lookup failed
+    std::string error;                         // why it failed, if it did
+    std::chrono::steady_clock::time_point expires;
+  };
+
+  std::chrono::seconds ttl;
+  std::chrono::seconds negativeTTL;
+  size_t maxHosts;
+  mutable std::mutex lock;                     // guards everything below
+  std::condition_variable_any resolved;
+  std::map<std::string, Entry> hosts;          // keyed by host:port
+  size_t numLookups;                           // that went to the system's resolver
+  size_t numHits;
+  size_t numNegativeHits;                      // of numHits, how many were remembered failures
+  size_t numCoalesced;                         // of numHits, how many waited on another's lookup
+  size_t numForgotten;
+  std::chrono::microseconds lookupTime;        // summed over numLookups
+
+  static int query(const std::string& host, const std::string& port, std::vector<Address>& addresses);
+  static std::string describe(const std::string& host, int status);
+  void evictExpired(std::chrono::steady_clock::time_point now);
+
+  DNSCache(const DNSCache& original) = delete;
+  DNSCache& operator=(const DNSCache& rhs) = delete;
+};
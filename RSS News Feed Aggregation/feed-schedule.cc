@@ -0,0 +1,159 @@
+/**
+ * File: feed-schedule.cc
+ * ----------------------
+ * Presents the implementation of the FeedSchedule class.
+ */
+
+#include "feed-schedule.h"
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <limits>
+#include <sstream>
+using namespace std;
+
+static const double kTargetNewItems = 3;   // new items a poll should turn up, ideally
+static const double kBackOff = 1.5;        // what a poll that turns up nothing stretches the interval by
+static const double kMaxSpeedUp = 4;       // the most one poll can shrink the interval by
+static const double kJitter = 0.1;         // how far either side of the interval the next poll may fall
+static const double kSmoothing = 0.3;      // weight of each poll in the moving average rate
+
+FeedSchedule::FeedSchedule(unsigned int minSeconds, unsigned int maxSeconds, unsigned int seed) :
+  minSeconds(max(minSeconds, 1u)), maxSeconds(max(maxSeconds, max(minSeconds, 1u))), random(seed) {}
+
+FeedSchedule::Feed& FeedSchedule::feedFor(const string& feed) {
+  auto found = feeds.find(feed);
+  if (found == feeds.end()) {
+    Feed state = {(double) minSeconds, 0, false, 0, 0, 0, 0, 0, 0};
+    found = feeds.emplace(feed, state).first;
+  }
+  return found->second;
+}
+
+void FeedSchedule::schedule(Feed& state, time_t now) {
+  uniform_real_distribution<double> jitter(1 - kJitter, 1 + kJitter);
+  state.lastPolled = now;
+  state.nextPoll = now + (time_t) (state.intervalSeconds * jitter(random) + 0.5);
+}
+
+/**
+ * A feed never tried has nothing to go on, so it sorts ahead of every
+ * feed that has been; the rest are ordered by the new items they're
+ * expected to have (none, for a feed whose polls have all failed), and
+ * then by how long they've been due.
+ */
+vector<string> FeedSchedule::due(const vector<string>& candidates, time_t now, size_t budget) const {
+  lock_guard<mutex> lg(lock);
+  vector<pair<pair<double, double>, string>> ranked;
+  for (const string& feed : candidates) {
+    auto found = feeds.find(feed);
+    if (found == feeds.end() || found->second.nextPoll == 0) {
+      ranked.push_back({{numeric_limits<double>::infinity(), 0}, feed});
+      continue;
+    }
+    const Feed& state = found->second;
+    if (state.nextPoll > now) continue;
+    double expected = state.lastPolled == 0 ? 0 : state.itemsPerHour * (now - state.lastPolled) / 3600;
+    ranked.push_back({{expected, double(now - state.nextPoll)}, feed});
+  }
+  sort(ranked.begin(), ranked.end(), [](const pair<pair<double, double>, string>& one,
+                                        const pair<pair<double, double>, string>& two) {
+    return one.first > two.first || (one.first == two.first && one.second < two.second);
+  });
+  if (budget > 0 && ranked.size() > budget) ranked.resize(budget);
+  vector<string> selected;
+  for (const auto& entry : ranked) selected.push_back(entry.second);
+  return selected;
+}
+
+void FeedSchedule::notePoll(const string& feed, size_t numNewItems, time_t now) {
+  lock_guard<mutex> lg(lock);
+  Feed& state = feedFor(feed);
+  state.numPolls++;
+  state.numNewItems += numNewItems;
+  if (numNewItems > 0) state.numChanged++;
+  if (state.lastPolled != 0 && now > state.lastPolled) {
+    double rate = numNewItems * 3600.0 / (now - state.lastPolled);
+    state.itemsPerHour = state.rated ? state.itemsPerHour + (rate - state.itemsPerHour) * kSmoothing : rate;
+    state.rated = true;
+  }
+  if (numNewItems == 0) {
+    state.intervalSeconds *= kBackOff;
+  } else if (numNewItems > kTargetNewItems) {
+    state.intervalSeconds /= min(numNewItems / kTargetNewItems, kMaxSpeedUp);
+  }
+  state.intervalSeconds = max(min(state.intervalSeconds, (double) maxSeconds), (double) minSeconds);
+  schedule(state, now);
+}
+
+void FeedSchedule::noteFirstPoll(const string& feed, time_t now) {
+  lock_guard<mutex> lg(lock);
+  Feed& state = feedFor(feed);
+  state.numPolls++;
+  schedule(state, now);
+}
+
+void FeedSchedule::noteFailure(const string& feed, time_t now) {
+  lock_guard<mutex> lg(lock);
+  Feed& state = feedFor(feed);
+  state.numFailed++;
+  state.intervalSeconds = min(state.intervalSeconds * kBackOff, (double) maxSeconds);
+  uniform_real_distribution<double> jitter(1 - kJitter, 1 + kJitter);
+  state.nextPoll = now + (time_t) (state.intervalSeconds * jitter(random) + 0.5);
+}
+
+/**
+ * The file has one line per feed: its URL, its interval in seconds, its
+ * rate in new items per hour, and when it was last and is next to be
+ * polled, in seconds since the epoch.  Lines that don't parse are
+ * skipped.
+ */
+bool FeedSchedule::load(const string& path) {
+  ifstream in(path);
+  if (!in) return false;
+  map<string, Feed> loaded;
+  string line;
+  while (getline(in, line)) {
+    istringstream fields(line);
+    string feed;
+    double intervalSeconds, itemsPerHour;
+    long long lastPolled, nextPoll;
+    if (!(fields >> feed >> intervalSeconds >> itemsPerHour >> lastPolled >> nextPoll) ||
+        intervalSeconds <= 0 || itemsPerHour < 0 || lastPolled < 0) continue;
+    intervalSeconds = max(min(intervalSeconds, (double) maxSeconds), (double) minSeconds);
+    Feed state = {intervalSeconds, itemsPerHour, true, (time_t) lastPolled, (time_t) nextPoll, 0, 0, 0, 0};
+    loaded.emplace(feed, state);
+  }
+  lock_guard<mutex> lg(lock);
+  for (const auto& entry : loaded) feeds[entry.first] = entry.second;
+  return true;
+}
+
+bool FeedSchedule::save(const string& path) const {
+  string temporary = path + ".tmp";
+  {
+    ofstream out(temporary);
+    lock_guard<mutex> lg(lock);
+    for (const auto& entry : feeds) {
+      const Feed& state = entry.second;
+      out << entry.first << " " << state.intervalSeconds << " " << state.itemsPerHour << " "
+          << (long long) state.lastPolled << " " << (long long) state.nextPoll << endl;
+    }
+    if (!out) return false;
+  }
+  return rename(temporary.c_str(), path.c_str()) == 0;
+}
+
+void FeedSchedule::print(ostream& out) const {
+  lock_guard<mutex> lg(lock);
+  out << left << setw(48) << "feed" << right << setw(12) << "interval s" << setw(12) << "items/hour"
+      << setw(8) << "polls" << setw(9) << "changed" << setw(10) << "new items" << setw(8) << "failed" << endl;
+  for (const auto& entry : feeds) {
+    const Feed& state = entry.second;
+    string feed = entry.first.size() > 47 ? entry.first.substr(0, 44) + "..." : entry.first;
+    out << left << setw(48) << feed << right << fixed << setprecision(0) << setw(12) << state.intervalSeconds
+        << setprecision(2) << setw(12) << state.itemsPerHour << setw(8) << state.numPolls << setw(9)
+        << state.numChanged << setw(10) << state.numNewItems << setw(8) << state.numFailed << endl;
+  }
+}
@@ -0,0 +1,124 @@
+/**
+ * File: feed-schedule.h
+ * ---------------------
+ * Defines the FeedSchedule class, which decides when each feed is next
+ * worth polling, instead of polling every feed at the same fixed rate
+ * whether it changes every minute or once a week.
+ *
+ * Every feed has a polling interval, adapted multiplicatively after each
+ * poll towards kTargetNewItems new items per poll: a poll that turns up
+ * nothing stretches the interval by kBackOff, and one that turns up more
+ * than the target shrinks it in proportion (by at most kMaxSpeedUp at a
+ * time), always within [minSeconds, maxSeconds].  Each next poll is put
+ * off by the interval give or take kJitter of it, so feeds that start out
+ * together drift apart instead of all coming due in the same round.
+ *
+ * Alongside the interval, each feed keeps a moving average of how many
+ * new items it turns up per hour.  When more feeds are due than a round
+ * has room for, the round goes to the ones expected to have the most new
+ * items waiting (that rate times the time since each was last polled),
+ * so fast-changing feeds get the budget first, and slow ones, which are
+ * left waiting, climb the order until they get a turn.
+ *
+ * Every feed's interval, rate and timing can be saved to a file and
+ * loaded again on the next run, so that feeds pick up where they left
+ * off instead of relearning their rates from minSeconds.
+ */
+
+#pragma once
+#include <cstddef>
+#include <ctime>
+#include <string>
+#include <vector>
+#include <ostream>
+#include <mutex>
+#include <map>
+#include <random>
+
+class FeedSchedule {
+ public:
+  static const unsigned int kDefaultMinSeconds = 60;
+  static const unsigned int kDefaultMaxSeconds = 24 * 60 * 60;
+
+/**
+ * Constructs a FeedSchedule that starts feeds it knows nothing about
+ * polling every minSeconds, and never lets any feed go longer than
+ * maxSeconds between polls.  seed seeds the jitter.
+ */
+  FeedSchedule(unsigned int minSeconds = kDefaultMinSeconds, unsigned int maxSeconds = kDefaultMaxSeconds,
+               unsigned int seed = std::random_device()());
+
+/**
+ * Returns those of the specified feeds that are due to be polled at now,
+ * those expected to have the most new items first, and no more than
+ * budget of them (or all of them, given a budget of 0).  Feeds it hasn't
+ * seen tried are due straight away, and go first; feeds that have only
+ * ever failed are due when their retry is, and go last.
+ */
+  std::vector<std::string> due(const std::vector<std::string>& feeds, time_t now, size_t budget = 0) const;
+
+/**
+ * Records a poll of the feed at now that turned up the specified number
+ * of items not seen before, adapting its interval and rate, and
+ * scheduling its next poll.
+ */
+  void notePoll(const std::string& feed, size_t numNewItems, time_t now);
+
+/**
+ * Records a poll of the feed at now whose items can't be told apart from
+ * older ones (the first since the program started, which finds every item
+ * new), which schedules the next poll without adapting anything.
+ */
+  void noteFirstPoll(const std::string& feed, time_t now);
+
+/**
+ * Records a failed poll of the feed at now, which stretches its interval
+ * by kBackOff (as a poll that turns up nothing does) and tries again
+ * after that, so a feed that's gone for good is tried less and less.
+ */
+  void noteFailure(const std::string& feed, time_t now);
+
+/**
+ * Loads the feeds' state saved in the specified file, returning false
+ * (and changing nothing) if it can't be read.
+ */
+  bool load(const std::string& path);
+
+/**
+ * Saves every feed's state to the specified file, replacing it only once
+ * the new contents are completely written.  Returns false if that didn't
+ * work out.
+ */
+  bool save(const std::string& path) const;
+
+/**
+ * Prints a table of every feed's interval and rate, and how its polls
+ * went this run.
+ */
+  void print(std::ostream& out) const;
+
+ private:
+  struct Feed {
+    double intervalSeconds;
+    double itemsPerHour;      // moving average of new items per hour between polls
+    bool rated;               // whether itemsPerHour has been measured yet
+    time_t lastPolled;        // 0 if never
+    time_t nextPoll;          // 0 if never tried
+    size_t numPolls;
+    size_t numChanged;        // polls that turned up new items
+    size_t numNewItems;
+    size_t numFailed;
+  };
+
+  unsigned int minSeconds;
+  unsigned int maxSeconds;
+  mutable std::mutex lock;
+  std::map<std::string, Feed> feeds;
+  std::mt19937 random;
+
+  Feed& feedFor(const std::string& feed);
+  void schedule(Feed& state, time_t now);
+
+  FeedSchedule(const FeedSchedule& original) = delete;
+  FeedSchedule& operator=(const FeedSchedule& rhs) = delete;
+};
@@ -0,0 +1,145 @@
+/**
+ * File: hcbench.cc
+ * ----------------
+ * Measures what the HTTPCache saves a re-run, by downloading the same
+ * batch of articles from a StandInServer (paced to kLinkBytesPerSecond,
+ * and waiting kSetupMillis before serving each new connection, as a
+ * real server would be by the network) several times over: without a
+ * cache, then through a cache that starts out empty, then through a new
+ * HTTPCache loaded from the same directory, as the next run would.
+ *
+ * That's done twice: once with the server saying its articles stay fresh
+ * for an hour, so the warm run never goes to the network, and once with
+ * the server saying they go stale at once, so the warm run revalidates
+ * every article and gets back 304s.  One article in kDuplicateEvery
+ * serves the same body as another, which the cache only stores once.
+ *
+ * Usage: ./hcbench [<number of articles>]
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <random>
+#include <memory>
+#include <unistd.h>
+#include "connection-pool.h"
+#include "http-cache.h"
+#include "stand-in-server.h"
+using namespace std;
+
+static const size_t kDefaultArticles = 400;
+static const size_t kNumThreads = 8;
+static const size_t kArticleBytes = 32 << 10;
+static const size_t kDuplicateEvery = 10;
+static const size_t kLinkBytesPerSecond = 4 << 20;
+static const size_t kSetupMillis = 5;
+
+struct Result {
+  double millis;
+  size_t numServed;          // requests that reached the server
+  size_t numBytesReceived;
+  size_t numHits;
+  size_t numMisses;
+};
+
+/**
+ * Serves articles[i] at /i, except that every kDuplicateEvery-th article
+ * serves the one before it.
+ */
+static unique_ptr<StandInServer> serve(const vector<string>& articles, size_t maxAge) {
+  StandInServer::Options options;
+  options.bytesPerSecond = kLinkBytesPerSecond;
+  options.acceptDelay = chrono::milliseconds(kSetupMillis);
+  return unique_ptr<StandInServer>(new StandInServer([&articles, maxAge](const StandInServer::Request& request) {
+    StandInServer::Reply reply;
+    size_t index = strtoul(request.target.c_str() + 1, NULL, 10);
+    size_t source = index % kDuplicateEvery == kDuplicateEvery - 1 ? index - 1 : index;
+    string etag = "\"" + to_string(source) + "\"";
+    reply.headers.push_back({"Cache-Control", "max-age=" + to_string(maxAge)});
+    reply.headers.push_back({"ETag", etag});
+    auto condition = request.headers.find("if-none-match");
+    if (condition != request.headers.end() && condition->second == etag) {
+      reply.status = 304;
+    } else {
+      reply.body = articles[source];
+    }
+    return reply;
+  }, options));
+}
+
+static Result run(StandInServer& server, const vector<string>& articles, const string& cacheDir) {
+  size_t numServedBefore = server.getNumRequests();
+  unique_ptr<HTTPCache> cache(cacheDir.empty() ? nullptr : new HTTPCache(cacheDir));
+  ConnectionPool pool(kNumThreads);
+  pool.useCache(cache.get());
+  atomic<size_t> next(0);
+  atomic<size_t> numFailed(0);
+  atomic<size_t> numBytesReceived(0);
+  vector<thread> threads;
+  auto start = chrono::steady_clock::now();
+  for (size_t i = 0; i < kNumThreads; i++) {
+    threads.push_back(thread([&] {
+      for (size_t index = next++; index < articles.size(); index = next++) {
+        try {
+          HTTPResponse response = pool.get(server.url("/" + to_string(index)));
+          size_t source = index % kDuplicateEvery == kDuplicateEvery - 1 ? index - 1 : index;
+          if (response.status != 200 || response.body != articles[source]) numFailed++;
+          numBytesReceived += response.numBytesReceived;
+        } catch (const exception& e) {
+          if (numFailed++ == 0) cerr << e.what() << endl;
+        }
+      }
+    }));
+  }
+  for (thread& t : threads) t.join();
+  if (cache != nullptr) cache->save();
+  double millis = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+  if (numFailed > 0) {
+    cerr << numFailed << " downloads failed!" << endl;
+    exit(1);
+  }
+  return {millis, server.getNumRequests() - numServedBefore, numBytesReceived,
+          cache ? cache->getNumHits() : 0, cache ? cache->getNumMisses() : 0};
+}
+
+static void report(const string& label, const Result& result) {
+  cout << setw(26) << label << setw(10) << result.numServed << setw(12) << result.numBytesReceived / 1024
+       << setw(8) << result.numHits << setw(8) << result.numMisses << setw(12) << fixed << setprecision(0)
+       << result.millis << endl;
+}
+
+int main(int argc, char *argv[]) {
+  size_t numArticles = argc > 1 ? strtoul(argv[1], NULL, 10) : kDefaultArticles;
+  mt19937 random(110);
+  uniform_int_distribution<int> letter('a', 'z');
+  vector<string> articles;
+  for (size_t i = 0; i < numArticles; i++) {
+    string article = "<html><body><p>";
+    while (article.size() < kArticleBytes) article += (random() % 7 == 0) ? ' ' : (char) letter(random);
+    articles.push_back(article + "</p></body></html>\n");
+  }
+
+  cout << numArticles << " articles of " << (kArticleBytes >> 10) << "KB, " << kNumThreads << " at a time:" << endl;
+  cout << setw(26) << "" << setw(10) << "served" << setw(12) << "KB on wire" << setw(8) << "hits" << setw(8)
+       << "misses" << setw(12) << "total ms" << endl;
+  report("no cache", run(*serve(articles, 3600), articles, ""));
+  for (size_t maxAge : {(size_t) 3600, (size_t) 0}) {
+    unique_ptr<StandInServer> server = serve(articles, maxAge);
+    char directory[] = "/tmp/hcbench-XXXXXX";
+    if (mkdtemp(directory) == NULL) {
+      cerr << "Couldn't create a cache directory." << endl;
+      return 1;
+    }
+    string suffix = maxAge > 0 ? " (fresh)" : " (stale)";
+    report("cold cache" + suffix, run(*server, articles, directory));
+    report("warm cache" + suffix, run(*server, articles, directory));
+    system(("rm -rf " + string(directory)).c_str());
+  }
+  return 0;
+}
@@ -0,0 +1,125 @@
+/**
+ * File: host-limits.cc
+ * --------------------
+ * Presents the implementation of the HostLimits class.
+ */
+
+#include "host-limits.h"
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+using namespace std;
+
+static const double kSlowFactor = 3;        // slower than this many baselines isn't healthy
+static const double kMaxErrorRate = 0.1;    // nor is an error rate at or above this
+static const double kSmoothing = 0.1;       // weight of each download in the moving averages
+static const double kBaselineDrift = 0.01;  // how far each slower download pulls the baseline up
+
+HostLimits::HostLimits(size_t initialLimit, size_t maxLimit) :
+  initialLimit(max<size_t>(initialLimit, 1)), maxLimit(max<size_t>(maxLimit, 1)) {}
+
+HostLimits::Host& HostLimits::hostFor(const string& host) {
+  auto found = hosts.find(host);
+  if (found == hosts.end()) {
+    size_t limit = min(initialLimit, maxLimit);
+    Host state = {(double) limit, 0, 0, 0, limit, 0, 0, 0};
+    found = hosts.emplace(host, state).first;
+  }
+  return found->second;
+}
+
+size_t HostLimits::limitFor(const Host& state) {
+  return max<size_t>((size_t) state.window, 1);
+}
+
+size_t HostLimits::limit(const string& host) {
+  lock_guard<mutex> lg(lock);
+  return limitFor(hostFor(host));
+}
+
+/**
+ * The baseline drops straight to any faster download, but only creeps
+ * up towards slower ones, so a host that really has slowed down for good
+ * (or a baseline loaded from a run on a faster network) doesn't keep
+ * every download looking unhealthy forever.
+ */
+void HostLimits::noteSuccess(const string& host, double millis) {
+  lock_guard<mutex> lg(lock);
+  Host& state = hostFor(host);
+  state.numSucceeded++;
+  state.sinceDecrease++;
+  state.errorRate *= 1 - kSmoothing;
+  state.meanMillis = state.numSucceeded == 1 ? millis : state.meanMillis + (millis - state.meanMillis) * kSmoothing;
+  bool healthy = state.baselineMillis == 0 || millis <= kSlowFactor * state.baselineMillis;
+  if (state.baselineMillis == 0 || millis < state.baselineMillis) {
+    state.baselineMillis = millis;
+  } else {
+    state.baselineMillis += (millis - state.baselineMillis) * kBaselineDrift;
+  }
+  if (healthy && state.errorRate < kMaxErrorRate) {
+    state.window = min(state.window + 1 / state.window, (double) maxLimit);
+  }
+}
+
+void HostLimits::noteFailure(const string& host, bool overloaded) {
+  lock_guard<mutex> lg(lock);
+  Host& state = hostFor(host);
+  state.numFailed++;
+  state.sinceDecrease++;
+  state.errorRate += (1 - state.errorRate) * kSmoothing;
+  if (!overloaded || state.sinceDecrease < limitFor(state)) return;
+  state.window = max(state.window / 2, 1.0);
+  state.sinceDecrease = 0;
+  state.numDecreases++;
+}
+
+/**
+ * The file has one line per host: its name, its limit (as the fractional
+ * window), and its baseline in milliseconds.  Lines that don't parse are
+ * skipped.
+ */
+bool HostLimits::load(const string& path) {
+  ifstream in(path);
+  if (!in) return false;
+  map<string, Host> loaded;
+  string line;
+  while (getline(in, line)) {
+    istringstream fields(line);
+    string host;
+    double window, baselineMillis;
+    if (!(fields >> host >> window >> baselineMillis) || window < 1 || baselineMillis < 0) continue;
+    window = min(window, (double) maxLimit);
+    Host state = {window, baselineMillis, 0, 0, (size_t) window, 0, 0, 0};
+    loaded.emplace(host, state);
+  }
+  lock_guard<mutex> lg(lock);
+  for (const auto& entry : loaded) hosts[entry.first] = entry.second;
+  return true;
+}
+
+bool HostLimits::save(const string& path) const {
+  string temporary = path + ".tmp";
+  {
+    ofstream out(temporary);
+    lock_guard<mutex> lg(lock);
+    for (const auto& entry : hosts) {
+      out << entry.first << " " << entry.second.window << " " << entry.second.baselineMillis << endl;
+    }
+    if (!out) return false;
+  }
+  return rename(temporary.c_str(), path.c_str()) == 0;
+}
+
+void HostLimits::print(ostream& out) const {
+  lock_guard<mutex> lg(lock);
+  out << left << setw(32) << "host" << right << setw(7) << "limit" << setw(13) << "baseline ms"
+      << setw(10) << "mean ms" << setw(8) << "ok" << setw(8) << "failed" << setw(8) << "halved" << endl;
+  for (const auto& entry : hosts) {
+    const Host& state = entry.second;
+    out << left << setw(32) << entry.first << right << setw(7) << limitFor(state) << fixed << setprecision(1)
+        << setw(13) << state.baselineMillis << setw(10) << state.meanMillis << setw(8) << state.numSucceeded
+        << setw(8) << state.numFailed << setw(8) << state.numDecreases << endl;
+  }
+}
@@ -0,0 +1,104 @@
+/**
+ * File: host-limits.h
+ * -------------------
+ * Defines the HostLimits class, which decides how many downloads the
+ * aggregator may have in flight against each server at once, instead of
+ * allowing every server the same fixed number.
+ *
+ * Each host's limit follows AIMD (additive increase, multiplicative
+ * decrease), the way TCP sizes its congestion window.  Every download
+ * that comes back healthy, meaning no more than three times slower than
+ * the host's baseline (roughly its fastest recent download) while fewer
+ * than one in ten of the host's recent downloads failed, adds 1 / limit
+ * to the limit, so the limit grows by about one for every full round of
+ * downloads.  A timeout or a 5xx halves it, at most once per round so
+ * that one burst of failures from downloads that were already in flight
+ * only counts once.  Other failures (a 404, a bad URL) say nothing about
+ * load, so they neither raise nor cut the limit, but they do count
+ * towards the error rate.
+ *
+ * What each host's limit and baseline ended up at can be saved to a file
+ * and loaded again on the next run, so that hosts start out where they
+ * left off instead of relearning their limits from kInitialLimit.
+ */
+
+#pragma once
+#include <cstddef>
+#include <string>
+#include <ostream>
+#include <mutex>
+#include <map>
+
+class HostLimits {
+ public:
+  static const size_t kInitialLimit = 4;
+  static const size_t kMaxLimit = 64;
+
+/**
+ * Constructs a HostLimits that starts hosts it knows nothing about at
+ * initialLimit, and never lets any host's limit exceed maxLimit.
+ */
+  HostLimits(size_t initialLimit = kInitialLimit, size_t maxLimit = kMaxLimit);
+
+/**
+ * Returns how many downloads may be in flight against the host right
+ * now, which is always at least 1.
+ */
+  size_t limit(const std::string& host);
+
+/**
+ * Records a download from the host that succeeded after the specified
+ * number of milliseconds.
+ */
+  void noteSuccess(const std::string& host, double millis);
+
+/**
+ * Records a download from the host that failed.  overloaded says whether
+ * the failure was one that points to the host being overwhelmed (a
+ * timeout or a 5xx), and should cut its limit.
+ */
+  void noteFailure(const std::string& host, bool overloaded);
+
+/**
+ * Loads the limits and baselines saved in the specified file, returning
+ * false (and changing nothing) if it can't be read.
+ */
+  bool load(const std::string& path);
+
+/**
+ * Saves every host's limit and baseline to the specified file, replacing
+ * it only once the new contents are completely written.  Returns false if
+ * that didn't work out.
+ */
+  bool save(const std::string& path) const;
+
+/**
+ * Prints a table of every host's limit, baseline and mean download time,
+ * and how its downloads went this run.
+ */
+  void print(std::ostream& out) const;
+
+ private:
+  struct Host {
+    double window;          // the limit, kept fractional so it can grow by 1 / limit
+    double baselineMillis;  // 0 until a download succeeds
+    double meanMillis;      // moving average of successful downloads
+    double errorRate;       // moving average of failures (1) and successes (0)
+    size_t sinceDecrease;   // downloads finished since the limit was last halved (or the
+                            // host was first seen), so the first failure counts
+    size_t numSucceeded;
+    size_t numFailed;
+    size_t numDecreases;
+  };
+
+  size_t initialLimit;
+  size_t maxLimit;
+  mutable std::mutex lock;
+  std::map<std::string, Host> hosts;
+
+  Host& hostFor(const std::string& host);
+  static size_t limitFor(const Host& state);
+
+  HostLimits(const HostLimits& original) = delete;
+  HostLimits& operator=(const HostLimits& rhs) = delete;
+};
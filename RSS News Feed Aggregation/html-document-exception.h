@@ -3,7 +3,10 @@
  * -------------------------------
  * Defines the HTML exception thrown whenever some network
  * or parsing issue prevents an HTML document from being
- * parsed properly.
+ * parsed properly.  overloaded() says whether the server looked
+ * overwhelmed (the download timed out or the connection failed, or the
+ * server answered with a 5xx or a 429), as opposed to anything else
+ * going wrong.
  */
 
 #pragma once
@@ -12,10 +15,13 @@
 
 class HTMLDocumentException: public std::exception {
  public: 
-  HTMLDocumentException(const std::string& message) throw() : message(message) {}
+  HTMLDocumentException(const std::string& message, bool overloaded = false) throw() :
+    message(message), isOverloaded(overloaded) {}
   ~HTMLDocumentException() throw() {}
   const char *what() const throw() { return message.c_str(); }
+  bool overloaded() const throw() { return isOverloaded; }
   
  private:
   const std::string message;
+  const bool isOverloaded;
 };
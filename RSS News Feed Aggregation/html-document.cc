@@ -10,10 +10,9 @@
 #include <vector>
 #include <cassert>
 #include <sstream>
+#include <algorithm>
+#include <chrono>
 
-#define BOOST_NETWORK_ENABLE_HTTPS
-#include <boost/network/protocol/http/client.hpp>
-#include <boost/network/uri.hpp>
 #include <myhtml/api.h>
 
 #include "html-document.h"
@@ -21,29 +20,59 @@
 #include "stream-tokenizer.h"
 
 using namespace std;
-using namespace boost::network;
-using namespace boost::network::http;
 
 void HTMLDocument::parse() throw (HTMLDocumentException) {
   	parse(download());
 }
 
+/**
+ * Each hop goes over a connection from the policy's pool, which is left
+ * open for the next download from the same server.  Failures that suggest
+ * the server is struggling (it timed out, refused or dropped the
+ * connection, or answered 5xx or 429, even after the policy's retries)
+ * throw an exception whose overloaded() is true, so the caller can back
+ * off from that server.  The chain starts from wherever redirects says it
+ * last ended up, and if that has since moved on or gone, the chain is
+ * forgotten and followed from the top again.
+ */
+static const unsigned int kTooManyRequests = 429;
+static const unsigned int kFirstServerError = 500;
 std::string HTMLDocument::download(size_t numRedirectsAllowed) throw (HTMLDocumentException)  {
-	std::string url = this->url;
+	std::string url = redirects.lookup(this->url);
+	bool remembered = url != this->url;
+	size_t numHops = 0;
+	chrono::seconds lifetime = chrono::seconds::max();
+	fromCache = true;
 	for (size_t i = 0; i < numRedirectsAllowed; i++) {
 		try {
-    		client::request req(url);
-    		client::options opts;
-    		opts.always_verify_peer(true).
-			    openssl_sni_hostname(req.host()).
-			    timeout(20);
-    		client cl(opts);
-    		client::response resp = cl.get(req);
-			auto head = headers(resp);
-			if (head.count("Location") == 0 && head.count("location") == 0) return body(resp);
-			const char *key = head.count("Location") > 0 ? "Location" : "location";
-			url = head[key].begin()->second;
+			HTTPResponse response = policy.get(url);
+			fromCache = fromCache && response.fromCache;
+			if (response.status >= kFirstServerError || response.status == kTooManyRequests) {
+				throw HTMLDocumentException("Error downloading document from " + this->url + ":\nServer responded with " +
+				                            to_string(response.status) + ".", true);
+			}
+			string location = response.header("location");
+			bool redirected = !location.empty() && response.status >= 300;
+			if (remembered && (redirected || response.status >= 400)) {
+				redirects.forget(this->url);
+				remembered = false;
+				url = this->url;
+				continue;
+			}
+			if (!redirected) {
+				if (response.status < 400) redirects.store(this->url, url, numHops, lifetime);
+				return move(response.body);
+			}
+			lifetime = min(lifetime, redirects.lifetime(response));
+			numHops++;
+			url = ConnectionPool::resolve(url, location);
+		} catch (HTMLDocumentException& hde) {
+			throw;
+		} catch (ConnectionException& e) {
+			if (remembered) redirects.forget(this->url);
+			throw HTMLDocumentException("Error downloading document from " + this->url + ":\n" + e.what(), true);
 		} catch (exception& e) {
+			if (remembered) redirects.forget(this->url);
 			throw HTMLDocumentException("Error downloading document from " + this->url + ":\n" + e.what());
 		}
 	}
@@ -11,6 +11,9 @@
 #include <string>
 #include <vector>
 #include "html-document-exception.h"
+#include "connection-pool.h"
+#include "request-policy.h"
+#include "redirect-cache.h"
 
 class HTMLDocument {
  public:
@@ -18,11 +21,16 @@ class HTMLDocument {
 /**
  * Constructor: HTMLDocument
  * Usage: HTMLDocument profile("http://www.facebook.com/jerry");
- *        HTMLDocument signin("https://login.stanford.edu");
+ *        HTMLDocument signin("https://login.stanford.edu", policy);
  * -------------------------
- * Constructs an HTMLDocument instance around the specified URL.
+ * Constructs an HTMLDocument instance around the specified URL, which
+ * downloads under the supplied request policy (or the shared one), and so
+ * over its connection pool, skipping any redirects the supplied cache (or
+ * the shared one) remembers.
  */
-  HTMLDocument(const std::string& url) : url(url) {}
+  HTMLDocument(const std::string& url, RequestPolicy& policy = RequestPolicy::shared(),
+               RedirectCache& redirects = RedirectCache::shared()) :
+    url(url), policy(policy), redirects(redirects), fromCache(false) {}
 
 /**
  * Method: parse
@@ -36,6 +44,21 @@ class HTMLDocument {
  */
   void parse() throw (HTMLDocumentException);
 
+/**
+ * Methods: download, parse
+ * Usage: string contents = htmlDoc.download();
+ *        htmlDoc.parse(contents);
+ * --------------------------------------------
+ * The two halves of parse(), for clients that want to do the networking
+ * and the tokenizing on different threads: download pulls the document
+ * content (following up to numRedirectsAllowed redirects) and returns it,
+ * and parse(contents) tokenizes it so that getTokens() works as expected.
+ *
+ * Both throw an HTMLDocumentException if anything goes wrong.
+ */
+  std::string download(size_t numRedirectsAllowed = 10) throw (HTMLDocumentException);
+  void parse(const std::string& contents) throw (HTMLDocumentException);
+
 /**
  * Method: getURL
  * cout << htmlDoc.getURL() << endl;
@@ -52,13 +75,23 @@ class HTMLDocument {
  * up the content of the document.
  */
   const std::vector<std::string>& getTokens() const { return tokens; }
+
+/**
+ * Method: wasCached
+ * if (!htmlDoc.wasCached()) ...
+ * -----------------------------
+ * Returns true if the last download was answered entirely from the pool's
+ * HTTP cache, and so says nothing about how quickly the server responds.
+ */
+  bool wasCached() const { return fromCache; }
   
  private:
   std::string url;
+  RequestPolicy& policy;
+  RedirectCache& redirects;
+  bool fromCache;
   std::vector<std::string> tokens;
 
-  std::string download(size_t numRedirectsAllowed = 10) throw (HTMLDocumentException);
-  void parse(const std::string& contents) throw (HTMLDocumentException);
   void extractTokens(struct myhtml_tree *tree) throw (HTMLDocumentException);
   void removeNodes(struct myhtml_tree *tree, const std::string& tagName) throw (HTMLDocumentException);
   
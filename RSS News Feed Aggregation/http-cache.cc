@@ -0,0 +1,346 @@
+/**
+ * File: http-cache.cc
+ * -------------------
+ * Presents the implementation of the HTTPCache class.
+ */
+
+#include "http-cache.h"
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <openssl/evp.h>
+using namespace std;
+
+static const string kIndexHeader = "aggregate-http-cache 1";
+static const size_t kReadChunkSize = 1 << 14;
+static const time_t kMaxHeuristicSeconds = 24 * 60 * 60;
+
+static string lowercase(string str) {
+  transform(str.begin(), str.end(), str.begin(), [](unsigned char ch) { return tolower(ch); });
+  return str;
+}
+
+static string header(const map<string, string>& headers, const string& name) {
+  auto found = headers.find(name);
+  return found == headers.end() ? "" : found->second;
+}
+
+/**
+ * Parses an HTTP date (in the IMF-fixdate form everything sends these
+ * days), returning -1 if it isn't one.
+ */
+static time_t parseDate(const string& date) {
+  struct tm fields;
+  memset(&fields, 0, sizeof(fields));
+  const char *end = strptime(date.c_str(), "%a, %d %b %Y %H:%M:%S", &fields);
+  return end == NULL ? -1 : timegm(&fields);
+}
+
+string HTTPValidators::conditions() const {
+  string conditions;
+  if (!etag.empty()) conditions += "If-None-Match: " + etag + "\r\n";
+  if (!lastModified.empty()) conditions += "If-Modified-Since: " + lastModified + "\r\n";
+  return conditions;
+}
+
+HTTPCache::Store::~Store() {
+  if (fd != -1) close(fd);
+  if (!temporary.empty()) unlink(temporary.c_str());
+  if (digest != nullptr) EVP_MD_CTX_free(digest);
+}
+
+void HTTPCache::Store::write(const char *data, size_t size) {
+  if (failed) return;
+  EVP_DigestUpdate(digest, data, size);
+  this->size += size;
+  for (size_t written = 0; written < size;) {
+    ssize_t count = ::write(fd, data + written, size - written);
+    if (count < 0 && errno == EINTR) continue;
+    if (count <= 0) {
+      failed = true;
+      return;
+    }
+    written += count;
+  }
+}
+
+HTTPCache::HTTPCache(const string& directory, size_t maxBytes) :
+  directory(directory), maxBytes(maxBytes), numBytes(0), clock(0), numFresh(0), numRevalidated(0),
+  numMisses(0), numStored(0), numDeduplicated(0), numEvicted(0) {
+  for (const string& path : {directory, directory + "/objects"}) {
+    if (mkdir(path.c_str(), 0755) != 0 && errno != EEXIST) {
+      throw runtime_error("Couldn't create cache directory " + path + ": " + strerror(errno));
+    }
+  }
+  load();
+}
+
+string HTTPCache::objectPath(const string& hash) const {
+  return directory + "/objects/" + hash;
+}
+
+/**
+ * The index starts with a header line, and then has one line per URL,
+ * least recently used first, of tab-separated fields: the URL, its
+ * body's hash and size, when it was last used, when it goes stale, and
+ * its ETag and Last-Modified.  Entries whose object is missing (or isn't
+ * the size it should be) are dropped, and objects no entry names (or
+ * temporary files left by a run that didn't finish) are deleted.
+ */
+void HTTPCache::load() {
+  ifstream in(directory + "/index");
+  string line;
+  if (in && getline(in, line) && line == kIndexHeader) {
+    while (getline(in, line)) {
+      vector<string> fields;
+      istringstream tokens(line);
+      for (string field; getline(tokens, field, '\t');) fields.push_back(field);
+      if (fields.size() >= 5) fields.resize(7);   // empty validators at the end leave no fields
+      if (fields.size() != 7) continue;
+      Entry entry = {fields[1], strtoul(fields[2].c_str(), NULL, 10), strtoull(fields[3].c_str(), NULL, 10),
+                     (time_t) strtoll(fields[4].c_str(), NULL, 10), fields[5], fields[6]};
+      struct stat info;
+      if (entry.lastUsed == 0 || recency.count(entry.lastUsed) > 0 || entries.count(fields[0]) > 0 ||
+          stat(objectPath(entry.hash).c_str(), &info) != 0 || (size_t) info.st_size != entry.size) continue;
+      entries[fields[0]] = entry;
+      recency[entry.lastUsed] = fields[0];
+      Object& object = objects[entry.hash];
+      object.size = entry.size;
+      object.numReferences++;
+      clock = max(clock, entry.lastUsed);
+    }
+  }
+  for (const auto& object : objects) numBytes += object.second.size;
+
+  DIR *listing = opendir((directory + "/objects").c_str());
+  if (listing != NULL) {
+    while (struct dirent *file = readdir(listing)) {
+      string name = file->d_name;
+      if (name != "." && name != ".." && objects.count(name) == 0) unlink(objectPath(name).c_str());
+    }
+    closedir(listing);
+  }
+  evict();
+}
+
+void HTTPCache::touch(const string& url, Entry& entry) {
+  if (entry.lastUsed != 0) recency.erase(entry.lastUsed);
+  entry.lastUsed = ++clock;
+  recency[entry.lastUsed] = url;
+}
+
+/**
+ * Removes the entry, and its object too if nothing else refers to it.
+ */
+void HTTPCache::drop(map<string, Entry>::iterator found) {
+  recency.erase(found->second.lastUsed);
+  auto object = objects.find(found->second.hash);
+  if (object != objects.end() && --object->second.numReferences == 0) {
+    unlink(objectPath(object->first).c_str());
+    numBytes -= object->second.size;
+    objects.erase(object);
+  }
+  entries.erase(found);
+}
+
+void HTTPCache::evict() {
+  while (numBytes > maxBytes && !recency.empty()) {
+    drop(entries.find(recency.begin()->second));
+    numEvicted++;
+  }
+}
+
+/**
+ * Returns when a response with the specified headers, received now, goes
+ * stale, which is now (or earlier) if it has to be revalidated straight
+ * away.
+ */
+time_t HTTPCache::freshUntil(const map<string, string>& headers, time_t now) {
+  string control = lowercase(header(headers, "cache-control"));
+  if (control.find("no-cache") != string::npos) return 0;
+  size_t maxAge = control.find("max-age=");
+  if (maxAge != string::npos && (maxAge == 0 || control[maxAge - 1] != '-')) {
+    return now + strtol(control.c_str() + maxAge + strlen("max-age="), NULL, 10);
+  }
+  time_t date = parseDate(header(headers, "date"));
+  if (date == -1) date = now;
+  if (headers.count("expires") > 0) {
+    time_t expires = parseDate(header(headers, "expires"));
+    return expires == -1 ? 0 : now + (expires - date);
+  }
+  time_t modified = parseDate(header(headers, "last-modified"));
+  if (modified != -1 && modified < date) return now + min((date - modified) / 10, kMaxHeuristicSeconds);
+  return 0;
+}
+
+unique_ptr<HTTPCache::Hit> HTTPCache::lookup(const string& url) {
+  lock_guard<mutex> lg(lock);
+  auto found = entries.find(url);
+  if (found == entries.end()) {
+    numMisses++;
+    return nullptr;
+  }
+  Entry& entry = found->second;
+  unique_ptr<Hit> hit(new Hit);
+  hit->body.open(objectPath(entry.hash), ios::binary);
+  if (!hit->body) {
+    drop(found);
+    numMisses++;
+    return nullptr;
+  }
+  hit->fresh = entry.freshUntil > time(NULL);
+  hit->validators = {entry.etag, entry.lastModified};
+  hit->size = entry.size;
+  touch(url, entry);
+  if (hit->fresh) numFresh++;
+  return hit;
+}
+
+void HTTPCache::read(Hit& hit, const Sink& sink) {
+  char buffer[kReadChunkSize];
+  size_t total = 0;
+  while (hit.body.read(buffer, sizeof(buffer)) || hit.body.gcount() > 0) {
+    sink(buffer, hit.body.gcount());
+    total += hit.body.gcount();
+  }
+  if (total != hit.size) throw runtime_error("Cached body was cut short");
+}
+
+/**
+ * Responses that could never be served from the cache, because they'd be
+ * stale straight away and there'd be nothing to revalidate them with,
+ * aren't worth storing.
+ */
+unique_ptr<HTTPCache::Store> HTTPCache::store(const string& url, const map<string, string>& headers) {
+  if (lowercase(header(headers, "cache-control")).find("no-store") != string::npos) return nullptr;
+  time_t now = time(NULL);
+  unique_ptr<Store> store(new Store);
+  store->url = url;
+  store->etag = header(headers, "etag");
+  store->lastModified = header(headers, "last-modified");
+  store->freshUntil = freshUntil(headers, now);
+  if (store->freshUntil <= now && store->etag.empty() && store->lastModified.empty()) return nullptr;
+  if (url.find_first_of("\t\n") != string::npos || (store->etag + store->lastModified).find('\t') != string::npos) {
+    return nullptr;
+  }
+  string temporary = objectPath("tmp-XXXXXX");
+  vector<char> name(temporary.begin(), temporary.end());
+  name.push_back('\0');
+  store->fd = mkstemp(name.data());
+  if (store->fd == -1) return nullptr;
+  store->temporary = name.data();
+  store->digest = EVP_MD_CTX_new();
+  if (store->digest == nullptr || EVP_DigestInit_ex(store->digest, EVP_sha256(), NULL) != 1) return nullptr;
+  return store;
+}
+
+/**
+ * The body is synced before it's renamed into place, so an object that
+ * exists is always complete.  The new entry takes its reference before
+ * the old one gives its up, in case they name the same object.
+ */
+void HTTPCache::commit(unique_ptr<Store> store) {
+  if (store->failed || store->size > maxBytes || fsync(store->fd) != 0) return;
+  close(store->fd);
+  store->fd = -1;
+  unsigned char digest[EVP_MAX_MD_SIZE];
+  unsigned int length;
+  EVP_DigestFinal_ex(store->digest, digest, &length);
+  ostringstream hash;
+  for (unsigned int i = 0; i < length; i++) hash << hex << setw(2) << setfill('0') << (unsigned int) digest[i];
+
+  lock_guard<mutex> lg(lock);
+  auto object = objects.find(hash.str());
+  if (object == objects.end()) {
+    if (rename(store->temporary.c_str(), objectPath(hash.str()).c_str()) != 0) return;
+    store->temporary.clear();
+    object = objects.emplace(hash.str(), Object{store->size, 0}).first;
+    numBytes += store->size;
+  } else {
+    numDeduplicated++;
+  }
+  object->second.numReferences++;
+  auto found = entries.find(store->url);
+  if (found != entries.end()) {
+    drop(found);
+    numMisses++;
+  }
+  Entry& entry = entries[store->url];
+  entry = {hash.str(), store->size, 0, store->freshUntil, store->etag, store->lastModified};
+  touch(store->url, entry);
+  numStored++;
+  evict();
+}
+
+/**
+ * A 304 needn't repeat the validators or Last-Modified, so the stored
+ * ones stand in for any it leaves out.
+ */
+void HTTPCache::refresh(const string& url, const map<string, string>& headers) {
+  lock_guard<mutex> lg(lock);
+  auto found = entries.find(url);
+  if (found == entries.end()) return;
+  Entry& entry = found->second;
+  map<string, string> merged = headers;
+  if (merged.count("etag") == 0 && !entry.etag.empty()) merged["etag"] = entry.etag;
+  if (merged.count("last-modified") == 0 && !entry.lastModified.empty()) merged["last-modified"] = entry.lastModified;
+  entry.freshUntil = freshUntil(merged, time(NULL));
+  entry.etag = header(merged, "etag");
+  entry.lastModified = header(merged, "last-modified");
+  touch(url, entry);
+  numRevalidated++;
+}
+
+bool HTTPCache::save() {
+  string path = directory + "/index";
+  string temporary = path + ".tmp";
+  FILE *out = fopen(temporary.c_str(), "w");
+  if (out == NULL) return false;
+  {
+    lock_guard<mutex> lg(lock);
+    fprintf(out, "%s\n", kIndexHeader.c_str());
+    for (const auto& used : recency) {
+      const Entry& entry = entries[used.second];
+      fprintf(out, "%s\t%s\t%zu\t%llu\t%lld\t%s\t%s\n", used.second.c_str(), entry.hash.c_str(), entry.size,
+              (unsigned long long) entry.lastUsed, (long long) entry.freshUntil, entry.etag.c_str(),
+              entry.lastModified.c_str());
+    }
+  }
+  bool written = fflush(out) == 0 && fsync(fileno(out)) == 0;
+  written = fclose(out) == 0 && written;
+  if (!written) {
+    unlink(temporary.c_str());
+    return false;
+  }
+  return rename(temporary.c_str(), path.c_str()) == 0;
+}
+
+size_t HTTPCache::getNumHits() const {
+  lock_guard<mutex> lg(lock);
+  return numFresh + numRevalidated;
+}
+
+size_t HTTPCache::getNumMisses() const {
+  lock_guard<mutex> lg(lock);
+  return numMisses;
+}
+
+void HTTPCache::printStats(ostream& out) const {
+  lock_guard<mutex> lg(lock);
+  out << "HTTP cache: " << numFresh << " fresh hits, " << numRevalidated << " revalidated, " << numMisses
+      << " misses, " << numStored << " stored (" << numDeduplicated << " duplicating a stored body), "
+      << numEvicted << " evicted; " << entries.size() << " URLs over " << objects.size() << " bodies, "
+      << numBytes << " bytes." << endl;
+}
@@ -0,0 +1,195 @@
+/**
+ * File: http-cache.h
+ * ------------------
+ * Defines the HTTPCache class, an on-disk cache of HTTP responses that
+ * lasts from one run to the next, so that a re-run over the same feeds
+ * only goes to the network for what has changed (or might have).
+ *
+ * The cache is a directory holding an index, keyed by URL, and an
+ * objects directory of bodies, each named for the SHA-256 of its
+ * contents, so that URLs serving identical bodies (the same article
+ * under two addresses, say) share one copy.  For each URL the index keeps
+ * the body's hash and size, how long the response stays fresh, and its
+ * validators (ETag and Last-Modified).
+ *
+ * A fresh response is served straight from disk.  A stale one is
+ * revalidated: the request carries its validators, and a 304 serves the
+ * stored body again.  Freshness comes from Cache-Control max-age, or
+ * failing that Expires, or failing that the usual heuristic of a tenth
+ * of the time since Last-Modified (capped at a day).  Only 200 responses
+ * are stored, and not those marked no-store.
+ *
+ * Bodies are written to a temporary file and renamed into place once
+ * complete and synced, and the index is replaced the same way by save,
+ * so a crash at any point leaves the cache as it was at the last save,
+ * plus (at worst) objects nothing refers to, which the next load deletes.
+ * Once the bodies add up to more than maxBytes, the least recently used
+ * URLs are dropped (and their bodies with them, unless another URL still
+ * shares them) until they fit.
+ *
+ * Any number of threads may use the cache at once, but only one process
+ * should use a directory at a time.
+ */
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <string>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <fstream>
+#include <functional>
+#include <ostream>
+
+struct evp_md_ctx_st;
+
+/**
+ * What a response can be revalidated with: its ETag and Last-Modified.
+ */
+struct HTTPValidators {
+  std::string etag;
+  std::string lastModified;
+
+  bool empty() const { return etag.empty() && lastModified.empty(); }
+
+/**
+ * Returns the request headers (each ending in CRLF) that make a request
+ * conditional on the response having changed since.
+ */
+  std::string conditions() const;
+};
+
+class HTTPCache {
+ public:
+  static const size_t kDefaultMaxBytes = 256 << 20;
+
+  typedef std::function<void(const char *data, size_t size)> Sink;
+
+/**
+ * A cached response, with its body open for reading, so that it stays
+ * readable even if it's evicted in the meantime.
+ */
+  struct Hit {
+    bool fresh;                // whether it can be served without asking the server
+    HTTPValidators validators;
+    size_t size;
+    std::ifstream body;
+  };
+
+/**
+ * A 200 response's body on its way into the cache.  It's written to a
+ * temporary file as it arrives, and only added to the cache by commit;
+ * if it's destroyed first, the temporary file goes with it.
+ */
+  class Store {
+   public:
+    ~Store();
+    void write(const char *data, size_t size);
+
+   private:
+    friend class HTTPCache;
+    std::string url;
+    std::string etag;
+    std::string lastModified;
+    time_t freshUntil;
+    std::string temporary;
+    int fd;
+    evp_md_ctx_st *digest;
+    size_t size;
+    bool failed;
+
+    Store() : freshUntil(0), fd(-1), digest(nullptr), size(0), failed(false) {}
+    Store(const Store& original) = delete;
+    Store& operator=(const Store& rhs) = delete;
+  };
+
+/**
+ * Opens (creating it if need be) the cache in the specified directory,
+ * and loads its index.  Throws a runtime_error if the directory can't be
+ * created.
+ */
+  HTTPCache(const std::string& directory, size_t maxBytes = kDefaultMaxBytes);
+
+/**
+ * Returns the cached response for the URL, or null if there isn't one.
+ * Counts a fresh one as a hit, and no response at all as a miss.
+ */
+  std::unique_ptr<Hit> lookup(const std::string& url);
+
+/**
+ * Hands the hit's body to sink a piece at a time.  Throws a runtime_error
+ * if it can't all be read.
+ */
+  static void read(Hit& hit, const Sink& sink);
+
+/**
+ * Returns a Store for the body of a 200 response to the URL with the
+ * specified headers (keyed by lowercased name), or null if the response
+ * can't be cached.
+ */
+  std::unique_ptr<Store> store(const std::string& url, const std::map<std::string, std::string>& headers);
+
+/**
+ * Adds the fully written body to the cache, in place of whatever the URL
+ * had before.
+ */
+  void commit(std::unique_ptr<Store> store);
+
+/**
+ * Records a 304 for the URL, taking its freshness and validators from
+ * the response's headers where it has them.
+ */
+  void refresh(const std::string& url, const std::map<std::string, std::string>& headers);
+
+/**
+ * Writes out the index, replacing the old one only once the new one is
+ * completely written.  Returns false if that didn't work out.
+ */
+  bool save();
+
+  size_t getNumHits() const;
+  size_t getNumMisses() const;
+  void printStats(std::ostream& out) const;
+
+ private:
+  struct Entry {
+    std::string hash;        // of the body, in hex: its object's name
+    size_t size;
+    uint64_t lastUsed;       // when, in the order URLs were looked up or stored
+    time_t freshUntil;
+    std::string etag;
+    std::string lastModified;
+  };
+
+  struct Object {
+    size_t size;
+    size_t numReferences;    // URLs whose entry names it
+  };
+
+  std::string directory;
+  size_t maxBytes;
+  mutable std::mutex lock;                   // guards everything below
+  std::map<std::string, Entry> entries;      // keyed by URL
+  std::map<uint64_t, std::string> recency;   // URLs, least recently used first
+  std::map<std::string, Object> objects;     // keyed by hash
+  size_t numBytes;                           // of every object
+  uint64_t clock;
+  size_t numFresh;                           // served without going to the network
+  size_t numRevalidated;                     // served after a 304
+  size_t numMisses;                          // not cached, or changed since
+  size_t numStored;
+  size_t numDeduplicated;                    // stored bodies some other URL already had
+  size_t numEvicted;
+
+  std::string objectPath(const std::string& hash) const;
+  void load();
+  void touch(const std::string& url, Entry& entry);
+  void drop(std::map<std::string, Entry>::iterator found);
+  void evict();
+  static time_t freshUntil(const std::map<std::string, std::string>& headers, time_t now);
+
+  HTTPCache(const HTTPCache& original) = delete;
+  HTTPCache& operator=(const HTTPCache& rhs) = delete;
+};
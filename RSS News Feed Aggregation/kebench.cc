@@ -0,0 +1,187 @@
+/**
+ * File: kebench.cc
+ * ----------------
+ * Compares two ways of capping downloads per server on a workload
+ * dominated by one server, the way single-server-source-feed.xml is:
+ *
+ *   semaphores   the old scheme: one thread per download, at most
+ *                kNumMaxArticle at once, each of which then blocks on its
+ *                server's semaphore until fewer than kNumPerServer
+ *                downloads from that server are running.
+ *   executor     a KeyedExecutor with kNumMaxArticle workers, keyed by
+ *                server, which only hands a worker a download its server
+ *                has room for.
+ *
+ * Downloads are simulated by sleeping.  For each scheme it reports the
+ * total time, and how long downloads from the *other* servers took to
+ * finish on average, since those are the ones the old scheme starves by
+ * parking its threads behind the busy server.
+ *
+ * It then compares a fixed cap of kNumPerServer against the adaptive caps
+ * of a HostLimits, on a workload split between a CDN that serves any
+ * number of downloads at once just as fast, and a fragile server whose
+ * downloads time out (after kTimeoutMillis) whenever more than
+ * kFragileCapacity of them are running.  It reports the total time, how
+ * many downloads timed out, and the limits HostLimits settled on.
+ *
+ * Usage: ./kebench [<number of downloads>]
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <thread>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <unordered_map>
+#include "semaphore.h"
+#include "keyed-executor.h"
+#include "host-limits.h"
+using namespace std;
+
+static const size_t kNumMaxArticle = 24;  // as in NewsAggregator
+static const size_t kNumPerServer = 10;   // as in NewsAggregator
+static const size_t kDefaultDownloads = 400;
+static const size_t kBusyServerShare = 9; // in every ten downloads, nine go to the busy server
+static const size_t kNumOtherServers = 20;
+static const size_t kDownloadMillis = 20;
+static const size_t kFragileCapacity = 3;
+static const size_t kTimeoutMillis = 200;
+
+struct Result {
+  double totalMillis;
+  double otherServerMillis;   // mean time from the start to finishing a download from a quiet server
+};
+
+static string serverFor(size_t download) {
+  if (download % 10 < kBusyServerShare) return "www.busy-server.com";
+  return "www.quiet-server-" + to_string(download % kNumOtherServers) + ".com";
+}
+
+static double millisSince(chrono::steady_clock::time_point start) {
+  return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
+static void download() {
+  this_thread::sleep_for(chrono::milliseconds(kDownloadMillis));
+}
+
+static Result summarize(const vector<double>& finished, chrono::steady_clock::time_point start) {
+  Result result = {millisSince(start), 0};
+  size_t numOther = 0;
+  for (size_t i = 0; i < finished.size(); i++) {
+    if (i % 10 < kBusyServerShare) continue;
+    result.otherServerMillis += finished[i];
+    numOther++;
+  }
+  if (numOther > 0) result.otherServerMillis /= numOther;
+  return result;
+}
+
+static Result withSemaphores(size_t numDownloads) {
+  vector<double> finished(numDownloads);
+  semaphore numThreads(kNumMaxArticle);
+  mutex serverLock;
+  unordered_map<string, unique_ptr<semaphore>> serverSemaphores;
+  vector<thread> threads;
+  auto start = chrono::steady_clock::now();
+  for (size_t i = 0; i < numDownloads; i++) {
+    numThreads.wait();
+    threads.push_back(thread([&, i] {
+      string server = serverFor(i);
+      serverLock.lock();
+      unique_ptr<semaphore>& serverSemaphore = serverSemaphores[server];
+      if (serverSemaphore == nullptr) serverSemaphore.reset(new semaphore(kNumPerServer));
+      serverLock.unlock();
+      serverSemaphore->wait();
+      download();
+      serverSemaphore->signal();
+      finished[i] = millisSince(start);
+      numThreads.signal();
+    }));
+  }
+  for (thread& t : threads) t.join();
+  return summarize(finished, start);
+}
+
+static Result withExecutor(size_t numDownloads) {
+  vector<double> finished(numDownloads);
+  KeyedExecutor executor(kNumMaxArticle, kNumPerServer);
+  auto start = chrono::steady_clock::now();
+  for (size_t i = 0; i < numDownloads; i++) {
+    executor.schedule(serverFor(i), [&finished, i, start] {
+      download();
+      finished[i] = millisSince(start);
+    });
+  }
+  executor.wait();
+  return summarize(finished, start);
+}
+
+struct AdaptiveResult {
+  double totalMillis;
+  size_t numTimeouts;
+};
+
+static string adaptiveServerFor(size_t download) {
+  return download % 2 == 0 ? "www.cdn.com" : "www.fragile.com";
+}
+
+/**
+ * Runs the downloads with per-server caps from keyLimit, reporting each
+ * one's outcome to limits if it's supplied.
+ */
+static AdaptiveResult withLimits(size_t numDownloads, const KeyedExecutor::KeyLimit& keyLimit,
+                                 HostLimits *limits) {
+  atomic<size_t> numFragileRunning(0), numTimeouts(0);
+  auto start = chrono::steady_clock::now();
+  {
+    KeyedExecutor executor(kNumMaxArticle, keyLimit);
+    for (size_t i = 0; i < numDownloads; i++) {
+      string server = adaptiveServerFor(i);
+      executor.schedule(server, [&, server] {
+        auto downloadStart = chrono::steady_clock::now();
+        bool fragile = server == "www.fragile.com";
+        bool timedOut = fragile && ++numFragileRunning > kFragileCapacity;
+        this_thread::sleep_for(chrono::milliseconds(timedOut ? kTimeoutMillis : kDownloadMillis));
+        if (fragile) numFragileRunning--;
+        if (timedOut) numTimeouts++;
+        if (limits == nullptr) return;
+        if (timedOut) limits->noteFailure(server, true);
+        else limits->noteSuccess(server, millisSince(downloadStart));
+      });
+    }
+  }
+  return {millisSince(start), numTimeouts};
+}
+
+int main(int argc, char *argv[]) {
+  size_t numDownloads = argc > 1 ? strtoul(argv[1], NULL, 10) : kDefaultDownloads;
+  cout << numDownloads << " downloads of " << kDownloadMillis << "ms, " << kBusyServerShare
+       << " in 10 from one server, " << kNumMaxArticle << " threads, " << kNumPerServer
+       << " per server:" << endl;
+  cout << setw(12) << "scheme" << setw(12) << "total ms" << setw(22) << "quiet-server mean ms" << endl;
+  Result semaphores = withSemaphores(numDownloads);
+  cout << setw(12) << "semaphores" << setw(12) << fixed << setprecision(0) << semaphores.totalMillis
+       << setw(22) << semaphores.otherServerMillis << endl;
+  Result executor = withExecutor(numDownloads);
+  cout << setw(12) << "executor" << setw(12) << executor.totalMillis
+       << setw(22) << executor.otherServerMillis << endl;
+
+  cout << endl << numDownloads << " downloads of " << kDownloadMillis << "ms, half from a CDN and half from a server"
+       << " that times out after " << kTimeoutMillis << "ms above " << kFragileCapacity << " at once:" << endl;
+  cout << setw(12) << "limits" << setw(12) << "total ms" << setw(12) << "timeouts" << endl;
+  AdaptiveResult fixedLimit = withLimits(numDownloads, [](const string&) { return kNumPerServer; }, nullptr);
+  cout << setw(12) << "fixed" << setw(12) << fixedLimit.totalMillis << setw(12) << fixedLimit.numTimeouts << endl;
+  HostLimits limits;
+  AdaptiveResult adaptive = withLimits(numDownloads, [&limits](const string& server) {
+    return limits.limit(server);
+  }, &limits);
+  cout << setw(12) << "adaptive" << setw(12) << adaptive.totalMillis << setw(12) << adaptive.numTimeouts << endl;
+  limits.print(cout);
+  return 0;
+}
@@ -0,0 +1,95 @@
+/**
+ * File: keyed-executor.cc
+ * -----------------------
+ * Presents the implementation of the KeyedExecutor class.
+ */
+
+#include "keyed-executor.h"
+#include <algorithm>
+using namespace std;
+
+KeyedExecutor::KeyedExecutor(size_t numWorkers, size_t perKeyLimit) :
+  KeyedExecutor(numWorkers, [perKeyLimit](const string&) { return perKeyLimit; }) {}
+
+KeyedExecutor::KeyedExecutor(size_t numWorkers, const KeyLimit& keyLimit) :
+  keyLimit(keyLimit), numOutstanding(0), exiting(false) {
+  for (size_t i = 0; i < numWorkers; i++) {
+    workers.push_back(thread([this] { worker(); }));
+  }
+}
+
+size_t KeyedExecutor::limitFor(const string& key) const {
+  return max<size_t>(keyLimit(key), 1);
+}
+
+void KeyedExecutor::schedule(const string& key, const function<void(void)>& thunk,
+                             const function<void(void)>& then) {
+  lock_guard<mutex> lg(lock);
+  numOutstanding++;
+  KeyState& state = keys[key];
+  if (state.numRunning >= limitFor(key)) {
+    state.backlog.push_back({key, thunk, then});
+    return;
+  }
+  state.numRunning++;
+  runnable.push_back({key, thunk, then});
+  runnableCV.notify_one();
+}
+
+/**
+ * Hands the finished thunk's slot to the next thunk in its key's backlog,
+ * along with any slots the key's cap has gained since, so the key never
+ * drops below its cap while it still has work waiting.
+ */
+void KeyedExecutor::release(const string& key) {
+  lock_guard<mutex> lg(lock);
+  KeyState& state = keys[key];
+  state.numRunning--;
+  size_t limit = limitFor(key);
+  while (!state.backlog.empty() && state.numRunning < limit) {
+    runnable.push_back(move(state.backlog.front()));
+    state.backlog.pop_front();
+    state.numRunning++;
+    runnableCV.notify_one();
+  }
+  if (state.numRunning == 0) keys.erase(key);
+}
+
+void KeyedExecutor::finish() {
+  lock_guard<mutex> lg(lock);
+  if (--numOutstanding == 0) doneCV.notify_all();
+}
+
+void KeyedExecutor::worker() {
+  while (true) {
+    Job job;
+    lock.lock();
+    runnableCV.wait(lock, [this] { return exiting || !runnable.empty(); });
+    if (runnable.empty()) { // only happens once we're exiting
+      lock.unlock();
+      return;
+    }
+    job = move(runnable.front());
+    runnable.pop_front();
+    lock.unlock();
+    job.thunk();
+    release(job.key);
+    if (job.then) job.then();
+    finish();
+  }
+}
+
+void KeyedExecutor::wait() {
+  lock.lock();
+  doneCV.wait(lock, [this] { return numOutstanding == 0; });
+  lock.unlock();
+}
+
+KeyedExecutor::~KeyedExecutor() {
+  wait();
+  lock.lock();
+  exiting = true;
+  runnableCV.notify_all();
+  lock.unlock();
+  for (thread& t : workers) t.join();
+}
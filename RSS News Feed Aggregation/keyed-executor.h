@@ -0,0 +1,108 @@
+/**
+ * File: keyed-executor.h
+ * ----------------------
+ * Defines the KeyedExecutor class, which runs thunks on a fixed set of
+ * worker threads while capping how many thunks sharing the same key (for
+ * the aggregator, the same server) may run at once.
+ *
+ * Thunks for a key that's already at its cap wait in that key's backlog,
+ * not on a worker thread: a worker only ever picks up a thunk that's
+ * allowed to run right now, and when a thunk finishes, the next one in
+ * its key's backlog (if any) becomes runnable in its place.  So however
+ * many articles are queued for one busy server, every worker is either
+ * running something or idle because there's nothing runnable at all.
+ *
+ * A thunk can come with a continuation, which runs on the same worker
+ * after the thunk's slot has been given up.  That's how the aggregator's
+ * fetch stage hands downloaded bytes on to the parse stage: if the parse
+ * stage is behind, the worker blocks in the continuation without keeping
+ * the server's slot.
+ *
+ * The cap can be the same for every key, or come from a function that
+ * the executor consults every time a thunk is scheduled or finishes, so
+ * that a key's cap can rise and fall while its thunks are running.  When
+ * the cap rises, the next thunk to finish releases as many of the key's
+ * waiting thunks as now fit; when it falls, finishing thunks give up
+ * their slots until the key is back under it.
+ */
+
+#pragma once
+#include <cstddef>
+#include <string>
+#include <functional>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_map>
+
+class KeyedExecutor {
+ public:
+  typedef std::function<size_t(const std::string& key)> KeyLimit;
+
+/**
+ * Constructs a KeyedExecutor with numWorkers worker threads, which will
+ * run at most perKeyLimit thunks with the same key at any one time.
+ */
+  KeyedExecutor(size_t numWorkers, size_t perKeyLimit);
+
+/**
+ * Constructs a KeyedExecutor with numWorkers worker threads, which will
+ * run at most keyLimit(key) thunks with the same key at any one time.
+ * keyLimit is called with the executor's lock held, so it mustn't call
+ * back into the executor; a limit below 1 is treated as 1.
+ */
+  KeyedExecutor(size_t numWorkers, const KeyLimit& keyLimit);
+
+/**
+ * Schedules the thunk to run under the specified key.  It runs as soon
+ * as a worker is free, unless the key is already running as many thunks
+ * as its cap allows, in which case it waits (in FIFO order with the key's
+ * other waiting thunks) until there's room.  If then is
+ * supplied, it runs right after the thunk, outside the key's cap.
+ */
+  void schedule(const std::string& key, const std::function<void(void)>& thunk,
+                const std::function<void(void)>& then = nullptr);
+
+/**
+ * Blocks until every thunk scheduled so far has run.
+ */
+  void wait();
+
+/**
+ * Waits for every scheduled thunk to run, and then brings down the
+ * worker threads.
+ */
+  ~KeyedExecutor();
+
+ private:
+  struct Job {
+    std::string key;
+    std::function<void(void)> thunk;
+    std::function<void(void)> then;
+  };
+
+  struct KeyState {
+    size_t numRunning;
+    std::deque<Job> backlog;
+  };
+
+  KeyLimit keyLimit;
+  std::vector<std::thread> workers;
+  std::mutex lock;                                  // guards everything below
+  std::condition_variable_any runnableCV;
+  std::deque<Job> runnable;                         // thunks cleared to run, in order
+  std::unordered_map<std::string, KeyState> keys;   // keys with thunks running or waiting
+  size_t numOutstanding;
+  std::condition_variable_any doneCV;
+  bool exiting;
+
+  size_t limitFor(const std::string& key) const;
+  void worker();
+  void release(const std::string& key);
+  void finish();
+
+  KeyedExecutor(const KeyedExecutor& original) = delete;
+  KeyedExecutor& operator=(const KeyedExecutor& rhs) = delete;
+};
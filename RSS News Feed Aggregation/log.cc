@@ -16,7 +16,7 @@ using namespace std;
 static const int kIncorrectUsage = 1;
 void NewsAggregatorLog::printUsage(const string& message, const string& executable) {
   cerr << "Error: " << message << endl;
-  cerr << "Usage: ./" << executable << " [--verbose] [--quiet] [--conserve-threads] [--url <feed-file>]" << endl;
+  cerr << "Usage: ./" << executable << " [--verbose] [--quiet] [--conserve-threads] [--stats] [--host-state <file>] [--feed-state <file>] [--cache-dir <directory>] [--daemon <seconds>] [--hedge <percentile>] [--url <feed-file>]" << endl;
   exit(kIncorrectUsage);
 }
 
@@ -28,6 +28,11 @@ void NewsAggregatorLog::noteFullRSSFeedListDownloadFailureAndExit(const string&
   exit(kBogusRSSFeedListName);
 }
 
+void NewsAggregatorLog::noteFullRSSFeedListDownloadFailure(const string& rssFeedListURI) const {
+  cerr << oslock << "Ran into trouble while pulling full RSS feed list from \""
+       << rssFeedListURI << "\"." << endl << "Trying again next time...." << endl << osunlock;
+}
+
 void NewsAggregatorLog::noteFullRSSFeedListDownloadEnd() const {
   if (verbose) cout << oslock << "All RSS news feed documents have been downloaded!" << endl << osunlock;
 }
@@ -86,3 +91,10 @@ void NewsAggregatorLog::noteAllArticlesHaveBeenScheduled(const string& feedTitle
   if (!verbose) return;
   cout << oslock << feedTitle << ": All articles have been scheduled." << endl << osunlock;
 }
+
+void NewsAggregatorLog::noteIndexUpdated(size_t round, size_t numFeedsChanged, size_t numFeedsPolled,
+                                         size_t numArticlesAdded) const {
+  if (!verbose) return;
+  cout << oslock << "Round " << round << ": " << numFeedsChanged << " of " << numFeedsPolled << " feeds polled changed, "
+       << numArticlesAdded << " new article" << (numArticlesAdded == 1 ? "" : "s") << " indexed." << endl << osunlock;
+}
@@ -5,6 +5,7 @@
  */
 
 #pragma once
+#include <cstddef>
 #include <string>
 #include "article.h"
 
@@ -15,6 +16,7 @@ class NewsAggregatorLog {
   static void printUsage(const std::string& message, const std::string& executableName);
   
   void noteFullRSSFeedListDownloadFailureAndExit(const std::string& rssFeedListURI) const;
+  void noteFullRSSFeedListDownloadFailure(const std::string& rssFeedListURI) const;
   void noteFullRSSFeedListDownloadEnd() const;
   
   void noteSingleFeedDownloadBeginning(const std::string& feedURI) const;
@@ -27,6 +29,8 @@ class NewsAggregatorLog {
   void noteSingleArticleDownloadSkipped(const Article& article) const;
   void noteSingleArticleDownloadFailure(const Article& article) const;
   void noteAllArticlesHaveBeenScheduled(const std::string& feedTitle) const;
+
+  void noteIndexUpdated(size_t round, size_t numFeedsChanged, size_t numFeedsPolled, size_t numArticlesAdded) const;
   
  private:
   bool verbose;
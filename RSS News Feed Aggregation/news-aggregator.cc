@@ -7,6 +7,8 @@
 #include "news-aggregator.h"
 #include <iostream>
 #include <iomanip>
+#include <cstdlib>
+#include <ctime>
 #include <getopt.h>
 #include <libxml/parser.h>
 #include <libxml/catalog.h>
@@ -18,6 +20,9 @@
 #include <mutex>
 #include <thread>
 #include <map>
+#include <memory>
+#include <algorithm>
+#include <chrono>
 #include "semaphore.h"
 #include <unordered_map>
 #include <unordered_set>
@@ -42,18 +47,32 @@ using namespace std;
  * of logging information as it does so.
  */
 static const string kDefaultRSSFeedListURL = "small-feed.xml";
+static const string kDefaultHostStateFile = ".aggregate-hosts";
+static const string kDefaultFeedStateFile = ".aggregate-feeds";
 NewsAggregator *NewsAggregator::createNewsAggregator(int argc, char *argv[]) {
     struct option options[] = {
 	{"verbose", no_argument, NULL, 'v'},
 	{"quiet", no_argument, NULL, 'q'},
 	{"url", required_argument, NULL, 'u'},
+	{"stats", no_argument, NULL, 's'},
+	{"host-state", required_argument, NULL, 'H'},
+	{"feed-state", required_argument, NULL, 'F'},
+	{"cache-dir", required_argument, NULL, 'c'},
+	{"daemon", required_argument, NULL, 'd'},
+	{"hedge", required_argument, NULL, 'e'},
 	{NULL, 0, NULL, 0},
     };
 
     string rssFeedListURI = kDefaultRSSFeedListURL;
+    string hostStateFile = kDefaultHostStateFile;
+    string feedStateFile = kDefaultFeedStateFile;
+    string cacheDir;
+    unsigned int pollSeconds = 0;
+    double hedgePercentile = 0;
     bool verbose = false;
+    bool stats = false;
     while (true) {
-	int ch = getopt_long(argc, argv, "vqu:", options, NULL);
+	int ch = getopt_long(argc, argv, "vqsu:H:F:c:d:e:", options, NULL);
 	if (ch == -1) break;
 	switch (ch) {
 	    case 'v':
@@ -65,6 +84,26 @@ NewsAggregator *NewsAggregator::createNewsAggregator(int argc, char *argv[]) {
 	    case 'u':
 		rssFeedListURI = optarg;
 		break;
+	    case 's':
+		stats = true;
+		break;
+	    case 'H':
+		hostStateFile = optarg;
+		break;
+	    case 'F':
+		feedStateFile = optarg;
+		break;
+	    case 'c':
+		cacheDir = optarg;
+		break;
+	    case 'd':
+		pollSeconds = atoi(optarg);
+		if (pollSeconds == 0) NewsAggregatorLog::printUsage("The polling interval must be a positive number of seconds.", argv[0]);
+		break;
+	    case 'e':
+		hedgePercentile = atof(optarg);
+		if (hedgePercentile <= 0 || hedgePercentile >= 100) NewsAggregatorLog::printUsage("The hedging percentile must be between 0 and 100.", argv[0]);
+		break;
 	    default:
 		NewsAggregatorLog::printUsage("Unrecognized flag.", argv[0]);
 	}
@@ -72,7 +111,25 @@ NewsAggregator *NewsAggregator::createNewsAggregator(int argc, char *argv[]) {
 
     argc -= optind;
     if (argc > 0) NewsAggregatorLog::printUsage("Too many arguments.", argv[0]);
-    return new NewsAggregator(rssFeedListURI, verbose);
+    return new NewsAggregator(rssFeedListURI, verbose, hostStateFile, feedStateFile, cacheDir, pollSeconds,
+			      hedgePercentile, stats);
+}
+
+/**
+ * Destructor: ~NewsAggregator
+ * ---------------------------
+ * Tells the poller to stop, waits for it to finish whatever round it's
+ * in the middle of, and only then cleans up the XML parser.
+ */
+NewsAggregator::~NewsAggregator() {
+    if (!poller.joinable()) return;
+    pollLock.lock();
+    stopping = true;
+    pollLock.unlock();
+    pollCondition.notify_all();
+    poller.join();
+    xmlCatalogCleanup();
+    xmlCleanupParser();
 }
 
 /**
@@ -81,15 +138,77 @@ NewsAggregator *NewsAggregator::createNewsAggregator(int argc, char *argv[]) {
  * Initalizex the XML parser, processes all feeds, and then
  * cleans up the parser.  The lion's share of the work is passed
  * on to processAllFeeds, which you will need to implement.
+ * Each server's download limit starts where the last run left it
+ * (unless hostStateFile is empty) and is saved again afterwards, as is
+ * each feed's polling schedule (unless feedStateFile is empty), and
+ * likewise the HTTP cache in cacheDir, if there is one.  Given a
+ * pollSeconds, leaves the parser be and starts the poller instead.
  */
 void NewsAggregator::buildIndex() {
     if (built) return;
     built = true; // optimistically assume it'll all work out
+    if (!hostStateFile.empty()) hostLimits.load(hostStateFile);
+    if (!feedStateFile.empty()) feedSchedule.load(feedStateFile);
+    if (!cacheDir.empty()) {
+	try {
+	    httpCache.reset(new HTTPCache(cacheDir));
+	    connectionPool.useCache(httpCache.get());
+	} catch (const runtime_error& e) {
+	    cerr << e.what() << "; carrying on without a cache." << endl;
+	}
+    }
     xmlInitParser();
     xmlInitializeCatalog();
     processAllFeeds();
-    xmlCatalogCleanup();
-    xmlCleanupParser();
+    saveState();
+    if (stats) {
+	hostLimits.print(cout);
+	feedSchedule.print(cout);
+	connectionPool.printStats(cout);
+	requestPolicy.printStats(cout);
+	RedirectCache::shared().printStats(cout);
+    }
+    if (pollSeconds > 0) {
+	poller = thread([this] {pollFeeds();});
+    } else {
+	xmlCatalogCleanup();
+	xmlCleanupParser();
+    }
+}
+
+/**
+ * Private Method: saveState
+ * -------------------------
+ * Saves the per-server download limits, the feeds' polling schedule and
+ * the HTTP cache index, so that the next run (should this one be cut
+ * short) starts from this round.
+ */
+void NewsAggregator::saveState() {
+    if (!hostStateFile.empty() && !hostLimits.save(hostStateFile)) {
+	cerr << "Couldn't save per-server download limits to \"" << hostStateFile << "\"." << endl;
+    }
+    if (!feedStateFile.empty() && !feedSchedule.save(feedStateFile)) {
+	cerr << "Couldn't save the feeds' polling schedule to \"" << feedStateFile << "\"." << endl;
+    }
+    if (httpCache != nullptr && !httpCache->save()) {
+	cerr << "Couldn't save the HTTP cache index in \"" << cacheDir << "\"." << endl;
+    }
+}
+
+/**
+ * Private Method: pollFeeds
+ * -------------------------
+ * Runs the poller thread: another round of processAllFeeds every
+ * pollSeconds, until the destructor says to stop.
+ */
+void NewsAggregator::pollFeeds() {
+    unique_lock<mutex> ul(pollLock);
+    while (!pollCondition.wait_for(ul, chrono::seconds(pollSeconds), [this] { return stopping; })) {
+	ul.unlock();
+	processAllFeeds();
+	saveState();
+	ul.lock();
+    }
 }
 
 /**
@@ -107,7 +226,9 @@ void NewsAggregator::queryIndex() const {
 	getline(cin, response);
 	response = trim(response);
 	if (response.empty()) break;
-	const vector<pair<Article, int> >& matches = index.getMatchingArticles(response);
+	indexSetLock.lock();
+	const vector<pair<Article, int> > matches = index.getMatchingArticles(response);
+	indexSetLock.unlock();
 	if (matches.empty()) {
 	    cout << "Ah, we didn't find the term \"" << response << "\". Try again." << endl;
 	} else {
@@ -144,107 +265,191 @@ void NewsAggregator::queryIndex() const {
  * of the class definition.
  */
 
-NewsAggregator::NewsAggregator(const string& rssFeedListURI, bool verbose): 
-    log(verbose), rssFeedListURI(rssFeedListURI), built(false), 
-    numFeedThread(kNumFeed), numMaxThreads(kNumMaxArticle) {}
+NewsAggregator::NewsAggregator(const string& rssFeedListURI, bool verbose, const string& hostStateFile,
+			       const string& feedStateFile, const string& cacheDir, unsigned int pollSeconds,
+			       double hedgePercentile, bool stats): 
+    log(verbose), rssFeedListURI(rssFeedListURI), hostStateFile(hostStateFile), feedStateFile(feedStateFile),
+    cacheDir(cacheDir),
+    pollSeconds(pollSeconds), stats(stats), built(false), 
+    numFeedThread(kNumFeed), numRounds(0), numFeedsChanged(0), numArticlesAdded(0), stopping(false),
+    feedSchedule(pollSeconds > 0 ? pollSeconds : FeedSchedule::kDefaultMinSeconds),
+    connectionPool(HostLimits::kMaxLimit),
+    requestPolicy(connectionPool, RequestPolicy::kDefaultMaxRetries, hedgePercentile),
+    articleExecutor(kNumMaxArticle, [this](const string& server) { return hostLimits.limit(server); }),
+    fetchedArticles(kNumQueuedArticles), parsedArticles(kNumQueuedArticles) {}
 
 
-void NewsAggregator::articleThreads(std::vector<Article> articles){
-    vector<thread> articleThreads;
-    //std::map<std::string, std::map<std::string, std::pair<Article, std::vector<std::string>>>> ArticleMap;
-    std::mutex ArticleMapLock;
-    std::mutex serverLock;
-    for(auto iter = articles.begin(); iter != articles.end(); iter++) {
-	numMaxThreads.wait();
-	articleThreads.push_back(thread([this, iter, &ArticleMapLock, &serverLock]
-	(semaphore& numMaxThreads,map<std::string, std::map<std::string, std::pair<Article, std::vector<std::string>>>> & ArticleMap) {
-		    numMaxThreads.signal(on_thread_exit);
-		    Article article = *iter;
-		    urlSetLock.lock();
-		    if(urlSet.count(article.url)) {
-		    	urlSetLock.unlock();
-		    	return;
-		    } else {
-		    	urlSet.insert(article.url);
-		   	urlSetLock.unlock();
-		    }	
-		    server Server = getURLServer(article.url);	
-		    serverLock.lock();
-		    unique_ptr<semaphore>& serverSemaph = serverSemaphoreMap[Server];
-		    if (serverSemaph == nullptr){
-			serverSemaph.reset(new semaphore(kNumPerServer));
-		    }
-		    serverLock.unlock();
-		    serverSemaph->wait();
-		    HTMLDocument htmlDocument(article.url);
-		    try{
-		    	htmlDocument.parse();
-		    } catch(const HTMLDocumentException& hde) {
-		    	serverSemaph->signal();
-		        return;
-		    }
-		    serverSemaph->signal();
-		    const auto& const_tokens = htmlDocument.getTokens(); 
-		    vector<std::string> tokens(const_tokens.begin(), const_tokens.end());
-		    sort(tokens.begin(), tokens.end());
-		    assert(is_sorted(tokens.cbegin(), tokens.cend()));
-		    Article newArticle;
-
-		    ArticleMapLock.lock();
-		    const auto& serverIt = ArticleMap.find(Server);
-		    if(serverIt != ArticleMap.end() && 
-		    serverIt->second.find(article.title) != serverIt->second.end()) {
-				vector<string> newTokens;
-				Article old = ArticleMap[Server][article.title].first;
-				vector<string> oldTokens = ArticleMap[Server][article.title].second;
-				sort(oldTokens.begin(), oldTokens.end());
+/**
+ * Private Method: fetchArticles
+ * -----------------------------
+ * Claims each of a feed's articles that no other feed has claimed, and
+ * schedules its download on the article executor under its server's key,
+ * telling hostLimits how long it took or how it failed.
+ * Once the bytes have arrived (and the server's slot has been given up),
+ * the same worker passes them on to the parse stage, waiting there if the
+ * parse stage is behind.  Doesn't wait for any of the downloads.  An
+ * article that fails to download is noted in failedURLs, so that once
+ * the round is over it can be claimed (and retried) again.  Returns how
+ * many articles it claimed.
+ */
+size_t NewsAggregator::fetchArticles(const std::vector<Article>& articles) {
+    size_t numClaimed = 0;
+    for (const Article& article : articles) {
+	urlSetLock.lock();
+	if (urlSet.count(article.url)) {
+	    urlSetLock.unlock();
+	    continue;
+	} else {
+	    urlSet.insert(article.url);
+	    urlSetLock.unlock();
+	}
+	numClaimed++;
+	auto fetched = make_shared<FetchedArticle>();
+	auto downloaded = make_shared<bool>(false);
+	fetched->article = article;
+	server Server = getURLServer(article.url);
+	articleExecutor.schedule(Server, [this, Server, fetched, downloaded] {
+	    HTMLDocument htmlDocument(fetched->article.url, requestPolicy);
+	    auto start = chrono::steady_clock::now();
+	    try {
+		fetched->contents = htmlDocument.download();
+		*downloaded = true;
+		if (!htmlDocument.wasCached()) {
+		    hostLimits.noteSuccess(Server, chrono::duration<double, milli>(chrono::steady_clock::now() - start).count());
+		}
+	    } catch (const HTMLDocumentException& hde) {
+		hostLimits.noteFailure(Server, hde.overloaded());
+		lock_guard<mutex> lg(urlSetLock);
+		failedURLs.push_back(fetched->article.url);
+	    }
+	}, [this, fetched, downloaded] {
+	    if (*downloaded) fetchedArticles.push(move(*fetched));
+	});
+    }
+    return numClaimed;
+}
 
-				set_intersection(oldTokens.cbegin(), oldTokens.cend(), 
-					tokens.cbegin(), tokens.cend(), back_inserter(newTokens));
-			
-				newArticle = min(old,article);
-				ArticleMap[Server][article.title] = make_pair(newArticle, newTokens);
-				ArticleMapLock.unlock();
-		    } else {
-				ArticleMap[Server][article.title] = make_pair(article, tokens);
-				ArticleMapLock.unlock();
-		    }
-	},ref(numMaxThreads),ref(ArticleMap)));
+/**
+ * Private Method: parseArticles
+ * -----------------------------
+ * Runs one thread of the parse stage: tokenizes downloaded articles and
+ * passes their sorted tokens on to the merge stage, until the fetch stage
+ * is done and its queue has been drained.
+ */
+void NewsAggregator::parseArticles() {
+    FetchedArticle fetched;
+    while (fetchedArticles.pop(fetched)) {
+	HTMLDocument htmlDocument(fetched.article.url, requestPolicy);
+	try {
+	    htmlDocument.parse(fetched.contents);
+	} catch (const HTMLDocumentException& hde) {
+	    continue;
+	}
+	const auto& const_tokens = htmlDocument.getTokens();
+	vector<std::string> tokens(const_tokens.begin(), const_tokens.end());
+	sort(tokens.begin(), tokens.end());
+	parsedArticles.push({fetched.article, move(tokens)});
     }
-    for (thread& t: articleThreads) t.join();
-    /*
-    for(auto serverIt = ArticleMap.begin(); serverIt != ArticleMap.end(); serverIt++) {
-	for (auto articleIt = serverIt->second.cbegin(); articleIt != serverIt->second.cend(); articleIt++) {
-	    indexSetLock.lock();
-	    index.add(articleIt->second.first, articleIt->second.second);
-	    indexSetLock.unlock();
+}
+
+/**
+ * Private Method: mergeArticles
+ * -----------------------------
+ * Runs the merge stage, the only thread that touches ArticleMap: folds
+ * each parsed article's tokens into ArticleMap, intersecting them with
+ * those of any article already recorded under the same server and title.
+ * The first time in a round that it changes an entry, it notes in
+ * replaced what the entry was before (or that there wasn't one).
+ */
+void NewsAggregator::mergeArticles() {
+    ParsedArticle parsed;
+    while (parsedArticles.pop(parsed)) {
+	const Article& article = parsed.article;
+	vector<string>& tokens = parsed.tokens;
+	assert(is_sorted(tokens.cbegin(), tokens.cend()));
+	server Server = getURLServer(article.url);
+	auto& articles = ArticleMap[Server];
+	auto found = articles.find(article.title);
+	auto key = make_pair(Server, article.title);
+	if (replaced.find(key) == replaced.end()) {
+	    if (found != articles.end()) {
+		replaced[key] = make_pair(true, found->second);
+	    } else {
+		replaced[key].first = false;
+		numArticlesAdded++;
+	    }
 	}
-    }*/
+	if (found != articles.end()) {
+	    vector<string> newTokens;
+	    const vector<string>& oldTokens = found->second.second;
+
+	    set_intersection(oldTokens.cbegin(), oldTokens.cend(),
+		    tokens.cbegin(), tokens.cend(), back_inserter(newTokens));
+
+	    Article newArticle = min(found->second.first, article);
+	    found->second = make_pair(newArticle, move(newTokens));
+	} else {
+	    articles[article.title] = make_pair(article, move(tokens));
+	}
+    }
 }
 
+/**
+ * Private Method: updateIndex
+ * ---------------------------
+ * Brings the index up to date with the round's changes to ArticleMap, by
+ * removing each replaced entry's old words and adding its new ones, all
+ * without letting a query see the index half done.
+ */
+void NewsAggregator::updateIndex() {
+    lock_guard<mutex> lg(indexSetLock);
+    for (const auto& replacement : replaced) {
+	const auto& previous = replacement.second;
+	if (previous.first) index.remove(previous.second.first, previous.second.second);
+	const auto& current = ArticleMap[replacement.first.first][replacement.first.second];
+	index.add(current.first, current.second);
+    }
+    replaced.clear();
+}
 
 void NewsAggregator::feedThread(const pair<string, string>& it) {
     numFeedThread.signal(on_thread_exit);
     urlSetLock.lock();
     std::string xmlUrl = it.first;
     std::string xmlTitle = it.second;
-    if(urlSet.count(xmlUrl)) {
+    if(feedsPolled.count(xmlUrl)) {
 	urlSetLock.unlock();
 	return;
     }
     else {
-	urlSet.insert(xmlUrl);
+	feedsPolled.insert(xmlUrl);
 	urlSetLock.unlock();
     }
-    RSSFeed rssFeed(xmlUrl);
+    feedValidatorsLock.lock();
+    HTTPValidators validators = feedValidators[xmlUrl];
+    feedValidatorsLock.unlock();
+    RSSFeed rssFeed(xmlUrl, requestPolicy);
+    time_t now = time(NULL);
     try{
-	rssFeed.parse();
+	if (!rssFeed.parseIfChanged(validators)) {
+	    log.noteSingleFeedDownloadSkipped(xmlUrl);
+	    feedSchedule.notePoll(xmlUrl, 0, now);
+	    return;
+	}
     } catch(const RSSFeedException& exception) {
 	log.noteSingleFeedDownloadFailure(xmlUrl);
+	feedSchedule.noteFailure(xmlUrl, now);
 	return;
     }
+    numFeedsChanged++;
+    feedValidatorsLock.lock();
+    feedValidators[xmlUrl] = validators;
+    feedValidatorsLock.unlock();
     const auto& articles = rssFeed.getArticles();
-    articleThreads(articles);    
+    size_t numNew = fetchArticles(articles);
+    // in the first round every article is new, which says nothing about how often the feed changes
+    if (numRounds == 1) feedSchedule.noteFirstPoll(xmlUrl, now);
+    else feedSchedule.notePoll(xmlUrl, numNew, now);
 }
 
 
@@ -256,6 +461,11 @@ void NewsAggregator::feedThread(const pair<string, string>& it) {
  * Downloads and parses the encapsulated RSSFeedList, which itself
  * leads to RSSFeeds, which themsleves lead to HTMLDocuemnts, which
  * can be collectively parsed for their tokens to build a huge RSSIndex.
+ * Called once per round: the first builds the index, and later ones
+ * (run by the poller) update it with whatever has changed since.
+ *
+ * A feed list that can't be had ends the program the first time, and
+ * just this round after that.  So does a round with no feeds due.
  * 
  * The vast majority of your Assignment 5 work has you implement this
  * method using multithreading while respecting the imposed constraints
@@ -268,25 +478,47 @@ void NewsAggregator::processAllFeeds() {
     try {
 	rssFeedList.parse();
     }catch(const RSSFeedListException& rfle) {
-	log.noteFullRSSFeedListDownloadFailureAndExit(rssFeedListURI);
+	if (numRounds == 0) log.noteFullRSSFeedListDownloadFailureAndExit(rssFeedListURI);
+	log.noteFullRSSFeedListDownloadFailure(rssFeedListURI);
 	return;
     }
-    vector<thread> threads;
     const auto& feeds = rssFeedList.getFeeds();
     //* Usage: const auto& feeds = list.getFeeds();
-    for(const pair<string, string>& feed : feeds){ 
+    vector<string> due;
+    for (const pair<string, string>& feed : feeds) due.push_back(feed.first);
+    if (numRounds > 0) {
+	due = feedSchedule.due(due, time(NULL), kMaxFeedsPerRound);
+	if (due.empty()) return;
+    }
+    numRounds++;
+    feedsPolled.clear();
+    numFeedsChanged = 0;
+    numArticlesAdded = 0;
+    fetchedArticles.reopen();
+    parsedArticles.reopen();
+    vector<thread> parsers;
+    for (unsigned int i = 0; i < max(thread::hardware_concurrency(), 1u); i++) {
+	parsers.push_back(thread([this] {parseArticles();}));
+    }
+    thread merger([this] {mergeArticles();});
+    vector<thread> threads;
+    for (const string& url : due) {
+	pair<string, string> feed = *feeds.find(url);
 	numFeedThread.wait();
 	threads.push_back(thread([this, feed] {feedThread(feed);}));
     }
     for (thread& feedThread : threads){
 	feedThread.join();
     }
-    for(auto serverIt = ArticleMap.begin(); serverIt != ArticleMap.end(); serverIt++) {
-        for (auto articleIt = serverIt->second.cbegin(); articleIt != serverIt->second.cend(); articleIt++) {
-            indexSetLock.lock();
-            index.add(articleIt->second.first, articleIt->second.second);
-            indexSetLock.unlock();
-        }
-    }
-
+    articleExecutor.wait();
+    fetchedArticles.close();
+    for (thread& parser : parsers) parser.join();
+    parsedArticles.close();
+    merger.join();
+    updateIndex();
+    urlSetLock.lock();
+    for (const string& url : failedURLs) urlSet.erase(url);
+    failedURLs.clear();
+    urlSetLock.unlock();
+    log.noteIndexUpdated(numRounds, numFeedsChanged, due.size(), numArticlesAdded);
 }
@@ -12,10 +12,21 @@
 #include <unordered_set>
 #include <unordered_map>
 #include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <atomic>
 #include<iostream>
 #include "log.h"
 #include "rss-index.h"
 #include "semaphore.h"
+#include "keyed-executor.h"
+#include "bounded-queue.h"
+#include "host-limits.h"
+#include "feed-schedule.h"
+#include "connection-pool.h"
+#include "request-policy.h"
+#include "http-cache.h"
+#include <memory>
 using namespace std;
 class NewsAggregator {
 
@@ -29,13 +40,22 @@ public:
  * their news articles, all in the pursuit of compiling one big, bad index.
  */
   static NewsAggregator *createNewsAggregator(int argc, char *argv[]);
+
+/**
+ * Destructor: ~NewsAggregator
+ * ---------------------------
+ * Stops polling for updates, if it was, once any update underway is done.
+ */
+  ~NewsAggregator();
  
 /**
  * Method: buildIndex
  * ------------------
  * Pulls the embedded RSSFeedList, parses it, parses the
  * RSSFeeds, and finally parses the HTMLDocuments they
- * reference to actually build the index.
+ * reference to actually build the index.  Given a pollSeconds,
+ * then goes on polling the feeds in the background every
+ * pollSeconds, adding whatever articles are new to the index.
  */
   void buildIndex();
 
@@ -43,7 +63,8 @@ public:
  * Method: queryIndex
  * ------------------
  * Provides the read-query-print loop that allows the user to
- * query the index to list articles.
+ * query the index to list articles.  Queries are answered while the
+ * index is being updated, from the index as it stood before or after.
  */
   void queryIndex() const;
   
@@ -63,30 +84,112 @@ public:
  
   NewsAggregatorLog log;
   std::string rssFeedListURI;
+  std::string hostStateFile;
+  std::string feedStateFile;
+  std::string cacheDir;
+  unsigned int pollSeconds;
+  bool stats;
   RSSIndex index;
   bool built;
 
-  std::mutex serverLock;
-  std::mutex articleMapLock;
   std::mutex urlSetLock;
-  std::mutex indexSetLock;
+  mutable std::mutex indexSetLock;
 
   semaphore numFeedThread;
-  semaphore numArticleThread;
-  semaphore numMaxThreads;
   std::map<std::string, std::map<std::string, std::pair<Article, std::vector<std::string>>>> ArticleMap;
-  std::unordered_map<server, std::unique_ptr<semaphore>> serverSemaphoreMap;
   std::unordered_set<std::string> urlSet;
+  std::vector<std::string> failedURLs;
+
+/**
+ * The index is built in rounds, the first by buildIndex and any later
+ * ones by the poller thread, every pollSeconds until the destructor sets
+ * stopping.  Each round re-reads the feed list and downloads its feeds
+ * (feedsPolled keeps a feed listed twice from being downloaded twice in
+ * one round), conditional on their having changed since the validators
+ * recorded in feedValidators.  The first round downloads every feed;
+ * later ones only those feedSchedule says are due, and no more than
+ * kMaxFeedsPerRound of them, and every poll tells feedSchedule how many
+ * new articles it turned up.  feedSchedule is loaded from feedStateFile
+ * and saved back to it like hostLimits.  Only articles no earlier round
+ * has claimed in urlSet are fetched, and an article whose download fails
+ * is released again, so the next round retries it.
+ *
+ * The merge stage records in replaced every (server, title) entry of
+ * ArticleMap it changes, along with what that entry was before the round
+ * (if anything), and once the round is done the index trades the old
+ * entries for the new ones in one go, under indexSetLock, which queries
+ * hold only as long as it takes to look up their term.  So the first
+ * round adds everything, and later ones add only what's new.
+ */
+  typedef std::map<std::pair<server, title>, std::pair<bool, std::pair<Article, std::vector<std::string>>>> Replacements;
+
+  size_t numRounds;
+  std::unordered_set<std::string> feedsPolled;
+  std::mutex feedValidatorsLock;
+  std::unordered_map<std::string, HTTPValidators> feedValidators;
+  std::atomic<size_t> numFeedsChanged;
+  Replacements replaced;
+  size_t numArticlesAdded;
+  std::thread poller;
+  std::mutex pollLock;
+  std::condition_variable pollCondition;
+  bool stopping;
   static const unsigned int kNumFeed = 8;
   static const unsigned int kNumMaxArticle = 24;
-  static const unsigned int kNumPerServer = 10; 
+  static const unsigned int kNumQueuedArticles = 32;
+  static const unsigned int kMaxFeedsPerRound = 64;
+
+/**
+ * Articles go through three stages.  The fetch stage downloads them on
+ * articleExecutor, one KeyedExecutor keyed by server and shared by every
+ * feed, so that no more downloads hit any one server at a time than
+ * hostLimits currently allows it, and articles waiting on a busy server
+ * wait in its backlog instead of tying up one of the kNumMaxArticle
+ * download threads.  Every download's outcome feeds back into
+ * hostLimits, which is loaded from hostStateFile before the downloads
+ * start and saved back to it once they're done.  Feeds and articles alike
+ * download under requestPolicy, which times out, retries and (given a
+ * --hedge percentile) hedges them, over connectionPool, so consecutive
+ * downloads from the same server share a connection, and given a
+ * cacheDir, through httpCache, so that a re-run only downloads what may
+ * have changed since.  Redirect chains (RedirectCache::shared()) and host
+ * names (DNSCache::shared()) are remembered across every download.  The
+ * downloaded bytes go on fetchedArticles to the parse stage, one thread
+ * per core, which tokenizes them; and the tokens go on parsedArticles to
+ * the single merge thread, which alone updates ArticleMap.
+ *
+ * Both queues hold at most kNumQueuedArticles articles, so a slow stage
+ * holds up the one before it.  A download gives up its server's slot as
+ * soon as its bytes arrive, before waiting for room on fetchedArticles,
+ * and parsing never waits on the network.
+ */
+  struct FetchedArticle {
+    Article article;
+    std::string contents;
+  };
+
+  struct ParsedArticle {
+    Article article;
+    std::vector<std::string> tokens;
+  };
+
+  HostLimits hostLimits;
+  FeedSchedule feedSchedule;
+  std::unique_ptr<HTTPCache> httpCache;
+  ConnectionPool connectionPool;
+  RequestPolicy requestPolicy;
+  KeyedExecutor articleExecutor;
+  BoundedQueue<FetchedArticle> fetchedArticles;
+  BoundedQueue<ParsedArticle> parsedArticles;
 /**
  * Constructor: NewsAggregator
  * ---------------------------
  * Private constructor used exclusively by the createNewsAggregator function
  * (and no one else) to construct a NewsAggregator around the supplied URI.
  */
-  NewsAggregator(const std::string& rssFeedListURI, bool verbose);
+  NewsAggregator(const std::string& rssFeedListURI, bool verbose, const std::string& hostStateFile,
+                 const std::string& feedStateFile, const std::string& cacheDir, unsigned int pollSeconds,
+                 double hedgePercentile, bool stats);
 
 /**
  * Method: processAllFeeds
@@ -96,12 +199,22 @@ public:
  */
 
  // void NewsAggregator::parseFeeds(const map<string, string>& feeds);
-  void articleThreads(std::vector<Article> articles);
+  size_t fetchArticles(const std::vector<Article>& articles);
+
+  void parseArticles();
+
+  void mergeArticles();
 
   void feedThread(const pair<string, string>& it);
 
   void processAllFeeds();
 
+  void updateIndex();
+
+  void saveState();
+
+  void pollFeeds();
+
 /**
  * Copy Constructor, Assignment Operator
  * -------------------------------------
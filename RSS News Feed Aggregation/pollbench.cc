@@ -0,0 +1,195 @@
+/**
+ * File: pollbench.cc
+ * ------------------
+ * Measures what polling in rounds, as aggregate --daemon does, costs with
+ * and without conditional requests and incremental index updates.  A
+ * StandInServer (paced to kLinkBytesPerSecond) serves kNumFeeds feeds of
+ * kItemsPerFeed items each, with ETags, and between rounds one feed in
+ * kChangeEvery gets a new item.  Each round downloads every feed, either
+ * unconditionally (parse) or conditionally (parseIfChanged), and then
+ * brings an RSSIndex up to date, either by rebuilding it from every
+ * article seen so far or by adding just the new ones to the index it
+ * already has.
+ *
+ * Usage: ./pollbench [<number of rounds>]
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <map>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <random>
+#include <memory>
+#include <algorithm>
+#include "connection-pool.h"
+#include "request-policy.h"
+#include "rss-feed.h"
+#include "rss-index.h"
+#include "stand-in-server.h"
+using namespace std;
+
+static const size_t kDefaultRounds = 10;
+static const size_t kNumFeeds = 60;
+static const size_t kItemsPerFeed = 40;
+static const size_t kChangeEvery = 10;
+static const size_t kNumThreads = 8;
+static const size_t kWordsPerArticle = 200;
+static const size_t kVocabularySize = 5000;
+static const size_t kLinkBytesPerSecond = 4 << 20;
+
+/**
+ * The feeds as the server has them: feed i's items are numbered from
+ * first[i], newest first, and its version changes whenever it does.
+ */
+struct Feeds {
+  mutex lock;
+  vector<size_t> first;
+  vector<size_t> version;
+
+  string document(size_t feed, const string& server) {
+    string document = "<?xml version=\"1.0\"?>\n<rss version=\"2.0\"><channel><title>Feed " + to_string(feed) + "</title>\n";
+    for (size_t item = first[feed]; item < first[feed] + kItemsPerFeed; item++) {
+      string id = to_string(feed) + "-" + to_string(item);
+      document += "<item><title>Story " + id + "</title><link>" + server + "/article/" + id + "</link>"
+                  "<description>A paragraph or so summing up story " + id + ", much as real feeds carry for "
+                  "every item, which makes up most of the bytes of a feed.</description></item>\n";
+    }
+    return document + "</channel></rss>\n";
+  }
+};
+
+/**
+ * Stands in for an article's tokens: kWordsPerArticle words drawn from the
+ * vocabulary according to its URL, sorted.
+ */
+static vector<string> tokens(const string& url) {
+  mt19937 random(hash<string>()(url));
+  vector<string> words;
+  for (size_t i = 0; i < kWordsPerArticle; i++) words.push_back("w" + to_string(random() % kVocabularySize));
+  sort(words.begin(), words.end());
+  return words;
+}
+
+struct Result {
+  double downloadMillis;
+  double indexMillis;
+  size_t numServed;
+  size_t numBytesReceived;
+  size_t numArticles;
+};
+
+static Result run(size_t numRounds, bool conditional, bool incremental) {
+  Feeds feeds;
+  feeds.first.assign(kNumFeeds, 0);
+  feeds.version.assign(kNumFeeds, 0);
+  StandInServer::Options options;
+  options.bytesPerSecond = kLinkBytesPerSecond;
+  string base;
+  StandInServer server([&feeds, &base](const StandInServer::Request& request) {
+    StandInServer::Reply reply;
+    size_t feed = strtoul(request.target.c_str() + strlen("/feed/"), NULL, 10);
+    lock_guard<mutex> lg(feeds.lock);
+    string etag = "\"" + to_string(feeds.version[feed]) + "\"";
+    reply.headers.push_back({"ETag", etag});
+    reply.headers.push_back({"Cache-Control", "no-cache"});
+    auto condition = request.headers.find("if-none-match");
+    if (condition != request.headers.end() && condition->second == etag) {
+      reply.status = 304;
+    } else {
+      reply.body = feeds.document(feed, base);
+    }
+    return reply;
+  }, options);
+  base = server.url("");
+
+  ConnectionPool pool(kNumThreads);
+  RequestPolicy policy(pool);
+  vector<HTTPValidators> validators(kNumFeeds);
+  map<string, vector<string>> seen;   // tokens, keyed by URL, as ArticleMap keeps them
+  vector<Article> all;
+  unique_ptr<RSSIndex> index(new RSSIndex);
+  Result result = {0, 0, 0, 0, 0};
+  size_t numServedBefore = server.getNumRequests();
+  for (size_t round = 0; round < numRounds; round++) {
+    if (round > 0) {
+      lock_guard<mutex> lg(feeds.lock);
+      for (size_t feed = round % kChangeEvery; feed < kNumFeeds; feed += kChangeEvery) {
+        feeds.first[feed]++;
+        feeds.version[feed]++;
+      }
+    }
+    atomic<size_t> next(0);
+    atomic<size_t> numFailed(0);
+    mutex articlesLock;
+    vector<Article> found;
+    vector<thread> threads;
+    auto start = chrono::steady_clock::now();
+    for (size_t i = 0; i < kNumThreads; i++) {
+      threads.push_back(thread([&] {
+        for (size_t feed = next++; feed < kNumFeeds; feed = next++) {
+          RSSFeed rssFeed(server.url("/feed/" + to_string(feed)), policy);
+          try {
+            if (conditional) rssFeed.parseIfChanged(validators[feed]);
+            else rssFeed.parse();
+          } catch (const RSSFeedException& e) {
+            if (numFailed++ == 0) cerr << e.what() << endl;
+          }
+          lock_guard<mutex> lg(articlesLock);
+          found.insert(found.end(), rssFeed.getArticles().begin(), rssFeed.getArticles().end());
+        }
+      }));
+    }
+    for (thread& t : threads) t.join();
+    auto downloaded = chrono::steady_clock::now();
+    if (numFailed > 0) {
+      cerr << numFailed << " downloads failed!" << endl;
+      exit(1);
+    }
+
+    vector<Article> added;
+    for (const Article& article : found) {
+      if (seen.count(article.url) == 0) {
+        seen[article.url] = tokens(article.url);
+        added.push_back(article);
+      }
+    }
+    all.insert(all.end(), added.begin(), added.end());
+    auto tokenized = chrono::steady_clock::now();
+    if (incremental) {
+      for (const Article& article : added) index->add(article, seen[article.url]);
+    } else {
+      index.reset(new RSSIndex);
+      for (const Article& article : all) index->add(article, seen[article.url]);
+    }
+    auto indexed = chrono::steady_clock::now();
+    result.downloadMillis += chrono::duration<double, milli>(downloaded - start).count();
+    result.indexMillis += chrono::duration<double, milli>(indexed - tokenized).count();
+  }
+  result.numServed = server.getNumRequests() - numServedBefore;
+  result.numBytesReceived = pool.getNumBytesReceived();
+  result.numArticles = all.size();
+  return result;
+}
+
+int main(int argc, char *argv[]) {
+  size_t numRounds = argc > 1 ? strtoul(argv[1], NULL, 10) : kDefaultRounds;
+  cout << numRounds << " rounds over " << kNumFeeds << " feeds of " << kItemsPerFeed << " items, one feed in "
+       << kChangeEvery << " changing between rounds:" << endl;
+  cout << setw(28) << "" << setw(10) << "served" << setw(12) << "KB on wire" << setw(10) << "articles"
+       << setw(14) << "download ms" << setw(12) << "index ms" << endl;
+  for (bool conditional : {false, true}) {
+    bool incremental = conditional;
+    Result result = run(numRounds, conditional, incremental);
+    cout << setw(28) << (conditional ? "conditional, incremental" : "unconditional, rebuild") << setw(10)
+         << result.numServed << setw(12) << result.numBytesReceived / 1024 << setw(10) << result.numArticles
+         << setw(14) << fixed << setprecision(0) << result.downloadMillis << setw(12) << result.indexMillis << endl;
+  }
+  return 0;
+}
@@ -0,0 +1,132 @@
+/**
+ * File: redirbench.cc
+ * -------------------
+ * Measures what the DNSCache and RedirectCache save when feeds sit behind
+ * a tracking redirector, as feedproxy-style feed links do.  kNumFeeds
+ * feeds, listed by their redirector URLs, are polled kNumRounds times by
+ * kNumThreads threads, each poll an RSSFeed::parse.  The redirector
+ * closes every connection (so each hop pays for connection setup, which
+ * acceptDelay stands in for, and a lookup of the host name), and both it
+ * and the feed server take kRoundTripMillis to answer.
+ *
+ * Polling is timed with neither cache, with just the DNS cache, and with
+ * both, reporting how many requests the redirector saw, how many times
+ * the system's resolver was asked, and how long it all took.
+ *
+ * Usage: ./redirbench [<number of rounds>]
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include "connection-pool.h"
+#include "request-policy.h"
+#include "redirect-cache.h"
+#include "dns-cache.h"
+#include "rss-feed.h"
+#include "stand-in-server.h"
+using namespace std;
+
+static const size_t kDefaultRounds = 4;
+static const size_t kNumFeeds = 40;
+static const size_t kItemsPerFeed = 10;
+static const size_t kNumThreads = 8;
+static const unsigned int kRoundTripMillis = 10;
+
+/**
+ * Names the server by host name rather than address, so connections to it
+ * have to be resolved.
+ */
+static string byName(const string& url) {
+  size_t address = url.find("127.0.0.1");
+  return address == string::npos ? url : url.substr(0, address) + "localhost" + url.substr(address + strlen("127.0.0.1"));
+}
+
+struct Result {
+  size_t numRedirected;
+  size_t numLookups;
+  double wallMillis;
+};
+
+static Result run(size_t numRounds, bool dns, bool redirects) {
+  StandInServer feeds([](const StandInServer::Request& request) {
+    this_thread::sleep_for(chrono::milliseconds(kRoundTripMillis));
+    StandInServer::Reply reply;
+    reply.body = "<?xml version=\"1.0\"?>\n<rss version=\"2.0\"><channel><title>" + request.target + "</title>\n";
+    for (size_t item = 0; item < kItemsPerFeed; item++) {
+      reply.body += "<item><title>Story " + to_string(item) + "</title><link>http://example.com" + request.target +
+                    "/" + to_string(item) + "</link></item>\n";
+    }
+    reply.body += "</channel></rss>\n";
+    return reply;
+  });
+  string feedBase = byName(feeds.url(""));
+  StandInServer::Options options;
+  options.keepAlive = false;
+  options.acceptDelay = chrono::milliseconds(kRoundTripMillis);
+  StandInServer redirector([&feedBase](const StandInServer::Request& request) {
+    this_thread::sleep_for(chrono::milliseconds(kRoundTripMillis));
+    StandInServer::Reply reply;
+    reply.status = 302;
+    reply.headers.push_back({"Location", feedBase + "/feed" + request.target.substr(strlen("/r"))});
+    return reply;
+  }, options);
+
+  DNSCache resolver;
+  ConnectionPool pool(kNumThreads, ConnectionPool::kDefaultIdleSeconds, ConnectionPool::kDefaultTimeoutSeconds,
+                      &TLSSessionCache::shared(), dns ? &resolver : nullptr);
+  RequestPolicy policy(pool);
+  RedirectCache cache(redirects ? RedirectCache::kDefaultMaxSeconds : 0);
+  atomic<size_t> numFailed(0);
+  auto start = chrono::steady_clock::now();
+  for (size_t round = 0; round < numRounds; round++) {
+    atomic<size_t> next(0);
+    vector<thread> threads;
+    for (size_t i = 0; i < kNumThreads; i++) {
+      threads.push_back(thread([&] {
+        for (size_t feed = next++; feed < kNumFeeds; feed = next++) {
+          RSSFeed rssFeed(byName(redirector.url("/r/" + to_string(feed))), policy, cache);
+          try {
+            rssFeed.parse();
+            if (rssFeed.getArticles().size() != kItemsPerFeed) numFailed++;
+          } catch (const RSSFeedException& e) {
+            if (numFailed++ == 0) cerr << e.what() << endl;
+          }
+        }
+      }));
+    }
+    for (thread& t : threads) t.join();
+  }
+  Result result;
+  result.wallMillis = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+  if (numFailed > 0) {
+    cerr << numFailed << " polls failed!" << endl;
+    exit(1);
+  }
+  result.numRedirected = redirector.getNumRequests();
+  result.numLookups = dns ? resolver.getNumLookups() : redirector.getNumConnections() + feeds.getNumConnections();
+  if (dns) resolver.printStats(cerr);
+  if (redirects) cache.printStats(cerr);
+  return result;
+}
+
+int main(int argc, char *argv[]) {
+  size_t numRounds = argc > 1 ? strtoul(argv[1], NULL, 10) : kDefaultRounds;
+  cout << numRounds << " rounds over " << kNumFeeds << " feeds behind a redirector, " << kRoundTripMillis
+       << "ms round trips:" << endl;
+  cout << setw(24) << "" << setw(12) << "redirected" << setw(12) << "lookups" << setw(10) << "wall ms" << endl;
+  for (int caches = 0; caches < 3; caches++) {
+    Result result = run(numRounds, caches >= 1, caches >= 2);
+    cout << setw(24) << (caches == 0 ? "no caches" : caches == 1 ? "DNS cache" : "DNS and redirect caches")
+         << setw(12) << result.numRedirected << setw(12) << result.numLookups << setw(10) << fixed
+         << setprecision(0) << result.wallMillis << endl;
+  }
+  return 0;
+}
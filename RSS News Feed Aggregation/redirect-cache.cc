@@ -0,0 +1,82 @@
+/**
+ * File: redirect-cache.cc
+ * -----------------------
+ * Presents the implementation of the RedirectCache class.
+ */
+
+#include "redirect-cache.h"
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+using namespace std;
+
+const size_t RedirectCache::kPermanentSeconds;
+const size_t RedirectCache::kTemporarySeconds;
+
+RedirectCache::RedirectCache(size_t maxSeconds, size_t maxURLs) :
+  maxLifetime(maxSeconds), maxURLs(max<size_t>(maxURLs, 1)), numLookups(0), numHits(0), numHopsSaved(0),
+  numStored(0), numForgotten(0) {}
+
+RedirectCache& RedirectCache::shared() {
+  static RedirectCache cache;
+  return cache;
+}
+
+string RedirectCache::lookup(const string& url) {
+  lock_guard<mutex> lg(lock);
+  numLookups++;
+  auto found = chains.find(url);
+  if (found == chains.end()) return url;
+  if (found->second.expires <= chrono::steady_clock::now()) {
+    chains.erase(found);
+    return url;
+  }
+  numHits++;
+  numHopsSaved += found->second.numHops;
+  return found->second.target;
+}
+
+chrono::seconds RedirectCache::lifetime(const HTTPResponse& response) const {
+  string control = response.header("cache-control");
+  transform(control.begin(), control.end(), control.begin(), ::tolower);
+  if (control.find("no-store") != string::npos || control.find("no-cache") != string::npos) return chrono::seconds(0);
+  size_t maxAge = control.find("max-age=");
+  if (maxAge != string::npos && (maxAge == 0 || control[maxAge - 1] != '-')) {
+    long seconds = strtol(control.c_str() + maxAge + strlen("max-age="), NULL, 10);
+    return min(chrono::seconds(max(seconds, 0L)), maxLifetime);
+  }
+  bool permanent = response.status == 301 || response.status == 308;
+  return min(chrono::seconds(permanent ? kPermanentSeconds : kTemporarySeconds), maxLifetime);
+}
+
+/**
+ * Once the cache is full, expired chains make way first, and then
+ * whichever chains come first.
+ */
+void RedirectCache::store(const string& url, const string& target, size_t numHops, chrono::seconds lifetime) {
+  if (lifetime.count() <= 0 || numHops == 0 || url == target) return;
+  auto now = chrono::steady_clock::now();
+  lock_guard<mutex> lg(lock);
+  if (chains.size() >= maxURLs && chains.count(url) == 0) {
+    for (auto entry = chains.begin(); entry != chains.end();) {
+      if (entry->second.expires <= now) entry = chains.erase(entry);
+      else ++entry;
+    }
+    while (chains.size() >= maxURLs) chains.erase(chains.begin());
+  }
+  chains[url] = {target, numHops, now + lifetime};
+  numStored++;
+}
+
+void RedirectCache::forget(const string& url) {
+  lock_guard<mutex> lg(lock);
+  if (chains.erase(url) > 0) numForgotten++;
+}
+
+void RedirectCache::printStats(ostream& out) const {
+  lock_guard<mutex> lg(lock);
+  out << "Redirects: " << numStored << " chains remembered, " << numHits << " of " << numLookups
+      << " lookups answered, saving " << numHopsSaved << " round trips; " << numForgotten
+      << " forgotten once they stopped working." << endl;
+}
@@ -0,0 +1,89 @@
+/**
+ * File: redirect-cache.h
+ * ----------------------
+ * Defines the RedirectCache class, which remembers where a URL's chain of
+ * redirects ended up, so that downloading it again (the same story linked
+ * from two feeds, or a feed polled round after round) goes straight to
+ * the end of the chain instead of following every hop, each a round trip
+ * of its own and often a connection to a tracking redirector as well.
+ *
+ * A chain is kept for as long as the shortest-lived of its hops: a hop's
+ * Cache-Control max-age if it has one, or else kPermanentSeconds for a
+ * 301 or 308 and kTemporarySeconds for any other redirect (redirectors
+ * rarely say, and resolve the same way every time), but never longer than
+ * maxSeconds.  A hop marked no-store or no-cache isn't kept at all.
+ *
+ * The cache can't know a chain has changed until its end stops working,
+ * so callers that find the end of a remembered chain gone (a 4xx, say)
+ * should forget it and follow the chain from the start again.
+ */
+
+#pragma once
+#include <cstddef>
+#include <string>
+#include <map>
+#include <mutex>
+#include <chrono>
+#include <ostream>
+#include "connection-pool.h"
+
+class RedirectCache {
+ public:
+  static const size_t kPermanentSeconds = 24 * 60 * 60;
+  static const size_t kTemporarySeconds = 60 * 60;
+  static const size_t kDefaultMaxSeconds = 24 * 60 * 60;
+  static const size_t kDefaultMaxURLs = 100000;
+
+  RedirectCache(size_t maxSeconds = kDefaultMaxSeconds, size_t maxURLs = kDefaultMaxURLs);
+
+/**
+ * Returns the cache shared by every RSSFeed and HTMLDocument that isn't
+ * handed one of their own.
+ */
+  static RedirectCache& shared();
+
+/**
+ * Returns where the URL's chain of redirects last ended up, if that's
+ * still fresh, or else the URL itself.
+ */
+  std::string lookup(const std::string& url);
+
+/**
+ * Returns how long the redirect in the response may be remembered for (0
+ * if it mayn't).
+ */
+  std::chrono::seconds lifetime(const HTTPResponse& response) const;
+
+/**
+ * Records that following the URL through numHops redirects ended at
+ * target, which may be remembered for lifetime.
+ */
+  void store(const std::string& url, const std::string& target, size_t numHops, std::chrono::seconds lifetime);
+
+/**
+ * Forgets where the URL's chain of redirects ended up.
+ */
+  void forget(const std::string& url);
+
+  void printStats(std::ostream& out) const;
+
+ private:
+  struct Entry {
+    std::string target;
+    size_t numHops;
+    std::chrono::steady_clock::time_point expires;
+  };
+
+  std::chrono::seconds maxLifetime;
+  size_t maxURLs;
+  mutable std::mutex lock;           // guards everything below
+  std::map<std::string, Entry> chains;
+  size_t numLookups;
+  size_t numHits;
+  size_t numHopsSaved;
+  size_t numStored;
+  size_t numForgotten;
+
+  RedirectCache(const RedirectCache& original) = delete;
+  RedirectCache& operator=(const RedirectCache& rhs) = delete;
+};
@@ -0,0 +1,288 @@
+/**
+ * File: request-policy.cc
+ * -----------------------
+ * Presents the implementation of the RequestPolicy class.
+ */
+
+#include "request-policy.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <exception>
+#include <thread>
+using namespace std;
+
+static const size_t kWindow = 100;                  // latencies kept per origin
+static const size_t kMinSamples = 10;               // before an origin's latencies are trusted
+static const double kTimeoutFactor = 3;             // times the 99th percentile
+static const double kMinTimeout = 1000;             // in milliseconds
+static const double kMaxTimeout = 20000;
+static const double kBaseBackoff = 100;             // before the first retry, at most
+static const double kMaxBackoff = 2000;
+static const double kMaxHedgeFraction = 0.1;        // of requests, at most, that are hedged
+static const size_t kNumHedgers = 4;                // threads sending hedges
+
+/**
+ * A request and (maybe) its hedge.  The first to finish with a response
+ * decides the race; if neither does, the last to fail decides it with its
+ * exception.
+ */
+struct RequestPolicy::Race {
+  mutex lock;
+  condition_variable done;
+  size_t numLaunched = 1;
+  size_t numFinished = 0;
+  bool decided = false;
+  size_t winner = 0;
+  HTTPResponse response;
+  exception_ptr error;
+  atomic<bool> cancelled[2];
+
+  Race() {
+    cancelled[0] = false;
+    cancelled[1] = false;
+  }
+};
+
+RequestPolicy::RequestPolicy(ConnectionPool& pool, size_t maxRetries, double hedgePercentile) :
+  pool(pool), maxRetries(maxRetries), hedgePercentile(min(max(hedgePercentile, 0.0), 100.0)),
+  stopping(false), random(random_device()()), numRequests(0), numRetries(0), numTimeouts(0), numHedged(0),
+  numHedgesWon(0), numFailed(0) {
+  if (this->hedgePercentile > 0) {
+    for (size_t i = 0; i < kNumHedgers; i++) hedgers.push_back(thread(&RequestPolicy::sendHedges, this));
+  }
+}
+
+RequestPolicy::~RequestPolicy() {
+  lock.lock();
+  stopping = true;
+  lock.unlock();
+  hedgeDue.notify_all();
+  for (thread& hedger : hedgers) hedger.join();
+}
+
+RequestPolicy& RequestPolicy::shared() {
+  static RequestPolicy policy(ConnectionPool::shared());
+  return policy;
+}
+
+static bool transient(unsigned int status) {
+  return status == 429 || status == 500 || status == 502 || status == 503 || status == 504;
+}
+
+HTTPResponse RequestPolicy::get(const string& url, const ConnectionPool::BodySink& sink,
+                                const HTTPValidators& validators) {
+  string origin = ConnectionPool::origin(url);
+  lock.lock();
+  numRequests++;
+  lock.unlock();
+  bool delivered = false;
+  ConnectionPool::BodySink tracked;
+  if (sink) {
+    tracked = [&delivered, &sink](const char *data, size_t size) {
+      delivered = true;
+      sink(data, size);
+    };
+  }
+  for (size_t numTries = 1;; numTries++) {
+    RequestOptions options;
+    options.validators = validators;
+    options.timeout = timeout(origin);
+    chrono::milliseconds wait;
+    try {
+      HTTPResponse response = attempt(url, origin, tracked, options);
+      if (!transient(response.status)) return response;
+      wait = backoff(numTries, &response);
+      if (numTries > maxRetries || wait.count() < 0) {
+        lock_guard<mutex> lg(lock);
+        numFailed++;
+        return response;
+      }
+    } catch (const ConnectionException& ce) {
+      if (numTries > maxRetries || delivered) {
+        lock_guard<mutex> lg(lock);
+        numFailed++;
+        throw;
+      }
+      wait = backoff(numTries, nullptr);
+    }
+    lock.lock();
+    numRetries++;
+    lock.unlock();
+    this_thread::sleep_for(wait);
+  }
+}
+
+/**
+ * A request is only worth hedging once its origin has enough latencies to
+ * say when it's running late.  Its hedge is queued to come due then, and
+ * the request runs here; if the hedge wins, it cancels the request, and
+ * if the request fails once the hedge is away, the hedge decides.
+ */
+HTTPResponse RequestPolicy::attempt(const string& url, const string& origin, const ConnectionPool::BodySink& sink,
+                                    const RequestOptions& options) {
+  double hedgeAfter = 0;
+  if (hedgePercentile > 0 && !sink) hedgeAfter = percentile(origin, hedgePercentile);
+  if (hedgeAfter <= 0) return send(url, origin, sink, options);
+
+  shared_ptr<Race> race = make_shared<Race>();
+  auto due = chrono::steady_clock::now() +
+             chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double, milli>(hedgeAfter));
+  lock.lock();
+  auto queued = hedges.insert(make_pair(due, Hedge{race, url, origin, options}));
+  bool earliest = queued == hedges.begin();
+  lock.unlock();
+  if (earliest) hedgeDue.notify_one();
+  run(race, 0, url, origin, options);
+  unique_lock<mutex> ul(race->lock);
+  race->done.wait(ul, [&race] { return race->decided; });
+  race->cancelled[0] = true;   // whichever is still going has lost
+  race->cancelled[1] = true;
+  if (race->error != nullptr) rethrow_exception(race->error);
+  if (race->winner == 1) {
+    lock_guard<mutex> lg(lock);
+    numHedgesWon++;
+  }
+  return move(race->response);
+}
+
+void RequestPolicy::run(shared_ptr<Race> race, size_t which, const string& url, const string& origin,
+                        RequestOptions options) {
+  options.cancelled = &race->cancelled[which];
+  HTTPResponse response;
+  exception_ptr error;
+  try {
+    response = send(url, origin, ConnectionPool::BodySink(), options);
+  } catch (...) {
+    error = current_exception();
+  }
+  race->lock.lock();
+  race->numFinished++;
+  if (!race->decided && (error == nullptr || race->numFinished == race->numLaunched)) {
+    race->decided = true;
+    race->winner = which;
+    race->response = move(response);
+    race->error = error;
+    if (which == 1) race->cancelled[0] = true;   // so the request gives up and its caller can return
+    race->done.notify_all();
+  }
+  race->lock.unlock();
+}
+
+/**
+ * Run by each of the hedgers: waits for the earliest hedge to come due,
+ * and sends it unless its request has finished in the meantime or hedges
+ * are already at their share of requests.
+ */
+void RequestPolicy::sendHedges() {
+  unique_lock<mutex> ul(lock);
+  while (!stopping) {
+    if (hedges.empty()) {
+      hedgeDue.wait(ul);
+      continue;
+    }
+    auto next = hedges.begin();
+    if (next->first > chrono::steady_clock::now()) {
+      hedgeDue.wait_until(ul, next->first);
+      continue;
+    }
+    Hedge hedge = move(next->second);
+    hedges.erase(next);
+    ul.unlock();
+    bool send = false;
+    hedge.race->lock.lock();
+    if (hedge.race->numFinished == 0) {
+      lock.lock();
+      send = numHedged < kMaxHedgeFraction * numRequests;
+      if (send) numHedged++;
+      lock.unlock();
+      if (send) hedge.race->numLaunched = 2;
+    }
+    hedge.race->lock.unlock();
+    if (send) run(hedge.race, 1, hedge.url, hedge.origin, hedge.options);
+    ul.lock();
+  }
+}
+
+/**
+ * Cached responses say nothing about the origin, and cancelled requests
+ * didn't get to finish, so neither is noted.
+ */
+HTTPResponse RequestPolicy::send(const string& url, const string& origin, const ConnectionPool::BodySink& sink,
+                                 const RequestOptions& options) {
+  auto start = chrono::steady_clock::now();
+  try {
+    HTTPResponse response = pool.get(url, sink, options);
+    if (!response.fromCache) note(origin, chrono::duration<double, milli>(response.elapsed).count());
+    return response;
+  } catch (const ConnectionException& ce) {
+    bool cancelled = options.cancelled != nullptr && *options.cancelled;
+    if (!cancelled && options.timeout.count() > 0 && chrono::steady_clock::now() - start >= options.timeout) {
+      note(origin, options.timeout.count());
+      lock_guard<mutex> lg(lock);
+      numTimeouts++;
+    }
+    throw;
+  }
+}
+
+void RequestPolicy::note(const string& origin, double millis) {
+  lock_guard<mutex> lg(lock);
+  Origin& state = origins[origin];
+  if (state.latencies.size() < kWindow) {
+    state.latencies.push_back(millis);
+  } else {
+    state.latencies[state.next] = millis;
+    state.next = (state.next + 1) % kWindow;
+  }
+}
+
+/**
+ * Returns the pth percentile of the origin's latencies in milliseconds,
+ * or 0 if it doesn't have kMinSamples of them yet.
+ */
+double RequestPolicy::percentile(const string& origin, double p) const {
+  lock_guard<mutex> lg(lock);
+  auto found = origins.find(origin);
+  if (found == origins.end() || found->second.latencies.size() < kMinSamples) return 0;
+  vector<double> latencies = found->second.latencies;
+  size_t rank = min<size_t>((size_t) ceil(p / 100 * latencies.size()), latencies.size());
+  nth_element(latencies.begin(), latencies.begin() + (rank > 0 ? rank - 1 : 0), latencies.end());
+  return latencies[rank > 0 ? rank - 1 : 0];
+}
+
+chrono::milliseconds RequestPolicy::timeout(const string& origin) const {
+  double p99 = percentile(origin, 99);
+  if (p99 <= 0) return chrono::milliseconds(0);
+  return chrono::milliseconds((long long) min(max(p99 * kTimeoutFactor, kMinTimeout), kMaxTimeout));
+}
+
+/**
+ * Returns how long to wait before the try after numTries of them, given
+ * the response the last one got (if it got one): what its Retry-After
+ * asks for, if it asks for a number of seconds, or else a random wait of
+ * up to kBaseBackoff doubled per try.  A Retry-After of more than
+ * kMaxBackoff comes back negative, as not worth waiting for.
+ */
+chrono::milliseconds RequestPolicy::backoff(size_t numTries, const HTTPResponse *response) {
+  if (response != nullptr) {
+    string after = response->header("retry-after");
+    char *end;
+    long seconds = after.empty() ? -1 : strtol(after.c_str(), &end, 10);
+    if (seconds >= 0 && *end == '\0') {
+      if (seconds * 1000 > kMaxBackoff) return chrono::milliseconds(-1);
+      return chrono::milliseconds(seconds * 1000);
+    }
+  }
+  double cap = min(kBaseBackoff * pow(2, numTries - 1), kMaxBackoff);
+  uniform_real_distribution<double> wait(0, cap);
+  lock_guard<mutex> lg(lock);
+  return chrono::milliseconds((long long) wait(random));
+}
+
+void RequestPolicy::printStats(ostream& out) const {
+  lock_guard<mutex> lg(lock);
+  out << "Requests: " << numRequests << " (" << numRetries << " retries, " << numTimeouts << " timeouts, "
+      << numHedged << " hedged, " << numHedgesWon << " won by the hedge, " << numFailed
+      << " still failing once out of retries)." << endl;
+}
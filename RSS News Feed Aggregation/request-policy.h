@@ -0,0 +1,139 @@
+/**
+ * File: request-policy.h
+ * ----------------------
+ * Defines the RequestPolicy class, which sits between the downloaders
+ * (RSSFeed and HTMLDocument) and a ConnectionPool, and decides how long
+ * each request may take, whether one that failed is worth another try,
+ * and whether one that's running late is worth racing with a duplicate.
+ *
+ * Timeouts: for each origin (scheme, host and port), the policy keeps the
+ * latencies of its last kWindow requests, and gives each new request
+ * kTimeoutFactor times their 99th percentile, within [kMinTimeout,
+ * kMaxTimeout].  Until an origin has kMinSamples of them, its requests get
+ * no timeout beyond the pool's own, which only gives up on a connection
+ * that stops making progress.  A request that times out counts as having
+ * taken its whole timeout, so an origin that has slowed down for good sees
+ * its timeout grow back.
+ *
+ * Retries: a request that fails in a way that's likely to be transient (a
+ * ConnectionException, which covers timeouts, refusals and resets, or a
+ * 429, 500, 502, 503 or 504) is tried again, up to maxRetries times, after
+ * a backoff drawn at random from between nothing and kBaseBackoff doubled
+ * once per earlier try (but no more than kMaxBackoff), so that clients
+ * that failed together don't all come back together.  A Retry-After
+ * shorter than kMaxBackoff is honoured instead.  A request whose body has
+ * started going to a sink can't be taken back, so it isn't retried.
+ *
+ * Hedging: given a hedgePercentile, a request (without a sink) that's
+ * still running once it has taken longer than that percentile of its
+ * origin's latencies is raced by a second, identical request, and
+ * whichever finishes first is the answer; the other is cancelled.  No
+ * more than kMaxHedgeFraction of requests are ever hedged, so an origin
+ * that's slow across the board isn't sent twice the requests.  The
+ * request itself runs on the caller's thread; hedges are sent by
+ * kNumHedgers threads the policy keeps for the purpose, so a hedge that
+ * comes due while they're all busy waits for one of them, or for its
+ * request to finish without it.
+ */
+
+#pragma once
+#include <cstddef>
+#include <string>
+#include <map>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <random>
+#include <thread>
+#include <ostream>
+#include "connection-pool.h"
+
+class RequestPolicy {
+ public:
+  static const size_t kDefaultMaxRetries = 2;
+
+/**
+ * Constructs a policy for requests over pool that retries each at most
+ * maxRetries times, and hedges those that outlast the hedgePercentile
+ * (say 95) of their origin's latencies, or none, given 0.
+ */
+  RequestPolicy(ConnectionPool& pool, size_t maxRetries = kDefaultMaxRetries, double hedgePercentile = 0);
+
+/**
+ * Waits for any hedge still running to be done with the pool, and stops
+ * the threads that send them.
+ */
+  ~RequestPolicy();
+
+/**
+ * Returns the policy, over the shared pool, used by every client that
+ * isn't handed one of its own.
+ */
+  static RequestPolicy& shared();
+
+/**
+ * Sends a GET for the URL (conditional on the validators, if there are
+ * any) as ConnectionPool::get does, but under the policy: with a timeout
+ * suited to the URL's origin, retried if it fails transiently, and hedged
+ * if it runs late.  Returns the last response (which may still be a 5xx
+ * or 429, if the retries ran out), or throws what the last try threw.
+ */
+  HTTPResponse get(const std::string& url, const ConnectionPool::BodySink& sink = ConnectionPool::BodySink(),
+                   const HTTPValidators& validators = HTTPValidators());
+
+/**
+ * Returns the timeout requests to the specified origin get right now, or
+ * 0 if they get none beyond the pool's.
+ */
+  std::chrono::milliseconds timeout(const std::string& origin) const;
+
+  void printStats(std::ostream& out) const;
+
+ private:
+  struct Origin {
+    std::vector<double> latencies;   // in milliseconds, the last kWindow of them
+    size_t next = 0;                 // where the next one goes, once there are kWindow
+  };
+
+  struct Race;
+
+  struct Hedge {
+    std::shared_ptr<Race> race;
+    std::string url;
+    std::string origin;
+    RequestOptions options;
+  };
+
+  ConnectionPool& pool;
+  size_t maxRetries;
+  double hedgePercentile;
+  std::vector<std::thread> hedgers;
+  mutable std::mutex lock;           // guards everything below
+  std::condition_variable hedgeDue;
+  std::multimap<std::chrono::steady_clock::time_point, Hedge> hedges;   // by when they're due
+  bool stopping;
+  std::map<std::string, Origin> origins;
+  std::mt19937 random;
+  size_t numRequests;
+  size_t numRetries;
+  size_t numTimeouts;
+  size_t numHedged;
+  size_t numHedgesWon;
+  size_t numFailed;                  // still failing once the retries ran out
+
+  HTTPResponse attempt(const std::string& url, const std::string& origin, const ConnectionPool::BodySink& sink,
+                       const RequestOptions& options);
+  HTTPResponse send(const std::string& url, const std::string& origin, const ConnectionPool::BodySink& sink,
+                    const RequestOptions& options);
+  void run(std::shared_ptr<Race> race, size_t which, const std::string& url, const std::string& origin,
+           RequestOptions options);
+  void sendHedges();
+  void note(const std::string& origin, double millis);
+  double percentile(const std::string& origin, double p) const;
+  std::chrono::milliseconds backoff(size_t numTries, const HTTPResponse *response);
+
+  RequestPolicy(const RequestPolicy& original) = delete;
+  RequestPolicy& operator=(const RequestPolicy& rhs) = delete;
+};
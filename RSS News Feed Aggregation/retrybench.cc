@@ -0,0 +1,137 @@
+/**
+ * File: retrybench.cc
+ * -------------------
+ * Measures what a RequestPolicy does for downloads from servers that are
+ * usually quick but now and then aren't.  kNumServers StandInServers each
+ * answer in kBaseMillis or so, except that one request in kStallEvery
+ * stalls for kStallMillis, and one in kFlakeEvery gets a 503 straight
+ * away.  kNumThreads threads download kNumRequests articles spread across
+ * them, first straight from a ConnectionPool (one try each, under the
+ * pool's fixed timeout), then under a RequestPolicy with retries and
+ * adaptive timeouts, and then with hedging at kHedgePercentile as well.
+ * Each reports how many downloads failed, the median, 99th percentile and
+ * worst latency of the rest, and how many requests the servers saw.
+ *
+ * Usage: ./retrybench [<number of requests>]
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <random>
+#include <memory>
+#include <algorithm>
+#include "connection-pool.h"
+#include "request-policy.h"
+#include "stand-in-server.h"
+using namespace std;
+
+static const size_t kDefaultRequests = 2000;
+static const size_t kNumServers = 4;
+static const size_t kNumThreads = 16;
+static const unsigned int kBaseMillis = 20;
+static const unsigned int kStallMillis = 3000;
+static const size_t kStallEvery = 200;
+static const size_t kFlakeEvery = 30;
+static const double kHedgePercentile = 95;
+
+enum Mode { kPoolOnly, kPolicy, kHedged };
+
+struct Result {
+  size_t numFailed;
+  size_t numServed;
+  double wallMillis;
+  vector<double> latencies;   // of the downloads that succeeded, in milliseconds
+};
+
+static Result run(size_t numRequests, Mode mode) {
+  vector<unique_ptr<StandInServer>> servers;
+  atomic<size_t> numServed(0);
+  for (size_t i = 0; i < kNumServers; i++) {
+    auto random = make_shared<mt19937>(110 + i);
+    auto randomLock = make_shared<mutex>();
+    servers.emplace_back(new StandInServer([random, randomLock, &numServed](const StandInServer::Request& request) {
+      numServed++;
+      size_t draw;
+      unsigned int jitter;
+      {
+        lock_guard<mutex> lg(*randomLock);
+        draw = (*random)();
+        jitter = (*random)() % kBaseMillis;
+      }
+      StandInServer::Reply reply;
+      if (draw % kFlakeEvery == 0) {
+        reply.status = 503;
+        return reply;
+      }
+      unsigned int millis = draw % kStallEvery == 1 ? kStallMillis : kBaseMillis / 2 + jitter;
+      this_thread::sleep_for(chrono::milliseconds(millis));
+      reply.body = "<html><body><p>Article " + request.target + "</p></body></html>";
+      return reply;
+    }));
+  }
+
+  ConnectionPool pool(kNumThreads);
+  RequestPolicy policy(pool, RequestPolicy::kDefaultMaxRetries, mode == kHedged ? kHedgePercentile : 0);
+  Result result = {0, 0, 0, {}};
+  atomic<size_t> next(0);
+  mutex resultLock;
+  vector<thread> threads;
+  auto start = chrono::steady_clock::now();
+  for (size_t i = 0; i < kNumThreads; i++) {
+    threads.push_back(thread([&] {
+      for (size_t request = next++; request < numRequests; request = next++) {
+        string url = servers[request % kNumServers]->url("/article/" + to_string(request));
+        auto begun = chrono::steady_clock::now();
+        bool ok;
+        try {
+          HTTPResponse response = mode == kPoolOnly ? pool.get(url) : policy.get(url);
+          ok = response.status == 200;
+        } catch (const exception& e) {
+          ok = false;
+        }
+        double millis = chrono::duration<double, milli>(chrono::steady_clock::now() - begun).count();
+        lock_guard<mutex> lg(resultLock);
+        if (ok) result.latencies.push_back(millis);
+        else result.numFailed++;
+      }
+    }));
+  }
+  for (thread& t : threads) t.join();
+  result.wallMillis = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+  result.numServed = numServed;
+  if (mode != kPoolOnly) policy.printStats(cerr);
+  return result;
+}
+
+static double percentile(vector<double> latencies, double p) {
+  if (latencies.empty()) return 0;
+  sort(latencies.begin(), latencies.end());
+  size_t rank = min(latencies.size() - 1, (size_t) (p / 100 * latencies.size()));
+  return latencies[rank];
+}
+
+int main(int argc, char *argv[]) {
+  size_t numRequests = argc > 1 ? strtoul(argv[1], NULL, 10) : kDefaultRequests;
+  cout << numRequests << " downloads over " << kNumServers << " servers answering in about " << kBaseMillis
+       << "ms, but stalling " << kStallMillis << "ms once in " << kStallEvery << " and failing 503 once in "
+       << kFlakeEvery << ":" << endl;
+  cout << setw(30) << "" << setw(8) << "failed" << setw(10) << "served" << setw(10) << "p50 ms" << setw(10)
+       << "p99 ms" << setw(10) << "max ms" << setw(10) << "wall ms" << endl;
+  for (Mode mode : {kPoolOnly, kPolicy, kHedged}) {
+    Result result = run(numRequests, mode);
+    string label = mode == kPoolOnly ? "one try, fixed timeout" :
+                   mode == kPolicy ? "retries, adaptive timeouts" : "... and hedged at p" + to_string((int) kHedgePercentile);
+    cout << setw(30) << label << setw(8) << result.numFailed << setw(10) << result.numServed << fixed
+         << setprecision(0) << setw(10) << percentile(result.latencies, 50) << setw(10)
+         << percentile(result.latencies, 99) << setw(10) << percentile(result.latencies, 100) << setw(10)
+         << result.wallMillis << endl;
+  }
+  return 0;
+}
@@ -10,65 +10,107 @@
 #include <vector>
 #include <cassert>
 #include <sstream>
+#include <algorithm>
+#include <chrono>
 
 #include <libxml/tree.h>
 #include <libxml/parser.h>
 #include <libxml/xpath.h>
 #include <libxml/xpathInternals.h>
 
-#define BOOST_NETWORK_ENABLE_HTTPS
-#include <boost/network/protocol/http/client.hpp>
-#include <boost/network/uri.hpp>
-#include <myhtml/api.h>
 
 #include "rss-feed-exception.h"
 #include "string-utils.h"
 
 using namespace std;
-using namespace boost::network;
-using namespace boost::network::http;
 
 using namespace std;
 
 static const int kXMLParseFlags = XML_PARSE_RECOVER | XML_PARSE_NOBLANKS | XML_PARSE_NOERROR | XML_PARSE_NOWARNING;
 
 void RSSFeed::parse() throw (RSSFeedException) {
-  parse(download());
+   HTTPValidators validators;
+   parseIfChanged(validators);
 }
 
-std::string RSSFeed::download(size_t numRedirectsAllowed) throw (RSSFeedException)  {
-	std::string url = this->url;
+/**
+ * The feed is parsed as it downloads: each piece of the body, once
+ * decompressed, goes straight into libxml2's push parser.
+ */
+bool RSSFeed::parseIfChanged(HTTPValidators& validators) throw (RSSFeedException) {
+   xmlParserCtxtPtr parser = xmlCreatePushParserCtxt(NULL, NULL, NULL, 0, url.c_str());
+   if (parser == NULL) throw RSSFeedException("Error: unable to create a parser for the RSS feed at \"" + url + "\".");
+   xmlCtxtUseOptions(parser, kXMLParseFlags);
+   HTTPResponse response;
+   try {
+     response = download([parser](const char *data, size_t size) { xmlParseChunk(parser, data, int(size), 0); },
+                         validators);
+   } catch (...) {
+     xmlFreeDoc(parser->myDoc);
+     xmlFreeParserCtxt(parser);
+     throw;
+   }
+   if (response.status == 304) {
+     xmlFreeDoc(parser->myDoc);
+     xmlFreeParserCtxt(parser);
+     return false;
+   }
+   xmlParseChunk(parser, NULL, 0, 1);
+   xmlDocPtr doc = parser->myDoc;
+   xmlFreeParserCtxt(parser);
+   if (doc == NULL) {
+     // This is the only real user error we handle with any frequency, as it's
+     // completely reasonable that the client more than occasionally specify a bogus URL.
+     basic_ostringstream<char> oss;
+     oss << "Error: unable to parse the RSS feed at \"" << url << "\".";
+     throw RSSFeedException(oss.str());
+   }
+   extractArticles(doc);
+   xmlFreeDoc(doc);
+   validators = {response.header("etag"), response.header("last-modified")};
+   return true;
+}
+
+/**
+ * Every hop carries the validators, though only the last is likely to
+ * have anything to compare them with.  The chain starts from wherever
+ * redirects says it last ended up, and if that has since moved on or
+ * gone, the chain is forgotten and followed from the top again.  Returns
+ * the final response, whose body (unless it's a 304) has gone to sink.
+ */
+HTTPResponse RSSFeed::download(const ConnectionPool::BodySink& sink, const HTTPValidators& validators,
+                               size_t numRedirectsAllowed) throw (RSSFeedException)  {
+	std::string url = redirects.lookup(this->url);
+	bool remembered = url != this->url;
+	size_t numHops = 0;
+	chrono::seconds lifetime = chrono::seconds::max();
 	for (size_t i = 0; i < numRedirectsAllowed; i++) {
 		try {
-    		client::request req(url);
-    		client::options opts;
-    		opts.always_verify_peer(true).
-			    openssl_sni_hostname(req.host()).
-			    timeout(20);
-    		client cl(opts);
-    		client::response resp = cl.get(req);
-			auto head = headers(resp);
-			if (head.count("Location") == 0 && head.count("location") == 0) return body(resp);
-			const char *key = head.count("Location") > 0 ? "Location" : "location";
-			url = head[key].begin()->second;
+			HTTPResponse response = policy.get(url, sink, validators);
+			string location = response.header("location");
+			bool redirected = !location.empty() && response.status >= 300;
+			if (remembered && (redirected || response.status >= 400)) {
+				redirects.forget(this->url);
+				remembered = false;
+				url = this->url;
+				continue;
+			}
+			if (!redirected) {
+				if (response.status < 400) redirects.store(this->url, url, numHops, lifetime);
+				return response;
+			}
+			lifetime = min(lifetime, redirects.lifetime(response));
+			numHops++;
+			url = ConnectionPool::resolve(url, location);
 		} catch (exception& e) {
+			if (remembered) redirects.forget(this->url);
 			throw RSSFeedException("Error downloading RSS feed from " + this->url + ":\n" + e.what());
 		}
 	}
 	throw RSSFeedException("Error downloading RSS feed  from " + this->url + ":\nToo many redirects.");
 }
 
-void RSSFeed::parse(const std::string& contents) throw (RSSFeedException) {
-   xmlDocPtr doc = xmlReadMemory(contents.c_str(), int(contents.size()), url.c_str(), 
-                                 /* encoding = */ NULL, kXMLParseFlags);
-   if (doc == NULL) {
-     // This is the only real user error we handle with any frequency, as it's
-     // completely reasonable that the client more than occasionally specify a bogus URL.
-     basic_ostringstream<char> oss;
-     oss << "Error: unable to parse the RSS feed at \"" << url << "\".";
-     throw RSSFeedException(oss.str());
-   }
-  
+void RSSFeed::extractArticles(xmlDocPtr doc) {
    xmlXPathContextPtr context = xmlXPathNewContext(doc);
    const xmlChar *expr = BAD_CAST "//item";
    xmlXPathObjectPtr items = xmlXPathEvalExpression(expr, context);
@@ -98,5 +140,4 @@ void RSSFeed::parse(const std::string& contents) throw (RSSFeedException) {
   
    xmlXPathFreeObject(items);
    xmlXPathFreeContext(context); 
-   xmlFreeDoc(doc); 
 }
@@ -11,6 +11,9 @@
 #include <vector>
 #include "article.h"
 #include "rss-feed-exception.h"
+#include "connection-pool.h"
+#include "request-policy.h"
+#include "redirect-cache.h"
 
 class RSSFeed {
  public:
@@ -19,9 +22,13 @@ class RSSFeed {
  * Constructor: RSSFeed
  * Usage: RSSFeed feed("http://feeds.washingtonpost.com/news/world.rss");
  * ----------------------------------------------------------------------
- * Constructs an RSSFeed object around the provided URL.
+ * Constructs an RSSFeed object around the provided URL, which downloads
+ * under the supplied request policy (or the shared one), and so over its
+ * connection pool, skipping any redirects the supplied cache (or the
+ * shared one) remembers.
  */
-  RSSFeed(const std::string& url) : url(url) {}
+  RSSFeed(const std::string& url, RequestPolicy& policy = RequestPolicy::shared(),
+          RedirectCache& redirects = RedirectCache::shared()) : url(url), policy(policy), redirects(redirects) {}
 
 /**
  * Method: parse
@@ -34,6 +41,19 @@ class RSSFeed {
  */
   void parse() throw (RSSFeedException);
 
+/**
+ * Method: parseIfChanged
+ * Usage: if (feed.parseIfChanged(validators)) ...
+ * -----------------------------------------------
+ * Like parse, except that the download is conditional on the feed having
+ * changed since it was served with the supplied validators (the ETag and
+ * Last-Modified of an earlier download, or nothing the first time).
+ * Returns false, and leaves getArticles empty, if the server says it
+ * hasn't; otherwise parses the feed, updates validators to those it came
+ * with, and returns true.
+ */
+  bool parseIfChanged(HTTPValidators& validators) throw (RSSFeedException);
+
 /**
  * Method: getArticles
  * Usage: const vector<Article>& articles = feed.getArticles();
@@ -45,10 +65,13 @@ class RSSFeed {
   
  private:
   std::string url;
+  RequestPolicy& policy;
+  RedirectCache& redirects;
   std::vector<Article> articles;
   
-  std::string download(size_t numRedirectsAllowed = 10) throw (RSSFeedException);
-  void parse(const std::string& contents) throw (RSSFeedException);
+  HTTPResponse download(const ConnectionPool::BodySink& sink, const HTTPValidators& validators,
+                        size_t numRedirectsAllowed = 10) throw (RSSFeedException);
+  void extractArticles(struct _xmlDoc *doc);
 
   /**
    * The following two lines delete the default implementations you'd
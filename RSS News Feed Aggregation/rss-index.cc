@@ -17,6 +17,18 @@ void RSSIndex::add(const Article& article, const vector<string>& words) {
   }
 }
 
+void RSSIndex::remove(const Article& article, const vector<string>& words) {
+  for (const string& word : words) {
+    auto indexFound = index.find(word);
+    if (indexFound == index.end()) continue;
+    map<Article, int>& matches = indexFound->second;
+    auto match = matches.find(article);
+    if (match == matches.end()) continue;
+    if (--match->second == 0) matches.erase(match);
+    if (matches.empty()) index.erase(indexFound);
+  }
+}
+
 static const vector<pair<Article, int> > emptyResult;
 vector<pair<Article, int> > RSSIndex::getMatchingArticles(const string& word) const {
   auto indexFound = index.find(word);
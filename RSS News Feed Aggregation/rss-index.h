@@ -26,6 +26,13 @@ class RSSIndex {
  */
   void add(const Article& article, const std::vector<std::string>& words);
 
+/**
+ * Undoes an earlier add of the same article and words, so that an article
+ * can be replaced by removing what was added for it and adding it again.
+ * Like add, remove is not thread-safe.
+ */
+  void remove(const Article& article, const std::vector<std::string>& words);
+
 /**
  * Returns a reference to the list of documents associated with the specified
  * word.  The list is a vector of URL/frequency pairs, sorted by frequency from
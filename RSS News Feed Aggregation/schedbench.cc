@@ -0,0 +1,146 @@
+/**
+ * File: schedbench.cc
+ * -------------------
+ * Measures what the FeedSchedule gets out of a fixed fetch budget, by
+ * simulating a week of polling (on a simulated clock, so it runs in a
+ * moment) kNumFeeds feeds whose items arrive at random, at rates spread
+ * evenly on a log scale from one a minute to one a week.  Every
+ * kRoundSeconds a round may poll up to kBudget feeds, and a feed only
+ * shows its kItemsPerFeed newest items, so anything that scrolls off
+ * before a poll sees it is missed.
+ *
+ * The adaptive schedule is compared with polling round-robin, which
+ * spends the whole budget every round, and with polling every feed at
+ * one fixed interval chosen to cost as many polls as the adaptive
+ * schedule did.  Each reports the polls made, how many turned up nothing,
+ * how long items waited to be found, and how many were missed.
+ *
+ * Usage: ./schedbench [<number of feeds>]
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <ctime>
+#include <string>
+#include <vector>
+#include <random>
+#include <algorithm>
+#include "feed-schedule.h"
+using namespace std;
+
+static const size_t kDefaultFeeds = 200;
+static const time_t kRoundSeconds = 60;
+static const time_t kSimulatedSeconds = 7 * 24 * 60 * 60;
+static const size_t kItemsPerFeed = 20;
+static const time_t kStart = 1000000000;
+
+struct Feed {
+  vector<time_t> arrivals;   // when each item was published, in order
+  size_t next;               // the first item no poll has seen yet
+  time_t lastPolled;
+};
+
+struct Result {
+  size_t numPolls;
+  size_t numEmpty;
+  size_t numFound;
+  size_t numMissed;
+  double delaySeconds;        // summed over the items found
+  double fastDelaySeconds;    // the same, over the fastest tenth of the feeds
+  size_t numFastFound;
+};
+
+/**
+ * Polls the feed at now, and returns how many new items it turned up.
+ */
+static size_t poll(Feed& feed, time_t now, bool fast, Result& result) {
+  size_t end = upper_bound(feed.arrivals.begin(), feed.arrivals.end(), now) - feed.arrivals.begin();
+  size_t visible = end > kItemsPerFeed ? end - kItemsPerFeed : 0;
+  size_t numNew = 0;
+  if (feed.next < visible) {
+    result.numMissed += visible - feed.next;
+    feed.next = visible;
+  }
+  for (; feed.next < end; feed.next++, numNew++) {
+    result.delaySeconds += now - feed.arrivals[feed.next];
+    if (fast) result.fastDelaySeconds += now - feed.arrivals[feed.next];
+  }
+  result.numPolls++;
+  result.numFound += numNew;
+  if (fast) result.numFastFound += numNew;
+  if (numNew == 0) result.numEmpty++;
+  feed.lastPolled = now;
+  return numNew;
+}
+
+enum Policy { kRoundRobin, kFixedInterval, kAdaptive };
+
+static Result run(const vector<vector<time_t>>& arrivals, Policy policy, size_t budget, time_t interval) {
+  vector<Feed> feeds;
+  vector<string> names;
+  for (size_t i = 0; i < arrivals.size(); i++) {
+    feeds.push_back({arrivals[i], 0, 0});
+    names.push_back("feed-" + to_string(i));
+  }
+  size_t numFast = arrivals.size() / 10;
+  FeedSchedule schedule(kRoundSeconds, FeedSchedule::kDefaultMaxSeconds, 110);
+  Result result = {0, 0, 0, 0, 0, 0, 0};
+  size_t cursor = 0;
+  for (time_t now = kStart; now < kStart + kSimulatedSeconds; now += kRoundSeconds) {
+    if (policy == kRoundRobin) {
+      for (size_t i = 0; i < budget; i++, cursor = (cursor + 1) % feeds.size()) {
+        poll(feeds[cursor], now, cursor < numFast, result);
+      }
+    } else if (policy == kFixedInterval) {
+      for (size_t i = 0; i < feeds.size(); i++) {
+        if (feeds[i].lastPolled == 0 || now - feeds[i].lastPolled >= interval) poll(feeds[i], now, i < numFast, result);
+      }
+    } else {
+      for (const string& name : schedule.due(names, now, budget)) {
+        size_t i = strtoul(name.c_str() + strlen("feed-"), NULL, 10);
+        bool first = feeds[i].lastPolled == 0;
+        size_t numNew = poll(feeds[i], now, i < numFast, result);
+        if (first) schedule.noteFirstPoll(name, now);
+        else schedule.notePoll(name, numNew, now);
+      }
+    }
+  }
+  return result;
+}
+
+static void report(const string& label, const Result& result) {
+  cout << setw(26) << label << setw(10) << result.numPolls << setw(10) << fixed << setprecision(1)
+       << 100.0 * result.numEmpty / result.numPolls << setw(10) << result.numFound << setw(10) << result.numMissed
+       << setw(12) << result.delaySeconds / max<size_t>(result.numFound, 1) / 60 << setw(14)
+       << result.fastDelaySeconds / max<size_t>(result.numFastFound, 1) / 60 << endl;
+}
+
+int main(int argc, char *argv[]) {
+  size_t numFeeds = argc > 1 ? strtoul(argv[1], NULL, 10) : kDefaultFeeds;
+  size_t budget = max<size_t>(numFeeds / 10, 1);
+  mt19937 random(110);
+  vector<vector<time_t>> arrivals(numFeeds);
+  double fastest = 1.0 / 60, slowest = 1.0 / kSimulatedSeconds;
+  for (size_t i = 0; i < numFeeds; i++) {
+    // feeds in order from fastest to slowest
+    double perSecond = fastest * pow(slowest / fastest, double(i) / max<size_t>(numFeeds - 1, 1));
+    exponential_distribution<double> gap(perSecond);
+    for (double t = kStart - 3600 + gap(random); t < kStart + kSimulatedSeconds; t += gap(random)) {
+      arrivals[i].push_back((time_t) t);
+    }
+  }
+
+  cout << "A simulated week of " << numFeeds << " feeds (items arriving from once a minute to once a week), "
+       << budget << " polls per " << kRoundSeconds << "s round at most:" << endl;
+  cout << setw(26) << "" << setw(10) << "polls" << setw(10) << "% empty" << setw(10) << "found" << setw(10)
+       << "missed" << setw(12) << "delay min" << setw(14) << "fastest 10%" << endl;
+  Result adaptive = run(arrivals, kAdaptive, budget, 0);
+  time_t interval = (time_t) ((double) kSimulatedSeconds * numFeeds / adaptive.numPolls);
+  report("round-robin", run(arrivals, kRoundRobin, budget, 0));
+  report("fixed every " + to_string(interval / 60) + " min", run(arrivals, kFixedInterval, 0, interval));
+  report("adaptive", adaptive);
+  return 0;
+}
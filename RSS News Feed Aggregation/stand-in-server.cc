@@ -0,0 +1,260 @@
+/**
+ * File: stand-in-server.cc
+ * ------------------------
+ * Presents the implementation of the StandInServer class.
+ */
+
+#include "stand-in-server.h"
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <openssl/ssl.h>
+#include <openssl/evp.h>
+#include <openssl/rsa.h>
+#include <openssl/pem.h>
+#include <openssl/x509v3.h>
+using namespace std;
+
+static const size_t kReadChunkSize = 1 << 14;
+static const int kBacklog = 128;
+static const int kKeyBits = 2048;
+static const long kCertificateSeconds = 24 * 60 * 60;
+
+static string reason(unsigned int status) {
+  switch (status) {
+    case 200: return "OK";
+    case 301: return "Moved Permanently";
+    case 302: return "Found";
+    case 304: return "Not Modified";
+    case 404: return "Not Found";
+    case 500: return "Internal Server Error";
+    case 503: return "Service Unavailable";
+    default: return "Status";
+  }
+}
+
+StandInServer::StandInServer(const Handler& handler, const Options& options) :
+  handler(handler), options(options), tlsContext(nullptr), numConnections(0), numRequests(0), numResumed(0),
+  stopping(false) {
+  signal(SIGPIPE, SIG_IGN);   // TLS writes to clients that hang up can't suppress it per call
+  if (options.tls) createTLSContext();
+  listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listener == -1) throw runtime_error(string("socket: ") + strerror(errno));
+  struct sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  address.sin_port = 0;
+  socklen_t length = sizeof(address);
+  if (bind(listener, (struct sockaddr *) &address, sizeof(address)) == -1 ||
+      listen(listener, kBacklog) == -1 ||
+      getsockname(listener, (struct sockaddr *) &address, &length) == -1) {
+    close(listener);
+    throw runtime_error(string("Couldn't start stand-in server: ") + strerror(errno));
+  }
+  port = ntohs(address.sin_port);
+  acceptor = thread([this] { accept(); });
+}
+
+StandInServer::~StandInServer() {
+  lock.lock();
+  stopping = true;
+  for (int fd : connections) shutdown(fd, SHUT_RDWR);
+  lock.unlock();
+  shutdown(listener, SHUT_RDWR);
+  acceptor.join();
+  close(listener);
+  for (thread& server : servers) server.join();
+  if (tlsContext != nullptr) SSL_CTX_free(tlsContext);
+}
+
+/**
+ * Generates an RSA key and a certificate for it, signed by itself, that
+ * names localhost and 127.0.0.1.
+ */
+void StandInServer::createTLSContext() {
+  SSL_library_init();
+  EVP_PKEY *key = NULL;
+  EVP_PKEY_CTX *keyContext = EVP_PKEY_CTX_new_id(EVP_PKEY_RSA, NULL);
+  if (keyContext == NULL || EVP_PKEY_keygen_init(keyContext) != 1 ||
+      EVP_PKEY_CTX_set_rsa_keygen_bits(keyContext, kKeyBits) != 1 || EVP_PKEY_keygen(keyContext, &key) != 1) {
+    EVP_PKEY_CTX_free(keyContext);
+    throw runtime_error("Couldn't generate a key for the stand-in server");
+  }
+  EVP_PKEY_CTX_free(keyContext);
+
+  X509 *x509 = X509_new();
+  X509_set_version(x509, 2);
+  ASN1_INTEGER_set(X509_get_serialNumber(x509), 1);
+  X509_gmtime_adj(X509_get_notBefore(x509), 0);
+  X509_gmtime_adj(X509_get_notAfter(x509), kCertificateSeconds);
+  X509_set_pubkey(x509, key);
+  X509_NAME *name = X509_get_subject_name(x509);
+  X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char *) "localhost", -1, -1, 0);
+  X509_set_issuer_name(x509, name);
+  X509V3_CTX extensionContext;
+  X509V3_set_ctx(&extensionContext, x509, x509, NULL, NULL, 0);
+  X509_EXTENSION *names = X509V3_EXT_conf_nid(NULL, &extensionContext, NID_subject_alt_name,
+                                              (char *) "DNS:localhost,IP:127.0.0.1");
+  X509_add_ext(x509, names, -1);
+  X509_EXTENSION_free(names);
+  X509_sign(x509, key, EVP_sha256());
+
+  BIO *pem = BIO_new(BIO_s_mem());
+  PEM_write_bio_X509(pem, x509);
+  char *data;
+  long length = BIO_get_mem_data(pem, &data);
+  certificate.assign(data, length);
+  BIO_free(pem);
+
+  tlsContext = SSL_CTX_new(SSLv23_server_method());
+  SSL_CTX_use_certificate(tlsContext, x509);
+  SSL_CTX_use_PrivateKey(tlsContext, key);
+  if (options.maxTLSVersion != 0) SSL_CTX_set_max_proto_version(tlsContext, options.maxTLSVersion);
+  SSL_CTX_set_session_cache_mode(tlsContext, SSL_SESS_CACHE_SERVER);
+  X509_free(x509);
+  EVP_PKEY_free(key);
+}
+
+string StandInServer::url(const string& path) const {
+  if (options.tls) return "https://localhost:" + to_string(port) + path;
+  return "http://127.0.0.1:" + to_string(port) + path;
+}
+
+bool StandInServer::writeCertificate(const string& path) const {
+  FILE *file = fopen(path.c_str(), "w");
+  if (file == NULL) return false;
+  bool written = fwrite(certificate.data(), 1, certificate.size(), file) == certificate.size();
+  return fclose(file) == 0 && written;
+}
+
+size_t StandInServer::getNumConnections() const {
+  lock_guard<mutex> lg(lock);
+  return numConnections;
+}
+
+size_t StandInServer::getNumRequests() const {
+  lock_guard<mutex> lg(lock);
+  return numRequests;
+}
+
+size_t StandInServer::getNumResumed() const {
+  lock_guard<mutex> lg(lock);
+  return numResumed;
+}
+
+void StandInServer::accept() {
+  while (true) {
+    int fd = ::accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+    if (fd == -1) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      return;
+    }
+    lock_guard<mutex> lg(lock);
+    if (stopping) {
+      close(fd);
+      return;
+    }
+    connections.push_back(fd);
+    numConnections++;
+    servers.push_back(thread([this, fd] { serve(fd); }));
+  }
+}
+
+/**
+ * Reads requests off the connection and answers them until the client
+ * closes it, or (unless keepAlive is set) after the first one.
+ */
+void StandInServer::serve(int fd) {
+  int noDelay = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+  this_thread::sleep_for(options.acceptDelay);
+  SSL *ssl = nullptr;
+  bool open = true;
+  if (tlsContext != nullptr) {
+    ssl = SSL_new(tlsContext);
+    SSL_set_fd(ssl, fd);
+    open = SSL_accept(ssl) == 1;
+    if (open && SSL_session_reused(ssl)) {
+      lock_guard<mutex> lg(lock);
+      numResumed++;
+    }
+  }
+  auto receive = [fd, ssl](char *buffer, size_t size) -> ssize_t {
+    if (ssl != nullptr) return SSL_read(ssl, buffer, size);
+    return recv(fd, buffer, size, 0);
+  };
+  auto transmit = [fd, ssl](const char *data, size_t size) -> ssize_t {
+    if (ssl != nullptr) return SSL_write(ssl, data, size);
+    return send(fd, data, size, MSG_NOSIGNAL);
+  };
+
+  string buffer;
+  while (open) {
+    size_t end;
+    while ((end = buffer.find("\r\n\r\n")) == string::npos) {
+      char chunk[kReadChunkSize];
+      ssize_t count = receive(chunk, sizeof(chunk));
+      if (count <= 0) {
+        open = false;
+        break;
+      }
+      buffer.append(chunk, count);
+    }
+    if (!open) break;
+
+    Request request;
+    size_t lineEnd = buffer.find("\r\n");
+    size_t targetStart = buffer.find(' ') + 1;
+    request.target = buffer.substr(targetStart, buffer.find(' ', targetStart) - targetStart);
+    for (size_t start = lineEnd + 2; start < end; start = buffer.find("\r\n", start) + 2) {
+      string line = buffer.substr(start, buffer.find("\r\n", start) - start);
+      size_t colon = line.find(':');
+      if (colon == string::npos) continue;
+      string name = line.substr(0, colon);
+      transform(name.begin(), name.end(), name.begin(), [](unsigned char ch) { return tolower(ch); });
+      request.headers[name] = line.substr(min(line.find_first_not_of(' ', colon + 1), line.size()));
+    }
+    buffer.erase(0, end + 4);
+
+    Reply reply = handler(request);
+    string response = "HTTP/1.1 " + to_string(reply.status) + " " + reason(reply.status) + "\r\n";
+    for (const pair<string, string>& header : reply.headers) response += header.first + ": " + header.second + "\r\n";
+    response += "Content-Length: " + to_string(reply.body.size()) + "\r\n";
+    if (!options.keepAlive) response += "Connection: close\r\n";
+    response += "\r\n" + reply.body;
+    for (size_t sent = 0; sent < response.size();) {
+      size_t size = response.size() - sent;
+      if (options.bytesPerSecond > 0) size = min(size, kReadChunkSize);
+      ssize_t count = transmit(response.data() + sent, size);
+      if (count <= 0) {
+        open = false;
+        break;
+      }
+      sent += count;
+      if (options.bytesPerSecond > 0) this_thread::sleep_for(chrono::microseconds(count * 1000000 / options.bytesPerSecond));
+    }
+    lock.lock();
+    numRequests++;
+    lock.unlock();
+    if (!options.keepAlive) break;
+  }
+
+  if (ssl != nullptr) {
+    if (open) SSL_shutdown(ssl);
+    SSL_free(ssl);
+  }
+  lock_guard<mutex> lg(lock);
+  connections.erase(find(connections.begin(), connections.end(), fd));
+  close(fd);
+}
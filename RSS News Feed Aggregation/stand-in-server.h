@@ -0,0 +1,103 @@
+/**
+ * File: stand-in-server.h
+ * -----------------------
+ * Defines the StandInServer class, a small HTTP/1.1 server on the
+ * loopback interface that the benchmarks download from in place of real
+ * news sites.  Every request is answered by a handler function, on a
+ * thread of its connection's own, and connections are kept alive between
+ * requests unless the server was told not to.
+ *
+ * With tls set, it serves https instead, under a self-signed certificate
+ * for localhost (and 127.0.0.1) that it generates for itself, which
+ * clients need to be told to trust.  It issues session tickets and keeps
+ * a session cache, as real servers do, so clients can resume.
+ */
+
+#pragma once
+#include <cstddef>
+#include <string>
+#include <map>
+#include <vector>
+#include <utility>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <chrono>
+
+struct ssl_ctx_st;
+
+class StandInServer {
+ public:
+  struct Request {
+    std::string target;
+    std::map<std::string, std::string> headers;   // keyed by lowercased name
+  };
+
+  struct Reply {
+    unsigned int status = 200;
+    std::vector<std::pair<std::string, std::string>> headers;
+    std::string body;
+  };
+
+  typedef std::function<Reply(const Request& request)> Handler;
+
+  struct Options {
+    bool keepAlive = true;                        // if false, every reply closes its connection
+    std::chrono::milliseconds acceptDelay{0};     // stands in for the round trips of connection setup
+    bool tls = false;
+    int maxTLSVersion = 0;                        // e.g. TLS1_2_VERSION; 0 for the newest there is
+    size_t bytesPerSecond = 0;                    // paces each connection's replies, as a slow link would; 0 for no limit
+  };
+
+/**
+ * Starts serving on an ephemeral loopback port.
+ */
+  StandInServer(const Handler& handler, const Options& options);
+  StandInServer(const Handler& handler) : StandInServer(handler, Options()) {}
+
+/**
+ * Closes every connection and waits for their threads to finish.
+ */
+  ~StandInServer();
+
+  unsigned short getPort() const { return port; }
+
+/**
+ * Returns the URL of the specified path (which should start with a slash)
+ * on this server.
+ */
+  std::string url(const std::string& path) const;
+
+/**
+ * Writes the server's certificate, in PEM form, to the specified file, so
+ * that clients can be told to trust it.  Returns false if it can't.
+ */
+  bool writeCertificate(const std::string& path) const;
+
+  size_t getNumConnections() const;
+  size_t getNumRequests() const;
+  size_t getNumResumed() const;
+
+ private:
+  Handler handler;
+  Options options;
+  int listener;
+  unsigned short port;
+  ssl_ctx_st *tlsContext;
+  std::string certificate;              // PEM
+  std::thread acceptor;
+  mutable std::mutex lock;              // guards everything below
+  std::vector<int> connections;         // open connection sockets, for shutting down
+  std::vector<std::thread> servers;
+  size_t numConnections;
+  size_t numRequests;
+  size_t numResumed;                    // TLS handshakes that resumed a session
+  bool stopping;
+
+  void createTLSContext();
+  void accept();
+  void serve(int fd);
+
+  StandInServer(const StandInServer& original) = delete;
+  StandInServer& operator=(const StandInServer& rhs) = delete;
+};
@@ -0,0 +1,102 @@
+/**
+ * File: tls-session-cache.cc
+ * --------------------------
+ * Presents the implementation of the TLSSessionCache class.
+ */
+
+#include "tls-session-cache.h"
+#include <algorithm>
+#include <ctime>
+#include <iomanip>
+#include <openssl/ssl.h>
+using namespace std;
+
+TLSSessionCache::TLSSessionCache(size_t maxSessions) :
+  maxSessions(max<size_t>(maxSessions, 1)), numStored(0), numHandshakes(0), numOffered(0), numResumed(0) {}
+
+TLSSessionCache::~TLSSessionCache() {
+  for (const auto& entry : sessions) SSL_SESSION_free(entry.second.session);
+}
+
+TLSSessionCache& TLSSessionCache::shared() {
+  static TLSSessionCache cache;
+  return cache;
+}
+
+/**
+ * OpenSSL's own client-side cache is turned off, so the callback is the
+ * only place sessions go.
+ */
+void TLSSessionCache::enable(SSL_CTX *context) {
+  SSL_CTX_set_app_data(context, this);
+  SSL_CTX_set_session_cache_mode(context, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+  SSL_CTX_sess_set_new_cb(context, newSession);
+}
+
+/**
+ * Returning 1 tells OpenSSL that the cache has taken over its reference
+ * to the session.
+ */
+int TLSSessionCache::newSession(SSL *ssl, SSL_SESSION *session) {
+  const char *host = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+  if (host == NULL) return 0;
+  TLSSessionCache *cache = static_cast<TLSSessionCache *>(SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl)));
+  cache->store(host, session);
+  return 1;
+}
+
+void TLSSessionCache::store(const string& host, SSL_SESSION *session) {
+  lock_guard<mutex> lg(lock);
+  auto found = sessions.find(host);
+  if (found != sessions.end()) {
+    SSL_SESSION_free(found->second.session);
+    found->second = {session, numStored++};
+    return;
+  }
+  if (sessions.size() == maxSessions) {
+    auto oldest = min_element(sessions.begin(), sessions.end(), [](const pair<const string, Entry>& a,
+                                                                   const pair<const string, Entry>& b) {
+      return a.second.stored < b.second.stored;
+    });
+    SSL_SESSION_free(oldest->second.session);
+    sessions.erase(oldest);
+  }
+  sessions[host] = {session, numStored++};
+}
+
+void TLSSessionCache::offer(SSL *ssl, const string& host) {
+  lock_guard<mutex> lg(lock);
+  auto found = sessions.find(host);
+  if (found == sessions.end()) return;
+  SSL_SESSION *session = found->second.session;
+  if (SSL_SESSION_get_time(session) + SSL_SESSION_get_timeout(session) < time(NULL)) {
+    SSL_SESSION_free(session);
+    sessions.erase(found);
+    return;
+  }
+  if (SSL_set_session(ssl, session) == 1) numOffered++;
+}
+
+void TLSSessionCache::noteHandshake(SSL *ssl) {
+  lock_guard<mutex> lg(lock);
+  numHandshakes++;
+  if (SSL_session_reused(ssl)) numResumed++;
+}
+
+size_t TLSSessionCache::getNumHandshakes() const {
+  lock_guard<mutex> lg(lock);
+  return numHandshakes;
+}
+
+size_t TLSSessionCache::getNumResumed() const {
+  lock_guard<mutex> lg(lock);
+  return numResumed;
+}
+
+void TLSSessionCache::printStats(ostream& out) const {
+  lock_guard<mutex> lg(lock);
+  out << "TLS sessions: " << numHandshakes << " handshakes, " << numOffered << " offered a cached session, "
+      << numResumed << " resumed (" << fixed << setprecision(1)
+      << (numHandshakes == 0 ? 0.0 : 100.0 * numResumed / numHandshakes) << "%), "
+      << sessions.size() << " hosts cached." << endl;
+}
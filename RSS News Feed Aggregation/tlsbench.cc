@@ -0,0 +1,112 @@
+/**
+ * File: tlsbench.cc
+ * -----------------
+ * Measures what TLS session resumption saves, against an https
+ * StandInServer with a self-signed certificate that closes every
+ * connection after one reply, so that every download needs a handshake
+ * of its own (as every download from a server used to, before the
+ * ConnectionPool, and as every new connection still does).
+ *
+ * Each run downloads the same documents through a ConnectionPool with no
+ * TLSSessionCache, and then through one with a cache of its own, under
+ * TLS 1.2 and then TLS 1.3, reporting the total time and how many
+ * handshakes resumed according to both the client and the server.
+ *
+ * Usage: ./tlsbench [<number of downloads>]
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <cstdlib>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <unistd.h>
+#include <openssl/ssl.h>
+#include "connection-pool.h"
+#include "tls-session-cache.h"
+#include "stand-in-server.h"
+using namespace std;
+
+static const size_t kDefaultDownloads = 1000;
+static const size_t kNumThreads = 8;
+static const size_t kDocumentBytes = 4 << 10;
+
+struct Result {
+  double millis;
+  size_t numHandshakes;
+  size_t numResumed;
+  size_t numServerResumed;
+};
+
+static Result run(size_t numDownloads, int maxTLSVersion, bool resume) {
+  string document(kDocumentBytes, 'x');
+  StandInServer::Options options;
+  options.keepAlive = false;
+  options.tls = true;
+  options.maxTLSVersion = maxTLSVersion;
+  StandInServer server([&document](const StandInServer::Request& request) {
+    StandInServer::Reply reply;
+    reply.body = document;
+    return reply;
+  }, options);
+  char certificate[] = "/tmp/tlsbench-XXXXXX";
+  int fd = mkstemp(certificate);
+  if (fd == -1 || !server.writeCertificate(certificate)) {
+    cerr << "Couldn't write the stand-in server's certificate." << endl;
+    exit(1);
+  }
+  close(fd);
+
+  unique_ptr<TLSSessionCache> sessions(resume ? new TLSSessionCache : nullptr);
+  ConnectionPool pool(ConnectionPool::kDefaultMaxPerHost, ConnectionPool::kDefaultIdleSeconds,
+                      ConnectionPool::kDefaultTimeoutSeconds, sessions.get());
+  pool.trustCertificates(certificate);
+  unlink(certificate);
+
+  atomic<size_t> next(0);
+  atomic<size_t> numFailed(0);
+  vector<thread> threads;
+  auto start = chrono::steady_clock::now();
+  for (size_t i = 0; i < kNumThreads; i++) {
+    threads.push_back(thread([&] {
+      for (size_t download = next++; download < numDownloads; download = next++) {
+        try {
+          HTTPResponse response = pool.get(server.url("/article-" + to_string(download) + ".html"));
+          if (response.body.size() != kDocumentBytes) numFailed++;
+        } catch (const exception& e) {
+          if (numFailed++ == 0) cerr << e.what() << endl;
+        }
+      }
+    }));
+  }
+  for (thread& t : threads) t.join();
+  double millis = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+  if (numFailed > 0) {
+    cerr << numFailed << " downloads failed!" << endl;
+    exit(1);
+  }
+  return {millis, server.getNumConnections(), sessions ? sessions->getNumResumed() : 0, server.getNumResumed()};
+}
+
+int main(int argc, char *argv[]) {
+  size_t numDownloads = argc > 1 ? strtoul(argv[1], NULL, 10) : kDefaultDownloads;
+  cout << numDownloads << " https downloads of " << (kDocumentBytes >> 10) << "KB, one connection each, "
+       << kNumThreads << " at a time:" << endl;
+  cout << setw(8) << "TLS" << setw(10) << "cache" << setw(12) << "total ms" << setw(18) << "handshakes/sec"
+       << setw(10) << "resumed" << setw(16) << "server agrees" << endl;
+  for (int version : {TLS1_2_VERSION, TLS1_3_VERSION}) {
+    for (bool resume : {false, true}) {
+      Result result = run(numDownloads, version, resume);
+      cout << setw(8) << (version == TLS1_2_VERSION ? "1.2" : "1.3") << setw(10) << (resume ? "on" : "off")
+           << setw(12) << fixed << setprecision(0) << result.millis
+           << setw(18) << result.numHandshakes / result.millis * 1000 << setw(10) << result.numResumed
+           << setw(16) << result.numServerResumed << endl;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,182 @@
+/**
+ * File: zbench.cc
+ * ---------------
+ * Measures what compressed transfers save, by downloading a batch of
+ * news-article-like HTML documents from a StandInServer whose connections
+ * are paced to kLinkBytesPerSecond, as a real server's would be by the
+ * network, since over loopback bytes are close to free.
+ *
+ * The same documents are served uncompressed (the client doesn't ask for
+ * compression), then gzipped and, when built with HAVE_BROTLI, as
+ * brotli.  Each run reports the bytes on the wire against the bytes of
+ * content, the time the whole batch took, and how much of it went into
+ * decompressing.
+ *
+ * Usage: ./zbench [<number of downloads>]
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <random>
+#include <zlib.h>
+#ifdef HAVE_BROTLI
+#include <brotli/encode.h>
+#endif
+#include "connection-pool.h"
+#include "stand-in-server.h"
+using namespace std;
+
+static const size_t kDefaultDownloads = 400;
+static const size_t kNumThreads = 8;
+static const size_t kNumDocuments = 16;
+static const size_t kNumParagraphs = 120;
+static const size_t kLinkBytesPerSecond = 4 << 20;
+
+/**
+ * Builds an article out of words drawn from a small vocabulary, wrapped
+ * in the kind of markup real news pages carry, which together compress
+ * about as well as the real thing.
+ */
+static string makeDocument(mt19937& random) {
+  static const vector<string> kVocabulary = {
+    "the", "of", "and", "to", "in", "a", "said", "for", "on", "that", "with", "was", "government", "minister",
+    "election", "report", "market", "percent", "year", "city", "officials", "police", "court", "week", "people",
+    "company", "president", "according", "statement", "Tuesday", "investigation", "economy", "billion",
+    "spokesperson", "announced", "thousands", "residents", "international", "agreement", "council", "policy"
+  };
+  string document = "<!DOCTYPE html>\n<html><head><meta charset=\"utf-8\"><title>Article</title>"
+                    "<link rel=\"stylesheet\" href=\"/static/css/article.css\"></head>\n<body><div class=\"article-body\">\n";
+  uniform_int_distribution<size_t> word(0, kVocabulary.size() - 1);
+  uniform_int_distribution<size_t> length(40, 120);
+  for (size_t i = 0; i < kNumParagraphs; i++) {
+    document += "<p class=\"article-paragraph\" data-index=\"" + to_string(i) + "\">";
+    for (size_t j = length(random); j > 0; j--) document += kVocabulary[word(random)] + " ";
+    document += "</p>\n";
+    if (i % 10 == 9) document += "<aside class=\"related\"><a href=\"/news/" + to_string(random()) + ".html\">Related</a></aside>\n";
+  }
+  return document + "</div></body></html>\n";
+}
+
+static string gzip(const string& document) {
+  z_stream stream = z_stream();
+  deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, MAX_WBITS + 16, 8, Z_DEFAULT_STRATEGY);
+  string compressed(deflateBound(&stream, document.size()), '\0');
+  stream.next_in = (Bytef *) document.data();
+  stream.avail_in = document.size();
+  stream.next_out = (Bytef *) &compressed[0];
+  stream.avail_out = compressed.size();
+  deflate(&stream, Z_FINISH);
+  compressed.resize(stream.total_out);
+  deflateEnd(&stream);
+  return compressed;
+}
+
+#ifdef HAVE_BROTLI
+static string brotli(const string& document) {
+  size_t size = BrotliEncoderMaxCompressedSize(document.size());
+  string compressed(size, '\0');
+  BrotliEncoderCompress(BROTLI_DEFAULT_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT, document.size(),
+                        (const uint8_t *) document.data(), &size, (uint8_t *) &compressed[0]);
+  compressed.resize(size);
+  return compressed;
+}
+#endif
+
+struct Result {
+  double millis;
+  size_t numBytesReceived;
+  size_t numBodyBytes;
+  double decodeMillis;
+};
+
+static Result run(size_t numDownloads, const vector<string>& documents, const string& coding,
+                  const vector<string>& encoded) {
+  StandInServer::Options options;
+  options.bytesPerSecond = kLinkBytesPerSecond;
+  StandInServer server([&](const StandInServer::Request& request) {
+    StandInServer::Reply reply;
+    size_t index = strtoul(request.target.c_str() + 1, NULL, 10) % documents.size();
+    auto accepted = request.headers.find("accept-encoding");
+    if (!coding.empty() && accepted != request.headers.end() && accepted->second.find(coding) != string::npos) {
+      reply.headers.push_back({"Content-Encoding", coding});
+      reply.body = encoded[index];
+    } else {
+      reply.body = documents[index];
+    }
+    return reply;
+  }, options);
+
+  ConnectionPool pool(kNumThreads);
+  pool.requestCompression(!coding.empty());
+  atomic<size_t> next(0);
+  atomic<size_t> numFailed(0);
+  atomic<size_t> numBytesReceived(0);
+  atomic<size_t> numBodyBytes(0);
+  atomic<size_t> decodeMicros(0);
+  vector<thread> threads;
+  auto start = chrono::steady_clock::now();
+  for (size_t i = 0; i < kNumThreads; i++) {
+    threads.push_back(thread([&] {
+      for (size_t download = next++; download < numDownloads; download = next++) {
+        try {
+          HTTPResponse response = pool.get(server.url("/" + to_string(download)));
+          if (response.body != documents[download % documents.size()]) numFailed++;
+          numBytesReceived += response.numBytesReceived;
+          numBodyBytes += response.numBodyBytes;
+          decodeMicros += response.decodeTime.count();
+        } catch (const exception& e) {
+          if (numFailed++ == 0) cerr << e.what() << endl;
+        }
+      }
+    }));
+  }
+  for (thread& t : threads) t.join();
+  double millis = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+  if (numFailed > 0) {
+    cerr << numFailed << " downloads failed!" << endl;
+    exit(1);
+  }
+  return {millis, numBytesReceived, numBodyBytes, decodeMicros / 1000.0};
+}
+
+int main(int argc, char *argv[]) {
+  size_t numDownloads = argc > 1 ? strtoul(argv[1], NULL, 10) : kDefaultDownloads;
+  mt19937 random(110);
+  vector<string> documents;
+  size_t totalBytes = 0;
+  for (size_t i = 0; i < kNumDocuments; i++) {
+    documents.push_back(makeDocument(random));
+    totalBytes += documents.back().size();
+  }
+  vector<pair<string, vector<string>>> codings = {{"", {}}, {"gzip", {}}};
+#ifdef HAVE_BROTLI
+  codings.push_back({"br", {}});
+#endif
+  for (auto& coding : codings) {
+    for (const string& document : documents) {
+      if (coding.first == "gzip") coding.second.push_back(gzip(document));
+#ifdef HAVE_BROTLI
+      else if (coding.first == "br") coding.second.push_back(brotli(document));
+#endif
+    }
+  }
+
+  cout << numDownloads << " downloads of ~" << totalBytes / documents.size() / 1024 << "KB articles over links paced to "
+       << (kLinkBytesPerSecond >> 20) << "MB/s, " << kNumThreads << " at a time:" << endl;
+  cout << setw(10) << "coding" << setw(14) << "KB on wire" << setw(14) << "KB content" << setw(8) << "ratio"
+       << setw(12) << "total ms" << setw(16) << "downloads/sec" << setw(12) << "decode ms" << endl;
+  for (const auto& coding : codings) {
+    Result result = run(numDownloads, documents, coding.first, coding.second);
+    cout << setw(10) << (coding.first.empty() ? "identity" : coding.first) << setw(14) << result.numBytesReceived / 1024
+         << setw(14) << result.numBodyBytes / 1024 << setw(8) << fixed << setprecision(2)
+         << double(result.numBodyBytes) / result.numBytesReceived << setw(12) << setprecision(0) << result.millis
+         << setw(16) << numDownloads / result.millis * 1000 << setw(12) << setprecision(1) << result.decodeMillis << endl;
+  }
+  return 0;
+}